@@ -0,0 +1,109 @@
+#include <new>
+
+#include "arena.h"
+
+
+static thread_local Arena *current=0;
+
+#define ARENA_ALIGN 16
+
+
+Arena::Arena(const SIZE_T c, const SIZE_T l) :
+  chunksize(c), limit(l), chunk(0), used(0), total(0), depth(0),
+  chunkallocs(0), declines(0), highwater(0)
+{}
+
+
+Arena::~Arena()
+{
+  SIZE_T i;
+
+  for (i=0;i<chunks.size();i++) {
+    delete [] chunks[i];
+  }
+}
+
+
+void *Arena::Allocate(const SIZE_T bytes)
+{
+  SIZE_T n=(bytes+ARENA_ALIGN-1) & ~(SIZE_T)(ARENA_ALIGN-1);
+  BYTE_T *p;
+
+  if (total+n>limit) {
+    declines++;
+    return 0;
+  }
+  // on to the next chunk that has room, making one if none does
+  while (chunk<chunks.size() && used+n>chunksizes[chunk]) {
+    chunk++;
+    used=0;
+  }
+  if (chunk==chunks.size()) {
+    SIZE_T size= n>chunksize ? n : chunksize;
+    try {
+      // new[] of BYTE_T aligns to the largest fundamental alignment
+      p=new BYTE_T [size];
+    }
+    catch (...) {
+      return 0;
+    }
+    chunks.push_back(p);
+    chunksizes.push_back(size);
+    chunkallocs++;
+  }
+  p=chunks[chunk]+used;
+  used+=n;
+  total+=n;
+  if (total>highwater) {
+    highwater=total;
+  }
+  return p;
+}
+
+
+void Arena::Reset()
+{
+  chunk=0;
+  used=0;
+  total=0;
+}
+
+
+SIZE_T Arena::GetNumChunkAllocs() const
+{
+  return chunkallocs;
+}
+
+
+SIZE_T Arena::GetNumDeclines() const
+{
+  return declines;
+}
+
+
+SIZE_T Arena::GetHighWater() const
+{
+  return highwater;
+}
+
+
+Arena *Arena::Current()
+{
+  return current;
+}
+
+
+ArenaScope::ArenaScope(Arena &a) : arena(&a), previous(current)
+{
+  arena->depth++;
+  current=arena;
+}
+
+
+ArenaScope::~ArenaScope()
+{
+  current=previous;
+  if (--arena->depth==0) {
+    arena->Reset();
+  }
+}
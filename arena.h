@@ -0,0 +1,77 @@
+#ifndef _arena
+#define _arena
+
+#include <vector>
+
+#include "global.h"
+
+using namespace std;
+
+//
+// Bump allocator for the temporaries of one index operation.  Memory
+// is carved from chunks that are kept from one operation to the next,
+// so once they have grown to what an operation needs, Allocate makes
+// no heap allocation at all.  Nothing is freed singly; Reset releases
+// everything at once.  Past limit bytes in one operation, Allocate
+// declines (returns zero) and callers fall back to the heap, so a
+// walk over a whole tree does not hold all of it.
+//
+class Arena {
+ private:
+  vector<BYTE_T *> chunks;
+  vector<SIZE_T>   chunksizes;
+  SIZE_T           chunksize;   // of new chunks, unless a request is larger
+  SIZE_T           limit;
+  SIZE_T           chunk;       // the chunk being carved
+  SIZE_T           used;        // bytes carved from it
+  SIZE_T           total;       // bytes handed out since the last Reset
+  SIZE_T           depth;       // open ArenaScopes on this arena
+  SIZE_T           chunkallocs, declines, highwater;
+
+  Arena(const Arena &rhs);
+  Arena & operator=(const Arena &rhs);
+
+ public:
+  Arena(const SIZE_T chunksize=65536, const SIZE_T limit=1<<20);
+  ~Arena();
+
+  // 16 byte aligned, or zero if over the limit or out of memory
+  void  *Allocate(const SIZE_T bytes);
+  // Everything allocated is released
+  void   Reset();
+
+  // Heap allocations the arena itself has made (its chunks)
+  SIZE_T GetNumChunkAllocs() const;
+  // Requests declined for being over the limit
+  SIZE_T GetNumDeclines() const;
+  // Most bytes handed out between two Resets
+  SIZE_T GetHighWater() const;
+
+  // The arena of the innermost open scope on this thread, or zero
+  static Arena *Current();
+
+  friend class ArenaScope;
+};
+
+
+//
+// Makes an arena current on this thread for as long as it is open.
+// Node buffers and the block-sized temporaries of reading and writing
+// nodes are then drawn from it.  When the outermost scope on an arena
+// closes, the arena is reset, so a scope must outlive everything that
+// was allocated under it.
+//
+class ArenaScope {
+ private:
+  Arena *arena;
+  Arena *previous;
+
+  ArenaScope(const ArenaScope &rhs);
+  ArenaScope & operator=(const ArenaScope &rhs);
+
+ public:
+  ArenaScope(Arena &arena);
+  ~ArenaScope();
+};
+
+#endif
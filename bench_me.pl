@@ -0,0 +1,58 @@
+#!/usr/bin/perl -w
+
+# Run one generated test sequence through sim with several sets of
+# options and compare what each costs on a performance-style disk.
+# usage: bench_me.pl [-g "genopts"] keysize valuesize seed numops ["opts" ...]
+#   e.g. bench_me.pl 8 8 1 20000 "" "betree"
+# genopts are passed on to gen_test_sequence.pl, as in
+#   bench_me.pl -g "deletes nolookups nodisplay" 8 8 1 20000 "" "betree"
+$diskstem="__bench";
+$numblocks=16384;
+$blocksize=1024;
+$heads=1;
+$blockspertrack=64;
+$tracks=256;
+$avgseek=10;
+$trackseek=1;
+$rotlat=4;
+$cachesize=16;
+
+$genopts="";
+if ($#ARGV>=1 && $ARGV[0] eq "-g") { 
+  shift;
+  $genopts=shift;
+}
+
+$#ARGV>=3 or die "usage: bench_me.pl [-g \"genopts\"] keysize valuesize seed numops [\"simopts\" ...]\n";
+
+($keysize,$valuesize,$seed,$numops,@optsets)=@ARGV;
+
+@optsets=("","betree") if $#optsets<0;
+
+$ENV{PATH}.=":.";
+
+$input="BENCH.$$.input";
+
+system "gen_test_sequence.pl $keysize $valuesize $seed $numops $genopts > $input";
+
+printf "%-20s %12s %12s %12s\n", "options", "diskreads", "diskwrites", "time";
+
+foreach $opts (@optsets) {
+  system "deletedisk $diskstem >/dev/null 2>&1";
+  system "makedisk $diskstem $numblocks $blocksize $heads $blockspertrack $tracks $avgseek $trackseek $rotlat >/dev/null 2>&1";
+
+  %stat=();
+  open(SIM, "sim $diskstem $cachesize $opts stats < $input 2>&1 >/dev/null |") or die "can't run sim\n";
+  while (<SIM>) {
+    if (/^(\w[\w ]*\w)\s+=\s+(\S+)/) {
+      $stat{$1}=$2;
+    }
+  }
+  close(SIM);
+
+  printf "%-20s %12s %12s %12s\n", ($opts eq "" ? "(btree)" : $opts),
+    $stat{"numdiskreads"}, $stat{"numdiskwrites"}, $stat{"total time"};
+}
+
+system "deletedisk $diskstem >/dev/null 2>&1";
+unlink $input;
@@ -0,0 +1,1033 @@
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+#include <new>
+#include <iostream>
+#include "betree.h"
+
+
+BeTreeMessage::BeTreeMessage() : op(BTREE_OP_INSERT)
+{}
+
+
+BeTreeMessage::BeTreeMessage(const BTreeOp o, const KEY_T &k, const VALUE_T &v) :
+  op(o), key(k), value(v)
+{}
+
+
+BeTreeMessage::BeTreeMessage(const BeTreeMessage &rhs) :
+  op(rhs.op), key(rhs.key), value(rhs.value)
+{}
+
+
+BeTreeMessage::~BeTreeMessage()
+{}
+
+
+BeTreeMessage & BeTreeMessage::operator=(const BeTreeMessage &rhs)
+{
+  op=rhs.op;
+  key=rhs.key;
+  value=rhs.value;
+  return *this;
+}
+
+
+SIZE_T BeTreeInterior::ChildFor(const KEY_T &key) const
+{
+  SIZE_T i;
+
+  for (i=0;i<keys.size();i++) {
+    if (key<keys[i] || key==keys[i]) {
+      break;
+    }
+  }
+  return i;
+}
+
+
+// True for the ops after which the key is gone
+static bool Removes(const BTreeOp op)
+{
+  return op==BTREE_OP_DELETE || op==BTREE_OP_ERASE;
+}
+
+
+//
+// Fold a message into a buffer that holds only older ones.  The
+// result is again at most one message per key, relative to the
+// same subtree.
+//
+static void MergeMessage(vector<BeTreeMessage> &msgs, const BeTreeMessage &m)
+{
+  vector<BeTreeMessage>::iterator i;
+
+  for (i=msgs.begin(); i!=msgs.end() && (*i).key<m.key; ++i) { }
+
+  if (i==msgs.end() || !((*i).key==m.key)) {
+    msgs.insert(i,m);
+    return;
+  }
+
+  switch ((*i).op) {
+  case BTREE_OP_INSERT:
+    // still not in the subtree below
+    if (Removes(m.op)) {
+      msgs.erase(i);
+    } else {
+      (*i).value=m.value;
+    }
+    break;
+  case BTREE_OP_UPDATE:
+  case BTREE_OP_DELETE:
+    // still in the subtree below
+    (*i).op = Removes(m.op) ? BTREE_OP_DELETE : BTREE_OP_UPDATE;
+    (*i).value=m.value;
+    break;
+  case BTREE_OP_UPSERT:
+  case BTREE_OP_ERASE:
+    // whether it is below is still not known
+    (*i).op = Removes(m.op) ? BTREE_OP_ERASE : BTREE_OP_UPSERT;
+    (*i).value=m.value;
+    break;
+  default:
+    break;
+  }
+}
+
+
+//
+// Apply sorted messages to sorted pairs
+//
+static void ApplyMessages(const vector<KeyValuePair> &in,
+			  const vector<BeTreeMessage> &msgs,
+			  vector<KeyValuePair> &out)
+{
+  SIZE_T i=0, j=0;
+
+  while (i<in.size() || j<msgs.size()) {
+    if (j==msgs.size() || (i<in.size() && in[i].key<msgs[j].key)) {
+      out.push_back(in[i++]);
+    } else if (i==in.size() || msgs[j].key<in[i].key) {
+      if (!Removes(msgs[j].op)) {
+	out.push_back(KeyValuePair(msgs[j].key,msgs[j].value));
+      }
+      j++;
+    } else {
+      if (!Removes(msgs[j].op)) {
+	out.push_back(KeyValuePair(msgs[j].key,msgs[j].value));
+      }
+      i++; j++;
+    }
+  }
+}
+
+
+static const char *OpName(const BTreeOp op)
+{
+  return op==BTREE_OP_INSERT ? "+" : op==BTREE_OP_UPDATE ? "=" : op==BTREE_OP_DELETE ? "-" :
+    op==BTREE_OP_UPSERT ? "~" : op==BTREE_OP_ERASE ? "!" : "?";
+}
+
+
+BeTreeIndex::BeTreeIndex(SIZE_T keysize,
+			 SIZE_T valuesize,
+			 BufferCache *cache,
+			 SIZE_T p) :
+  BTreeIndex(keysize,valuesize,cache), pivots(p)
+{}
+
+
+BeTreeIndex::BeTreeIndex() : BTreeIndex(), pivots(0)
+{}
+
+
+//
+// Note, will not attach!
+//
+BeTreeIndex::BeTreeIndex(const BeTreeIndex &rhs) : BTreeIndex(rhs), pivots(rhs.pivots)
+{}
+
+
+BeTreeIndex::~BeTreeIndex()
+{}
+
+
+BeTreeIndex & BeTreeIndex::operator=(const BeTreeIndex &rhs)
+{
+  return *(new(this)BeTreeIndex(rhs));
+}
+
+
+ERROR_T BeTreeIndex::Attach(const SIZE_T initblock, const bool create)
+{
+  ERROR_T rc;
+  SIZE_T features;
+
+  if (GetCopyOnWrite() || GetMultiVersion() || GetMemTableLimit() || (bloombits && !bloomglobal) ||
+      GetPrefixCompression() || GetSuffixTruncation() || GetVariableLength() || GetOverflowThreshold() ||
+      GetOrderStatistics()) {
+    return ERROR_UNIMPL;
+  }
+
+  // An empty root (no keys, null first pointer, no messages) is
+  // what the plain B-tree creates already
+  rc=BTreeIndex::Attach(initblock,create);
+
+  if (rc) {
+    return rc;
+  }
+
+  if (create) {
+    if (pivots==0) {
+      pivots=(SIZE_T)sqrt((double)superblock.info.GetNumSlotsAsInterior());
+    }
+    if (pivots<2) {
+      pivots=2;
+    }
+    if (pivots>superblock.info.GetNumSlotsAsInterior() || GetNumMessageSlots()<1) {
+      return ERROR_SIZE;
+    }
+    // on top of the formats the plain B-tree just chose
+    superblock.GetSuperField(BTREE_SUPER_FEATURES,features);
+    superblock.SetSuperField(BTREE_SUPER_FEATURES,features | BTREE_FEATURE_BUFFERED);
+    superblock.SetSuperField(BTREE_SUPER_PIVOTS,pivots);
+    return superblock.Serialize(buffercache,superblock_index);
+  }
+
+  superblock.GetSuperField(BTREE_SUPER_FEATURES,features);
+  if (!(features & BTREE_FEATURE_BUFFERED)) {
+    return ERROR_NOTANINDEX;
+  }
+  superblock.GetSuperField(BTREE_SUPER_PIVOTS,pivots);
+
+  return ERROR_NOERROR;
+}
+
+
+SIZE_T BeTreeIndex::GetNumMessageSlots() const
+{
+  SIZE_T used=sizeof(SIZE_T)+pivots*(sizeof(SIZE_T)+superblock.info.keysize)+sizeof(SIZE_T);
+
+  if (used>superblock.info.GetNumDataBytes()) {
+    return 0;
+  }
+  return (superblock.info.GetNumDataBytes()-used)/
+    (sizeof(SIZE_T)+superblock.info.keysize+superblock.info.valuesize);  // floor intended
+}
+
+
+char *BeTreeIndex::ResolveMessages(const BTreeNode &b) const
+{
+  return b.data+sizeof(SIZE_T)+pivots*(sizeof(SIZE_T)+b.info.keysize);
+}
+
+
+ERROR_T BeTreeIndex::LoadInterior(const BTreeNode &b, BeTreeInterior &n) const
+{
+  SIZE_T i, num, op;
+  KEY_T key;
+  SIZE_T ptr;
+  ERROR_T rc;
+  char *p;
+
+  n.keys.clear();
+  n.ptrs.clear();
+  n.msgs.clear();
+
+  for (i=0;i<b.info.numkeys;i++) {
+    rc=b.GetKey(i,key);
+    if (rc) { return rc; }
+    n.keys.push_back(key);
+  }
+  for (i=0;i<=b.info.numkeys;i++) {
+    rc=b.GetPtr(i,ptr);
+    if (rc) { return rc; }
+    n.ptrs.push_back(ptr);
+  }
+
+  p=ResolveMessages(b);
+  memcpy(&num,p,sizeof(SIZE_T));
+  p+=sizeof(SIZE_T);
+
+  if (num>GetNumMessageSlots()) {
+    return ERROR_INSANE;
+  }
+
+  for (i=0;i<num;i++) {
+    BeTreeMessage m;
+    memcpy(&op,p,sizeof(SIZE_T));
+    p+=sizeof(SIZE_T);
+    m.op=(BTreeOp)op;
+    m.key.Resize(b.info.keysize,false);
+    memcpy(m.key.data,p,b.info.keysize);
+    p+=b.info.keysize;
+    m.value.Resize(b.info.valuesize,false);
+    memcpy(m.value.data,p,b.info.valuesize);
+    p+=b.info.valuesize;
+    n.msgs.push_back(m);
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BeTreeIndex::StoreInterior(BTreeNode &b, const BeTreeInterior &n) const
+{
+  SIZE_T i, num, op;
+  ERROR_T rc;
+  char *p;
+
+  assert(n.keys.size()<=pivots && n.ptrs.size()==n.keys.size()+1);
+
+  if (n.msgs.size()>GetNumMessageSlots()) {
+    return ERROR_IMPLBUG;
+  }
+
+  b.info.numkeys=n.keys.size();
+  for (i=0;i<n.keys.size();i++) {
+    rc=b.SetKey(i,n.keys[i]);
+    if (rc) { return rc; }
+  }
+  for (i=0;i<n.ptrs.size();i++) {
+    rc=b.SetPtr(i,n.ptrs[i]);
+    if (rc) { return rc; }
+  }
+
+  p=ResolveMessages(b);
+  num=n.msgs.size();
+  memcpy(p,&num,sizeof(SIZE_T));
+  p+=sizeof(SIZE_T);
+
+  for (i=0;i<num;i++) {
+    op=n.msgs[i].op;
+    memcpy(p,&op,sizeof(SIZE_T));
+    p+=sizeof(SIZE_T);
+    memcpy(p,n.msgs[i].key.data,b.info.keysize);
+    p+=b.info.keysize;
+    memcpy(p,n.msgs[i].value.data,b.info.valuesize);
+    p+=b.info.valuesize;
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BeTreeIndex::WriteInterior(SIZE_T &node, const int nodetype, const BeTreeInterior &n,
+				   vector<KEY_T> &sepkeys, vector<SIZE_T> &newnodes)
+{
+  SIZE_T children=n.ptrs.size();
+  SIZE_T parts, part, first, last, i;
+  SIZE_T newnode;
+  ERROR_T rc;
+
+  if (n.keys.size()<=pivots) {
+    BTreeNode b(nodetype,
+		superblock.info.keysize,
+		superblock.info.valuesize,
+		buffercache->GetBlockSize(),
+		superblock.info.headerbytes);
+    rc=StoreInterior(b,n);
+    if (rc) { return rc; }
+    return WriteNode(node,b);
+  }
+
+  // Too many pivots.  Deal the children out evenly; the keys between
+  // the parts move up, and each part takes the messages for its range.
+  // A split root becomes ordinary interior nodes under a new root.
+  parts=(children+pivots)/(pivots+1);
+
+  for (part=0;part<parts;part++) {
+    BeTreeInterior p;
+    BTreeNode b(BTREE_INTERIOR_NODE,
+		superblock.info.keysize,
+		superblock.info.valuesize,
+		buffercache->GetBlockSize(),
+		superblock.info.headerbytes);
+
+    first=part*children/parts;
+    last=(part+1)*children/parts;
+
+    for (i=first;i<last;i++) {
+      p.ptrs.push_back(n.ptrs[i]);
+      if (i+1<last) {
+	p.keys.push_back(n.keys[i]);
+      }
+    }
+    for (i=0;i<n.msgs.size();i++) {
+      SIZE_T c=n.ChildFor(n.msgs[i].key);
+      if (c>=first && c<last) {
+	p.msgs.push_back(n.msgs[i]);
+      }
+    }
+
+    rc=StoreInterior(b,p);
+    if (rc) { return rc; }
+
+    if (part==0) {
+      rc=WriteNode(node,b);
+      if (rc) { return rc; }
+    } else {
+      sepkeys.push_back(n.keys[first-1]);
+      rc=AllocateNode(newnode);
+      if (rc) { return rc; }
+      rc=WriteNode(newnode,b);
+      if (rc) { return rc; }
+      newnodes.push_back(newnode);
+    }
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BeTreeIndex::ApplyToLeaf(SIZE_T &node, const vector<BeTreeMessage> &msgs,
+				 vector<KEY_T> &sepkeys, vector<SIZE_T> &newnodes)
+{
+  BTreeNode b(BTREE_LEAF_NODE,
+	      superblock.info.keysize,
+	      superblock.info.valuesize,
+	      buffercache->GetBlockSize(),
+	      superblock.info.headerbytes);
+  vector<KeyValuePair> kvs, out;
+  KeyValuePair kv;
+  SIZE_T slots=b.info.GetNumSlotsAsLeaf();
+  SIZE_T n, parts, part, first, last, i;
+  SIZE_T newnode;
+  ERROR_T rc;
+
+  if (node==0) {
+    rc=AllocateNode(node);
+    if (rc) { return rc; }
+  } else {
+    rc=b.Unserialize(buffercache,node,superblock.info);
+    if (rc) { return rc; }
+    for (i=0;i<b.info.numkeys;i++) {
+      rc=b.GetKeyVal(i,kv);
+      if (rc) { return rc; }
+      kvs.push_back(kv);
+    }
+  }
+
+  ApplyMessages(kvs,msgs,out);
+
+  // One rewrite per batch, spread over as many leaves as it needs
+  n=out.size();
+  parts= n>slots ? (n+slots-1)/slots : 1;
+
+  for (part=0;part<parts;part++) {
+    BTreeNode p(BTREE_LEAF_NODE,
+		superblock.info.keysize,
+		superblock.info.valuesize,
+		buffercache->GetBlockSize(),
+		superblock.info.headerbytes);
+
+    first=part*n/parts;
+    last=(part+1)*n/parts;
+
+    p.info.numkeys=last-first;
+    for (i=first;i<last;i++) {
+      rc=p.SetKeyVal(i-first,out[i]);
+      if (rc) { return rc; }
+    }
+
+    if (part==0) {
+      rc=WriteNode(node,p);
+      if (rc) { return rc; }
+    } else {
+      sepkeys.push_back(out[first-1].key);
+      rc=AllocateNode(newnode);
+      if (rc) { return rc; }
+      rc=WriteNode(newnode,p);
+      if (rc) { return rc; }
+      newnodes.push_back(newnode);
+    }
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BeTreeIndex::PushMessages(SIZE_T &node, BTreeNode &b, const vector<BeTreeMessage> &msgs,
+				  vector<KEY_T> &sepkeys, vector<SIZE_T> &newnodes)
+{
+  BeTreeInterior n;
+  SIZE_T i, c, best;
+  ERROR_T rc;
+
+  rc=LoadInterior(b,n);
+  if (rc) { return rc; }
+
+  for (i=0;i<msgs.size();i++) {
+    MergeMessage(n.msgs,msgs[i]);
+  }
+
+  while (n.msgs.size()>GetNumMessageSlots()) {
+    // Flush the batch for the child with the most pending messages
+    vector<SIZE_T> counts(n.ptrs.size(),0);
+    vector<BeTreeMessage> batch, rest;
+    vector<KEY_T> childsepkeys;
+    vector<SIZE_T> childnewnodes;
+    SIZE_T child;
+
+    for (i=0;i<n.msgs.size();i++) {
+      counts[n.ChildFor(n.msgs[i].key)]++;
+    }
+    best=0;
+    for (c=1;c<counts.size();c++) {
+      if (counts[c]>counts[best]) {
+	best=c;
+      }
+    }
+    for (i=0;i<n.msgs.size();i++) {
+      if (n.ChildFor(n.msgs[i].key)==best) {
+	batch.push_back(n.msgs[i]);
+      } else {
+	rest.push_back(n.msgs[i]);
+      }
+    }
+    n.msgs=rest;
+
+    child=n.ptrs[best];
+    if (child==0) {
+      rc=ApplyToLeaf(child,batch,childsepkeys,childnewnodes);
+    } else {
+      BTreeNode cb;
+      rc=cb.Unserialize(buffercache,child,superblock.info);
+      if (rc) { return rc; }
+      if (cb.info.nodetype==BTREE_LEAF_NODE) {
+	rc=ApplyToLeaf(child,batch,childsepkeys,childnewnodes);
+      } else if (cb.info.nodetype==BTREE_INTERIOR_NODE) {
+	rc=PushMessages(child,cb,batch,childsepkeys,childnewnodes);
+      } else {
+	rc=ERROR_INSANE;
+      }
+    }
+    if (rc) { return rc; }
+
+    n.ptrs[best]=child;
+    n.keys.insert(n.keys.begin()+best,childsepkeys.begin(),childsepkeys.end());
+    n.ptrs.insert(n.ptrs.begin()+best+1,childnewnodes.begin(),childnewnodes.end());
+  }
+
+  return WriteInterior(node,b.info.nodetype,n,sepkeys,newnodes);
+}
+
+
+ERROR_T BeTreeIndex::Enqueue(const BeTreeMessage &m)
+{
+  SIZE_T root=superblock.info.rootnode;
+  SIZE_T newroot;
+  BTreeNode b;
+  vector<BeTreeMessage> msgs(1,m);
+  vector<KEY_T> sepkeys;
+  vector<SIZE_T> newnodes;
+  ERROR_T rc;
+  SIZE_T i;
+
+  rc=b.Unserialize(buffercache,root,superblock.info);
+  if (rc) { return rc; }
+
+  rc=PushMessages(root,b,msgs,sepkeys,newnodes);
+
+  // The root split (maybe several ways), so grow the tree
+  while (rc==ERROR_NOERROR && !sepkeys.empty()) {
+    BeTreeInterior r;
+    r.ptrs.push_back(root);
+    for (i=0;i<sepkeys.size();i++) {
+      r.keys.push_back(sepkeys[i]);
+      r.ptrs.push_back(newnodes[i]);
+    }
+    sepkeys.clear();
+    newnodes.clear();
+    rc=AllocateNode(newroot);
+    if (rc) { break; }
+    rc=WriteInterior(newroot,BTREE_ROOT_NODE,r,sepkeys,newnodes);
+    root=newroot;
+  }
+
+  if (rc) {
+    AbortWrite();
+    return rc;
+  }
+
+  if (root!=superblock.info.rootnode) {
+    return PublishRoot(root);
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BeTreeIndex::QueryInternal(const SIZE_T &node, const KEY_T &key, VALUE_T &value)
+{
+  BTreeNode b;
+  BeTreeInterior n;
+  KEY_T testkey;
+  SIZE_T offset;
+  ERROR_T rc;
+
+  if (node==0) {
+    return ERROR_NONEXISTENT;
+  }
+
+  rc=b.Unserialize(buffercache,node,superblock.info);
+  if (rc) { return rc; }
+
+  switch (b.info.nodetype) {
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    rc=LoadInterior(b,n);
+    if (rc) { return rc; }
+    // A pending message is newer than anything below it
+    for (offset=0;offset<n.msgs.size();offset++) {
+      if (n.msgs[offset].key==key) {
+	if (Removes(n.msgs[offset].op)) {
+	  return ERROR_NONEXISTENT;
+	}
+	value=n.msgs[offset].value;
+	return ERROR_NOERROR;
+      }
+    }
+    return QueryInternal(n.ptrs[n.ChildFor(key)],key,value);
+    break;
+  case BTREE_LEAF_NODE:
+    for (offset=0;offset<b.info.numkeys;offset++) {
+      rc=b.GetKey(offset,testkey);
+      if (rc) { return rc; }
+      if (testkey==key) {
+	return b.GetVal(offset,value);
+      }
+    }
+    return ERROR_NONEXISTENT;
+    break;
+  default:
+    return ERROR_INSANE;
+  }
+
+  return ERROR_INSANE;
+}
+
+
+ERROR_T BeTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+{
+  ArenaScope scope(arena);
+  if (key.length!=superblock.info.keysize) {
+    return ERROR_SIZE;
+  }
+  return QueryInternal(superblock.info.rootnode,key,value);
+}
+
+
+//
+// Writes still return the same errors as BTreeIndex, so each one
+// first checks whether the key exists.  Only the path down is read,
+// and not even that for a key the global filter rules out; the write
+// itself is deferred to the root's buffer.
+//
+ERROR_T BeTreeIndex::Exists(const KEY_T &key, VALUE_T &old)
+{
+  ERROR_T rc;
+
+  if (GlobalFilterRulesOut(key)) {
+    return ERROR_NONEXISTENT;
+  }
+  rc=QueryInternal(superblock.info.rootnode,key,old);
+  if (rc==ERROR_NONEXISTENT && bloombits) {
+    globalfalsepos++;
+  }
+  return rc;
+}
+
+
+ERROR_T BeTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+{
+  ArenaScope scope(arena);
+  VALUE_T old;
+  ERROR_T rc;
+
+  if (key.length!=superblock.info.keysize || value.length!=superblock.info.valuesize) {
+    return ERROR_SIZE;
+  }
+
+  rc=Exists(key,old);
+
+  if (rc==ERROR_NOERROR) {
+    return ERROR_CONFLICT;
+  } else if (rc!=ERROR_NONEXISTENT) {
+    return rc;
+  }
+
+  rc=Enqueue(BeTreeMessage(BTREE_OP_INSERT,key,value));
+  if (rc==ERROR_NOERROR) {
+    NoteGlobalInsert(key);
+  }
+  return rc;
+}
+
+
+ERROR_T BeTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+{
+  ArenaScope scope(arena);
+  VALUE_T old;
+  ERROR_T rc;
+
+  if (key.length!=superblock.info.keysize || value.length!=superblock.info.valuesize) {
+    return ERROR_SIZE;
+  }
+
+  rc=Exists(key,old);
+  if (rc) { return rc; }
+
+  return Enqueue(BeTreeMessage(BTREE_OP_UPDATE,key,value));
+}
+
+
+ERROR_T BeTreeIndex::Delete(const KEY_T &key)
+{
+  ArenaScope scope(arena);
+  VALUE_T old;
+  ERROR_T rc;
+
+  if (key.length!=superblock.info.keysize) {
+    return ERROR_SIZE;
+  }
+
+  rc=Exists(key,old);
+  if (rc) { return rc; }
+
+  rc=Enqueue(BeTreeMessage(BTREE_OP_DELETE,key,old));
+  if (rc==ERROR_NOERROR) {
+    NoteGlobalDelete();
+  }
+  return rc;
+}
+
+
+ERROR_T BeTreeIndex::Upsert(const KEY_T &key, const VALUE_T &value)
+{
+  ArenaScope scope(arena);
+  ERROR_T rc;
+
+  if (key.length!=superblock.info.keysize || value.length!=superblock.info.valuesize) {
+    return ERROR_SIZE;
+  }
+
+  rc=Enqueue(BeTreeMessage(BTREE_OP_UPSERT,key,value));
+  if (rc==ERROR_NOERROR) {
+    NoteGlobalInsert(key);
+  }
+  return rc;
+}
+
+
+ERROR_T BeTreeIndex::Erase(const KEY_T &key)
+{
+  ArenaScope scope(arena);
+  VALUE_T none(superblock.info.valuesize);
+  ERROR_T rc;
+
+  if (key.length!=superblock.info.keysize) {
+    return ERROR_SIZE;
+  }
+
+  // stored like any message, though never read
+  memset(none.data,0,none.length);
+  rc=Enqueue(BeTreeMessage(BTREE_OP_ERASE,key,none));
+  if (rc==ERROR_NOERROR) {
+    NoteGlobalDelete();
+  }
+  return rc;
+}
+
+
+ERROR_T BeTreeIndex::CollectInternal(const SIZE_T &node, vector<KeyValuePair> &kvs) const
+{
+  BTreeNode b;
+  BeTreeInterior n;
+  KeyValuePair kv;
+  vector<KeyValuePair> below;
+  SIZE_T i;
+  ERROR_T rc;
+
+  if (node==0) {
+    return ERROR_NOERROR;
+  }
+
+  rc=b.Unserialize(buffercache,node,superblock.info);
+  if (rc) { return rc; }
+
+  switch (b.info.nodetype) {
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    rc=LoadInterior(b,n);
+    if (rc) { return rc; }
+    for (i=0;i<n.ptrs.size();i++) {
+      rc=CollectInternal(n.ptrs[i],below);
+      if (rc) { return rc; }
+    }
+    ApplyMessages(below,n.msgs,kvs);
+    return ERROR_NOERROR;
+    break;
+  case BTREE_LEAF_NODE:
+    for (i=0;i<b.info.numkeys;i++) {
+      rc=b.GetKeyVal(i,kv);
+      if (rc) { return rc; }
+      kvs.push_back(kv);
+    }
+    return ERROR_NOERROR;
+    break;
+  default:
+    return ERROR_INSANE;
+  }
+}
+
+
+ERROR_T BeTreeIndex::BuildGlobalFilter()
+{
+  vector<KeyValuePair> kvs;
+  SIZE_T i;
+  ERROR_T rc;
+
+  rc=CollectInternal(superblock.info.rootnode,kvs);
+  if (rc) { return rc; }
+
+  globalroom=2*kvs.size()+64;
+  globalfilter=BloomFilter(globalroom,bloombits);
+  globalkeys=0;
+  globaldeletes=0;
+
+  for (i=0;i<kvs.size();i++) {
+    globalfilter.Add(kvs[i].key);
+    globalkeys++;
+  }
+  globalvalid=true;
+  return ERROR_NOERROR;
+}
+
+
+void BeTreeIndex::NoteNode(const SIZE_T &node, const BTreeNode &b)
+{}
+
+
+ERROR_T BeTreeIndex::DisplayBuffered(const SIZE_T &node, ostream &o,
+				     const BTreeDisplayType display_type) const
+{
+  BTreeNode b;
+  BeTreeInterior n;
+  KeyValuePair kv;
+  SIZE_T i, j;
+  ERROR_T rc;
+
+  if (node==0) {
+    return ERROR_NOERROR;
+  }
+
+  rc=b.Unserialize(buffercache,node,superblock.info);
+  if (rc) { return rc; }
+
+  if (display_type==BTREE_DEPTH_DOT) {
+    o << node << " [ label=\""<<node<<": ";
+  } else {
+    o << node << ": ";
+  }
+
+  switch (b.info.nodetype) {
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    rc=LoadInterior(b,n);
+    if (rc) { return rc; }
+    if (display_type!=BTREE_DEPTH_DOT) {
+      o << "Interior: ";
+    }
+    for (i=0;i<n.ptrs.size();i++) {
+      o << "*" << n.ptrs[i] << " ";
+      if (i<n.keys.size()) {
+	for (j=0;j<b.info.keysize;j++) {
+	  o << n.keys[i].data[j];
+	}
+	o << " ";
+      }
+    }
+    o << "| ";
+    for (i=0;i<n.msgs.size();i++) {
+      o << OpName(n.msgs[i].op);
+      for (j=0;j<b.info.keysize;j++) {
+	o << n.msgs[i].key.data[j];
+      }
+      if (!Removes(n.msgs[i].op)) {
+	o << ",";
+	for (j=0;j<b.info.valuesize;j++) {
+	  o << n.msgs[i].value.data[j];
+	}
+      }
+      o << " ";
+    }
+    break;
+  case BTREE_LEAF_NODE:
+    if (display_type!=BTREE_DEPTH_DOT) {
+      o << "Leaf: ";
+    }
+    for (i=0;i<b.info.numkeys;i++) {
+      rc=b.GetKeyVal(i,kv);
+      if (rc) { return rc; }
+      for (j=0;j<b.info.keysize;j++) {
+	o << kv.key.data[j];
+      }
+      o << " ";
+      for (j=0;j<b.info.valuesize;j++) {
+	o << kv.value.data[j];
+      }
+      o << " ";
+    }
+    break;
+  default:
+    o << "Unsupported Node Type " << b.info.nodetype;
+    return ERROR_INSANE;
+  }
+
+  if (display_type==BTREE_DEPTH_DOT) {
+    o << "\" ];";
+  }
+  o << endl;
+
+  for (i=0;i<n.ptrs.size();i++) {
+    if (n.ptrs[i]==0) {
+      continue;
+    }
+    if (display_type==BTREE_DEPTH_DOT) {
+      o << node << " -> "<<n.ptrs[i]<<";\n";
+    }
+    rc=DisplayBuffered(n.ptrs[i],o,display_type);
+    if (rc) { return rc; }
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BeTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
+{
+  vector<KeyValuePair> kvs;
+  SIZE_T i, j;
+  ERROR_T rc;
+
+  if (display_type==BTREE_SORTED_KEYVAL) {
+    rc=CollectInternal(superblock.info.rootnode,kvs);
+    if (rc) { return rc; }
+    for (i=0;i<kvs.size();i++) {
+      o << "(";
+      for (j=0;j<superblock.info.keysize;j++) {
+	o << kvs[i].key.data[j];
+      }
+      o << ",";
+      for (j=0;j<superblock.info.valuesize;j++) {
+	o << kvs[i].value.data[j];
+      }
+      o << ")\n";
+    }
+    return ERROR_NOERROR;
+  }
+
+  if (display_type==BTREE_DEPTH_DOT) {
+    o << "digraph tree { \n";
+  }
+  rc=DisplayBuffered(superblock.info.rootnode,o,display_type);
+  if (display_type==BTREE_DEPTH_DOT) {
+    o << "}\n";
+  }
+  return rc;
+}
+
+
+//
+// The B-tree checks (order, bounds, balance), plus: no interior node
+// has more than pivots keys or more messages than fit, buffers are
+// sorted with one message per key, and every message lies in the
+// node's key range.
+//
+ERROR_T BeTreeIndex::SanityCheckBuffered(const SIZE_T &node, const SIZE_T depth, SIZE_T &leafdepth,
+					 const KEY_T *lo, const KEY_T *hi) const
+{
+  BTreeNode b;
+  BeTreeInterior n;
+  KEY_T testkey;
+  SIZE_T i;
+  ERROR_T rc;
+
+  if (!buffercache->IsBlockAllocated(node)) {
+    return ERROR_INSANE;
+  }
+
+  rc=b.Unserialize(buffercache,node,superblock.info);
+  if (rc) { return rc; }
+
+  if ((depth==0) != (b.info.nodetype==BTREE_ROOT_NODE)) {
+    return ERROR_INSANE;
+  }
+
+  if (b.info.nodetype==BTREE_LEAF_NODE) {
+    if (b.info.numkeys>b.info.GetNumSlotsAsLeaf()) {
+      return ERROR_INSANE;
+    }
+    if (leafdepth==0) {
+      leafdepth=depth;
+    } else if (leafdepth!=depth) {
+      return ERROR_INSANE;
+    }
+    for (i=0;i<b.info.numkeys;i++) {
+      KEY_T lastkey(testkey);
+      rc=b.GetKey(i,testkey);
+      if (rc) { return rc; }
+      if ((i>0 && !(lastkey<testkey)) ||
+	  (lo && !(*lo<testkey)) || (hi && *hi<testkey)) {
+	return ERROR_INSANE;
+      }
+    }
+    return ERROR_NOERROR;
+  }
+
+  if (b.info.nodetype!=BTREE_ROOT_NODE && b.info.nodetype!=BTREE_INTERIOR_NODE) {
+    return ERROR_INSANE;
+  }
+  if (b.info.numkeys>pivots) {
+    return ERROR_INSANE;
+  }
+
+  rc=LoadInterior(b,n);
+  if (rc) { return rc; }
+
+  for (i=0;i<n.keys.size();i++) {
+    if ((i>0 && !(n.keys[i-1]<n.keys[i])) ||
+	(lo && !(*lo<n.keys[i])) || (hi && *hi<n.keys[i])) {
+      return ERROR_INSANE;
+    }
+  }
+  for (i=0;i<n.msgs.size();i++) {
+    if ((i>0 && !(n.msgs[i-1].key<n.msgs[i].key)) ||
+	(lo && !(*lo<n.msgs[i].key)) || (hi && *hi<n.msgs[i].key)) {
+      return ERROR_INSANE;
+    }
+  }
+
+  if (n.ptrs[0]==0) {
+    // only the root of a tree that has never flushed
+    return (depth==0 && n.keys.empty()) ? ERROR_NOERROR : ERROR_INSANE;
+  }
+
+  for (i=0;i<n.ptrs.size();i++) {
+    rc=SanityCheckBuffered(n.ptrs[i],depth+1,leafdepth,
+			   i>0 ? &n.keys[i-1] : lo,
+			   i<n.keys.size() ? &n.keys[i] : hi);
+    if (rc) { return rc; }
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BeTreeIndex::SanityCheck() const
+{
+  SIZE_T leafdepth=0;
+
+  return SanityCheckBuffered(superblock.info.rootnode,0,leafdepth,0,0);
+}
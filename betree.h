@@ -0,0 +1,142 @@
+#ifndef _betree
+#define _betree
+
+#include <iostream>
+#include <vector>
+
+#include "global.h"
+#include "block.h"
+#include "disksystem.h"
+#include "buffercache.h"
+#include "btree_ds.h"
+#include "btree.h"
+
+using namespace std;
+
+//
+// A pending insert, update or delete waiting in an interior node's
+// buffer.  The op is relative to the subtree below the buffer:
+//
+//   BTREE_OP_INSERT   the key is not in the subtree
+//   BTREE_OP_UPDATE   the key is in the subtree and gets value
+//   BTREE_OP_DELETE   the key is in the subtree and goes away
+//   BTREE_OP_UPSERT   the key may be in the subtree and gets value
+//   BTREE_OP_ERASE    the key may be in the subtree and goes away
+//
+struct BeTreeMessage {
+  BTreeOp op;
+  KEY_T   key;
+  VALUE_T value;
+
+  BeTreeMessage();
+  BeTreeMessage(const BTreeOp op, const KEY_T &key, const VALUE_T &value);
+  BeTreeMessage(const BeTreeMessage &rhs);
+  virtual ~BeTreeMessage();
+  BeTreeMessage & operator=(const BeTreeMessage &rhs);
+};
+
+
+//
+// An interior node of a BeTreeIndex unpacked into memory
+//
+struct BeTreeInterior {
+  vector<KEY_T>         keys;
+  vector<SIZE_T>        ptrs;   // zero means no child yet (empty root)
+  vector<BeTreeMessage> msgs;   // sorted by key, one per key
+
+  // The child (by pointer offset) that covers key
+  SIZE_T ChildFor(const KEY_T &key) const;
+};
+
+
+//
+// Write-optimized B-tree (a B-epsilon tree).  Interior nodes keep only
+// a few pivots and spend the rest of their block on a buffer of
+// pending messages.  Writes go into the root's buffer; when a buffer
+// fills, the messages bound for its busiest child are pushed down in
+// one batch, so a leaf is rewritten once per batch instead of once
+// per write.  Lookups check the buffers on the way down.
+//
+// Insert, Update and Delete reply as BTreeIndex does, so each first
+// looks the key up, which reads down to its leaf unless a buffer on
+// the way has it.  With a global Bloom filter, an Insert (or Update
+// or Delete) of a key the filter rules out reads nothing.  Upsert
+// and Erase are blind: they only send a message in at the root.
+//
+// Buffered interior node:
+//
+// PTR KEY PTR ... KEY PTR (up to pivots keys) NUMMSGS OP KEY VALUE OP KEY VALUE ...
+//
+// Leaves are ordinary BTreeIndex leaves.  Copy-on-write, multi-version,
+// memtable, per-leaf Bloom filter, prefix compression, suffix
+// truncation, variable-length, overflow and order-statistic modes are
+// not supported.
+//
+class BeTreeIndex : public BTreeIndex {
+ protected:
+  SIZE_T pivots;   // most keys an interior node may hold
+
+  SIZE_T  GetNumMessageSlots() const;
+  char   *ResolveMessages(const BTreeNode &b) const;
+
+  ERROR_T LoadInterior(const BTreeNode &b, BeTreeInterior &n) const;
+  ERROR_T StoreInterior(BTreeNode &b, const BeTreeInterior &n) const;
+
+  // Write n back as node, splitting it if it has too many pivots.
+  // The parts after the first go to new nodes listed in newnodes,
+  // preceded by the separators in sepkeys.
+  ERROR_T WriteInterior(SIZE_T &node, const int nodetype, const BeTreeInterior &n,
+			vector<KEY_T> &sepkeys, vector<SIZE_T> &newnodes);
+  // Apply a sorted batch of messages to a leaf (zero means a new one)
+  ERROR_T ApplyToLeaf(SIZE_T &node, const vector<BeTreeMessage> &msgs,
+		      vector<KEY_T> &sepkeys, vector<SIZE_T> &newnodes);
+  // Add a sorted batch of messages to an interior node's buffer,
+  // flushing to children while the buffer is over full
+  ERROR_T PushMessages(SIZE_T &node, BTreeNode &b, const vector<BeTreeMessage> &msgs,
+		       vector<KEY_T> &sepkeys, vector<SIZE_T> &newnodes);
+  // Send a new message in at the root
+  ERROR_T Enqueue(const BeTreeMessage &m);
+
+  ERROR_T QueryInternal(const SIZE_T &node, const KEY_T &key, VALUE_T &value);
+  // QueryInternal, unless the global filter rules key out
+  ERROR_T Exists(const KEY_T &key, VALUE_T &old);
+  // Every pair in the subtree, sorted, with its buffers applied
+  ERROR_T CollectInternal(const SIZE_T &node, vector<KeyValuePair> &kvs) const;
+  ERROR_T DisplayBuffered(const SIZE_T &node, ostream &o,
+			  const BTreeDisplayType display_type) const;
+  ERROR_T SanityCheckBuffered(const SIZE_T &node, const SIZE_T depth, SIZE_T &leafdepth,
+			      const KEY_T *lo, const KEY_T *hi) const;
+  // From CollectInternal, buffers applied
+  virtual ERROR_T BuildGlobalFilter();
+  // Leaves get no filters of their own, since lookups never check them
+  virtual void    NoteNode(const SIZE_T &node, const BTreeNode &b);
+
+ public:
+  // pivots=0 picks about the square root of the interior fanout,
+  // which is the usual epsilon=1/2 tradeoff.  Like keysize and
+  // valuesize it only matters when creating the index.
+  BeTreeIndex(SIZE_T keysize,
+	      SIZE_T valuesize,
+	      BufferCache *cache,
+	      SIZE_T pivots=0);
+  BeTreeIndex();
+  BeTreeIndex(const BeTreeIndex &rhs);
+  virtual ~BeTreeIndex();
+  BeTreeIndex & operator=(const BeTreeIndex &rhs);
+
+  // Same contracts as BTreeIndex
+  virtual ERROR_T Attach(const SIZE_T initblock, const bool create=false);
+  virtual ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
+  virtual ERROR_T Update(const KEY_T &key, const VALUE_T &value);
+  virtual ERROR_T Delete(const KEY_T &key);
+  virtual ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
+  virtual ERROR_T Upsert(const KEY_T &key, const VALUE_T &value);
+  virtual ERROR_T Erase(const KEY_T &key);
+  virtual ERROR_T SanityCheck() const;
+  virtual ERROR_T Display(ostream &o, BTreeDisplayType display_type=BTREE_DEPTH) const;
+
+  using BTreeIndex::Lookup;
+  using BTreeIndex::Display;
+};
+
+#endif
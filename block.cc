@@ -2,29 +2,46 @@
 #include <string.h>
 
 #include "block.h"
+#include "arena.h"
 
-Block::Block() : data(0), length(0), lastaccessed(-1), dirty(false)
+Block::Block() : data(inlinedata), length(0), lastaccessed(-1), dirty(false), capacity(BLOCK_INLINE_BYTES), owned(false)
 {}
 
 
-Block::Block(const SIZE_T s) : data(0), length(0), lastaccessed(-1), dirty(false)
+Block::Block(const SIZE_T s) : data(inlinedata), length(0), lastaccessed(-1), dirty(false), capacity(BLOCK_INLINE_BYTES), owned(false)
 {
   Resize(s);
 }
 
 
+Block::Block(const SIZE_T s, Arena *arena) : data(inlinedata), length(0), lastaccessed(-1), dirty(false), capacity(BLOCK_INLINE_BYTES), owned(false)
+{
+  BYTE_T *d;
 
-Block::Block(const Block &rhs) : data(0), length(0), lastaccessed(rhs.lastaccessed), dirty(rhs.dirty)
+  if (arena && s>capacity && (d=(BYTE_T *)arena->Allocate(s))) { 
+    data=d;
+    capacity=s;
+  }
+  Resize(s);
+}
+
+
+Block::Block(const Block &rhs) : data(inlinedata), length(0), lastaccessed(rhs.lastaccessed), dirty(rhs.dirty), capacity(BLOCK_INLINE_BYTES), owned(false)
 {
-  if (Resize(rhs.length)!=ERROR_NOERROR) { 
+  if (Resize(rhs.length,false)!=ERROR_NOERROR) { 
     throw GenericException();
   }
   memcpy(data,rhs.data,rhs.length);
 }
 
-Block::Block(const char * str) : data(0), length(0), lastaccessed(-1), dirty(false)
+Block::Block(Block &&rhs) : data(inlinedata), length(0), lastaccessed(rhs.lastaccessed), dirty(rhs.dirty), capacity(BLOCK_INLINE_BYTES), owned(false)
+{
+  *this=static_cast<Block &&>(rhs);
+}
+
+Block::Block(const char * str) : data(inlinedata), length(0), lastaccessed(-1), dirty(false), capacity(BLOCK_INLINE_BYTES), owned(false)
 {
-  if (Resize(strlen(str))!=ERROR_NOERROR) { 
+  if (Resize(strlen(str),false)!=ERROR_NOERROR) { 
     throw GenericException();
   }
   memcpy(data,str,strlen(str));
@@ -32,7 +49,8 @@ Block::Block(const char * str) : data(0), length(0), lastaccessed(-1), dirty(fal
 
 Block::~Block() 
 { 
-  if (data) { delete [] data; data=0; }
+  if (owned) { delete [] data; }
+  data=0;
   length=0;
   lastaccessed=-1;
   dirty=false;
@@ -40,7 +58,39 @@ Block::~Block()
 
 Block & Block::operator=(const Block &rhs)
 {
-  return *(new (this) Block(rhs));
+  if (this!=&rhs) { 
+    if (Resize(rhs.length,false)!=ERROR_NOERROR) { 
+      throw GenericException();
+    }
+    memcpy(data,rhs.data,rhs.length);
+    lastaccessed=rhs.lastaccessed;
+    dirty=rhs.dirty;
+  }
+  return *this;
+}
+
+Block & Block::operator=(Block &&rhs)
+{
+  if (this==&rhs) { 
+    return *this;
+  }
+  if (!rhs.owned) { 
+    // nothing to take: copy the bytes
+    *this=static_cast<const Block &>(rhs);
+  } else {
+    if (owned) { delete [] data; }
+    data=rhs.data;
+    capacity=rhs.capacity;
+    owned=true;
+    length=rhs.length;
+    lastaccessed=rhs.lastaccessed;
+    dirty=rhs.dirty;
+    rhs.data=rhs.inlinedata;
+    rhs.capacity=BLOCK_INLINE_BYTES;
+    rhs.owned=false;
+  }
+  rhs.length=0;
+  return *this;
 }
 
 
@@ -50,6 +100,12 @@ Block & Block::operator=(const Block &rhs)
 ERROR_T Block::Resize(const SIZE_T newlen, const bool copy)
 {
   BYTE_T *d;
+
+  if (newlen<=capacity) { 
+    // a key or value refilled in place keeps its buffer
+    length=newlen;
+    return ERROR_NOERROR;
+  }
   
   try {
     d = new BYTE_T [newlen];
@@ -62,8 +118,10 @@ ERROR_T Block::Resize(const SIZE_T newlen, const bool copy)
     memcpy(d,data,MIN(newlen,length));
   }
   
-  if (data) { delete [] data; }
+  if (owned) { delete [] data; }
   data = d;
+  capacity=newlen;
+  owned=true;
 
   length=newlen;
 
@@ -86,17 +144,18 @@ static char low2hex(BYTE_T x)
 
 
 
-#define MAX(x,y) ((x)>(y) ? (x) : (y))
-
+// Byte order, with a block ordered before the longer ones it begins
 bool Block::operator<(const Block &rhs) const
 {
-  return memcmp(data,rhs.data,MAX(length,rhs.length))<0;
+  int cmp=CompareBytes(data,rhs.data,MIN(length,rhs.length));
+
+  return cmp<0 || (cmp==0 && length<rhs.length);
 }
 
 
 bool Block::operator==(const Block &rhs) const
 {
-  return memcmp(data,rhs.data,MAX(length,rhs.length))==0;
+  return length==rhs.length && memcmp(data,rhs.data,length)==0;
 }
 
 ostream & Block::Print(ostream &os) const
@@ -109,3 +168,28 @@ ostream & Block::Print(ostream &os) const
   return os;
 }
 
+
+void NormalizeUnsigned(const unsigned long long v, const SIZE_T bytes, Block &b)
+{
+  b.Resize(bytes,false);
+  EncodeUnsigned(v,bytes,b.data);
+}
+
+
+void NormalizeSigned(const long long v, const SIZE_T bytes, Block &b)
+{
+  b.Resize(bytes,false);
+  EncodeSigned(v,bytes,b.data);
+}
+
+
+unsigned long long DenormalizeUnsigned(const Block &b)
+{
+  return DecodeUnsigned(b.data,b.length);
+}
+
+
+long long DenormalizeSigned(const Block &b)
+{
+  return DecodeSigned(b.data,b.length);
+}
@@ -2,26 +2,43 @@
 #define _block
 
 #include <iostream>
+#include <string.h>
+#include <stdint.h>
 
 #include "global.h"
 
 using namespace std;
 
+class Arena;
+
+// Blocks of up to this many bytes (most keys and values) are held in
+// the Block itself rather than on the heap
+#define BLOCK_INLINE_BYTES 32
+
 struct Block {
   BYTE_T	*data;
   SIZE_T 	length;
   double        lastaccessed;  // for use in buffercache only
   bool          dirty;         // for use in buffercahce only
+  SIZE_T        capacity;      // bytes data can hold without growing
+  bool          owned;         // data is from new[] and goes with the block
+  BYTE_T        inlinedata[BLOCK_INLINE_BYTES];
 
   Block();
   Block(const SIZE_T size);
+  // Borrows its buffer from arena, if there is one; the block must
+  // not outlive the arena's next Reset unless it has grown since
+  Block(const SIZE_T size, Arena *arena);
   Block(const Block &rhs);
+  Block(Block &&rhs);          // takes rhs's heap buffer, if it has one
   Block(const char *data);
   virtual ~Block();
-  Block & operator=(const Block &rhs);
+  Block & operator=(const Block &rhs);  // reuses this block's buffer when it fits
+  Block & operator=(Block &&rhs);
 
   // returns one of ERROR_NOERROR (zero)
   // ERROR_NOMEM or other nonzero error code.
+  // Only allocates to grow past capacity; shrinking keeps the buffer.
   ERROR_T Resize(const SIZE_T newlength, const bool copy=true);
 
   bool operator<(const Block &rhs) const;
@@ -33,4 +50,115 @@ struct Block {
 inline ostream & operator<<(ostream &os, const Block &b) { return b.Print(os);}
 
 
+// Compares len bytes in memcmp order, eight at a time: a word loaded
+// big endian orders the same way as its bytes, so only the word where
+// they differ needs its bytes looked at
+inline int CompareBytes(const BYTE_T *a, const BYTE_T *b, const SIZE_T len)
+{
+  unsigned long long x, y;
+  SIZE_T i;
+
+  for (i=0;i+sizeof(x)<=len;i+=sizeof(x)) { 
+    memcpy(&x,a+i,sizeof(x));
+    memcpy(&y,b+i,sizeof(y));
+    if (x!=y) { 
+#if __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+      x=__builtin_bswap64(x);
+      y=__builtin_bswap64(y);
+#endif
+      return x<y ? -1 : 1;
+    }
+  }
+  if (i+sizeof(unsigned int)<=len) { 
+    // and a four byte key as one word too
+    unsigned int u, v;
+    memcpy(&u,a+i,sizeof(u));
+    memcpy(&v,b+i,sizeof(v));
+    if (u!=v) { 
+#if __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+      u=__builtin_bswap32(u);
+      v=__builtin_bswap32(v);
+#endif
+      return u<v ? -1 : 1;
+    }
+    i+=sizeof(u);
+  }
+  return memcmp(a+i,b+i,len-i);
+}
+
+
+// Order-preserving key encodings of integers, in bytes bytes (up to 8):
+// big endian, and for signed ones with the sign bit flipped, so that
+// the keys order as the numbers do.  The Encode/Decode forms work on
+// bytes at p; the word sizes are a byte swap on little-endian hosts.
+inline void EncodeUnsigned(const unsigned long long v, const SIZE_T bytes, BYTE_T *p)
+{
+  if (bytes==sizeof(uint64_t)) { 
+#if __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+    uint64_t w=__builtin_bswap64(v);
+#else
+    uint64_t w=v;
+#endif
+    memcpy(p,&w,sizeof(w));
+  } else if (bytes==sizeof(uint32_t)) { 
+#if __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+    uint32_t w=__builtin_bswap32((uint32_t)v);
+#else
+    uint32_t w=(uint32_t)v;
+#endif
+    memcpy(p,&w,sizeof(w));
+  } else {
+    for (SIZE_T i=0;i<bytes;i++) { 
+      p[i]=(v>>(8*(bytes-1-i))) & 0xff;
+    }
+  }
+}
+
+inline unsigned long long DecodeUnsigned(const BYTE_T *p, const SIZE_T bytes)
+{
+  if (bytes==sizeof(uint64_t)) { 
+    uint64_t w;
+    memcpy(&w,p,sizeof(w));
+#if __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+    w=__builtin_bswap64(w);
+#endif
+    return w;
+  } else if (bytes==sizeof(uint32_t)) { 
+    uint32_t w;
+    memcpy(&w,p,sizeof(w));
+#if __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+    w=__builtin_bswap32(w);
+#endif
+    return w;
+  } else {
+    unsigned long long v=0;
+    for (SIZE_T i=0;i<bytes;i++) { 
+      v=v<<8 | p[i];
+    }
+    return v;
+  }
+}
+
+inline void EncodeSigned(const long long v, const SIZE_T bytes, BYTE_T *p)
+{
+  EncodeUnsigned((unsigned long long)v ^ (1ULL<<(8*bytes-1)),bytes,p);
+}
+
+inline long long DecodeSigned(const BYTE_T *p, const SIZE_T bytes)
+{
+  unsigned long long v=DecodeUnsigned(p,bytes) ^ (1ULL<<(8*bytes-1));
+
+  if (bytes<sizeof(v)) { 
+    // sign extend
+    v=(unsigned long long)((long long)(v<<(64-8*bytes))>>(64-8*bytes));
+  }
+  return (long long)v;
+}
+
+void NormalizeUnsigned(const unsigned long long v, const SIZE_T bytes, Block &b);
+void NormalizeSigned(const long long v, const SIZE_T bytes, Block &b);
+unsigned long long DenormalizeUnsigned(const Block &b);
+long long DenormalizeSigned(const Block &b);
+
+
 #endif
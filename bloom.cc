@@ -0,0 +1,119 @@
+#include "bloom.h"
+
+
+BloomFilter::BloomFilter() : numhashes(0)
+{}
+
+
+BloomFilter::BloomFilter(const SIZE_T numkeys, const SIZE_T bitsperkey)
+{
+  // k = ln 2 * bits per key minimizes the false positive rate
+  numhashes=(bitsperkey*69+50)/100;
+  if (numhashes<1) {
+    numhashes=1;
+  }
+  bits.resize((numkeys*bitsperkey+7)/8+1,0);
+}
+
+
+BloomFilter::BloomFilter(const BloomFilter &rhs) : bits(rhs.bits), numhashes(rhs.numhashes)
+{}
+
+
+BloomFilter::~BloomFilter()
+{}
+
+
+BloomFilter & BloomFilter::operator=(const BloomFilter &rhs)
+{
+  bits=rhs.bits;
+  numhashes=rhs.numhashes;
+  return *this;
+}
+
+
+// FNV-1a, and a second hash derived from it, combined as
+// h1 + i*h2 (Kirsch and Mitzenmacher)
+static void Hash(const Block &key, SIZE_T &h1, SIZE_T &h2)
+{
+  SIZE_T i;
+
+  h1=2166136261u;
+  for (i=0;i<key.length;i++) {
+    h1^=key.data[i];
+    h1*=16777619u;
+  }
+  h2=h1;
+  h2^=h2>>16;
+  h2*=0x85ebca6bu;
+  h2^=h2>>13;
+  h2*=0xc2b2ae35u;
+  h2^=h2>>16;
+  h2|=1;
+}
+
+
+void BloomFilter::Add(const Block &key)
+{
+  SIZE_T h1, h2, i, bit;
+  SIZE_T nbits=bits.size()*8;
+
+  if (nbits==0) {
+    return;
+  }
+  Hash(key,h1,h2);
+  for (i=0;i<numhashes;i++) {
+    bit=(h1+i*h2)%nbits;
+    bits[bit/8]|=1<<(bit%8);
+  }
+}
+
+
+bool BloomFilter::MayContain(const Block &key) const
+{
+  SIZE_T h1, h2, i, bit;
+  SIZE_T nbits=bits.size()*8;
+
+  if (nbits==0) {
+    return true;
+  }
+  Hash(key,h1,h2);
+  for (i=0;i<numhashes;i++) {
+    bit=(h1+i*h2)%nbits;
+    if (!(bits[bit/8] & (1<<(bit%8)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+void BloomFilter::Clear()
+{
+  bits.assign(bits.size(),0);
+}
+
+
+SIZE_T BloomFilter::GetNumBytes() const
+{
+  return bits.size();
+}
+
+
+BYTE_T *BloomFilter::GetBytes()
+{
+  return bits.empty() ? 0 : &bits[0];
+}
+
+
+const BYTE_T *BloomFilter::GetBytes() const
+{
+  return bits.empty() ? 0 : &bits[0];
+}
+
+
+ostream & BloomFilter::Print(ostream &os) const
+{
+  os << "BloomFilter(bytes="<<bits.size()<<", hashes="<<numhashes<<")";
+  return os;
+}
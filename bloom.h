@@ -0,0 +1,44 @@
+#ifndef _bloom
+#define _bloom
+
+#include <iostream>
+#include <vector>
+
+#include "global.h"
+#include "block.h"
+
+using namespace std;
+
+//
+// Bloom filter over keys.  MayContain never says no for a key that
+// was added; it says yes for a key that was not with probability
+// about 0.6185^(bits per key).
+//
+class BloomFilter {
+ private:
+  vector<BYTE_T> bits;
+  SIZE_T         numhashes;
+
+ public:
+  BloomFilter();
+  // Room for numkeys keys at bitsperkey bits each
+  BloomFilter(const SIZE_T numkeys, const SIZE_T bitsperkey);
+  BloomFilter(const BloomFilter &rhs);
+  virtual ~BloomFilter();
+  BloomFilter & operator=(const BloomFilter &rhs);
+
+  void   Add(const Block &key);
+  bool   MayContain(const Block &key) const;
+  void   Clear();
+
+  // The raw bit array, for saving and restoring the filter
+  SIZE_T  GetNumBytes() const;
+  BYTE_T *GetBytes();
+  const BYTE_T *GetBytes() const;
+
+  ostream & Print(ostream &os) const;
+};
+
+inline ostream & operator<<(ostream &os, const BloomFilter &f) { return f.Print(os); }
+
+#endif
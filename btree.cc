@@ -1,8 +1,9 @@
 #include <assert.h>
 #include <string.h> //Used for memmove
+#include <algorithm>
 #include <iostream>
-#include <queue>
 #include <set>
+#include <utility>
 #include "btree.h"
 
 KeyValuePair::KeyValuePair()
@@ -19,15 +20,55 @@ KeyValuePair::KeyValuePair(const KeyValuePair &rhs) :
 {}
 
 
+KeyValuePair::KeyValuePair(KeyValuePair &&rhs) :
+  key(move(rhs.key)), value(move(rhs.value))
+{}
+
+
 KeyValuePair::~KeyValuePair()
 {}
 
 
 KeyValuePair & KeyValuePair::operator=(const KeyValuePair &rhs)
 {
-  return *( new (this) KeyValuePair(rhs));
+  key=rhs.key;
+  value=rhs.value;
+  return *this;
+}
+
+
+KeyValuePair & KeyValuePair::operator=(KeyValuePair &&rhs)
+{
+  key=move(rhs.key);
+  value=move(rhs.value);
+  return *this;
+}
+
+BTreeSnapshot::BTreeSnapshot() : rootnode(0), epoch(0), timestamp(BTREE_VERSION_LATEST)
+{}
+
+
+BTreeSnapshot::BTreeSnapshot(const SIZE_T r, const SIZE_T e, const SIZE_T t) :
+  rootnode(r), epoch(e), timestamp(t)
+{}
+
+
+//
+// The version stamp is kept as the tail of a multi-version value
+//
+static SIZE_T GetStamp(const VALUE_T &v, const SIZE_T uservaluesize)
+{
+  SIZE_T stamp;
+  memcpy(&stamp,v.data+uservaluesize,sizeof(SIZE_T));
+  return stamp;
+}
+
+static void SetStamp(VALUE_T &v, const SIZE_T uservaluesize, const SIZE_T stamp)
+{
+  memcpy(v.data+uservaluesize,&stamp,sizeof(SIZE_T));
 }
 
+
 BTreeIndex::BTreeIndex(SIZE_T keysize, 
 		       SIZE_T valuesize,
 		       BufferCache *cache,
@@ -36,12 +77,55 @@ BTreeIndex::BTreeIndex(SIZE_T keysize,
   superblock.info.keysize=keysize;
   superblock.info.valuesize=valuesize;
   buffercache=cache;
+  copyonwrite=false;
+  epoch=0;
+  prefixleaves=false;
+  suffixtruncation=false;
+  varlen=false;
+  overflowthreshold=0;
+  overflowsize=0;
+  counted=false;
+  searchtype=BTREE_SEARCH_LINEAR;
+  keyprobes=0;
+  multiversion=false;
+  timestamp=0;
+  memtablelimit=0;
+  memtablebytes=0;
+  bloombits=0;
+  bloomglobal=false;
+  globalvalid=false;
+  globalroom=0;
+  globalkeys=0;
+  globaldeletes=0;
+  leafskips=leaffalsepos=0;
+  globalskips=globalfalsepos=0;
   // note: ignoring unique now
 }
 
 BTreeIndex::BTreeIndex()
 {
-  // shouldn't have to do anything
+  copyonwrite=false;
+  epoch=0;
+  prefixleaves=false;
+  suffixtruncation=false;
+  varlen=false;
+  overflowthreshold=0;
+  overflowsize=0;
+  counted=false;
+  searchtype=BTREE_SEARCH_LINEAR;
+  keyprobes=0;
+  multiversion=false;
+  timestamp=0;
+  memtablelimit=0;
+  memtablebytes=0;
+  bloombits=0;
+  bloomglobal=false;
+  globalvalid=false;
+  globalroom=0;
+  globalkeys=0;
+  globaldeletes=0;
+  leafskips=leaffalsepos=0;
+  globalskips=globalfalsepos=0;
 }
 
 
@@ -53,6 +137,33 @@ BTreeIndex::BTreeIndex(const BTreeIndex &rhs)
   buffercache=rhs.buffercache;
   superblock_index=rhs.superblock_index;
   superblock=rhs.superblock;
+  copyonwrite=rhs.copyonwrite;
+  epoch=rhs.epoch;
+  prefixleaves=rhs.prefixleaves;
+  suffixtruncation=rhs.suffixtruncation;
+  varlen=rhs.varlen;
+  overflowthreshold=rhs.overflowthreshold;
+  overflowsize=rhs.overflowsize;
+  counted=rhs.counted;
+  searchtype=rhs.searchtype;
+  keyprobes=rhs.keyprobes;
+  multiversion=rhs.multiversion;
+  timestamp=rhs.timestamp;
+  memtablelimit=rhs.memtablelimit;
+  memtablebytes=rhs.memtablebytes;
+  memtable=rhs.memtable;
+  bloombits=rhs.bloombits;
+  bloomglobal=rhs.bloomglobal;
+  leaffilters=rhs.leaffilters;
+  globalfilter=rhs.globalfilter;
+  globalvalid=rhs.globalvalid;
+  globalroom=rhs.globalroom;
+  globalkeys=rhs.globalkeys;
+  globaldeletes=rhs.globaldeletes;
+  leafskips=rhs.leafskips;
+  leaffalsepos=rhs.leaffalsepos;
+  globalskips=rhs.globalskips;
+  globalfalsepos=rhs.globalfalsepos;
 }
 
 BTreeIndex::~BTreeIndex()
@@ -67,538 +178,2606 @@ BTreeIndex & BTreeIndex::operator=(const BTreeIndex &rhs)
 }
 
 
+// A block freed since Attach if there is one, else the head of the
+// free list, else the next never-used block.  Only the free list
+// needs its block read, for the link to the next.  Whoever gets the
+// block writes it whole, which the cache takes without a read.
 ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
 {
-  n=superblock.info.freelist;
+  SIZE_T fresh;
 
-  if (n==0) { 
-    return ERROR_NOSPACE;
-  }
+  superblock.GetSuperField(BTREE_SUPER_FRESH,fresh);
+
+  if (!freed.empty()) { 
+    n=freed.back();
+    freed.pop_back();
+  } else if (superblock.info.freelist!=0) { 
+    n=superblock.info.freelist;
+
+    BTreeNode node;
+
+    node.Unserialize(buffercache,n,superblock.info);
 
-  BTreeNode node;
+    assert(node.info.nodetype==BTREE_UNALLOCATED_BLOCK);
 
-  node.Unserialize(buffercache,n);
+    superblock.info.freelist=node.info.freelist;
 
-  assert(node.info.nodetype==BTREE_UNALLOCATED_BLOCK);
+    superblock.Serialize(buffercache,superblock_index);
+  } else if (fresh!=0 && fresh<buffercache->GetNumBlocks()) { 
+    n=fresh;
 
-  superblock.info.freelist=node.info.freelist;
+    superblock.SetSuperField(BTREE_SUPER_FRESH,fresh+1);
 
-  superblock.Serialize(buffercache,superblock_index);
+    superblock.Serialize(buffercache,superblock_index);
+  } else {
+    return ERROR_NOSPACE;
+  }
 
   buffercache->NotifyAllocateBlock(n);
 
+  if (copyonwrite) { 
+    pending_fresh.push_back(n);
+  }
+
   return ERROR_NOERROR;
 }
 
 
+// The block is neither read nor written: the cache drops its copy,
+// and it goes on the free list only on Detach (see WriteFreeList)
 ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
 {
-  BTreeNode node;
-
-  node.Unserialize(buffercache,n);
+  freed.push_back(n);
 
-  assert(node.info.nodetype!=BTREE_UNALLOCATED_BLOCK);
-
-  node.info.nodetype=BTREE_UNALLOCATED_BLOCK;
+  buffercache->NotifyDeallocateBlock(n);
 
-  node.info.freelist=superblock.info.freelist;
+  leaffilters.erase(n);
 
-  node.Serialize(buffercache,n);
+  return ERROR_NOERROR;
 
-  superblock.info.freelist=n;
+}
 
-  superblock.Serialize(buffercache,superblock_index);
 
-  buffercache->NotifyDeallocateBlock(n);
+ERROR_T BTreeIndex::WriteFreeList()
+{
+  SIZE_T i;
+  ERROR_T rc;
 
+  // the last freed ends up at the head, to be handed out first again
+  for (i=0;i<freed.size();i++) { 
+    BTreeNode node(BTREE_UNALLOCATED_BLOCK,
+		   superblock.info.keysize,
+		   superblock.info.valuesize,
+		   buffercache->GetBlockSize());
+    node.info.rootnode=superblock.info.rootnode;
+    node.info.freelist=superblock.info.freelist;
+    rc=node.Serialize(buffercache,freed[i]);
+    if (rc) { return rc; }
+    superblock.info.freelist=freed[i];
+  }
+  freed.clear();
   return ERROR_NOERROR;
-
 }
 
-ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
+
+ERROR_T BTreeIndex::WriteNode(SIZE_T &n, const BTreeNode &b)
 {
   ERROR_T rc;
+  SIZE_T newn;
+
+  if (copyonwrite &&
+      find(pending_fresh.begin(),pending_fresh.end(),n)==pending_fresh.end()) { 
+    // Never overwrite a block that the published root (or a snapshot)
+    // can reach.  Shadow it instead and let the parent pick up newn.
+    // One allocated by this operation is reachable by no one yet.
+    rc=AllocateNode(newn);
+    if (rc) { return rc; }
+    pending_retired.push_back(n);
+    n=newn;
+  }
 
-  superblock_index=initblock;
-  assert(superblock_index==0);
+  return WriteNewNode(n,b);
+}
 
-  if (create) {
-    // build a super block, root node, and a free space list
-    //
-    // Superblock at superblock_index
-    // root node at superblock_index+1
-    // free space list for rest
-    BTreeNode newsuperblock(BTREE_SUPERBLOCK,
-			    superblock.info.keysize,
-			    superblock.info.valuesize,
-			    buffercache->GetBlockSize());
-    newsuperblock.info.rootnode=superblock_index+1;
-    newsuperblock.info.freelist=superblock_index+2;
-    newsuperblock.info.numkeys=0;
 
-    buffercache->NotifyAllocateBlock(superblock_index);
+ERROR_T BTreeIndex::WriteNewNode(const SIZE_T &n, const BTreeNode &b)
+{
+  ERROR_T rc;
 
-    rc=newsuperblock.Serialize(buffercache,superblock_index);
+  rc=b.Serialize(buffercache,n);
+  if (rc) { return rc; }
 
-    if (rc) { 
-      return rc;
-    }
-    
-    BTreeNode newrootnode(BTREE_ROOT_NODE,
-			  superblock.info.keysize,
-			  superblock.info.valuesize,
-			  buffercache->GetBlockSize());
-    newrootnode.info.rootnode=superblock_index+1;
-    newrootnode.info.freelist=superblock_index+2;
-    newrootnode.info.numkeys=0;
+  NoteNode(n,b);
+  return ERROR_NOERROR;
+}
 
-    buffercache->NotifyAllocateBlock(superblock_index+1);
 
-    rc=newrootnode.Serialize(buffercache,superblock_index+1);
+ERROR_T BTreeIndex::PublishRoot(const SIZE_T &newroot)
+{
+  ERROR_T rc;
+  SIZE_T i;
 
-    if (rc) { 
-      return rc;
-    }
+  superblock.info.rootnode=newroot;
 
-    for (SIZE_T i=superblock_index+2; i<buffercache->GetNumBlocks();i++) { 
-      BTreeNode newfreenode(BTREE_UNALLOCATED_BLOCK,
-			    superblock.info.keysize,
-			    superblock.info.valuesize,
-			    buffercache->GetBlockSize());
-      newfreenode.info.rootnode=superblock_index+1;
-      newfreenode.info.freelist= ((i+1)==buffercache->GetNumBlocks()) ? 0: i+1;
-      
-      rc = newfreenode.Serialize(buffercache,i);
+  rc=superblock.Serialize(buffercache,superblock_index);
 
-      if (rc) {
-	return rc;
-      }
+  if (rc) { return rc; }
 
-    }
+  // Everything replaced by this operation was last reachable from
+  // the version we just moved away from
+  for (i=0;i<pending_retired.size();i++) { 
+    retired.push_back(make_pair(epoch,pending_retired[i]));
   }
+  pending_retired.clear();
+  pending_fresh.clear();
+  epoch++;
 
-  // OK, now, mounting the btree is simply a matter of reading the superblock 
-
-  return superblock.Unserialize(buffercache,initblock);
+  return ReclaimRetired();
 }
-    
 
-ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
+
+ERROR_T BTreeIndex::AbortWrite()
 {
-  return superblock.Serialize(buffercache,superblock_index);
+  ERROR_T rc;
+  SIZE_T i;
+
+  // The old root is still published, so the blocks we shadowed are
+  // still live.  Only the fresh copies need to go.
+  pending_retired.clear();
+  for (i=0;i<pending_fresh.size();i++) { 
+    rc=DeallocateNode(pending_fresh[i]);
+    if (rc) { return rc; }
+  }
+  pending_fresh.clear();
+  return ERROR_NOERROR;
 }
- 
 
-ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
-					   const BTreeOp op,
-					   const KEY_T &key,
-					   VALUE_T &value)
+
+ERROR_T BTreeIndex::ReclaimRetired()
 {
-  BTreeNode b;
   ERROR_T rc;
-  SIZE_T offset;
-  KEY_T testkey;
-  SIZE_T ptr;
 
-  rc= b.Unserialize(buffercache,node);
-
-  if (rc!=ERROR_NOERROR) { 
-    return rc;
+  // A block retired at epoch e is reachable only from snapshots
+  // taken at epoch e or earlier
+  while (!retired.empty() &&
+	 (snapshots.empty() || retired.front().first < snapshots.begin()->first)) { 
+    rc=DeallocateNode(retired.front().second);
+    if (rc) { return rc; }
+    retired.pop_front();
   }
+  return ERROR_NOERROR;
+}
 
-  switch (b.info.nodetype) { 
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    // Scan through key/ptr pairs
-    //and recurse if possible
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (key<testkey || key==testkey) {
-      	// OK, so we now have the first key that's larger
-      	// so we need to recurse on the ptr immediately previous to 
-      	// this one, if it exists
-      	rc=b.GetPtr(offset,ptr);
-      	if (rc) { return rc; }
-      	return LookupOrUpdateInternal(ptr,op,key,value);
-      }
-    }
-    // if we got here, we need to go to the next pointer, if it exists
-    if (b.info.numkeys>0) { 
-      rc=b.GetPtr(b.info.numkeys,ptr);
-      if (rc) { return rc; }
-      return LookupOrUpdateInternal(ptr,op,key,value);
-    } else {
-      // There are no keys at all on this node, so nowhere to go
-      return ERROR_NONEXISTENT;
-    }
-    break;
-  case BTREE_LEAF_NODE:
-    // Scan through keys looking for matching value
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (testkey==key) { 
-      	if (op==BTREE_OP_LOOKUP) { 
-      	  return b.GetVal(offset,value);
-      	} else { 
-      	  // BTREE_OP_UPDATE
-      	  // WRITE ME
-      	  return b.SetVal(offset,value);
-      	}
-      }
-    }
-    return ERROR_NONEXISTENT;
-    break;
-  default:
-    // We can't be looking at anything other than a root, internal, or leaf
-    return ERROR_INSANE;
-    break;
-  }  
 
-  return ERROR_INSANE;
+void BTreeIndex::SetCopyOnWrite(const bool cow)
+{
+  copyonwrite=cow;
 }
 
 
-static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt)
+bool BTreeIndex::GetCopyOnWrite() const
 {
-  KEY_T key;
-  VALUE_T value;
-  SIZE_T ptr;
-  SIZE_T offset;
-  ERROR_T rc;
-  unsigned i;
+  return copyonwrite;
+}
 
-  if (dt==BTREE_DEPTH_DOT) { 
-    os << nodenum << " [ label=\""<<nodenum<<": ";
-  } else if (dt==BTREE_DEPTH) {
-    os << nodenum << ": ";
-  } else {
-  }
 
-  switch (b.info.nodetype) { 
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    if (dt==BTREE_SORTED_KEYVAL) {
-    } else {
-      if (dt==BTREE_DEPTH_DOT) { 
-      } else { 
-	os << "Interior: ";
-      }
-      for (offset=0;offset<=b.info.numkeys;offset++) { 
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	os << "*" << ptr << " ";
-	// Last pointer
-	if (offset==b.info.numkeys) break;
-	rc=b.GetKey(offset,key);
-	if (rc) {  return rc; }
-	for (i=0;i<b.info.keysize;i++) { 
-	  os << key.data[i];
-	}
-	os << " ";
-      }
-    }
-    break;
-  case BTREE_LEAF_NODE:
-    if (dt==BTREE_DEPTH_DOT || dt==BTREE_SORTED_KEYVAL) { 
-    } else {
-      os << "Leaf: ";
-    }
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      if (offset==0) { 
-	// special case for first pointer
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	if (dt!=BTREE_SORTED_KEYVAL) { 
-	  os << "*" << ptr << " ";
-	}
-      }
-      if (dt==BTREE_SORTED_KEYVAL) { 
-	os << "(";
-      }
-      rc=b.GetKey(offset,key);
-      if (rc) {  return rc; }
-      for (i=0;i<b.info.keysize;i++) { 
-	os << key.data[i];
-      }
-      if (dt==BTREE_SORTED_KEYVAL) { 
-	os << ",";
-      } else {
-	os << " ";
-      }
-      rc=b.GetVal(offset,value);
-      if (rc) {  return rc; }
-      for (i=0;i<b.info.valuesize;i++) { 
-	os << value.data[i];
-      }
-      if (dt==BTREE_SORTED_KEYVAL) { 
-	os << ")\n";
-      } else {
-	os << " ";
-      }
-    }
-    break;
-  default:
-    if (dt==BTREE_DEPTH_DOT) { 
-      os << "Unknown("<<b.info.nodetype<<")";
-    } else {
-      os << "Unsupported Node Type " << b.info.nodetype ;
-    }
-  }
-  if (dt==BTREE_DEPTH_DOT) { 
-    os << "\" ]";
-  }
-  return ERROR_NOERROR;
+void BTreeIndex::SetMultiVersion(const bool mvcc)
+{
+  multiversion=mvcc;
 }
-  
-ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+
+
+bool BTreeIndex::GetMultiVersion() const
 {
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+  return multiversion;
 }
 
 
-// The function to create a new leaf node in one disk write
-ERROR_T BTreeIndex::CreateLeafNode(SIZE_T &ptr, const KEY_T &key, const VALUE_T &value){
-  BTreeNode node;
-  ERROR_T rc;
-  // Allocate a new node. NOTE that AllocateNode cannot take const SIZE_T as an argument.
-  rc=AllocateNode(ptr);
-  if (rc) { return rc; }
-  rc=node.Unserialize(buffercache,ptr);
-  if (rc) { return rc; }
-  node.info.nodetype=(SIZE_T)BTREE_LEAF_NODE;// This is causing a overflow.
-  //Insert the key and value into the newleaf. NOTE, hav eto do numkeys++ before setting key or value.
-  node.info.numkeys=1;
-  node.SetKey(0,key);
-  node.SetVal(0,value);
+void BTreeIndex::SetPrefixCompression(const bool prefix)
+{
+  prefixleaves=prefix;
+}
 
-  rc=node.Serialize(buffercache,ptr);
-  if (rc) { return rc; }
-  return ERROR_NOERROR;
+
+bool BTreeIndex::GetPrefixCompression() const
+{
+  return prefixleaves;
 }
 
-// The function to split an internal node. The input is the node, the key and the value to be inserted after/during the split
-ERROR_T BTreeIndex::SplitInternal(const SIZE_T &node, const KEY_T &key, const VALUE_T &value){
-  //        Splitting an internal node:
-  //            The difference is xl contains [m-2]-1 smallest keys and xr contains [m/2] largest keys. 
-  //            Note that the [m/2]th key J is not placed in xl or xr, but is used to be a key in parent node
-  //            Make J the parent of xl and xr, and push j together with its child pointers(to xl) into the parent of x. 
-  BTreeNode b;
-  ERROR_T rc;
-  SIZE_T offset;
-  SIZE_T offset_keyvalue;
-  KEY_T testkey;
-  KeyValuePair testkeyvalue;
-  SIZE_T ptr;
-  SIZE_T xl_ptr;
-  SIZE_T xr_ptr;
-  BTreeNode xl_node;
-  BTreeNode xr_node;
 
-  rc= b.Unserialize(buffercache,node);
+void BTreeIndex::SetSuffixTruncation(const bool truncate)
+{
+  suffixtruncation=truncate;
+}
 
-  if (rc!=ERROR_NOERROR) { 
-    return rc;
-  }
-  //check whether the node is internal node
-  assert(b.info.nodetype==BTREE_ROOT_NODE || b.info.nodetype==BTREE_INTERIOR_NODE);
-  // Find the position to insert key and value.
-  for (offset=0;offset<b.info.numkeys;offset++) { 
-    rc=b.GetKey(offset,testkey);
-    if (rc) {  return rc; }
-    if (key<testkey || key==testkey) {
-      // OK, so we now have the first key that's larger
-      // So we record the offset and quit
-      offset_keyvalue=offset;
-      break;
+
+bool BTreeIndex::GetSuffixTruncation() const
+{
+  return suffixtruncation;
+}
+
+
+void BTreeIndex::SetVariableLength(const bool variable)
+{
+  varlen=variable;
+}
+
+
+bool BTreeIndex::GetVariableLength() const
+{
+  return varlen;
+}
+
+
+void BTreeIndex::SetOverflowThreshold(const SIZE_T threshold)
+{
+  overflowthreshold=threshold;
+}
+
+
+SIZE_T BTreeIndex::GetOverflowThreshold() const
+{
+  return overflowthreshold;
+}
+
+
+void BTreeIndex::SetOrderStatistics(const bool counts)
+{
+  counted=counts;
+}
+
+
+bool BTreeIndex::GetOrderStatistics() const
+{
+  return counted;
+}
+
+
+void BTreeIndex::SetSearchType(const BTreeSearchType how)
+{
+  searchtype=how;
+}
+
+
+BTreeSearchType BTreeIndex::GetSearchType() const
+{
+  return searchtype;
+}
+
+
+SIZE_T BTreeIndex::GetNumKeyProbes() const
+{
+  return keyprobes;
+}
+
+
+const Arena & BTreeIndex::GetArena() const
+{
+  return arena;
+}
+
+
+// In a variable-length tree keysize and valuesize are the largest
+// allowed, and keys are never empty
+bool BTreeIndex::KeyFits(const KEY_T &key) const
+{
+  if (varlen) { 
+    return key.length>0 && key.length<=superblock.info.keysize;
+  }
+  return key.length==superblock.info.keysize;
+}
+
+
+bool BTreeIndex::ValueFits(const VALUE_T &value) const
+{
+  if (varlen) { 
+    return value.length<=superblock.info.valuesize;
+  }
+  return value.length==GetUserValueSize();
+}
+
+
+void BTreeIndex::SetMemTableLimit(const SIZE_T bytes)
+{
+  memtablelimit=bytes;
+}
+
+
+SIZE_T BTreeIndex::GetMemTableLimit() const
+{
+  return memtablelimit;
+}
+
+
+SIZE_T BTreeIndex::GetUserValueSize() const
+{
+  if (overflowsize) { 
+    return overflowsize;
+  }
+  return superblock.info.valuesize - (multiversion ? sizeof(SIZE_T) : 0);
+}
+
+
+void BTreeIndex::SetBloomFilter(const SIZE_T bitsperkey, const bool global)
+{
+  if (bitsperkey!=bloombits || !global) { 
+    leaffilters.clear();
+    globalvalid=false;
+  }
+  bloombits=bitsperkey;
+  bloomglobal=global;
+}
+
+
+SIZE_T BTreeIndex::GetBloomFilter() const
+{
+  return bloombits;
+}
+
+
+void BTreeIndex::GetBloomFilterStats(SIZE_T &ls, SIZE_T &lf, SIZE_T &gs, SIZE_T &gf) const
+{
+  ls=leafskips;
+  lf=leaffalsepos;
+  gs=globalskips;
+  gf=globalfalsepos;
+}
+
+
+// Every leaf filter is the same size, enough for the fullest leaf 
+// the format allows, so that a saved one can be read back
+SIZE_T BTreeIndex::GetLeafFilterRoom() const
+{
+  if (prefixleaves) { 
+    return superblock.info.GetNumSlotsAsLeaf(superblock.info.keysize-1);
+  }
+  if (varlen) { 
+    // one byte keys and empty values
+    return (superblock.info.GetNumDataBytes()-sizeof(SIZE_T))/(2*sizeof(SIZE_T)+1);
+  }
+  return superblock.info.GetNumSlotsAsLeaf();
+}
+
+
+void BTreeIndex::NoteNode(const SIZE_T &node, const BTreeNode &b)
+{
+  KEY_T key;
+  SIZE_T offset;
+
+  if (!bloombits || b.info.nodetype!=BTREE_LEAF_NODE) { 
+    return;
+  }
+
+  BloomFilter f(GetLeafFilterRoom(),bloombits);
+
+  for (offset=0;offset<b.info.numkeys;offset++) { 
+    if (b.GetKey(offset,key)) { 
+      // can't vouch for this leaf
+      leaffilters.erase(node);
+      return;
     }
+    f.Add(key);
   }
-  if (offset_keyvalue<b.info.numkeys/2-1){
-    // If the key to be inserted is in xl
-    rc=b.GetPtr(offset,ptr);
+  leaffilters[node]=f;
+}
+
+
+bool BTreeIndex::LeafFilterRulesOut(const SIZE_T &node, const KEY_T &key)
+{
+  map<SIZE_T,BloomFilter>::const_iterator f;
+
+  if (!bloombits) { 
+    return false;
+  }
+  f=leaffilters.find(node);
+  if (f==leaffilters.end() || (*f).second.MayContain(key)) { 
+    return false;
+  }
+  leafskips++;
+  return true;
+}
+
+
+bool BTreeIndex::GlobalFilterRulesOut(const KEY_T &key)
+{
+  if (!bloombits || !bloomglobal) { 
+    return false;
+  }
+  if (!globalvalid && BuildGlobalFilter()) { 
+    return false;
+  }
+  if (globalfilter.MayContain(key)) { 
+    return false;
+  }
+  globalskips++;
+  return true;
+}
+
+
+// The global filter is built from a scan of the tree, with room to
+// double.  Inserts add to it; deletes can't take bits out, so it is
+// rebuilt once it is full or half its keys may be gone.
+ERROR_T BTreeIndex::BuildGlobalFilter()
+{
+  vector<KeyValuePair> kvs;
+  BTreeMemTable::const_iterator m;
+  SIZE_T i;
+  ERROR_T rc;
+
+  rc=ScanInternal(superblock.info.rootnode,kvs);
+  if (rc) { return rc; }
+
+  globalroom=2*(kvs.size()+memtable.size())+64;
+  globalfilter=BloomFilter(globalroom,bloombits);
+  globalkeys=0;
+  globaldeletes=0;
+
+  for (i=0;i<kvs.size();i++) { 
+    globalfilter.Add(kvs[i].key);
+    globalkeys++;
+  }
+  for (m=memtable.begin();m!=memtable.end();++m) { 
+    if ((*m).second.first!=BTREE_OP_DELETE) { 
+      globalfilter.Add((*m).first);
+      globalkeys++;
+    }
+  }
+  globalvalid=true;
+  return ERROR_NOERROR;
+}
+
+
+void BTreeIndex::NoteGlobalInsert(const KEY_T &key)
+{
+  if (bloombits && bloomglobal && globalvalid) { 
+    globalfilter.Add(key);
+    if (++globalkeys>globalroom) { 
+      globalvalid=false;
+    }
+  }
+}
+
+
+void BTreeIndex::NoteGlobalDelete()
+{
+  if (bloombits && bloomglobal && globalvalid) { 
+    // the key's bits stay set, so the filter slowly fills with misses
+    if (++globaldeletes*2>globalkeys) { 
+      globalvalid=false;
+    }
+  }
+}
+
+
+static void PutSize(vector<BYTE_T> &buf, const SIZE_T v)
+{
+  buf.insert(buf.end(),(const BYTE_T *)&v,(const BYTE_T *)&v+sizeof(SIZE_T));
+}
+
+
+static bool GetSize(const vector<BYTE_T> &buf, SIZE_T &pos, SIZE_T &v)
+{
+  if (pos+sizeof(SIZE_T)>buf.size()) { 
+    return false;
+  }
+  memcpy(&v,&buf[pos],sizeof(SIZE_T));
+  pos+=sizeof(SIZE_T);
+  return true;
+}
+
+
+static bool GetFilter(const vector<BYTE_T> &buf, SIZE_T &pos, BloomFilter &f)
+{
+  if (pos+f.GetNumBytes()>buf.size()) { 
+    return false;
+  }
+  memcpy(f.GetBytes(),&buf[pos],f.GetNumBytes());
+  pos+=f.GetNumBytes();
+  return true;
+}
+
+
+ERROR_T BTreeIndex::SaveFilters(SIZE_T &first)
+{
+  vector<BYTE_T> buf;
+  vector<SIZE_T> nodes;
+  map<SIZE_T,BloomFilter>::const_iterator f;
+  SIZE_T room=superblock.info.GetNumDataBytes()-sizeof(SIZE_T);
+  SIZE_T i, n, next;
+  ERROR_T rc;
+
+  first=0;
+
+  PutSize(buf,bloombits);
+  PutSize(buf,bloomglobal && globalvalid ? globalroom : 0);
+  PutSize(buf,globalkeys);
+  if (bloomglobal && globalvalid) { 
+    buf.insert(buf.end(),globalfilter.GetBytes(),globalfilter.GetBytes()+globalfilter.GetNumBytes());
+  }
+  PutSize(buf,leaffilters.size());
+  for (f=leaffilters.begin();f!=leaffilters.end();++f) { 
+    PutSize(buf,(*f).first);
+    buf.insert(buf.end(),(*f).second.GetBytes(),(*f).second.GetBytes()+(*f).second.GetNumBytes());
+  }
+
+  n=(buf.size()+room-1)/room;
+  for (i=0;i<n;i++) { 
+    rc=AllocateNode(next);
     if (rc) { return rc; }
-    // Allocate a new node. (The left node)
-    rc=AllocateNode(xl_ptr);
+    nodes.push_back(next);
+  }
+
+  for (i=0;i<n;i++) { 
+    BTreeNode b(BTREE_FILTER_NODE,
+		superblock.info.keysize,
+		superblock.info.valuesize,
+		buffercache->GetBlockSize(),
+		superblock.info.headerbytes);
+    next= i+1<n ? nodes[i+1] : 0;
+    memcpy(b.data,&next,sizeof(SIZE_T));
+    memcpy(b.data+sizeof(SIZE_T),&buf[i*room],
+	   buf.size()-i*room<room ? buf.size()-i*room : room);
+    rc=b.Serialize(buffercache,nodes[i]);
     if (rc) { return rc; }
-    rc=xl_node.Unserialize(buffercache,xl_ptr);
+  }
+
+  first= n ? nodes[0] : 0;
+  return ERROR_NOERROR;
+}
+
+
+// The chain is freed whether or not it is used, since whatever 
+// changes the tree next may not keep the filters up to date
+ERROR_T BTreeIndex::LoadFilters(const SIZE_T &first)
+{
+  vector<BYTE_T> buf;
+  SIZE_T room=superblock.info.GetNumDataBytes()-sizeof(SIZE_T);
+  SIZE_T node, next, pos, bits, groom, gkeys, num, leaf, i;
+  BTreeNode b;
+  ERROR_T rc;
+
+  for (node=first;node!=0;node=next) { 
+    rc=b.Unserialize(buffercache,node,superblock.info);
     if (rc) { return rc; }
-    // Loop through the original node and insert the first [m-2]-1 smallest key/value pairs
-    for (offset=0;offset<offset_keyvalue;offset++) { 
-      rc=b.GetKeyVal(offset,testkeyvalue);
-      if (rc) {  return rc; }
-      xl_node.SetKeyVal(offset,testkeyvalue);
+    if (b.info.nodetype!=BTREE_FILTER_NODE) { 
+      return ERROR_INSANE;
     }
-    //insert the input key/value pair
-    xl_node.SetKey(offset_keyvalue,key);
-    xl_node.SetVal(offset_keyvalue,value);
-    // Keep doing the loop and insert the first [m-2]-1 smallest key/value pairs
-    for (offset=offset_keyvalue;offset<b.info.numkeys/2-1;offset++) { 
-      rc=b.GetKeyVal(offset,testkeyvalue);
-      if (rc) {  return rc; }
-      xl_node.SetKeyVal(offset+1,testkeyvalue);
+    memcpy(&next,b.data,sizeof(SIZE_T));
+    buf.insert(buf.end(),(BYTE_T *)b.data+sizeof(SIZE_T),(BYTE_T *)b.data+sizeof(SIZE_T)+room);
+    rc=DeallocateNode(node);
+    if (rc) { return rc; }
+  }
+
+  leaffilters.clear();
+  globalvalid=false;
+
+  pos=0;
+  if (!bloombits || !GetSize(buf,pos,bits) || bits!=bloombits || 
+      !GetSize(buf,pos,groom) || !GetSize(buf,pos,gkeys)) { 
+    return ERROR_NOERROR;
+  }
+  if (groom) { 
+    BloomFilter g(groom,bloombits);
+    if (!GetFilter(buf,pos,g)) { 
+      return ERROR_NOERROR;
+    }
+    if (bloomglobal) { 
+      globalfilter=g;
+      globalroom=groom;
+      globalkeys=gkeys;
+      globaldeletes=0;
+      globalvalid=true;
+    }
+  }
+  if (!GetSize(buf,pos,num)) { 
+    return ERROR_NOERROR;
+  }
+  for (i=0;i<num;i++) { 
+    BloomFilter f(GetLeafFilterRoom(),bloombits);
+    if (!GetSize(buf,pos,leaf) || !GetFilter(buf,pos,f)) { 
+      break;
+    }
+    leaffilters[leaf]=f;
+  }
+  return ERROR_NOERROR;
+}
+
+
+// A value's chain takes blocks from the free list in order, which on
+// a fresh disk are consecutive, so it can usually be read back in one
+// request
+ERROR_T BTreeIndex::PutOverflow(const VALUE_T &value, VALUE_T &stored)
+{
+  SIZE_T room=superblock.info.GetNumDataBytes()-sizeof(SIZE_T);
+  SIZE_T n=(value.length+room-1)/room;
+  SIZE_T length=value.length | BTREE_OVERFLOW_EXTENT;
+  vector<SIZE_T> nodes;
+  SIZE_T i, next;
+  ERROR_T rc=ERROR_NOERROR;
+
+  for (i=0;i<n;i++) { 
+    rc=AllocateNode(next);
+    if (rc) { break; }
+    if (i>0 && next!=nodes[i-1]+1) { 
+      length&=~BTREE_OVERFLOW_EXTENT;
+    }
+    nodes.push_back(next);
+  }
+  if (rc) { 
+    // the disk filled part way: give back what the chain took
+    for (i=0;i<nodes.size();i++) { 
+      DeallocateNode(nodes[i]);
+    }
+    return rc;
+  }
+
+  for (i=0;i<n;i++) { 
+    BTreeNode b(BTREE_OVERFLOW_NODE,
+		superblock.info.keysize,
+		superblock.info.valuesize,
+		buffercache->GetBlockSize(),
+		superblock.info.headerbytes);
+    next= i+1<n ? nodes[i+1] : 0;
+    memcpy(b.data,&next,sizeof(SIZE_T));
+    memcpy(b.data+sizeof(SIZE_T),value.data+i*room,
+	   value.length-i*room<room ? value.length-i*room : room);
+    rc=b.Serialize(buffercache,nodes[i]);
+    if (rc) { 
+      for (i=0;i<nodes.size();i++) { 
+	DeallocateNode(nodes[i]);
+      }
+      return rc;
+    }
+  }
+
+  next= n ? nodes[0] : 0;
+  rc=stored.Resize(2*sizeof(SIZE_T),false);
+  if (rc) { return rc; }
+  memcpy(stored.data,&next,sizeof(SIZE_T));
+  memcpy(stored.data+sizeof(SIZE_T),&length,sizeof(SIZE_T));
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::GetOverflow(const VALUE_T &stored, VALUE_T &value) const
+{
+  SIZE_T room=superblock.info.GetNumDataBytes()-sizeof(SIZE_T);
+  SIZE_T node, length, n, i;
+  vector<Block> blocks;
+  BTreeNode b;
+  bool extent;
+  ERROR_T rc;
+
+  if (stored.length!=2*sizeof(SIZE_T)) { 
+    return ERROR_INSANE;
+  }
+  memcpy(&node,stored.data,sizeof(SIZE_T));
+  memcpy(&length,stored.data+sizeof(SIZE_T),sizeof(SIZE_T));
+  extent=(length & BTREE_OVERFLOW_EXTENT)!=0;
+  length&=~BTREE_OVERFLOW_EXTENT;
+  n=(length+room-1)/room;
+
+  if (extent && n>1) { 
+    rc=buffercache->ReadBlocks(node,n,blocks);
+    if (rc) { return rc; }
+  } else {
+    for (i=0;i<n;i++) { 
+      Block block;
+      rc=buffercache->ReadBlock(node,block);
+      if (rc) { return rc; }
+      rc=b.Unpack(block,&superblock.info);
+      if (rc) { return rc; }
+      memcpy(&node,b.data,sizeof(SIZE_T));
+      blocks.push_back(move(block));
     }
+  }
 
-    //allocate right node
-    // Allocate a new node. (The left node)
-    rc=AllocateNode(xr_ptr);
+  rc=value.Resize(length,false);
+  if (rc) { return rc; }
+  for (i=0;i<n;i++) { 
+    rc=b.Unpack(blocks[i],&superblock.info);
     if (rc) { return rc; }
-    rc=xl_node.Unserialize(buffercache,xr_ptr);
+    if (b.info.nodetype!=BTREE_OVERFLOW_NODE) { 
+      return ERROR_INSANE;
+    }
+    memcpy(value.data+i*room,b.data+sizeof(SIZE_T),
+	   length-i*room<room ? length-i*room : room);
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::FreeOverflow(const VALUE_T &stored)
+{
+  SIZE_T node, next;
+  BTreeNode b;
+  ERROR_T rc;
+
+  // a memtable tombstone has no value at all
+  if (!overflowsize || stored.length!=2*sizeof(SIZE_T)) { 
+    return ERROR_NOERROR;
+  }
+  memcpy(&node,stored.data,sizeof(SIZE_T));
+  for (;node!=0;node=next) { 
+    rc=b.Unserialize(buffercache,node,superblock.info);
     if (rc) { return rc; }
-    for (offset=b.info.numkeys/2+1;offset<b.info.numkeys;offset++){
-      rc=b.GetKeyVal(offset,testkeyvalue);
-      if (rc) {  return rc; }
-      xr_node.SetKeyVal(offset-(b.info.numkeys/2+1),testkeyvalue);
+    if (b.info.nodetype!=BTREE_OVERFLOW_NODE) { 
+      return ERROR_INSANE;
     }
-    //deallocate original node
+    memcpy(&next,b.data,sizeof(SIZE_T));
     rc=DeallocateNode(node);
     if (rc) { return rc; }
-
-  }else if (offset_keyvalue==b.info.numkeys/2-1){
-    // If the key to be inserted is the [m/2]th key, which is in neither xl or xr (It's stored in leaf node but is not a key in the current internal node)
-  }else{
-    // If the key to be inserted is in xr
   }
-  return ERROR_UNIMPL;
+  return ERROR_NOERROR;
 }
 
-// The function to split a leaf node
-ERROR_T BTreeIndex::SplitLeaf(const SIZE_T &node, const KEY_T &key, const VALUE_T &value){
 
-  return ERROR_UNIMPL;
+ERROR_T BTreeIndex::CheckOverflow(const VALUE_T &stored, set<SIZE_T> &seen) const
+{
+  SIZE_T room=superblock.info.GetNumDataBytes()-sizeof(SIZE_T);
+  SIZE_T node, prev, length, n, i;
+  bool extent;
+  BTreeNode b;
+  ERROR_T rc;
+
+  if (stored.length!=2*sizeof(SIZE_T)) { 
+    return ERROR_INSANE;
+  }
+  memcpy(&node,stored.data,sizeof(SIZE_T));
+  memcpy(&length,stored.data+sizeof(SIZE_T),sizeof(SIZE_T));
+  extent=(length & BTREE_OVERFLOW_EXTENT)!=0;
+  length&=~BTREE_OVERFLOW_EXTENT;
+  n=(length+room-1)/room;
+  if (length!=overflowsize) { 
+    return ERROR_INSANE;
+  }
+
+  for (i=0;i<n;i++) { 
+    if (node==0 || seen.find(node)!=seen.end() || !buffercache->IsBlockAllocated(node)) { 
+      return ERROR_INSANE;
+    }
+    seen.insert(node);
+    prev=node;
+    rc=b.Unserialize(buffercache,node,superblock.info);
+    if (rc) { return rc; }
+    if (b.info.nodetype!=BTREE_OVERFLOW_NODE) { 
+      return ERROR_INSANE;
+    }
+    memcpy(&node,b.data,sizeof(SIZE_T));
+    if (extent && i+1<n && node!=prev+1) { 
+      return ERROR_INSANE;
+    }
+  }
+  return node==0 ? ERROR_NOERROR : ERROR_INSANE;
+}
+
+
+ERROR_T BTreeIndex::OpenSnapshot(BTreeSnapshot &snap)
+{
+  ERROR_T rc;
+
+  // The snapshot must see every acknowledged write
+  rc=FlushMemTable();
+  if (rc) { return rc; }
+
+  if (copyonwrite) { 
+    // The pinned root already holds only what was committed
+    snap=BTreeSnapshot(superblock.info.rootnode,epoch);
+    snapshots[epoch]++;
+    return ERROR_NOERROR;
+  }
+  if (multiversion) { 
+    snap=BTreeSnapshot(0,0,timestamp);
+    readers.insert(timestamp);
+    return ERROR_NOERROR;
+  }
+  // in-place writes would change the nodes under the reader
+  return ERROR_UNIMPL;
+}
+
+
+ERROR_T BTreeIndex::CloseSnapshot(const BTreeSnapshot &snap)
+{
+  if (snap.rootnode==0) { 
+    multiset<SIZE_T>::iterator r=readers.find(snap.timestamp);
+    if (r==readers.end()) { 
+      return ERROR_NONEXISTENT;
+    }
+    // The versions it could see go away as their leaves are rewritten
+    readers.erase(r);
+    return ERROR_NOERROR;
+  }
+
+  map<SIZE_T,SIZE_T>::iterator i=snapshots.find(snap.epoch);
+
+  if (i==snapshots.end()) { 
+    return ERROR_NONEXISTENT;
+  }
+  if (--(*i).second==0) { 
+    snapshots.erase(i);
+  }
+  return ReclaimRetired();
+}
+
+ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
+{
+  ERROR_T rc;
+
+  superblock_index=initblock;
+  assert(superblock_index==0);
+
+  if (create) {
+    // build a super block, root node, and a free space list
+    //
+    // Superblock at superblock_index
+    // root node at superblock_index+1
+    // free space list for rest
+    if (multiversion && prefixleaves) { 
+      // versions of one key share a leaf slot by slot
+      return ERROR_UNIMPL;
+    }
+    if (varlen && (multiversion || prefixleaves)) { 
+      // stamps sit at a fixed offset, and prefixes in a fixed layout
+      return ERROR_UNIMPL;
+    }
+    if (counted && multiversion) { 
+      // a leaf's slots are versions, not keys
+      return ERROR_UNIMPL;
+    }
+    overflowsize=0;
+    if (overflowthreshold && superblock.info.valuesize>overflowthreshold) { 
+      if (copyonwrite || multiversion || varlen) { 
+	// a chain would outlive the snapshots of the leaf that owns
+	// it, and a varlen leaf could not tell a reference from a value
+	return ERROR_UNIMPL;
+      }
+      // leaves hold just where each value is
+      overflowsize=superblock.info.valuesize;
+      superblock.info.valuesize=2*sizeof(SIZE_T);
+    }
+    if (multiversion) { 
+      // every value carries its version stamp
+      superblock.info.valuesize+=sizeof(SIZE_T);
+    }
+
+    BTreeNode newsuperblock(BTREE_SUPERBLOCK,
+			    superblock.info.keysize,
+			    superblock.info.valuesize,
+			    buffercache->GetBlockSize());
+    newsuperblock.info.rootnode=superblock_index+1;
+    newsuperblock.info.freelist=0;
+    newsuperblock.info.numkeys=0;
+    newsuperblock.SetSuperField(BTREE_SUPER_FEATURES,
+				(multiversion ? BTREE_FEATURE_MVCC : 0) |
+				(prefixleaves ? BTREE_FEATURE_PREFIX : 0) |
+				(suffixtruncation ? BTREE_FEATURE_TRUNCATED : 0) |
+				(varlen ? BTREE_FEATURE_VARLEN : 0) |
+				(overflowsize ? BTREE_FEATURE_OVERFLOW : 0) |
+				(counted ? BTREE_FEATURE_COUNTED : 0) |
+				BTREE_FEATURE_COMPACT);
+    newsuperblock.SetSuperField(BTREE_SUPER_VERSION,BTREE_FORMAT_VERSION);
+    newsuperblock.SetSuperField(BTREE_SUPER_OVERFLOW,overflowsize);
+    newsuperblock.SetSuperField(BTREE_SUPER_TIMESTAMP,0);
+    // the rest of the disk is free, without being written to say so
+    newsuperblock.SetSuperField(BTREE_SUPER_FRESH,superblock_index+2);
+
+    buffercache->NotifyAllocateBlock(superblock_index);
+
+    rc=newsuperblock.Serialize(buffercache,superblock_index);
+
+    if (rc) { 
+      return rc;
+    }
+    
+    BTreeNode newrootnode(BTREE_ROOT_NODE,
+			  superblock.info.keysize,
+			  superblock.info.valuesize,
+			  buffercache->GetBlockSize(),
+			  BTREE_COMPACT_HEADER_BYTES);
+    newrootnode.info.rootnode=superblock_index+1;
+    newrootnode.info.freelist=superblock_index+2;
+    newrootnode.info.numkeys=0;
+    rc=FormatInterior(newrootnode);
+    if (rc) { 
+      return rc;
+    }
+
+    buffercache->NotifyAllocateBlock(superblock_index+1);
+
+    rc=newrootnode.Serialize(buffercache,superblock_index+1);
+
+    if (rc) { 
+      return rc;
+    }
+  }
+
+  // OK, now, mounting the btree is simply a matter of reading the superblock 
+
+  rc=superblock.Unserialize(buffercache,initblock);
+
+  if (rc) { 
+    return rc;
+  }
+
+  if (superblock.info.nodetype!=BTREE_SUPERBLOCK) { 
+    return ERROR_NOTANINDEX;
+  }
+
+  SIZE_T features;
+
+  SIZE_T filters;
+
+  SIZE_T version;
+
+  superblock.GetSuperField(BTREE_SUPER_VERSION,version);
+  if (version>BTREE_FORMAT_VERSION) { 
+    // written by a newer layout than this code knows
+    return ERROR_UNIMPL;
+  }
+  if (version<6) { 
+    // the whole free list is chained
+    superblock.SetSuperField(BTREE_SUPER_FRESH,0);
+  }
+  freed.clear();
+
+  superblock.GetSuperField(BTREE_SUPER_FEATURES,features);
+  superblock.GetSuperField(BTREE_SUPER_TIMESTAMP,timestamp);
+  superblock.GetSuperField(BTREE_SUPER_FILTERS,filters);
+  multiversion = (features & BTREE_FEATURE_MVCC)!=0;
+  prefixleaves = (features & BTREE_FEATURE_PREFIX)!=0;
+  suffixtruncation = (features & BTREE_FEATURE_TRUNCATED)!=0;
+  varlen = (features & BTREE_FEATURE_VARLEN)!=0;
+  counted = (features & BTREE_FEATURE_COUNTED)!=0;
+  // superblock.info is also the layout of the tree's nodes
+  superblock.info.headerbytes = (features & BTREE_FEATURE_COMPACT) ? 
+    BTREE_COMPACT_HEADER_BYTES : BTREE_FULL_HEADER_BYTES;
+  overflowsize=0;
+  if (features & BTREE_FEATURE_OVERFLOW) { 
+    if (copyonwrite) { 
+      return ERROR_UNIMPL;
+    }
+    superblock.GetSuperField(BTREE_SUPER_OVERFLOW,overflowsize);
+  }
+
+  leaffilters.clear();
+  globalvalid=false;
+
+  if (filters) { 
+    rc=LoadFilters(filters);
+    if (rc) { return rc; }
+    superblock.SetSuperField(BTREE_SUPER_FILTERS,0);
+    return superblock.Serialize(buffercache,superblock_index);
+  }
+
+  return ERROR_NOERROR;
+}
+    
+
+ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
+{
+  SIZE_T filters;
+  ERROR_T rc;
+
+  rc=FlushMemTable();
+  if (rc) { return rc; }
+
+  // Snapshots do not survive a detach, so nothing can reach
+  // the retired blocks any more
+  snapshots.clear();
+  rc=ReclaimRetired();
+  if (rc) { return rc; }
+
+  filters=0;
+  if (bloombits) { 
+    rc=SaveFilters(filters);
+    if (rc) { return rc; }
+    // not part of any tree operation
+    pending_fresh.clear();
+  }
+
+  rc=WriteFreeList();
+  if (rc) { return rc; }
+
+  initblock=superblock_index;
+  superblock.SetSuperField(BTREE_SUPER_TIMESTAMP,timestamp);
+  superblock.SetSuperField(BTREE_SUPER_FILTERS,filters);
+  return superblock.Serialize(buffercache,superblock_index);
+}
+ 
+
+ERROR_T BTreeIndex::LookupOrUpdateInternal(SIZE_T &node,
+					   const BTreeOp op,
+					   const KEY_T &key,
+					   VALUE_T &value,
+					   const SIZE_T readts)
+{
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T offset;
+  SIZE_T stamp;
+  SIZE_T ptr;
+  SIZE_T child;
+  bool filtered;
+  bool found;
+
+  rc= b.Unserialize(buffercache,node,superblock.info);
+
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+
+  switch (b.info.nodetype) { 
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    // There are no keys at all on this node, so nowhere to go
+    if (b.info.numkeys==0) { 
+      return ERROR_NONEXISTENT;
+    }
+    // Find the first key that's larger or equal and recurse on
+    // the ptr immediately previous to it, or on the last pointer
+    // if there is no such key
+    rc=b.FindKey(key,offset,found,searchtype,&keyprobes);
+    if (rc) { return rc; }
+    rc=b.GetPtr(offset,ptr);
+    if (rc) { return rc; }
+    if (LeafFilterRulesOut(ptr,key)) { 
+      return ERROR_NONEXISTENT;
+    }
+    child=ptr;
+    rc=LookupOrUpdateInternal(child,op,key,value,readts);
+    if (rc) { return rc; }
+    if (child!=ptr) { 
+      // the child was shadowed, so we must be shadowed too
+      rc=b.SetPtr(offset,child);
+      if (rc) { return rc; }
+      return WriteNode(node,b);
+    }
+    return ERROR_NOERROR;
+    break;
+  case BTREE_LEAF_NODE:
+    filtered=leaffilters.find(node)!=leaffilters.end();
+    if (bloombits && !filtered) { 
+      // we have the keys in hand, so the next miss here is free
+      NoteNode(node,b);
+    }
+    if (!multiversion) { 
+      // Compare against the stored keys (suffixes) in place
+      rc=b.FindKey(key,offset,found,searchtype,&keyprobes);
+      if (rc) { return rc; }
+      if (found && op==BTREE_OP_LOOKUP) { 
+	return b.GetVal(offset,value);
+      } else if (found) { 
+	// BTREE_OP_UPDATE
+	VALUE_T old;
+	rc=b.GetVal(offset,old);
+	if (rc) { return rc; }
+	rc=b.SetVal(offset,value);
+	if (rc) { return rc; }
+	rc=WriteNode(node,b);
+	if (rc) { return rc; }
+	return FreeOverflow(old);
+      }
+      if (filtered) { 
+	leaffalsepos++;
+      }
+      return ERROR_NONEXISTENT;
+    }
+    // Versions of a key are newest first, so FindKey lands on the
+    // newest, and a read walks on over that key's older versions to
+    // the first one visible at readts
+    rc=b.FindKey(key,offset,found,searchtype,&keyprobes);
+    if (rc) { return rc; }
+    if (found) { 
+      for (;;) { 
+	rc=b.GetVal(offset,value);
+	if (rc) { return rc; }
+	stamp=GetStamp(value,GetUserValueSize());
+	if ((stamp & ~BTREE_VERSION_TOMBSTONE) <= readts) { 
+	  if (stamp & BTREE_VERSION_TOMBSTONE) { 
+	    return ERROR_NONEXISTENT;
+	  }
+	  return value.Resize(GetUserValueSize());
+	}
+	offset++;
+	if (offset==b.info.numkeys) { 
+	  return ERROR_NONEXISTENT;
+	}
+	keyprobes++;
+	if (b.CompareKey(key,offset)!=0) { 
+	  return ERROR_NONEXISTENT;
+	}
+      }
+    }
+    if (filtered) { 
+      leaffalsepos++;
+    }
+    return ERROR_NONEXISTENT;
+    break;
+  default:
+    // We can't be looking at anything other than a root, internal, or leaf
+    return ERROR_INSANE;
+    break;
+  }  
+
+  return ERROR_INSANE;
+}
+
+
+//
+// In a multi-version leaf, valuesize is the size of the value without
+// its stamp.  The sorted listing shows only the version of each key
+// that is visible at readts; the depth listings show every version.
+// A value kept out of line is shown as the first block of its chain.
+//
+static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt,
+			 const SIZE_T valuesize, const bool versioned, const SIZE_T readts,
+			 const bool outofline)
+{
+  KEY_T key;
+  KEY_T donekey;
+  bool havedonekey=false;
+  VALUE_T value;
+  SIZE_T ptr;
+  SIZE_T offset;
+  SIZE_T stamp=0;
+  ERROR_T rc;
+  unsigned i;
+
+  if (dt==BTREE_DEPTH_DOT) { 
+    os << nodenum << " [ label=\""<<nodenum<<": ";
+  } else if (dt==BTREE_DEPTH) {
+    os << nodenum << ": ";
+  } else {
+  }
+
+  switch (b.info.nodetype) { 
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (dt==BTREE_SORTED_KEYVAL) {
+    } else {
+      if (dt==BTREE_DEPTH_DOT) { 
+      } else { 
+	os << "Interior: ";
+      }
+      for (offset=0;offset<=b.info.numkeys;offset++) { 
+	rc=b.GetPtr(offset,ptr);
+	if (rc) { return rc; }
+	os << "*" << ptr << " ";
+	// Last pointer
+	if (offset==b.info.numkeys) break;
+	rc=b.GetKey(offset,key);
+	if (rc) {  return rc; }
+	// a truncated separator is shown as stored
+	for (i=0;i<b.GetKeyLength(offset);i++) { 
+	  os << key.data[i];
+	}
+	os << " ";
+      }
+    }
+    break;
+  case BTREE_LEAF_NODE:
+    if (dt==BTREE_DEPTH_DOT || dt==BTREE_SORTED_KEYVAL) { 
+    } else {
+      os << "Leaf: ";
+    }
+    for (offset=0;offset<b.info.numkeys;offset++) { 
+      if (offset==0 && b.IsPrefixed()) { 
+	// the first word holds the prefix length instead
+	if (dt!=BTREE_SORTED_KEYVAL) { 
+	  os << "[" << b.GetLeafPrefixLength() << "] ";
+	}
+      } else if (offset==0 && !b.IsVariableLength()) { 
+	// special case for first pointer
+	rc=b.GetPtr(offset,ptr);
+	if (rc) { return rc; }
+	if (dt!=BTREE_SORTED_KEYVAL) { 
+	  os << "*" << ptr << " ";
+	}
+      }
+      rc=b.GetKey(offset,key);
+      if (rc) {  return rc; }
+      rc=b.GetVal(offset,value);
+      if (rc) {  return rc; }
+      if (versioned) { 
+	stamp=GetStamp(value,valuesize);
+	if (dt==BTREE_SORTED_KEYVAL) { 
+	  if ((havedonekey && donekey==key) || 
+	      (stamp & ~BTREE_VERSION_TOMBSTONE) > readts) { 
+	    continue;
+	  }
+	  // this is the version readts sees
+	  donekey=key;
+	  havedonekey=true;
+	  if (stamp & BTREE_VERSION_TOMBSTONE) { 
+	    continue;
+	  }
+	}
+      }
+      if (dt==BTREE_SORTED_KEYVAL) { 
+	os << "(";
+      }
+      for (i=0;i<key.length;i++) { 
+	os << key.data[i];
+      }
+      if (dt==BTREE_SORTED_KEYVAL) { 
+	os << ",";
+      } else {
+	os << " ";
+      }
+      if (outofline && value.length==2*sizeof(SIZE_T)) { 
+	memcpy(&ptr,value.data,sizeof(SIZE_T));
+	os << "->" << ptr;
+      } else {
+	for (i=0;i<valuesize && i<value.length;i++) { 
+	  os << value.data[i];
+	}
+      }
+      if (versioned && dt!=BTREE_SORTED_KEYVAL) { 
+	os << "@" << (stamp & ~BTREE_VERSION_TOMBSTONE)
+	   << ((stamp & BTREE_VERSION_TOMBSTONE) ? "-" : "");
+      }
+      if (dt==BTREE_SORTED_KEYVAL) { 
+	os << ")\n";
+      } else {
+	os << " ";
+      }
+    }
+    break;
+  default:
+    if (dt==BTREE_DEPTH_DOT) { 
+      os << "Unknown("<<b.info.nodetype<<")";
+    } else {
+      os << "Unsupported Node Type " << b.info.nodetype ;
+    }
+  }
+  if (dt==BTREE_DEPTH_DOT) { 
+    os << "\" ]";
+  }
+  return ERROR_NOERROR;
+}
+  
+ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+{
+  ArenaScope scope(arena);
+  SIZE_T root=superblock.info.rootnode;
+  BTreeMemTable::const_iterator m;
+  ERROR_T rc;
+
+  if (!KeyFits(key)) { 
+    return ERROR_SIZE;
+  }
+
+  m=memtable.find(key);
+  if (m!=memtable.end()) { 
+    if ((*m).second.first==BTREE_OP_DELETE) { 
+      return ERROR_NONEXISTENT;
+    }
+    if (overflowsize) { 
+      return GetOverflow((*m).second.second,value);
+    }
+    value=(*m).second.second;
+    return ERROR_NOERROR;
+  }
+
+  if (GlobalFilterRulesOut(key)) { 
+    return ERROR_NONEXISTENT;
+  }
+
+  rc=LookupOrUpdateInternal(root, BTREE_OP_LOOKUP, key, value);
+
+  if (rc==ERROR_NONEXISTENT && bloombits && bloomglobal) { 
+    globalfalsepos++;
+  }
+  if (rc==ERROR_NOERROR && overflowsize) { 
+    VALUE_T stored(value);
+    rc=GetOverflow(stored,value);
+  }
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::Lookup(const BTreeSnapshot &snap, const KEY_T &key, VALUE_T &value)
+{
+  ArenaScope scope(arena);
+  SIZE_T root=snap.rootnode;
+
+  if (root==0) { 
+    if (readers.find(snap.timestamp)==readers.end()) { 
+      return ERROR_NONEXISTENT;
+    }
+    root=superblock.info.rootnode;
+  } else if (snapshots.find(snap.epoch)==snapshots.end()) { 
+    return ERROR_NONEXISTENT;
+  }
+  if (!KeyFits(key)) { 
+    return ERROR_SIZE;
+  }
+
+  return LookupOrUpdateInternal(root, BTREE_OP_LOOKUP, key, value, snap.timestamp);
+}
+
+
+// The function to create a new leaf node in one disk write
+ERROR_T BTreeIndex::CreateLeafNode(SIZE_T &ptr, const KEY_T &key, const VALUE_T &value)
+{
+  BTreeNode node(BTREE_LEAF_NODE,
+		 superblock.info.keysize,
+		 superblock.info.valuesize,
+		 buffercache->GetBlockSize(),
+		 superblock.info.headerbytes);
+  ERROR_T rc;
+
+  rc=FormatLeaf(node);
+  if (rc) { return rc; }
+  rc=AllocateNode(ptr);
+  if (rc) { return rc; }
+  // NOTE, have to do numkeys++ before setting key or value.
+  node.info.numkeys=1;
+  rc=node.SetKey(0,key);
+  if (rc) { return rc; }
+  rc=node.SetVal(0,value);
+  if (rc) { return rc; }
+
+  return WriteNewNode(ptr,node);
+}
+
+
+// Split an internal node that has no room for (key, ptr) at offset.
+// The middle key is not kept in either half, but is pushed up
+ERROR_T BTreeIndex::SplitInternal(SIZE_T &node, BTreeNode &b, const SIZE_T offset,
+				  const KEY_T &key, const SIZE_T &ptr, const SIZE_T count,
+				  KEY_T &splitkey, SIZE_T &splitnode)
+{
+  vector<KEY_T> &keys=splitkeys;
+  vector<SIZE_T> &ptrs=splitptrs;
+  vector<SIZE_T> &counts=splitcounts;
+  KEY_T testkey;
+  SIZE_T testptr;
+  SIZE_T i, n, mid;
+  ERROR_T rc;
+
+  keys.clear();
+  ptrs.clear();
+  counts.clear();
+  for (i=0;i<b.info.numkeys;i++) { 
+    rc=b.GetKey(i,testkey);
+    if (rc) { return rc; }
+    keys.push_back(testkey);
+  }
+  for (i=0;i<=b.info.numkeys;i++) { 
+    rc=b.GetPtr(i,testptr);
+    if (rc) { return rc; }
+    ptrs.push_back(testptr);
+    if (counted) { 
+      rc=b.GetCount(i,testptr);
+      if (rc) { return rc; }
+      counts.push_back(testptr);
+    }
+  }
+  keys.insert(keys.begin()+offset,key);
+  ptrs.insert(ptrs.begin()+offset+1,ptr);
+  if (counted) { 
+    counts.insert(counts.begin()+offset+1,count);
+  }
+
+  n=keys.size();
+  mid=n/2;
+
+  if (b.IsSlotted()) { 
+    // Split where the stored bytes balance instead
+    SIZE_T total=BTreeNode::GetSlottedBytes(keys,0,n,superblock.info.keysize,varlen,counted);
+    for (mid=1; mid+1<n && 
+	   2*BTreeNode::GetSlottedBytes(keys,0,mid,superblock.info.keysize,varlen,counted)<total; mid++) { }
+    if (BTreeNode::GetSlottedBytes(keys,0,mid,superblock.info.keysize,varlen,counted)>b.info.GetNumDataBytes() ||
+	BTreeNode::GetSlottedBytes(keys,mid+1,n,superblock.info.keysize,varlen,counted)>b.info.GetNumDataBytes()) { 
+      return ERROR_NOSPACE;
+    }
+  }
+
+  BTreeNode right(BTREE_INTERIOR_NODE,
+		  superblock.info.keysize,
+		  superblock.info.valuesize,
+		  buffercache->GetBlockSize(),
+		  superblock.info.headerbytes);
+  rc=FormatInterior(right);
+  if (rc) { return rc; }
+
+  // A split root stays where it is as an ordinary interior node, 
+  // and Insert builds a new root above it
+  b.info.nodetype=BTREE_INTERIOR_NODE;
+  rc=FormatInterior(b);
+  if (rc) { return rc; }
+  b.info.numkeys=mid;
+  for (i=0;i<mid;i++) { 
+    rc=b.SetKey(i,keys[i]);
+    if (rc) { return rc; }
+    rc=b.SetPtr(i,ptrs[i]);
+    if (rc) { return rc; }
+  }
+  rc=b.SetPtr(mid,ptrs[mid]);
+  if (rc) { return rc; }
+  for (i=0;i<=mid && counted;i++) { 
+    rc=b.SetCount(i,counts[i]);
+    if (rc) { return rc; }
+  }
+
+  right.info.numkeys=n-mid-1;
+  for (i=mid+1;i<n;i++) { 
+    rc=right.SetKey(i-mid-1,keys[i]);
+    if (rc) { return rc; }
+    rc=right.SetPtr(i-mid-1,ptrs[i]);
+    if (rc) { return rc; }
+  }
+  rc=right.SetPtr(n-mid-1,ptrs[n]);
+  if (rc) { return rc; }
+  for (i=mid+1;i<=n && counted;i++) { 
+    rc=right.SetCount(i-mid-1,counts[i]);
+    if (rc) { return rc; }
+  }
+
+  splitkey=keys[mid];
+
+  rc=AllocateNode(splitnode);
+  if (rc) { return rc; }
+  rc=WriteNewNode(splitnode,right);
+  if (rc) { return rc; }
+  return WriteNode(node,b);
+}
+
+
+// Split a full leaf while inserting (key, value) at offset.  Keys less
+// than or equal to splitkey stay in node, the rest go to splitnode
+ERROR_T BTreeIndex::SplitLeaf(SIZE_T &node, BTreeNode &b, const SIZE_T offset,
+			      const KEY_T &key, const VALUE_T &value,
+			      KEY_T &splitkey, SIZE_T &splitnode)
+{
+  vector<KeyValuePair> &kvs=splitkvs;
+  KeyValuePair testkeyvalue;
+  SIZE_T i;
+  bool split;
+  ERROR_T rc;
+
+  kvs.clear();
+  for (i=0;i<b.info.numkeys;i++) { 
+    rc=b.GetKeyVal(i,testkeyvalue);
+    if (rc) { return rc; }
+    kvs.push_back(testkeyvalue);
+  }
+  kvs.insert(kvs.begin()+offset,KeyValuePair(key,value));
+
+  return WriteLeafEntries(node,b,kvs,split,splitkey,splitnode);
+}
+
+
+// Write kvs back as leaf node.  If they do not fit, keys less than
+// or equal to splitkey stay in node and the rest go to splitnode.
+// All versions of a key stay in the same leaf.
+ERROR_T BTreeIndex::WriteLeafEntries(SIZE_T &node, BTreeNode &b, 
+				     const vector<KeyValuePair> &kvs,
+				     bool &split, KEY_T &splitkey, SIZE_T &splitnode)
+{
+  SIZE_T i, n, mid, up, down, bytes;
+  ERROR_T rc;
+
+  n=kvs.size();
+  split=false;
+
+  // Rewritten from scratch, so a variable-length heap starts empty
+  rc=FormatLeaf(b);
+  if (rc) { return rc; }
+
+  if (LeafFits(kvs,0,n)) { 
+    b.info.numkeys=n;
+    for (i=0;i<n;i++) { 
+      rc=b.SetKeyVal(i,kvs[i]);
+      if (rc) { return rc; }
+    }
+    return WriteNode(node,b);
+  }
+
+  split=true;
+
+  // Start in the middle, by bytes if pairs differ in size, and move
+  // to the nearest key boundary
+  mid=(n+1)/2;
+  if (varlen) { 
+    bytes=BTreeNode::GetVariableLeafBytes(kvs,0,n);
+    for (mid=1; mid<n-1 && 2*BTreeNode::GetVariableLeafBytes(kvs,0,mid)<bytes; mid++) { }
+  }
+  for (up=mid; up<n && kvs[up].key==kvs[up-1].key; up++) { }
+  for (down=mid; down>0 && kvs[down].key==kvs[down-1].key; down--) { }
+  if (up<n && LeafFits(kvs,0,up) && LeafFits(kvs,up,n)) { 
+    mid=up;
+  } else if (down>0 && LeafFits(kvs,0,down) && LeafFits(kvs,down,n)) { 
+    mid=down;
+  } else {
+    return ERROR_NOSPACE;
+  }
+
+  BTreeNode right(BTREE_LEAF_NODE,
+		  superblock.info.keysize,
+		  superblock.info.valuesize,
+		  buffercache->GetBlockSize(),
+		  superblock.info.headerbytes);
+  rc=FormatLeaf(right);
+  if (rc) { return rc; }
+
+  b.info.numkeys=mid;
+  for (i=0;i<mid;i++) { 
+    rc=b.SetKeyVal(i,kvs[i]);
+    if (rc) { return rc; }
+  }
+  right.info.numkeys=n-mid;
+  for (i=mid;i<n;i++) { 
+    rc=right.SetKeyVal(i-mid,kvs[i]);
+    if (rc) { return rc; }
+  }
+
+  splitkey=Separator(kvs[mid-1].key,kvs[mid].key);
+
+  rc=AllocateNode(splitnode);
+  if (rc) { return rc; }
+  rc=WriteNewNode(splitnode,right);
+  if (rc) { return rc; }
+  return WriteNode(node,b);
+}
+
+
+// Keep only the versions some open snapshot can still see.  A version
+// is seen by snapshots taken from its own stamp up to (but not
+// including) the stamp of the next newer version of the same key.
+void BTreeIndex::PruneVersions(vector<KeyValuePair> &kvs) const
+{
+  vector<KeyValuePair> kept;
+  multiset<SIZE_T>::const_iterator r;
+  SIZE_T uvs=GetUserValueSize();
+  SIZE_T i, j, k, first, from, until;
+
+  for (i=0;i<kvs.size();i=j) { 
+    for (j=i+1;j<kvs.size() && kvs[j].key==kvs[i].key;j++) { }
+    first=kept.size();
+    // the newest version is what current readers see
+    kept.push_back(kvs[i]);
+    for (k=i+1;k<j;k++) { 
+      from=GetStamp(kvs[k].value,uvs) & ~BTREE_VERSION_TOMBSTONE;
+      until=GetStamp(kvs[k-1].value,uvs) & ~BTREE_VERSION_TOMBSTONE;
+      r=readers.lower_bound(from);
+      if (r!=readers.end() && *r<until) { 
+	kept.push_back(kvs[k]);
+      }
+    }
+    // a delete with nothing left behind it hides nothing
+    if (kept.size()==first+1 && 
+	(GetStamp(kept[first].value,uvs) & BTREE_VERSION_TOMBSTONE)) { 
+      kept.pop_back();
+    }
+  }
+  kvs=kept;
+}
+
+
+// Apply op to a multi-version leaf.  The new version (value already
+// carries its stamp) goes in front of the older ones, and the whole
+// leaf is garbage collected as it is rewritten.
+ERROR_T BTreeIndex::VersionedLeafOp(SIZE_T &node, BTreeNode &b, const BTreeOp op,
+				    const KEY_T &key, const VALUE_T &value,
+				    bool &split, KEY_T &splitkey, SIZE_T &splitnode)
+{
+  vector<KeyValuePair> kvs;
+  KeyValuePair testkeyvalue;
+  SIZE_T offset;
+  bool live;
+  ERROR_T rc;
+
+  for (offset=0;offset<b.info.numkeys;offset++) { 
+    rc=b.GetKeyVal(offset,testkeyvalue);
+    if (rc) { return rc; }
+    kvs.push_back(testkeyvalue);
+  }
+
+  for (offset=0;offset<kvs.size() && kvs[offset].key<key;offset++) { }
+
+  live = offset<kvs.size() && kvs[offset].key==key &&
+    !(GetStamp(kvs[offset].value,GetUserValueSize()) & BTREE_VERSION_TOMBSTONE);
+
+  if (op==BTREE_OP_INSERT && live) { 
+    return ERROR_CONFLICT;
+  }
+  if (op!=BTREE_OP_INSERT && !live) { 
+    return ERROR_NONEXISTENT;
+  }
+
+  kvs.insert(kvs.begin()+offset,KeyValuePair(key,value));
+
+  PruneVersions(kvs);
+
+  return WriteLeafEntries(node,b,kvs,split,splitkey,splitnode);
+}
+
+
+// The helper function for insert (and, for multi-version trees,
+// update and delete). Can be called recursively.
+// node is updated if it had to be moved (copy-on-write), and split
+// is set if the caller must add (splitkey, splitnode) after node
+ERROR_T BTreeIndex::InsertHelper(SIZE_T &node, const BTreeOp op,
+				 const KEY_T &key, const VALUE_T &value,
+				 bool &split, KEY_T &splitkey, SIZE_T &splitnode)
+{
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T offset;
+  SIZE_T ptr;
+  SIZE_T child;
+  bool childsplit;
+  KEY_T childkey;
+  SIZE_T childnode;
+  bool found;
+
+  split=false;
+
+  rc= b.Unserialize(buffercache,node,superblock.info);
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+
+  switch (b.info.nodetype) { 
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      if (b.info.numkeys==0) { 
+	if (op!=BTREE_OP_INSERT) { 
+	  return ERROR_NONEXISTENT;
+	}
+	// Empty tree.  The root gets the key as its only separator,
+	// a leaf holding the pair on its left, and an empty leaf
+	// for larger keys on its right.
+	BTreeNode empty(BTREE_LEAF_NODE,
+			superblock.info.keysize,
+			superblock.info.valuesize,
+			buffercache->GetBlockSize(),
+			superblock.info.headerbytes);
+	rc=FormatLeaf(empty);
+	if (rc) { return rc; }
+	rc=CreateLeafNode(ptr,key,value);
+	if (rc) { return rc; }
+	rc=AllocateNode(child);
+	if (rc) { return rc; }
+	rc=WriteNewNode(child,empty);
+	if (rc) { return rc; }
+	b.info.numkeys=1;
+	rc=b.SetKey(0,key);
+	if (rc) { return rc; }
+	rc=b.SetPtr(0,ptr);
+	if (rc) { return rc; }
+	rc=b.SetPtr(1,child);
+	if (rc) { return rc; }
+	if (counted) { 
+	  rc=b.SetCount(0,1);
+	  if (rc) { return rc; }
+	  rc=b.SetCount(1,0);
+	  if (rc) { return rc; }
+	}
+	return WriteNode(node,b);
+      }
+      // Find the first key that's larger or equal
+      rc=b.FindKey(key,offset,found,searchtype,&keyprobes);
+      if (rc) { return rc; }
+      rc=b.GetPtr(offset,ptr);
+      if (rc) { return rc; }
+      child=ptr;
+      rc=InsertHelper(child,op,key,value,childsplit,childkey,childnode);
+      if (rc) { return rc; }
+      if (!childsplit && child==ptr && !counted) { 
+	// nothing changed at this level
+	return ERROR_NOERROR;
+      }
+      rc=b.SetPtr(offset,child);
+      if (rc) { return rc; }
+      SIZE_T count, rightcount;
+      count=rightcount=0;
+      if (counted) { 
+	// the key went somewhere under offset, and the keys that
+	// moved to a new child are counted at its pointer instead
+	rc=b.GetCount(offset,count);
+	if (rc) { return rc; }
+	if (childsplit) { 
+	  rc=SubtreeCount(childnode,rightcount);
+	  if (rc) { return rc; }
+	}
+	rc=b.SetCount(offset,count+1-rightcount);
+	if (rc) { return rc; }
+      }
+      if (!childsplit) { 
+	return WriteNode(node,b);
+      }
+      if (!b.HasRoomForKey(childkey)) { 
+	split=true;
+	return SplitInternal(node,b,offset,childkey,childnode,rightcount,splitkey,splitnode);
+      }
+      rc=b.InsertKeyPtr(offset,childkey,childnode);
+      if (rc) { return rc; }
+      if (counted) { 
+	rc=b.SetCount(offset+1,rightcount);
+	if (rc) { return rc; }
+      }
+      return WriteNode(node,b);
+      break;
+    case BTREE_LEAF_NODE:
+      if (multiversion) { 
+	return VersionedLeafOp(node,b,op,key,value,split,splitkey,splitnode);
+      }
+      // Find the place to insert
+      rc=b.FindKey(key,offset,found,searchtype,&keyprobes);
+      if (rc) { return rc; }
+      if (found) { 
+	return ERROR_CONFLICT;
+      }
+      if (!b.HasRoomForKeyVal(key,value)) { 
+	split=true;
+	return SplitLeaf(node,b,offset,key,value,splitkey,splitnode);
+      }
+      rc=b.InsertKeyVal(offset,key,value);
+      if (rc) { return rc; }
+      return WriteNode(node,b);
+      break;
+    default:
+      // We can't be looking at anything other than a root, internal, or leaf
+      return ERROR_INSANE;
+      break;
+  }  
+
+  return ERROR_INSANE;
+}
+
+
+ERROR_T BTreeIndex::ApplyAtLeaf(const BTreeOp op, const KEY_T &key, const VALUE_T &value)
+{
+  SIZE_T root=superblock.info.rootnode;
+  SIZE_T newroot;
+  bool split;
+  KEY_T splitkey;
+  SIZE_T splitnode;
+  VALUE_T stored(value);
+  ERROR_T rc;
+
+  if (multiversion) { 
+    // Stamp the new version.  The clock only moves if the write happens.
+    stored.Resize(superblock.info.valuesize,false);
+    memset(stored.data,0,stored.length);
+    if (op!=BTREE_OP_DELETE) { 
+      memcpy(stored.data,value.data,GetUserValueSize());
+    }
+    SetStamp(stored,GetUserValueSize(),
+	     (timestamp+1) | (op==BTREE_OP_DELETE ? BTREE_VERSION_TOMBSTONE : 0));
+  }
+
+  rc=InsertHelper(root,op,key,stored,split,splitkey,splitnode);
+
+  if (rc==ERROR_NOERROR && split) { 
+    // The root itself split, so the tree grows a level
+    BTreeNode b(BTREE_ROOT_NODE,
+		superblock.info.keysize,
+		superblock.info.valuesize,
+		buffercache->GetBlockSize(),
+		superblock.info.headerbytes);
+    FormatInterior(b);
+    b.info.numkeys=1;
+    b.SetKey(0,splitkey);
+    b.SetPtr(0,root);
+    b.SetPtr(1,splitnode);
+    if (counted) { 
+      SIZE_T left, right;
+      rc=SubtreeCount(root,left);
+      if (rc==ERROR_NOERROR) { 
+	rc=SubtreeCount(splitnode,right);
+      }
+      b.SetCount(0,left);
+      b.SetCount(1,right);
+    }
+    if (rc==ERROR_NOERROR) { 
+      rc=AllocateNode(newroot);
+    }
+    if (rc==ERROR_NOERROR) { 
+      rc=WriteNewNode(newroot,b);
+      root=newroot;
+    }
+  }
+
+  if (rc) { 
+    AbortWrite();
+    return rc;
+  }
+
+  if (multiversion) { 
+    timestamp++;
+    superblock.SetSuperField(BTREE_SUPER_TIMESTAMP,timestamp);
+  }
+
+  if (root!=superblock.info.rootnode) { 
+    return PublishRoot(root);
+  }
+  return ERROR_NOERROR;
+}
+
+
+// Writes are checked against the memtable and then the tree, so they
+// fail exactly as they would without it.  Only the check reads the
+// tree; the write itself waits for the next flush.
+ERROR_T BTreeIndex::MemTableWrite(const BTreeOp op, const KEY_T &key, const VALUE_T &value)
+{
+  BTreeMemTable::iterator m;
+  SIZE_T root=superblock.info.rootnode;
+  VALUE_T old;
+  ERROR_T rc;
+
+  m=memtable.find(key);
+
+  if (m!=memtable.end()) { 
+    bool live = (*m).second.first!=BTREE_OP_DELETE;
+    if (op==BTREE_OP_INSERT && live) { 
+      return ERROR_CONFLICT;
+    }
+    if (op!=BTREE_OP_INSERT && !live) { 
+      return ERROR_NONEXISTENT;
+    }
+    // the value held here is going away either way
+    rc=FreeOverflow((*m).second.second);
+    if (rc) { return rc; }
+    if (op==BTREE_OP_DELETE && (*m).second.first==BTREE_OP_INSERT) { 
+      // never reached the tree, so there is nothing to delete there
+      memtable.erase(m);
+      memtablebytes-=superblock.info.keysize+superblock.info.valuesize;
+      return ERROR_NOERROR;
+    }
+    if (op==BTREE_OP_INSERT) { 
+      // reinsert of a key deleted from the tree
+      (*m).second.first=BTREE_OP_UPDATE;
+    } else if (op==BTREE_OP_DELETE) { 
+      (*m).second.first=BTREE_OP_DELETE;
+    }
+    (*m).second.second=value;
+    return ERROR_NOERROR;
+  }
+
+  if (GlobalFilterRulesOut(key)) { 
+    rc=ERROR_NONEXISTENT;
+  } else {
+    rc=LookupOrUpdateInternal(root,BTREE_OP_LOOKUP,key,old);
+    if (rc==ERROR_NONEXISTENT && bloombits && bloomglobal) { 
+      globalfalsepos++;
+    }
+  }
+
+  if (rc==ERROR_NOERROR && op==BTREE_OP_INSERT) { 
+    return ERROR_CONFLICT;
+  }
+  if (rc==ERROR_NONEXISTENT && op==BTREE_OP_INSERT) { 
+    rc=ERROR_NOERROR;
+  }
+  if (rc) { 
+    return rc;
+  }
+
+  memtable[key]=pair<BTreeOp,VALUE_T>(op,value);
+  memtablebytes+=superblock.info.keysize+superblock.info.valuesize;
+
+  if (memtablebytes>=memtablelimit) { 
+    return FlushMemTable();
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::FlushMemTable()
+{
+  ArenaScope scope(arena);
+  ERROR_T rc;
+
+  if (memtable.empty()) { 
+    return ERROR_NOERROR;
+  }
+
+  rc=ApplyBatchAtRoot(memtable);
+
+  if (rc) { 
+    // Every entry is idempotent against the tree, so keep them all 
+    // and let a later flush try again
+    return rc;
+  }
+
+  memtable.clear();
+  memtablebytes=0;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::ApplyBatchAtRoot(const BTreeMemTable &batch)
+{
+  SIZE_T root=superblock.info.rootnode;
+  vector<KEY_T> sepkeys;
+  vector<SIZE_T> newnodes;
+  ERROR_T rc;
+
+  rc=ApplyBatch(root,batch.begin(),batch.end(),sepkeys,newnodes);
+
+  // The root split (maybe several ways), so the tree grows
+  while (rc==ERROR_NOERROR && !sepkeys.empty()) { 
+    BTreeNode b(BTREE_ROOT_NODE,
+		superblock.info.keysize,
+		superblock.info.valuesize,
+		buffercache->GetBlockSize(),
+		superblock.info.headerbytes);
+    vector<KEY_T> keys(sepkeys);
+    vector<SIZE_T> ptrs(1,root);
+    vector<SIZE_T> counts;
+    ptrs.insert(ptrs.end(),newnodes.begin(),newnodes.end());
+    sepkeys.clear();
+    newnodes.clear();
+    for (SIZE_T i=0;i<ptrs.size() && counted && rc==ERROR_NOERROR;i++) { 
+      SIZE_T count;
+      rc=SubtreeCount(ptrs[i],count);
+      counts.push_back(count);
+    }
+    if (rc) { 
+      break;
+    }
+    root=0;
+    rc=WriteInteriorParts(root,b,keys,ptrs,counts,sepkeys,newnodes);
+  }
+
+  if (rc) { 
+    AbortWrite();
+    return rc;
+  }
+
+  if (root!=superblock.info.rootnode) { 
+    return PublishRoot(root);
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::ApplyBatch(SIZE_T &node,
+			       BTreeMemTable::const_iterator first,
+			       BTreeMemTable::const_iterator last,
+			       vector<KEY_T> &sepkeys, vector<SIZE_T> &newnodes)
+{
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T offset;
+  KEY_T testkey;
+  KeyValuePair testkeyvalue;
+  SIZE_T ptr;
+  SIZE_T child;
+  vector<KEY_T> keys, childkeys;
+  vector<SIZE_T> ptrs, childnodes, counts;
+  vector<KeyValuePair> kvs, out;
+  BTreeMemTable::const_iterator m, end;
+  SIZE_T count, i;
+  bool changed=false;
+
+  rc= b.Unserialize(buffercache,node,superblock.info);
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+
+  switch (b.info.nodetype) { 
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (b.info.numkeys==0) { 
+      // Empty tree, so everything is an insert.  Build the leaves,
+      // and as in InsertHelper keep at least one separator, with an
+      // empty leaf on its right if need be.
+      BTreeNode leaf(BTREE_LEAF_NODE,
+		     superblock.info.keysize,
+		     superblock.info.valuesize,
+		     buffercache->GetBlockSize(),
+		     superblock.info.headerbytes);
+      for (m=first;m!=last;++m) { 
+	kvs.push_back(KeyValuePair((*m).first,(*m).second.second));
+      }
+      child=0;
+      rc=WriteLeafParts(child,leaf,kvs,childkeys,childnodes);
+      if (rc) { return rc; }
+      ptrs.push_back(child);
+      keys=childkeys;
+      ptrs.insert(ptrs.end(),childnodes.begin(),childnodes.end());
+      if (keys.empty()) { 
+	BTreeNode empty(BTREE_LEAF_NODE,
+			superblock.info.keysize,
+			superblock.info.valuesize,
+			buffercache->GetBlockSize(),
+			superblock.info.headerbytes);
+	rc=FormatLeaf(empty);
+	if (rc) { return rc; }
+	keys.push_back(kvs.back().key);
+	rc=AllocateNode(child);
+	if (rc) { return rc; }
+	rc=WriteNewNode(child,empty);
+	if (rc) { return rc; }
+	ptrs.push_back(child);
+      }
+      for (i=0;i<ptrs.size() && counted;i++) { 
+	rc=SubtreeCount(ptrs[i],count);
+	if (rc) { return rc; }
+	counts.push_back(count);
+      }
+      return WriteInteriorParts(node,b,keys,ptrs,counts,sepkeys,newnodes);
+    }
+    // Hand each child the run of writes that falls under it
+    m=first;
+    for (offset=0;offset<=b.info.numkeys;offset++) { 
+      rc=b.GetPtr(offset,ptr);
+      if (rc) { return rc; }
+      if (offset<b.info.numkeys) { 
+	rc=b.GetKey(offset,testkey);
+	if (rc) { return rc; }
+      }
+      for (end=m; end!=last && (offset==b.info.numkeys || 
+				 (*end).first<testkey || (*end).first==testkey); ++end) { }
+      child=ptr;
+      childkeys.clear();
+      childnodes.clear();
+      if (m!=end) { 
+	rc=ApplyBatch(child,m,end,childkeys,childnodes);
+	if (rc) { return rc; }
+	changed = changed || child!=ptr || !childkeys.empty();
+      }
+      if (counted) { 
+	// an untouched child keeps its count, the others are read back
+	rc=b.GetCount(offset,count);
+	if (rc) { return rc; }
+	if (m!=end) { 
+	  SIZE_T old=count;
+	  rc=SubtreeCount(child,count);
+	  if (rc) { return rc; }
+	  changed = changed || count!=old;
+	}
+	counts.push_back(count);
+	for (i=0;i<childnodes.size();i++) { 
+	  rc=SubtreeCount(childnodes[i],count);
+	  if (rc) { return rc; }
+	  counts.push_back(count);
+	}
+      }
+      m=end;
+      ptrs.push_back(child);
+      keys.insert(keys.end(),childkeys.begin(),childkeys.end());
+      ptrs.insert(ptrs.end(),childnodes.begin(),childnodes.end());
+      if (offset<b.info.numkeys) { 
+	keys.push_back(testkey);
+      }
+    }
+    if (!changed) { 
+      return ERROR_NOERROR;
+    }
+    return WriteInteriorParts(node,b,keys,ptrs,counts,sepkeys,newnodes);
+    break;
+  case BTREE_LEAF_NODE:
+    for (offset=0;offset<b.info.numkeys;offset++) { 
+      rc=b.GetKeyVal(offset,testkeyvalue);
+      if (rc) { return rc; }
+      kvs.push_back(testkeyvalue);
+    }
+    // Merge the sorted writes into the sorted leaf
+    offset=0;
+    for (m=first;m!=last;++m) { 
+      for (;offset<kvs.size() && kvs[offset].key<(*m).first;offset++) { 
+	out.push_back(kvs[offset]);
+      }
+      if (offset<kvs.size() && kvs[offset].key==(*m).first) { 
+	// replaced or deleted
+	rc=FreeOverflow(kvs[offset].value);
+	if (rc) { return rc; }
+	offset++;
+      }
+      if ((*m).second.first!=BTREE_OP_DELETE) { 
+	out.push_back(KeyValuePair((*m).first,(*m).second.second));
+      }
+    }
+    for (;offset<kvs.size();offset++) { 
+      out.push_back(kvs[offset]);
+    }
+    return WriteLeafParts(node,b,out,sepkeys,newnodes);
+    break;
+  default:
+    return ERROR_INSANE;
+    break;
+  }
+
+  return ERROR_INSANE;
+}
+
+
+// Length of the prefix two keys share
+static SIZE_T CommonPrefix(const KEY_T &a, const KEY_T &b, const SIZE_T keysize)
+{
+  SIZE_T i;
+
+  for (i=0;i<keysize && a.data[i]==b.data[i];i++) { }
+  return i;
+}
+
+
+// Write kvs as the leaf node (0 for a new one), spread evenly over as
+// few leaves as hold them.  Each separator is the last key of the leaf
+// before it.  With prefix compression, a leaf holds as many keys as 
+// fit once the prefix of its first and last is stored only once, and
+// with variable lengths as many as fit in its bytes.
+ERROR_T BTreeIndex::WriteLeafParts(SIZE_T &node, BTreeNode &b,
+				   const vector<KeyValuePair> &kvs,
+				   vector<KEY_T> &sepkeys, vector<SIZE_T> &newnodes)
+{
+  SIZE_T keysize=superblock.info.keysize;
+  SIZE_T slots= prefixleaves ? GetLeafFilterRoom() : b.info.GetNumSlotsAsLeaf();
+  SIZE_T n=kvs.size();
+  SIZE_T parts= n>slots ? (n+slots-1)/slots : 1;
+  SIZE_T part, from, to, i, plen;
+  SIZE_T newnode;
+  ERROR_T rc;
+
+  if (prefixleaves && n>0) { 
+    // slots is the most any leaf can hold, so this is a lower bound
+    for (;;parts++) { 
+      for (part=0;part<parts;part++) { 
+	from=part*n/parts;
+	to=(part+1)*n/parts;
+	plen=CommonPrefix(kvs[from].key,kvs[to-1].key,keysize);
+	if (to-from>superblock.info.GetNumSlotsAsLeaf(plen)) { 
+	  break;
+	}
+      }
+      if (part==parts) { 
+	break;
+      }
+    }
+  }
+
+  if (varlen && n>0) { 
+    parts=(BTreeNode::GetVariableLeafBytes(kvs,0,n)+superblock.info.GetNumDataBytes()-1)/
+      superblock.info.GetNumDataBytes();
+    for (;;parts++) { 
+      for (part=0;part<parts;part++) { 
+	if (!LeafFits(kvs,part*n/parts,(part+1)*n/parts)) { 
+	  break;
+	}
+      }
+      if (part==parts) { 
+	break;
+      }
+    }
+  }
+
+  for (part=0;part<parts;part++) { 
+    BTreeNode p(BTREE_LEAF_NODE,
+		superblock.info.keysize,
+		superblock.info.valuesize,
+		buffercache->GetBlockSize(),
+		superblock.info.headerbytes);
+    rc=FormatLeaf(p);
+    if (rc) { return rc; }
+    from=part*n/parts;
+    to=(part+1)*n/parts;
+    if (prefixleaves && to>from) { 
+      plen=CommonPrefix(kvs[from].key,kvs[to-1].key,keysize);
+      if (plen>0) { 
+	rc=p.SetLeafPrefix(kvs[from].key,plen);
+	if (rc) { return rc; }
+      }
+    }
+    p.info.numkeys=to-from;
+    for (i=from;i<to;i++) { 
+      rc=p.SetKeyVal(i-from,kvs[i]);
+      if (rc) { return rc; }
+    }
+    if (part==0 && node==0) { 
+      rc=AllocateNode(node);
+      if (rc) { return rc; }
+      rc=WriteNewNode(node,p);
+      if (rc) { return rc; }
+    } else if (part==0) { 
+      rc=WriteNode(node,p);
+      if (rc) { return rc; }
+    } else {
+      sepkeys.push_back(Separator(kvs[from-1].key,kvs[from].key));
+      rc=AllocateNode(newnode);
+      if (rc) { return rc; }
+      rc=WriteNewNode(newnode,p);
+      if (rc) { return rc; }
+      newnodes.push_back(newnode);
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::FormatInterior(BTreeNode &b) const
+{
+  ERROR_T rc;
+
+  rc=ERROR_NOERROR;
+  if (varlen) { 
+    rc=b.SetVariableLength();
+  } else if (suffixtruncation || counted) { 
+    rc=b.SetSlotted();
+  }
+  if (rc==ERROR_NOERROR && counted) { 
+    // counts sit in the directory next to their pointers
+    rc=b.SetCounted();
+  }
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::FormatLeaf(BTreeNode &b) const
+{
+  if (varlen) { 
+    return b.SetVariableLength();
+  }
+  return ERROR_NOERROR;
+}
+
+
+// True if kvs[from,to) fit in one leaf
+bool BTreeIndex::LeafFits(const vector<KeyValuePair> &kvs, const SIZE_T from, const SIZE_T to) const
+{
+  if (varlen) { 
+    return BTreeNode::GetVariableLeafBytes(kvs,from,to)<=superblock.info.GetNumDataBytes();
+  }
+  return to-from<=superblock.info.GetNumSlotsAsLeaf();
+}
+
+
+KEY_T BTreeIndex::Separator(const KEY_T &left, const KEY_T &right) const
+{
+  KEY_T sep(left);
+  SIZE_T i;
+
+  if (!suffixtruncation) { 
+    return sep;
+  }
+  if (varlen) { 
+    // The shortest prefix of right that is above left, unless that
+    // is right itself or no shorter than left
+    for (i=0;i<left.length && i<right.length && left.data[i]==right.data[i];i++) { }
+    if (i+1<right.length && i+1<left.length) { 
+      sep.Resize(i+1,false);
+      memcpy(sep.data,right.data,i+1);
+    }
+    return sep;
+  }
+  // Keep left up to the first byte where it is below right, and pad
+  // with 0xff, which a slotted node does not store.  Then left <= 
+  // sep < right.
+  for (i=0;i<superblock.info.keysize && left.data[i]==right.data[i];i++) { }
+  for (i++;i<superblock.info.keysize;i++) { 
+    sep.data[i]=(char)0xff;
+  }
+  return sep;
+}
+
+
+// Write keys and ptrs (and counts, in a counted tree) as the interior
+// node b (node 0 for a new one), splitting it evenly if they do not fit.  The key between two parts
+// is pushed up, and a split root becomes an ordinary interior node
+// (see SplitInternal).  Slotted nodes are split evenly by count into 
+// as few parts as each fit.
+ERROR_T BTreeIndex::WriteInteriorParts(SIZE_T &node, BTreeNode &b,
+				       const vector<KEY_T> &keys, const vector<SIZE_T> &ptrs,
+				       const vector<SIZE_T> &counts,
+				       vector<KEY_T> &sepkeys, vector<SIZE_T> &newnodes)
+{
+  SIZE_T slots=b.info.GetNumSlotsAsInterior();
+  SIZE_T n=ptrs.size();
+  SIZE_T parts= keys.size()>slots ? (n+slots)/(slots+1) : 1;
+  SIZE_T part, from, to, i;
+  SIZE_T newnode;
+  ERROR_T rc;
+
+  if (suffixtruncation || varlen || counted) { 
+    for (parts=1;;parts++) { 
+      for (part=0;part<parts;part++) { 
+	from=part*n/parts;
+	to=(part+1)*n/parts;
+	if (BTreeNode::GetSlottedBytes(keys,from,to-1,superblock.info.keysize,varlen,counted)>
+	    b.info.GetNumDataBytes()) { 
+	  break;
+	}
+      }
+      if (part==parts) { 
+	break;
+      }
+    }
+  }
+
+  for (part=0;part<parts;part++) { 
+    BTreeNode p(parts>1 ? BTREE_INTERIOR_NODE : b.info.nodetype,
+		superblock.info.keysize,
+		superblock.info.valuesize,
+		buffercache->GetBlockSize(),
+		superblock.info.headerbytes);
+    rc=FormatInterior(p);
+    if (rc) { return rc; }
+    from=part*n/parts;
+    to=(part+1)*n/parts;
+    p.info.numkeys=to-from-1;
+    for (i=from;i<to;i++) { 
+      rc=p.SetPtr(i-from,ptrs[i]);
+      if (rc) { return rc; }
+      if (counted) { 
+	rc=p.SetCount(i-from,counts[i]);
+	if (rc) { return rc; }
+      }
+      if (i+1<to) { 
+	rc=p.SetKey(i-from,keys[i]);
+	if (rc) { return rc; }
+      }
+    }
+    if (part==0 && node==0) { 
+      rc=AllocateNode(node);
+      if (rc) { return rc; }
+      rc=WriteNewNode(node,p);
+      if (rc) { return rc; }
+    } else if (part==0) { 
+      rc=WriteNode(node,p);
+      if (rc) { return rc; }
+    } else {
+      sepkeys.push_back(keys[from-1]);
+      rc=AllocateNode(newnode);
+      if (rc) { return rc; }
+      rc=WriteNewNode(newnode,p);
+      if (rc) { return rc; }
+      newnodes.push_back(newnode);
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+{
+  ArenaScope scope(arena);
+  VALUE_T stored(value);
+  ERROR_T rc;
+
+  if (!KeyFits(key) || !ValueFits(value)) { 
+    return ERROR_SIZE;
+  }
+
+  if (overflowsize) { 
+    // written before the key is checked, and freed again if the
+    // insert fails
+    rc=PutOverflow(value,stored);
+    if (rc) { return rc; }
+  }
+
+  if (memtablelimit && !multiversion) { 
+    rc=MemTableWrite(BTREE_OP_INSERT,key,stored);
+  } else if (prefixleaves) { 
+    // The leaf's prefix may shrink, so it is rewritten whole, as a
+    // flush would, after the same check MemTableWrite makes
+    SIZE_T root=superblock.info.rootnode;
+    VALUE_T old;
+    BTreeMemTable one;
+
+    if (GlobalFilterRulesOut(key)) { 
+      rc=ERROR_NONEXISTENT;
+    } else {
+      rc=LookupOrUpdateInternal(root,BTREE_OP_LOOKUP,key,old);
+      if (rc==ERROR_NONEXISTENT && bloombits && bloomglobal) { 
+	globalfalsepos++;
+      }
+    }
+    if (rc==ERROR_NOERROR) { 
+      rc=ERROR_CONFLICT;
+    } else if (rc==ERROR_NONEXISTENT) { 
+      one[key]=pair<BTreeOp,VALUE_T>(BTREE_OP_INSERT,stored);
+      rc=ApplyBatchAtRoot(one);
+    }
+  } else {
+    rc=ApplyAtLeaf(BTREE_OP_INSERT,key,stored);
+  }
+
+  if (rc!=ERROR_NOERROR) { 
+    FreeOverflow(stored);
+  }
+
+  if (rc==ERROR_NOERROR) { 
+    NoteGlobalInsert(key);
+  }
+  return rc;
+}
+
+  
+ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+{
+  ArenaScope scope(arena);
+  SIZE_T root=superblock.info.rootnode;
+  VALUE_T val(value);
+  ERROR_T rc;
+
+  if (!KeyFits(key) || !ValueFits(value)) { 
+    return ERROR_SIZE;
+  }
+
+  if (multiversion) { 
+    // a new version may not fit in the leaf, so this can split
+    return ApplyAtLeaf(BTREE_OP_UPDATE,key,value);
+  }
+
+  if (overflowsize) { 
+    // written before the key is found, and freed again if the update
+    // fails
+    rc=PutOverflow(value,val);
+    if (rc) { return rc; }
+  }
+
+  if (memtablelimit) { 
+    rc=MemTableWrite(BTREE_OP_UPDATE,key,val);
+    if (rc!=ERROR_NOERROR) { 
+      FreeOverflow(val);
+    }
+    return rc;
+  }
+
+  if (GlobalFilterRulesOut(key)) { 
+    FreeOverflow(val);
+    return ERROR_NONEXISTENT;
+  }
+
+  rc=LookupOrUpdateInternal(root, BTREE_OP_UPDATE, key, val);
+
+  if (rc==ERROR_NONEXISTENT && bloombits && bloomglobal) { 
+    globalfalsepos++;
+  }
+  if (rc==ERROR_NOSPACE && varlen) { 
+    // A longer value than the leaf has room for, so the leaf is
+    // rewritten whole, splitting if need be
+    BTreeMemTable one;
+
+    AbortWrite();
+    one[key]=pair<BTreeOp,VALUE_T>(BTREE_OP_UPDATE,value);
+    return ApplyBatchAtRoot(one);
+  }
+  if (rc) { 
+    AbortWrite();
+    FreeOverflow(val);
+    return rc;
+  }
+
+  if (root!=superblock.info.rootnode) { 
+    return PublishRoot(root);
+  }
+  return ERROR_NOERROR;
+}
+
+
+// The helper function for delete. Can be called recursively.
+// Leaves are allowed to underflow (down to empty); we do not merge.
+ERROR_T BTreeIndex::DeleteHelper(SIZE_T &node, const KEY_T &key)
+{
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T offset;
+  VALUE_T value;
+  SIZE_T ptr;
+  SIZE_T child;
+  bool found;
+
+  rc= b.Unserialize(buffercache,node,superblock.info);
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+
+  switch (b.info.nodetype) { 
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (b.info.numkeys==0) { 
+      return ERROR_NONEXISTENT;
+    }
+    rc=b.FindKey(key,offset,found,searchtype,&keyprobes);
+    if (rc) { return rc; }
+    rc=b.GetPtr(offset,ptr);
+    if (rc) { return rc; }
+    if (LeafFilterRulesOut(ptr,key)) { 
+      return ERROR_NONEXISTENT;
+    }
+    child=ptr;
+    rc=DeleteHelper(child,key);
+    if (rc) { return rc; }
+    if (counted) { 
+      SIZE_T count;
+      rc=b.GetCount(offset,count);
+      if (rc) { return rc; }
+      rc=b.SetCount(offset,count-1);
+      if (rc) { return rc; }
+    }
+    if (child!=ptr || counted) { 
+      rc=b.SetPtr(offset,child);
+      if (rc) { return rc; }
+      return WriteNode(node,b);
+    }
+    return ERROR_NOERROR;
+    break;
+  case BTREE_LEAF_NODE:
+    rc=b.FindKey(key,offset,found,searchtype,&keyprobes);
+    if (rc) { return rc; }
+    if (!found) { 
+      return ERROR_NONEXISTENT;
+    }
+    rc=b.GetVal(offset,value);
+    if (rc) { return rc; }
+    rc=b.DeleteKeyVal(offset);
+    if (rc) { return rc; }
+    rc=WriteNode(node,b);
+    if (rc) { return rc; }
+    return FreeOverflow(value);
+    break;
+  default:
+    return ERROR_INSANE;
+    break;
+  }
+
+  return ERROR_INSANE;
+}
+
+  
+ERROR_T BTreeIndex::Delete(const KEY_T &key)
+{
+  ArenaScope scope(arena);
+  SIZE_T root=superblock.info.rootnode;
+  ERROR_T rc;
+
+  if (!KeyFits(key)) { 
+    return ERROR_SIZE;
+  }
+
+  if (multiversion) { 
+    // snapshots may still need the deleted value, so leave a tombstone
+    rc=ApplyAtLeaf(BTREE_OP_DELETE,key,VALUE_T());
+  } else if (memtablelimit) { 
+    rc=MemTableWrite(BTREE_OP_DELETE,key,VALUE_T());
+  } else if (GlobalFilterRulesOut(key)) { 
+    rc=ERROR_NONEXISTENT;
+  } else {
+    rc=DeleteHelper(root,key);
+    if (rc==ERROR_NONEXISTENT && bloombits && bloomglobal) { 
+      globalfalsepos++;
+    }
+    if (rc) { 
+      AbortWrite();
+    } else if (root!=superblock.info.rootnode) { 
+      rc=PublishRoot(root);
+    }
+  }
+
+  if (rc==ERROR_NOERROR) { 
+    NoteGlobalDelete();
+  }
+  return rc;
 }
 
 
-// The helper function for insert. Can be called recursively.
-ERROR_T BTreeIndex::InsertHelper(const SIZE_T &node, const KEY_T &key, const VALUE_T &value)
+ERROR_T BTreeIndex::Upsert(const KEY_T &key, const VALUE_T &value)
 {
-  BTreeNode b;
   ERROR_T rc;
-  SIZE_T offset;
-  KEY_T testkey;
-  SIZE_T ptr;
-  std::cout<<"Step 2"<<std::endl;
-  rc= b.Unserialize(buffercache,node);
-  std::cout<<"Step 3. Node: "<<node<<std::endl;
-  if (rc!=ERROR_NOERROR) { 
-    return rc;
-  }
-
-  switch (b.info.nodetype) { 
-    case BTREE_ROOT_NODE:
-    case BTREE_INTERIOR_NODE:
-      // Scan through key/ptr pairs
-      //and recurse if possible
-      for (offset=0;offset<b.info.numkeys;offset++) { 
-        rc=b.GetKey(offset,testkey);
-        if (rc) {  return rc; }
-        if (key<testkey || key==testkey) {
-          // OK, so we now have the first key that's larger
-          // so we ned to recurse on the ptr immediately previous to 
-          // this one, if it exists
-          rc=b.GetPtr(offset,ptr);
-          if (rc) { return rc; }
-          return InsertHelper(ptr, key,value);
-        }
-      }
-      // if we got here, we need to go to the next pointer, if it exists
-      if (b.info.numkeys>0) { 
-        if (b.info.nodetype==BTREE_ROOT_NODE && b.info.numkeys==1){
-          //special situation when the node only have one leaf node as the child.
-          //Get the stored pointer to the next leaf node.
-          rc=b.GetPtr(0,ptr);
-          if (rc) { return rc; }
-          std::cout<<"Special situation. Node: "<<ptr<<std::endl;
-          return InsertHelper(ptr, key,value);
-        }
-        rc=b.GetPtr(b.info.numkeys,ptr);
-        if (rc) { return rc; }
-        return InsertHelper(ptr, key,value);
-      } else {
-        // There are no keys at all on this node, so nowhere to go
-        // Therefore we need to create a new leaf node and insert that.
-        rc=CreateLeafNode(ptr,key,value);
-        if (rc) { return rc; }
-        // Append the newleaf to the root and add one to root's numkeys.
-        b.info.numkeys=1;
-        b.SetKey(0,key);
-        b.GetKey(0,testkey);
-        std::cout<<"testkey: "<<testkey<<std::endl;
-        b.SetPtr(0,ptr);
-        std::cout<<"ptr: "<<ptr<<std::endl;
-        // Need to serialize after changing value
-        b.Serialize(buffercache,node);
-        return ERROR_NOERROR;
-      }
-      break;
-    case BTREE_LEAF_NODE:
-      std::cout<<"Step 4"<<std::endl;
-      // Scan through keys looking for matching value
-      for (offset=0;offset<b.info.numkeys;offset++) { 
-        rc=b.GetKey(offset,testkey);
-        if (rc) {  return rc; }
-        // we've found the place to insert the key and value
-        if (key<testkey || testkey==key) { 
-          //WRITE ME
-          if (b.info.GetNumSlotsAsLeaf()==0){
-            SplitLeaf(node,key,value);
-          }else{
-            // Move the memory after the insertion place one forward.
-            memmove(b.data+(b.info.keysize+b.info.valuesize)*offset+sizeof(SIZE_T),b.data+(b.info.keysize+b.info.valuesize)*(offset+1)+sizeof(SIZE_T),b.info.GetNumDataBytes()-sizeof(SIZE_T)-(b.info.keysize+b.info.valuesize)*offset);
-            b.SetKey(offset,key);
-            b.SetVal(offset,value);
-          }
-          return ERROR_NOERROR;
-        }
-      }
-      return ERROR_NONEXISTENT;
-      break;
-    default:
-      // We can't be looking at anything other than a root, internal, or leaf
-      return ERROR_INSANE;
-      break;
-  }  
 
-  return ERROR_INSANE;
+  rc=Insert(key,value);
+  if (rc==ERROR_CONFLICT) { 
+    rc=Update(key,value);
+  }
+  return rc;
 }
 
-ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
-{
-  // WRITE ME
-  // We start at the superblock. 
-  // 1. Check if the current block is a leaf node. 
-  //     If not a leaf node.
-  //        do search (may use linear search for now, can write a separate function)
-  //            If currKey<key, then move to the right. Otherwise return the pointer of currKey. (next pointer to the right)
-  //            If we reached the end, then the key is larger than any other key in the current node. Insert into the pointer Which leads us to the next block in the linked list
-  //     If a leaf node,
-  //        If leaf contains <L keys, insert into the leaf at the correct position (using search)
-  //        If leaf is already full, then split the leaf.
-  //            Insert into leaf, pretending that the leaf has space for the new key/value.
-  //            Split x into 2 new leaves xl and xr. xl contains the l/2 smallest keys and xr contains the remaining l/2 keys. Let J be the minimum key in xr
-  //            Make a copy of J to be the parent of xl and xr. insert the copy into the parent node. (key=J, value=pointer to xl)
-  //        Splitting an internal node:
-  //            The difference is xl contains [m-2]-1 smallest keys and xr contains [m/2] largest keys. 
-  //            Note that the [m/2]th key J is not placed in xl or xr, but is used to be a key in parent node
-  //            Make J the parent of xl and xr, and push j together with its child pointers(to xl) into the parent of x. 
-  std::cout<<"Step 1"<<std::endl;
-  return InsertHelper(superblock_index+1,key,value);
-}
 
-  
-ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+ERROR_T BTreeIndex::Erase(const KEY_T &key)
 {
-  // WRITE ME
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, key, value);
-}
+  ERROR_T rc;
 
-  
-ERROR_T BTreeIndex::Delete(const KEY_T &key)
-{
-  // This is optional extra credit 
-  //
-  // 
-  return ERROR_UNIMPL;
+  rc=Delete(key);
+  if (rc==ERROR_NONEXISTENT) { 
+    rc=ERROR_NOERROR;
+  }
+  return rc;
 }
 
   
@@ -610,7 +2789,8 @@ ERROR_T BTreeIndex::Delete(const KEY_T &key)
 
 ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
 				    ostream &o,
-				    BTreeDisplayType display_type) const
+				    BTreeDisplayType display_type,
+				    const SIZE_T readts) const
 {
   KEY_T testkey;
   SIZE_T ptr;
@@ -618,13 +2798,14 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
   ERROR_T rc;
   SIZE_T offset;
 
-  rc= b.Unserialize(buffercache,node);
+  rc= b.Unserialize(buffercache,node,superblock.info);
 
   if (rc!=ERROR_NOERROR) { 
     return rc;
   }
 
-  rc = PrintNode(o,node,b,display_type);
+  rc = PrintNode(o,node,b,display_type,GetUserValueSize(),multiversion,readts,
+		 overflowsize!=0);
   
   if (rc) { return rc; }
 
@@ -646,7 +2827,7 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
 	if (display_type==BTREE_DEPTH_DOT) { 
 	  o << node << " -> "<<ptr<<";\n";
 	}
-	rc=DisplayInternal(ptr,o,display_type);
+	rc=DisplayInternal(ptr,o,display_type,readts);
 	if (rc) { return rc; }
       }
     }
@@ -667,121 +2848,433 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
 }
 
 
+ERROR_T BTreeIndex::ScanInternal(const SIZE_T &node, vector<KeyValuePair> &kvs) const
+{
+  BTreeNode b;
+  KeyValuePair testkeyvalue;
+  SIZE_T offset;
+  SIZE_T ptr;
+  ERROR_T rc;
+
+  rc= b.Unserialize(buffercache,node,superblock.info);
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+
+  switch (b.info.nodetype) { 
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (b.info.numkeys>0) { 
+      for (offset=0;offset<=b.info.numkeys;offset++) { 
+	rc=b.GetPtr(offset,ptr);
+	if (rc) { return rc; }
+	rc=ScanInternal(ptr,kvs);
+	if (rc) { return rc; }
+      }
+    }
+    return ERROR_NOERROR;
+    break;
+  case BTREE_LEAF_NODE:
+    for (offset=0;offset<b.info.numkeys;offset++) { 
+      rc=b.GetKeyVal(offset,testkeyvalue);
+      if (rc) { return rc; }
+      kvs.push_back(testkeyvalue);
+    }
+    return ERROR_NOERROR;
+    break;
+  default:
+    return ERROR_INSANE;
+    break;
+  }
+
+  return ERROR_INSANE;
+}
+
+
+ERROR_T BTreeIndex::SubtreeCount(const SIZE_T &node, SIZE_T &count) const
+{
+  BTreeNode b;
+  ERROR_T rc;
+
+  rc=b.Unserialize(buffercache,node,superblock.info);
+  if (rc) { return rc; }
+  count=b.GetSubtreeCount();
+  return ERROR_NOERROR;
+}
+
+
+// Descend as a lookup does, adding up the counts of the children
+// passed over on the left
+ERROR_T BTreeIndex::Rank(const KEY_T &key, SIZE_T &rank)
+{
+  ArenaScope scope(arena);
+  SIZE_T node;
+  BTreeNode b;
+  SIZE_T offset, i, count;
+  bool found;
+  ERROR_T rc;
+
+  if (!counted) { 
+    return ERROR_UNIMPL;
+  }
+  if (!KeyFits(key)) { 
+    return ERROR_SIZE;
+  }
+  // the counts only cover what has reached the tree
+  rc=FlushMemTable();
+  if (rc) { return rc; }
+
+  node=superblock.info.rootnode;
+  rank=0;
+  while (1) { 
+    rc=b.Unserialize(buffercache,node,superblock.info);
+    if (rc) { return rc; }
+    rc=b.FindKey(key,offset,found,searchtype,&keyprobes);
+    if (rc) { return rc; }
+    if (b.info.nodetype==BTREE_LEAF_NODE) { 
+      rank+=offset;
+      return ERROR_NOERROR;
+    }
+    if (b.info.numkeys==0) { 
+      // empty tree
+      return ERROR_NOERROR;
+    }
+    for (i=0;i<offset;i++) { 
+      rc=b.GetCount(i,count);
+      if (rc) { return rc; }
+      rank+=count;
+    }
+    rc=b.GetPtr(offset,node);
+    if (rc) { return rc; }
+  }
+}
+
+
+ERROR_T BTreeIndex::Select(const SIZE_T k, KEY_T &key)
+{
+  ArenaScope scope(arena);
+  SIZE_T node;
+  BTreeNode b;
+  SIZE_T left=k;
+  SIZE_T offset, count;
+  ERROR_T rc;
+
+  if (!counted) { 
+    return ERROR_UNIMPL;
+  }
+  rc=FlushMemTable();
+  if (rc) { return rc; }
+
+  node=superblock.info.rootnode;
+  while (1) { 
+    rc=b.Unserialize(buffercache,node,superblock.info);
+    if (rc) { return rc; }
+    if (b.info.nodetype==BTREE_LEAF_NODE) { 
+      if (left>=b.info.numkeys) { 
+	// only the counts of a damaged tree would lead here
+	return ERROR_INSANE;
+      }
+      return b.GetKey(left,key);
+    }
+    if (b.info.nodetype!=BTREE_ROOT_NODE && b.info.nodetype!=BTREE_INTERIOR_NODE) { 
+      return ERROR_INSANE;
+    }
+    if (node==superblock.info.rootnode && k>=b.GetSubtreeCount()) { 
+      return ERROR_NONEXISTENT;
+    }
+    // the child holding the key, and its keys to skip
+    for (offset=0;offset<=b.info.numkeys;offset++) { 
+      rc=b.GetCount(offset,count);
+      if (rc) { return rc; }
+      if (left<count) { 
+	break;
+      }
+      left-=count;
+    }
+    if (offset>b.info.numkeys) { 
+      return ERROR_INSANE;
+    }
+    rc=b.GetPtr(offset,node);
+    if (rc) { return rc; }
+  }
+}
+
+
+ERROR_T BTreeIndex::Count(const KEY_T &lo, const KEY_T &hi, SIZE_T &count)
+{
+  ArenaScope scope(arena);
+  SIZE_T below, above;
+  ERROR_T rc;
+
+  rc=Rank(lo,below);
+  if (rc) { return rc; }
+  rc=Rank(hi,above);
+  if (rc) { return rc; }
+  count= above>below ? above-below : 0;
+  return ERROR_NOERROR;
+}
+
+
+//
+// Pending memtable writes are merged into the sorted listing.  The
+// depth listings show the tree as it is on disk, followed by the
+// memtable.
+//
 ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
+{
+  BTreeMemTable::const_iterator m;
+  ERROR_T rc;
+  unsigned i;
+
+  if ((memtable.empty() && !overflowsize) || display_type==BTREE_DEPTH_DOT) { 
+    return Display(BTreeSnapshot(superblock.info.rootnode,epoch),o,display_type);
+  }
+
+  if (display_type==BTREE_DEPTH) { 
+    rc=Display(BTreeSnapshot(superblock.info.rootnode,epoch),o,display_type);
+    if (rc) { return rc; }
+    o << "memtable: ";
+    for (m=memtable.begin();m!=memtable.end();++m) { 
+      o << ((*m).second.first==BTREE_OP_INSERT ? "+" : 
+	    (*m).second.first==BTREE_OP_UPDATE ? "=" : "-");
+      for (i=0;i<(*m).first.length;i++) { 
+	o << (*m).first.data[i];
+      }
+      if ((*m).second.first!=BTREE_OP_DELETE) { 
+	o << ",";
+	for (i=0;i<(*m).second.second.length;i++) { 
+	  o << (*m).second.second.data[i];
+	}
+      }
+      o << " ";
+    }
+    o << endl;
+    return ERROR_NOERROR;
+  }
+
+  return ListSorted(superblock.info.rootnode,o,true);
+}
+
+
+ERROR_T BTreeIndex::ListSorted(const SIZE_T &root, ostream &o, const bool withmemtable) const
+{
+  vector<KeyValuePair> kvs;
+  BTreeMemTable::const_iterator m, end;
+  SIZE_T offset;
+  ERROR_T rc;
+  unsigned i;
+
+  rc=ScanInternal(root,kvs);
+  if (rc) { return rc; }
+
+  offset=0;
+  m=memtable.begin();
+  end= withmemtable ? memtable.end() : memtable.begin();
+  while (offset<kvs.size() || m!=end) { 
+    KeyValuePair kv;
+    if (m==end || (offset<kvs.size() && kvs[offset].key<(*m).first)) { 
+      kv=kvs[offset++];
+    } else {
+      if (offset<kvs.size() && kvs[offset].key==(*m).first) { 
+	offset++;
+      }
+      if ((*m).second.first==BTREE_OP_DELETE) { 
+	++m;
+	continue;
+      }
+      kv=KeyValuePair((*m).first,(*m).second.second);
+      ++m;
+    }
+    if (overflowsize) { 
+      VALUE_T stored(kv.value);
+      rc=GetOverflow(stored,kv.value);
+      if (rc) { return rc; }
+    }
+    o << "(";
+    for (i=0;i<kv.key.length;i++) { 
+      o << kv.key.data[i];
+    }
+    o << ",";
+    for (i=0;i<kv.value.length;i++) { 
+      o << kv.value.data[i];
+    }
+    o << ")\n";
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::Display(const BTreeSnapshot &snap, ostream &o, BTreeDisplayType display_type) const
 {
   ERROR_T rc;
+
+  if (overflowsize && display_type==BTREE_SORTED_KEYVAL) { 
+    // leaves hold only where the values are
+    return ListSorted(snap.rootnode ? snap.rootnode : superblock.info.rootnode,o,false);
+  }
   if (display_type==BTREE_DEPTH_DOT) { 
     o << "digraph tree { \n";
   }
-  rc=DisplayInternal(superblock.info.rootnode,o,display_type);
+  rc=DisplayInternal(snap.rootnode ? snap.rootnode : superblock.info.rootnode,
+		     o,display_type,snap.timestamp);
   if (display_type==BTREE_DEPTH_DOT) { 
     o << "}\n";
   }
-  return ERROR_NOERROR;
+  return rc;
 }
 
 
-ERROR_T BTreeIndex::SanityCheck() const
+//
+// Checks that
+//   every node is a root, interior, or leaf node of the right kind 
+//     for where it is, and allocated
+//   no node is reachable twice (it's a tree)
+//   keys within a node are in strictly increasing order, and
+//     all keys under a pointer lie between the keys around it
+//   no node holds more keys than fit in its block
+//   all leaves are at the same depth (it's balanced)
+// 
+// We don't check for a minimum use ratio, since Delete does not
+// merge underflowing leaves.
+//
+ERROR_T BTreeIndex::SanityCheckInternal(const SIZE_T &node,
+					const SIZE_T depth,
+					SIZE_T &leafdepth,
+					const KEY_T *lo,
+					const KEY_T *hi,
+					set<SIZE_T> &seen) const
 {
-  // WRITE ME
-  // this function checks the following condition and returns ERROR_INSANE if any condition is false
-  // all paths from the root to a leaf have the same depth
-  // at least ceiling((n+1)/2) pointers in any interior node is actually used, where n is the max allowed key num for a block
-  // at least floor((n+1)/1) pointers in any leaf node is actually used to point to data records
-
   BTreeNode b;
   ERROR_T rc;
   SIZE_T offset;
   KEY_T testkey;
+  KEY_T lastkey;
   SIZE_T ptr;
-  VALUE_T value;
-  std::queue<SIZE_T> Q;
 
-  rc= b.Unserialize(buffercache,superblock.info.rootnode);
+  if (seen.find(node)!=seen.end()) { 
+    return ERROR_INSANE;
+  }
+  seen.insert(node);
+
+  if (!buffercache->IsBlockAllocated(node)) { 
+    return ERROR_INSANE;
+  }
 
+  rc= b.Unserialize(buffercache,node,superblock.info);
   if (rc!=ERROR_NOERROR) { return rc; }
 
-  if (b.info.numkeys < 1) {
-    // check if only one pointer is used
-    rc=b.GetPtr(1,ptr);
-    if (rc) {
-      rc = b.GetPtr(0,ptr);
-      if (rc or ptr) {
-        return ERROR_INSANE;
+  if ((depth==0) != (b.info.nodetype==BTREE_ROOT_NODE)) { 
+    return ERROR_INSANE;
+  }
+
+  switch (b.info.nodetype) { 
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (b.info.numkeys>b.GetNumSlotsAsInterior()) { 
+      return ERROR_INSANE;
+    }
+    if (counted!=b.IsCounted()) { 
+      return ERROR_INSANE;
+    }
+    if (b.info.numkeys==0) { 
+      // only an empty tree's root may have no keys
+      return depth==0 ? ERROR_NOERROR : ERROR_INSANE;
+    }
+    break;
+  case BTREE_LEAF_NODE:
+    if (b.info.numkeys>b.GetNumSlotsAsLeaf()) { 
+      return ERROR_INSANE;
+    }
+    if (leafdepth==0) { 
+      leafdepth=depth;
+    } else if (leafdepth!=depth) { 
+      return ERROR_INSANE;
+    }
+    break;
+  default:
+    return ERROR_INSANE;
+  }
+
+  for (offset=0;offset<b.info.numkeys;offset++) { 
+    rc=b.GetKey(offset,testkey);
+    if (rc) { return rc; }
+    if (offset>0 && multiversion && b.info.nodetype==BTREE_LEAF_NODE && 
+	lastkey==testkey) { 
+      // versions of one key, newest first
+      VALUE_T newer, older;
+      rc=b.GetVal(offset-1,newer);
+      if (rc) { return rc; }
+      rc=b.GetVal(offset,older);
+      if (rc) { return rc; }
+      if ((GetStamp(older,GetUserValueSize()) & ~BTREE_VERSION_TOMBSTONE) >=
+	  (GetStamp(newer,GetUserValueSize()) & ~BTREE_VERSION_TOMBSTONE)) { 
+	return ERROR_INSANE;
       }
+    } else if (offset>0 && !(lastkey<testkey)) { 
+      return ERROR_INSANE;
+    }
+    if ((lo && !(*lo<testkey)) || (hi && *hi<testkey)) { 
+      return ERROR_INSANE;
+    }
+    lastkey=testkey;
+    if (overflowsize && b.info.nodetype==BTREE_LEAF_NODE) { 
+      VALUE_T value;
+      rc=b.GetVal(offset,value);
+      if (rc) { return rc; }
+      rc=CheckOverflow(value,seen);
+      if (rc) { return rc; }
     }
   }
-  else {
-    // push the 2nd level blocks into Q
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetPtr(offset,ptr);
-      if (rc) {  return rc; }
-      Q.push(ptr);
-    }  
-    
-    bool terminate = false;
-    while (true) {
-      // unserialize all nodes in the queue
-      // for every node, check if they are the same type
-      // check if every node meets saturation rate limit
-      // push all their childrens into Q
-      // if all nodes are leaf, check if in order, then terminate
-      std::set<SIZE_T> s; // contains the types of nodes in a level 
-      std::vector<VALUE_T> v;
-      for (unsigned i=0; i<Q.size(); i++) {
-        b.Unserialize(buffercache,Q.pop_front());
-        s.insert(b.info.nodetype);
-        switch (b.info.nodetype) {
-          case BTREE_INTERIOR_NODE:
-            // at least ceiling((n+1)/2) pointers in any interior node is actually used, where n is the max allowed key num for a block
-            if ((b.info.numkeys < (b.info.block_size+1)/2+1) or (not (rc=b.GetPtr(b.info.numkeys)))) {
-              return ERROR_INSANE;
-            }
-            // push all children into queue
-            for (offset=0;offset<b.info.numkeys;offset++) {
-              rc = b.GetPtr(offset,ptr);
-              if (rc) {return ERROR_INSANE;}
-              Q.push(ptr);
-            }
-          case BTREE_LEAF_NODE:
-            // at least floor((n+1)/1) pointers in any leaf node is actually used to point to data records
-            if ((b.info.numkeys < (b.info.block_size+1)/2) or (not (rc=b.GetVal(b.info.numkeys)))) {
-              return ERROR_INSANE;
-            }
-            // push all value into vector
-            for (unsigned j=0; j<b.info.numkeys;j++) {
-              rc = b.GetVal(j,value);
-              if (rc) {return ERROR_INSANE;};
-              v.insert(value);
-            }
-            continue;
-        }
-      }
-
-      // if there are more than 1 type of nodes in a level, tree is insane
-      if (s.size() > 1) {
-        return ERROR_INSANE;
-      }
-
-      // iterate through v and check that values are in order
-      for (unsigned i=0; i<v.size()-1; i++) {
-        if (v[i] > v[i+1]) {
-          return ERROR_INSANE;
-        }
+
+  if (b.info.nodetype==BTREE_LEAF_NODE) { 
+    return ERROR_NOERROR;
+  }
+
+  for (offset=0;offset<=b.info.numkeys;offset++) { 
+    KEY_T childlo, childhi;
+    rc=b.GetPtr(offset,ptr);
+    if (rc) { return rc; }
+    if (offset>0) { 
+      rc=b.GetKey(offset-1,childlo);
+      if (rc) { return rc; }
+    }
+    if (offset<b.info.numkeys) { 
+      rc=b.GetKey(offset,childhi);
+      if (rc) { return rc; }
+    }
+    rc=SanityCheckInternal(ptr,depth+1,leafdepth,
+			   offset>0 ? &childlo : lo,
+			   offset<b.info.numkeys ? &childhi : hi,
+			   seen);
+    if (rc) { return rc; }
+    if (counted) { 
+      // the child's own counts were just checked, so its total holds
+      SIZE_T count, childcount;
+      rc=b.GetCount(offset,count);
+      if (rc) { return rc; }
+      rc=SubtreeCount(ptr,childcount);
+      if (rc) { return rc; }
+      if (count!=childcount) { 
+	return ERROR_INSANE;
       }
     }
   }
+
   return ERROR_NOERROR;
 }
 
 
+ERROR_T BTreeIndex::SanityCheck() const
+{
+  SIZE_T leafdepth=0;
+  set<SIZE_T> seen;
+
+  return SanityCheckInternal(superblock.info.rootnode,0,leafdepth,0,0,seen);
+}
+
+
 ostream & BTreeIndex::Print(ostream &os) const
 {
-  // WRITE ME
   Display(os, BTREE_DEPTH_DOT);
   return os;
 }
-
-
-
-
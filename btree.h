@@ -3,6 +3,10 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
 
 #include "global.h"
 #include "block.h"
@@ -10,6 +14,8 @@
 #include "buffercache.h"
 
 #include "btree_ds.h"
+#include "bloom.h"
+#include "arena.h"
 
 using namespace std;
 
@@ -32,44 +38,256 @@ struct KeyValuePair {
   KeyValuePair();
   KeyValuePair(const KEY_T &key, const VALUE_T &value);
   KeyValuePair(const KeyValuePair &rhs);
+  KeyValuePair(KeyValuePair &&rhs);   // takes rhs's heap buffers, as Block does
   virtual ~KeyValuePair();
   KeyValuePair & operator=(const KeyValuePair &rhs);
+  KeyValuePair & operator=(KeyValuePair &&rhs);
 
 };
 
-enum BTreeOp {BTREE_OP_INSERT, BTREE_OP_DELETE, BTREE_OP_UPDATE,BTREE_OP_LOOKUP};
+// Version stamps in multi-version leaves.  The top bit marks a delete.
+const SIZE_T BTREE_VERSION_TOMBSTONE=0x80000000;
+const SIZE_T BTREE_VERSION_LATEST=0x7fffffff;
+
+//
+// A snapshot pins the tree as it was when the snapshot was opened.
+// In copy-on-write mode it pins the root (the nodes reachable from
+// rootnode are never overwritten while the snapshot is held).  In
+// multi-version mode rootnode is zero and reads see the newest version
+// of each key no younger than timestamp.
+//
+struct BTreeSnapshot {
+  SIZE_T rootnode;
+  SIZE_T epoch;
+  SIZE_T timestamp;
+
+  BTreeSnapshot();
+  BTreeSnapshot(const SIZE_T rootnode, const SIZE_T epoch, const SIZE_T timestamp=BTREE_VERSION_LATEST);
+};
+
+enum BTreeOp {BTREE_OP_INSERT, BTREE_OP_DELETE, BTREE_OP_UPDATE,BTREE_OP_LOOKUP,
+	      BTREE_OP_UPSERT, BTREE_OP_ERASE};
 
 enum BTreeDisplayType {BTREE_DEPTH, BTREE_DEPTH_DOT, BTREE_SORTED_KEYVAL};
 
+// Writes held in memory in front of the tree, by key.  The op is
+// relative to the tree below:
+//
+//   BTREE_OP_INSERT   the key is not in the tree
+//   BTREE_OP_UPDATE   the key is in the tree and gets the value
+//   BTREE_OP_DELETE   the key is in the tree and goes away
+//
+typedef map<KEY_T,pair<BTreeOp,VALUE_T> > BTreeMemTable;
+
 class BTreeIndex {
- private:
+ protected:
   BufferCache *buffercache;
   SIZE_T       superblock_index;
   BTreeNode    superblock;
+  // Node buffers of the operation under way; each public operation
+  // that reads nodes opens an ArenaScope on it
+  Arena        arena;
+  // What SplitLeaf and SplitInternal gather a node into, kept so that
+  // a split reuses the capacity of the last one
+  vector<KeyValuePair> splitkvs;
+  vector<KEY_T>  splitkeys;
+  vector<SIZE_T> splitptrs, splitcounts;
+
+ private:
+  // Copy-on-write (shadow paging) state
+  bool         copyonwrite;
+  SIZE_T       epoch;                      // number of root flips so far
+  map<SIZE_T,SIZE_T> snapshots;            // epoch => readers holding it
+  deque<pair<SIZE_T,SIZE_T> > retired;     // (last live epoch, block)
+  vector<SIZE_T> pending_retired;          // replaced by the current op
+  vector<SIZE_T> pending_fresh;            // allocated by the current op
+
+  // Blocks freed while attached, handed out again before any other
+  // with no read or write of their own, and put on the superblock's
+  // free list only by Detach
+  vector<SIZE_T> freed;
+
+  // Leaves store a common key prefix once
+  bool         prefixleaves;
+  // Separators are cut short, in slotted interior nodes
+  bool         suffixtruncation;
+  // Keys and values of any length up to keysize and valuesize
+  bool         varlen;
+  // Values are kept out of line in overflow chains
+  SIZE_T       overflowthreshold;          // bytes, 0 if values stay in leaves
+  SIZE_T       overflowsize;               // size of a value, 0 if in leaves
+  // Interior nodes count the keys under each pointer
+  bool         counted;
+  // How descents search each node, and the key compares they made
+  BTreeSearchType searchtype;
+  SIZE_T       keyprobes;
+
+  // Multi-version state
+  bool         multiversion;
+  SIZE_T       timestamp;                  // stamp of the newest version
+  multiset<SIZE_T> readers;                // timestamps of open snapshots
+
+  // Memtable state
+  SIZE_T        memtablelimit;             // bytes, 0 if there is no memtable
+  SIZE_T        memtablebytes;             // key and value bytes held
+  BTreeMemTable memtable;
 
  protected:
+  // Bloom filter state.  A leaf's filter is keyed by its block, so 
+  // the filter of a block that copy-on-write has replaced stays 
+  // right for the snapshots that can still reach it.
+  SIZE_T       bloombits;                  // bits per key, 0 if off
+  bool         bloomglobal;                // also keep one filter for the tree
+  map<SIZE_T,BloomFilter> leaffilters;     // leaf block => filter of its keys
+  BloomFilter  globalfilter;
+  bool         globalvalid;                // globalfilter covers every key
+  SIZE_T       globalroom;                 // keys globalfilter was sized for
+  SIZE_T       globalkeys;                 // keys added to it
+  SIZE_T       globaldeletes;              // keys deleted since it was built
+  SIZE_T       leafskips, leaffalsepos;
+  SIZE_T       globalskips, globalfalsepos;
 
   ERROR_T      AllocateNode(SIZE_T &node);
 
   ERROR_T      DeallocateNode(const SIZE_T &node);
+  // Chain the blocks freed since Attach onto the superblock's free list
+  ERROR_T      WriteFreeList();
 
-  ERROR_T      LookupOrUpdateInternal(const SIZE_T &Node,
+  // Write b back as node.  In copy-on-write mode the node is written
+  // to a freshly allocated block instead, and node is updated to it
+  ERROR_T      WriteNode(SIZE_T &node, const BTreeNode &b);
+  // Make newroot the root of the tree (the superblock write is the 
+  // atomic flip in copy-on-write mode)
+  ERROR_T      PublishRoot(const SIZE_T &newroot);
+  // Undo the allocations of a copy-on-write operation that failed
+  ERROR_T      AbortWrite();
+  // Free retired blocks that no snapshot can reach any more
+  ERROR_T      ReclaimRetired();
+
+  ERROR_T      LookupOrUpdateInternal(SIZE_T &node,
 				      const BTreeOp op, 
 				      const KEY_T &key,
-				      VALUE_T &val);
+				      VALUE_T &val,
+				      const SIZE_T readts=BTREE_VERSION_LATEST);
+
+  // Size of the values callers see (without the version stamp)
+  SIZE_T       GetUserValueSize() const;
+  // Drop versions of a multi-version leaf that no snapshot can see
+  void         PruneVersions(vector<KeyValuePair> &kvs) const;
+  // Apply an insert, update or delete to a multi-version leaf
+  ERROR_T      VersionedLeafOp(SIZE_T &node, BTreeNode &b, const BTreeOp op,
+			       const KEY_T &key, const VALUE_T &value,
+			       bool &split, KEY_T &splitkey, SIZE_T &splitnode);
+  // Descend to the leaf for key and apply op there, splitting
+  // and growing the root as needed
+  ERROR_T      ApplyAtLeaf(const BTreeOp op, const KEY_T &key, const VALUE_T &value);
+
+  // Record a write in the memtable, flushing it if it is full
+  ERROR_T      MemTableWrite(const BTreeOp op, const KEY_T &key, const VALUE_T &value);
+  // Apply a whole batch from the root, growing the tree as needed
+  ERROR_T      ApplyBatchAtRoot(const BTreeMemTable &batch);
+  // Apply the sorted writes [first,last) to the subtree at node, 
+  // reading and rewriting each node on their paths once.  Nodes
+  // that overflow split as many ways as they need; the new nodes
+  // after node are in newnodes, preceded by the separators in sepkeys
+  ERROR_T      ApplyBatch(SIZE_T &node,
+			  BTreeMemTable::const_iterator first,
+			  BTreeMemTable::const_iterator last,
+			  vector<KEY_T> &sepkeys, vector<SIZE_T> &newnodes);
+  ERROR_T      WriteLeafParts(SIZE_T &node, BTreeNode &b,
+			      const vector<KeyValuePair> &kvs,
+			      vector<KEY_T> &sepkeys, vector<SIZE_T> &newnodes);
+  // Lay out a fresh interior node in the tree's format
+  ERROR_T      FormatInterior(BTreeNode &b) const;
+  ERROR_T      FormatLeaf(BTreeNode &b) const;
+  // Whether kvs[from,to) fit in one leaf of the tree's format
+  bool         LeafFits(const vector<KeyValuePair> &kvs, const SIZE_T from, const SIZE_T to) const;
+  // Whether a key or value has a length the tree takes
+  bool         KeyFits(const KEY_T &key) const;
+  bool         ValueFits(const VALUE_T &value) const;
+  // The key to go between two leaves: left itself, or with suffix
+  // truncation the key with the fewest stored bytes that does
+  KEY_T        Separator(const KEY_T &left, const KEY_T &right) const;
+  ERROR_T      WriteInteriorParts(SIZE_T &node, BTreeNode &b,
+				  const vector<KEY_T> &keys, const vector<SIZE_T> &ptrs,
+				  const vector<SIZE_T> &counts,
+				  vector<KEY_T> &sepkeys, vector<SIZE_T> &newnodes);
+  // Keys under node, read from the node itself
+  ERROR_T      SubtreeCount(const SIZE_T &node, SIZE_T &count) const;
+  // Every pair in the subtree, in key order (not multi-version)
+  ERROR_T      ScanInternal(const SIZE_T &node, vector<KeyValuePair> &kvs) const;
+
+  // Keys a leaf filter is sized for
+  SIZE_T       GetLeafFilterRoom() const;
+  // Write b to a block just allocated for it
+  ERROR_T      WriteNewNode(const SIZE_T &node, const BTreeNode &b);
+  // Rebuild the filter of node, which now holds b
+  virtual void NoteNode(const SIZE_T &node, const BTreeNode &b);
+  // True if the leaf filter for node shows key cannot be there
+  bool         LeafFilterRulesOut(const SIZE_T &node, const KEY_T &key);
+  // True if the global filter shows key is not in the tree
+  bool         GlobalFilterRulesOut(const KEY_T &key);
+  // From a scan of every key; a subclass that lays out its nodes
+  // differently scans them its own way
+  virtual ERROR_T BuildGlobalFilter();
+  // Keep the global filter up to date with a key written, or with
+  // one deleted (which it can't forget, so it is rebuilt after many)
+  void         NoteGlobalInsert(const KEY_T &key);
+  void         NoteGlobalDelete();
+  // Filters are kept in a chain of blocks between Detach and Attach
+  ERROR_T      LoadFilters(const SIZE_T &first);
+  ERROR_T      SaveFilters(SIZE_T &first);
+
+  // Write value to a new overflow chain and make stored, the leaf's
+  // reference to it
+  ERROR_T      PutOverflow(const VALUE_T &value, VALUE_T &stored);
+  // Read the value stored refers to
+  ERROR_T      GetOverflow(const VALUE_T &stored, VALUE_T &value) const;
+  // Free the chain of a stored value that is going away (a no-op
+  // unless values are out of line)
+  ERROR_T      FreeOverflow(const VALUE_T &stored);
+  // Add the chain of stored to seen, checking it
+  ERROR_T      CheckOverflow(const VALUE_T &stored, set<SIZE_T> &seen) const;
+  // The sorted listing of the tree from root, and the memtable if
+  // withmemtable, with values read back from their chains
+  ERROR_T      ListSorted(const SIZE_T &root, ostream &o, const bool withmemtable) const;
   
 
   ERROR_T      DisplayInternal(const SIZE_T &node,
 			       ostream &o, 
-			       const BTreeDisplayType display_type=BTREE_DEPTH) const;
+			       const BTreeDisplayType display_type=BTREE_DEPTH,
+			       const SIZE_T readts=BTREE_VERSION_LATEST) const;
+
+  ERROR_T      SanityCheckInternal(const SIZE_T &node,
+				   const SIZE_T depth,
+				   SIZE_T &leafdepth,
+				   const KEY_T *lo,
+				   const KEY_T *hi,
+				   set<SIZE_T> &seen) const;
+
   // The function to create a new leaf node
   ERROR_T CreateLeafNode(SIZE_T &ptr, const KEY_T &key, const VALUE_T &value);
 
-  ERROR_T SplitInternal(const SIZE_T &node, const KEY_T &key, const VALUE_T &value);
-  // The function to split a leaf node
-  ERROR_T SplitLeaf(const SIZE_T &node, const KEY_T &key, const VALUE_T &value);
-  // The helper function for insert. Can be called recursively.
-  ERROR_T InsertHelper(const SIZE_T &node, const KEY_T &key, const VALUE_T &value);
+  // The functions to split a full node while inserting into it.
+  // The node keeps the lower half, splitnode receives the upper half
+  // and splitkey is the separator to push into the parent
+  ERROR_T SplitInternal(SIZE_T &node, BTreeNode &b, const SIZE_T offset,
+			const KEY_T &key, const SIZE_T &ptr, const SIZE_T count,
+			KEY_T &splitkey, SIZE_T &splitnode);
+  ERROR_T SplitLeaf(SIZE_T &node, BTreeNode &b, const SIZE_T offset,
+		    const KEY_T &key, const VALUE_T &value,
+		    KEY_T &splitkey, SIZE_T &splitnode);
+  // Write kvs back as leaf node, splitting it if they do not fit
+  ERROR_T WriteLeafEntries(SIZE_T &node, BTreeNode &b, 
+			   const vector<KeyValuePair> &kvs,
+			   bool &split, KEY_T &splitkey, SIZE_T &splitnode);
+  // The helper function for insert (and, for multi-version
+  // trees, update and delete). Can be called recursively.
+  ERROR_T InsertHelper(SIZE_T &node, const BTreeOp op, 
+		       const KEY_T &key, const VALUE_T &value,
+		       bool &split, KEY_T &splitkey, SIZE_T &splitnode);
+  // The helper function for delete. Can be called recursively.
+  ERROR_T DeleteHelper(SIZE_T &node, const KEY_T &key);
 public:
   //
   // keysize and valueszie should be stored in the 
@@ -101,7 +319,7 @@ public:
   // you need to find the elements of the tree.
   // return zero on success or ERROR_NOTANINDEX if we are
   // giving you an incorrect block to start with
-  ERROR_T Attach(const SIZE_T initblock, const bool create=false );
+  virtual ERROR_T Attach(const SIZE_T initblock, const bool create=false );
   
   // This is called after all inserts, updates, or deletes are done.
   // We expect you to tell us the number of your superblock, which
@@ -112,26 +330,147 @@ public:
   // return ERROR_NOSPACE if you run out of disk space
   // return ERROR_SIZE if the key or value are the wrong size for this index
   // return ERROR_CONFLICT if the key already exists and it's a unique index
-  ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
+  virtual ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
   
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   // return ERROR_SIZE if the key or value are the wrong size for this index
-  ERROR_T Update(const KEY_T &key, const VALUE_T &value);
+  virtual ERROR_T Update(const KEY_T &key, const VALUE_T &value);
   
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   // return ERROR_SIZE if the key or value are the wrong size for this index
-  ERROR_T Delete(const KEY_T &key);
+  virtual ERROR_T Delete(const KEY_T &key);
   
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
-  ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
+  virtual ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
+
+  // Blind writes: key gets value, or goes away, whether or not it
+  // was there, and nothing says which.  Here they are an Insert
+  // that falls back to an Update and a Delete of a key that may be
+  // missing; an index that can defer them without looking (see
+  // BeTreeIndex) does.
+  // return zero on success
+  // return ERROR_SIZE if the key or value are the wrong size for this index
+  virtual ERROR_T Upsert(const KEY_T &key, const VALUE_T &value);
+  virtual ERROR_T Erase(const KEY_T &key);
+
+  // Copy-on-write mode.  Modified nodes are written to fresh blocks,
+  // their parents are rewritten up to a new root, and the superblock
+  // then flips to that root.  Replaced blocks are freed once no
+  // snapshot that can reach them is open.
+  void    SetCopyOnWrite(const bool cow);
+  bool    GetCopyOnWrite() const;
+
+  // Multi-version mode.  Leaves keep older versions of a value (and
+  // deleted keys) for as long as an open snapshot can see them, so
+  // snapshot reads never block or see later writes.  Old versions are
+  // dropped whenever their leaf is rewritten.  Must be chosen before
+  // Attach(initblock,true); an existing tree records it on disk.
+  void    SetMultiVersion(const bool mvcc);
+  bool    GetMultiVersion() const;
+
+  // Prefix-compressed leaves.  Each leaf stores the prefix its keys
+  // share once and only their suffixes, so it holds more of them.
+  // Leaf searches compare suffixes.  Must be chosen before
+  // Attach(initblock,true); an existing tree records it on disk.
+  // Not available for multi-version trees.
+  void    SetPrefixCompression(const bool prefix);
+  bool    GetPrefixCompression() const;
+
+  // Suffix truncation.  A leaf split promotes the shortest separator
+  // that divides the two leaves, and interior nodes keep separators
+  // in a slotted layout that stores only those bytes, so fanout
+  // grows.  Chosen like prefix compression.
+  void    SetSuffixTruncation(const bool truncate);
+  bool    GetSuffixTruncation() const;
+
+  // Variable-length keys and values.  keysize and valuesize become
+  // the largest allowed, and nodes keep each key and value in a heap
+  // with a slot directory, so short ones take only their own bytes.
+  // Keys order bytewise, a prefix first.  Chosen like prefix
+  // compression; not available with it or for multi-version trees.
+  void    SetVariableLength(const bool variable);
+  bool    GetVariableLength() const;
+
+  // Overflow values.  If valuesize is over threshold bytes, each
+  // value is written to a chain of overflow blocks of its own and
+  // leaves hold just its first block and length, so they keep their
+  // fanout.  Chains are allocated as consecutive blocks when the
+  // free list allows, and read in one disk request then.  Chosen
+  // like prefix compression; not available in copy-on-write or
+  // multi-version trees, or with variable lengths.
+  void    SetOverflowThreshold(const SIZE_T threshold);
+  SIZE_T  GetOverflowThreshold() const;
+
+  // Order statistics.  Interior nodes keep the number of keys under
+  // each of their pointers, kept up by inserts, deletes and splits,
+  // so Rank, Select and Count read one node per level.  Chosen like
+  // prefix compression; not available for multi-version trees.
+  void    SetOrderStatistics(const bool counts);
+  bool    GetOrderStatistics() const;
+
+  // Node search.  Lookups, inserts, deletes and ranks find a key in
+  // each node they read by a linear scan (the default), by binary 
+  // search, or by interpolation, which suits evenly spread keys such
+  // as numeric strings; see BTreeSearchType.  Not part of the format,
+  // so it may change at any time.  Buffered trees always scan.
+  void    SetSearchType(const BTreeSearchType how);
+  BTreeSearchType GetSearchType() const;
+  // Key compares made by those searches so far
+  SIZE_T  GetNumKeyProbes() const;
+
+  // Where each operation's node buffers come from, for its statistics
+  const Arena & GetArena() const;
+
+  // return ERROR_UNIMPL if the tree does not keep counts
+  // The number of keys less than key
+  ERROR_T Rank(const KEY_T &key, SIZE_T &rank);
+  // The key with k keys less than it
+  // return ERROR_NONEXISTENT if there are not more than k keys
+  ERROR_T Select(const SIZE_T k, KEY_T &key);
+  // The number of keys in [lo,hi)
+  ERROR_T Count(const KEY_T &lo, const KEY_T &hi, SIZE_T &count);
+
+  // Memtable.  With a limit set, Insert, Update and Delete (as a
+  // tombstone) go into a sorted table in memory, and once it holds
+  // limit bytes of keys and values it is merged into the tree in one
+  // sorted pass that rewrites each affected leaf once.  Lookups check
+  // it first.  Snapshots and Detach flush it.  0 (the default) turns
+  // it off; multi-version trees always write straight through.
+  void    SetMemTableLimit(const SIZE_T bytes);
+  SIZE_T  GetMemTableLimit() const;
+  ERROR_T FlushMemTable();
+
+  // Bloom filters.  With bitsperkey set, each leaf gets a filter of
+  // its keys, held in memory and checked before the leaf is read, so
+  // most lookups, updates and deletes of missing keys stop at the 
+  // leaf's parent.  global adds one filter for the whole tree, checked
+  // before the descent.  Filters are saved by Detach and read back by
+  // the next Attach that asks for them; a leaf without one is just 
+  // read.  0 (the default) turns them off.
+  void    SetBloomFilter(const SIZE_T bitsperkey, const bool global=false);
+  SIZE_T  GetBloomFilter() const;
+  // Lookups each filter answered, and those it let through for
+  // keys that turned out to be missing
+  void    GetBloomFilterStats(SIZE_T &leafskips, SIZE_T &leaffalsepos,
+			      SIZE_T &globalskips, SIZE_T &globalfalsepos) const;
+
+  // return zero on success
+  // return ERROR_UNIMPL if the index is in neither copy-on-write
+  // nor multi-version mode
+  ERROR_T OpenSnapshot(BTreeSnapshot &snap);
+  // return ERROR_NONEXISTENT if the snapshot is not open
+  ERROR_T CloseSnapshot(const BTreeSnapshot &snap);
+
+  // Lookup against an open snapshot
+  ERROR_T Lookup(const BTreeSnapshot &snap, const KEY_T &key, VALUE_T &value);
 
   // Here you should figure out if your index makes sense
   // Is it a tree?  Is it in order?  Is it balanced?  Does each node have
   // a valid use ratio?
-  ERROR_T SanityCheck() const;
+  virtual ERROR_T SanityCheck() const;
 
   // Display tree
   // BTREE_DEPTH means to do a depth first traversal of 
@@ -143,7 +482,8 @@ public:
   // key/value pairs in the leaves, one "(key, value)" tuple
   // per line.  This will be the keys and values in the tree
   // sorted in order of keys.
-  ERROR_T Display(ostream &o, BTreeDisplayType display_type=BTREE_DEPTH) const;
+  virtual ERROR_T Display(ostream &o, BTreeDisplayType display_type=BTREE_DEPTH) const;
+  ERROR_T Display(const BTreeSnapshot &snap, ostream &o, BTreeDisplayType display_type=BTREE_DEPTH) const;
   
   ostream & Print(ostream &os) const;
   
@@ -0,0 +1,261 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <new>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "btree.h"
+#include "btree_int.h"
+
+//
+// Checks that, once the tree is in the cache and the index's arena has
+// grown to what an operation needs, Lookup, Update and Insert make no
+// heap allocations, for numeric string keys and for a
+// BTreeIntegerIndex<uint64_t>.  Every operator new and delete in the
+// program is counted; an operation that allocates makes the test fail.
+// Keys and values over BLOCK_INLINE_BYTES (LARGE_KEYSIZE and
+// LARGE_VALUESIZE) live on the heap, so for those the test only fails
+// if the operations leave more allocated than they found.  The cache
+// must hold the whole tree, since a miss may allocate.  The disk (made
+// by makedisk) is reformatted for each kind of key.
+//
+
+#define LARGE_KEYSIZE   40
+#define LARGE_VALUESIZE 100
+
+static SIZE_T allocs=0;
+static long   live=0;        // allocated and not yet freed
+static bool   counting=false;
+
+void *operator new(size_t bytes)
+{
+  void *p;
+
+  if (counting) {
+    allocs++;
+  }
+  if (!(p=malloc(bytes ? bytes : 1))) {
+    throw bad_alloc();
+  }
+  live++;
+  return p;
+}
+
+void operator delete(void *p) noexcept
+{
+  if (p) {
+    live--;
+  }
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  if (p) {
+    live--;
+  }
+  free(p);
+}
+
+
+void usage()
+{
+  cerr << "usage: btree_alloctest filestem cachesize keysize numkeys numops [seed]\n";
+}
+
+
+// Heap allocations made by numops calls of op, on numops to 2*numops-1,
+// after a round on 0 to numops-1 to warm the cache and the arena, and
+// how many of them are still held after
+template <class OP>
+static SIZE_T Count(const char *keys, const char *what, const SIZE_T numops, OP op,
+		    long &leaked)
+{
+  SIZE_T i, n;
+  long before;
+
+  for (i=0;i<numops;i++) {
+    if (op(i)!=ERROR_NOERROR) {
+      cerr << what << " failed on warmup\n";
+      exit(-1);
+    }
+  }
+  allocs=0;
+  before=live;
+  counting=true;
+  for (i=numops;i<2*numops;i++) {
+    if (op(i)!=ERROR_NOERROR) {
+      counting=false;
+      cerr << what << " failed\n";
+      exit(-1);
+    }
+  }
+  counting=false;
+  n=allocs;
+  leaked=live-before;
+  printf("%-10s %-8s %12lu %12.3f %12ld\n",keys,what,(unsigned long)n,(double)n/numops,leaked);
+  return n;
+}
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T keysize, numkeys, numops;
+  SIZE_T superblocknum;
+  SIZE_T i, bad;
+  long leaked, leaks;
+  vector<KEY_T> keys, fresh, lkeys, lfresh;
+  VALUE_T lvalue(LARGE_VALUESIZE);
+  vector<uint64_t> ikeys, ifresh, order;
+  char buf[64];
+  ERROR_T rc;
+
+  if (argc<6) {
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  keysize=atoi(argv[3]);
+  numkeys=atoi(argv[4]);
+  numops=atoi(argv[5]);
+  srand48(argc>6 ? atoi(argv[6]) : 1);
+
+  if (keysize<8 || keysize>BLOCK_INLINE_BYTES || numkeys>=10000000 || numops>numkeys) {
+    cerr << "keysize must be from 8 to " << BLOCK_INLINE_BYTES << ", numkeys under 10000000 and numops at most numkeys\n";
+    return -1;
+  }
+
+  // Keys are built before counting starts: even numbers, in random
+  // order, go in first, and odd ones are inserted while counting
+  for (i=0;i<numkeys;i++) {
+    order.push_back(i);
+  }
+  for (i=numkeys;i>1;i--) {
+    swap(order[i-1],order[lrand48()%i]);
+  }
+  for (i=0;i<numkeys;i++) {
+    snprintf(buf,sizeof(buf),"%0*llu",(int)keysize,(unsigned long long)2*order[i]);
+    keys.push_back(KEY_T(buf));
+    ikeys.push_back(2*order[i]);
+    snprintf(buf,sizeof(buf),"%0*llu",(int)keysize,(unsigned long long)2*order[i]+1);
+    fresh.push_back(KEY_T(buf));
+    ifresh.push_back(2*order[i]+1);
+    snprintf(buf,sizeof(buf),"%0*llu",LARGE_KEYSIZE,(unsigned long long)2*order[i]);
+    lkeys.push_back(KEY_T(buf));
+    snprintf(buf,sizeof(buf),"%0*llu",LARGE_KEYSIZE,(unsigned long long)2*order[i]+1);
+    lfresh.push_back(KEY_T(buf));
+  }
+  memset(lvalue.data,'v',lvalue.length);
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,0);
+  if (cache.SetSize(argv[2])!=ERROR_NOERROR) {
+    usage();
+    return -1;
+  }
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  printf("%-10s %-8s %12s %12s %12s\n","keys","op","allocs","allocs/op","leaked");
+  bad=0;
+  leaks=0;
+
+  {
+    BTreeIndex btree(keysize,keysize,&cache);
+    VALUE_T val(keysize);
+
+    if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+      cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+      return -1;
+    }
+    for (i=0;i<numkeys;i++) {
+      if ((rc=btree.Insert(keys[i],keys[i]))!=ERROR_NOERROR) {
+	cerr << "Can't insert due to error "<<rc<<endl;
+	return -1;
+      }
+    }
+    bad+=Count("string","lookup",numops,[&](SIZE_T j) { return btree.Lookup(keys[j%numops],val); },leaked);
+    leaks+=leaked;
+    bad+=Count("string","update",numops,[&](SIZE_T j) { return btree.Update(keys[j%numops],keys[j%numops]); },leaked);
+    leaks+=leaked;
+    bad+=Count("string","insert",numops/2,[&](SIZE_T j) { return btree.Insert(fresh[j],keys[j]); },leaked);
+    leaks+=leaked;
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+  }
+
+  {
+    BTreeIntegerIndex<uint64_t> btree(keysize,&cache);
+    VALUE_T val(keysize);
+
+    if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+      cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+      return -1;
+    }
+    for (i=0;i<numkeys;i++) {
+      if ((rc=btree.Insert(ikeys[i],keys[i]))!=ERROR_NOERROR) {
+	cerr << "Can't insert due to error "<<rc<<endl;
+	return -1;
+      }
+    }
+    bad+=Count("uint64_t","lookup",numops,[&](SIZE_T j) { return btree.Lookup(ikeys[j%numops],val); },leaked);
+    leaks+=leaked;
+    bad+=Count("uint64_t","update",numops,[&](SIZE_T j) { return btree.Update(ikeys[j%numops],keys[j%numops]); },leaked);
+    leaks+=leaked;
+    bad+=Count("uint64_t","insert",numops/2,[&](SIZE_T j) { return btree.Insert(ifresh[j],keys[j]); },leaked);
+    leaks+=leaked;
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+  }
+
+  {
+    BTreeIndex btree(LARGE_KEYSIZE,LARGE_VALUESIZE,&cache);
+    VALUE_T val(LARGE_VALUESIZE);
+
+    if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+      cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+      return -1;
+    }
+    for (i=0;i<numkeys;i++) {
+      if ((rc=btree.Insert(lkeys[i],lvalue))!=ERROR_NOERROR) {
+	cerr << "Can't insert due to error "<<rc<<endl;
+	return -1;
+      }
+    }
+    // these allocate, being on the heap, but must free what they do
+    Count("large","lookup",numops,[&](SIZE_T j) { return btree.Lookup(lkeys[j%numops],val); },leaked);
+    leaks+=leaked;
+    Count("large","update",numops,[&](SIZE_T j) { return btree.Update(lkeys[j%numops],lvalue); },leaked);
+    leaks+=leaked;
+    Count("large","insert",numops/2,[&](SIZE_T j) { return btree.Insert(lfresh[j],lvalue); },leaked);
+    leaks+=leaked;
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+  }
+
+  if ((rc=cache.Detach())!=ERROR_NOERROR) {
+    cerr <<"Can't detach from cache due to error "<<rc<<endl;
+    return -1;
+  }
+  if (bad) {
+    cerr << bad << " heap allocations in operations that should make none\n";
+  }
+  if (leaks) {
+    cerr << leaks << " heap allocations that operations did not free\n";
+  }
+  if (bad || leaks) {
+    return -1;
+  }
+  return 0;
+}
@@ -10,7 +10,6 @@ void usage()
 int main(int argc, char **argv)
 {
   char *filestem;
-  SIZE_T cachesize;
   SIZE_T superblocknum;
   char *key;
 
@@ -20,11 +19,15 @@ int main(int argc, char **argv)
   }
 
   filestem=argv[1];
-  cachesize=atoi(argv[2]);
   key=argv[3];
 
   DiskSystem disk(filestem);
-  BufferCache cache(&disk,cachesize);
+  BufferCache cache(&disk,0);
+  if (cache.SetSize(argv[2])!=ERROR_NOERROR) { 
+    usage();
+    return -1;
+  }
+  cache.SetMissRatioCurve(MRC_DEFAULT_SAMPLES);
   BTreeIndex btree(0,0,&cache);
   
   ERROR_T rc;
@@ -64,6 +67,10 @@ int main(int argc, char **argv)
     cerr << endl;
     
     cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+    cerr << "residentbytes   = "<<cache.GetPeakResidentBytes()<<endl;
+    // what other cache sizes would have missed
+    cerr << endl;
+    cache.GetMissRatioCurve().PrintCurve(cerr);
 
     return 0;
   }
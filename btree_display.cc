@@ -11,7 +11,6 @@ int main(int argc, char **argv)
 {
   char *filestem;
   bool dot;
-  SIZE_T cachesize;
   SIZE_T superblocknum;
 
   if (argc!=4) { 
@@ -20,11 +19,15 @@ int main(int argc, char **argv)
   }
 
   filestem=argv[1];
-  cachesize=atoi(argv[2]);
   dot=argv[3][0]=='d' || argv[3][0]=='D';
 
   DiskSystem disk(filestem);
-  BufferCache cache(&disk,cachesize);
+  BufferCache cache(&disk,0);
+  if (cache.SetSize(argv[2])!=ERROR_NOERROR) { 
+    usage();
+    return -1;
+  }
+  cache.SetMissRatioCurve(MRC_DEFAULT_SAMPLES);
   BTreeIndex btree(0,0,&cache);
   
   ERROR_T rc;
@@ -65,6 +68,10 @@ int main(int argc, char **argv)
     cerr << endl;
     
     cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+    cerr << "residentbytes   = "<<cache.GetPeakResidentBytes()<<endl;
+    // what other cache sizes would have missed
+    cerr << endl;
+    cache.GetMissRatioCurve().PrintCurve(cerr);
 
     return 0;
   }
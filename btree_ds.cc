@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include "btree_ds.h"
+#include "arena.h"
 #include "buffercache.h"
 
 #include "btree.h"
@@ -12,7 +13,7 @@ using namespace std;
 
 SIZE_T NodeMetadata::GetNumDataBytes() const
 {
-  SIZE_T n=blocksize-sizeof(*this);
+  SIZE_T n=blocksize-headerbytes;
   return n;
 }
 
@@ -27,6 +28,15 @@ SIZE_T NodeMetadata::GetNumSlotsAsLeaf() const
   return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+valuesize);  // floor intended
 }
 
+SIZE_T NodeMetadata::GetNumSlotsAsLeaf(const SIZE_T prefixlen) const
+{
+  assert(prefixlen<=keysize);
+  if (keysize-prefixlen+valuesize==0) { 
+    return 0;
+  }
+  return (GetNumDataBytes()-sizeof(SIZE_T)-prefixlen)/(keysize-prefixlen+valuesize);  // floor intended
+}
+
 
 ostream & NodeMetadata::Print(ostream &os) const 
 {
@@ -34,29 +44,58 @@ ostream & NodeMetadata::Print(ostream &os) const
 				   nodetype==BTREE_SUPERBLOCK ? "SUPERBLOCK" :
 				   nodetype==BTREE_ROOT_NODE ? "ROOT_NODE" :
 				   nodetype==BTREE_INTERIOR_NODE ? "INTERIOR_NODE" :
-				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" : "UNKNOWN_TYPE")
+				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" :
+				   nodetype==BTREE_FILTER_NODE ? "FILTER_NODE" :
+				   nodetype==BTREE_OVERFLOW_NODE ? "OVERFLOW_NODE" : "UNKNOWN_TYPE")
      << ", keysize="<<keysize<<", valuesize="<<valuesize<<", blocksize="<<blocksize
-     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys<<")";
+     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys
+     << ", headerbytes="<<headerbytes<<")";
   return os;
 }
 
 BTreeNode::BTreeNode() 
 {
   info.nodetype=BTREE_UNALLOCATED_BLOCK;
+  info.headerbytes=BTREE_FULL_HEADER_BYTES;
   data=0;
+  inarena=false;
 }
 
 BTreeNode::~BTreeNode()
 {
-  if (data) { 
+  FreeData();
+  info.nodetype=BTREE_UNALLOCATED_BLOCK;
+}
+
+
+void BTreeNode::AllocateData()
+{
+  Arena *arena=Arena::Current();
+
+  data=0;
+  inarena=false;
+  if (arena) { 
+    data=(char *)arena->Allocate(info.blocksize);
+    inarena= data!=0;
+  }
+  if (!data) { 
+    data=new char [info.blocksize];
+  }
+}
+
+
+void BTreeNode::FreeData()
+{
+  if (data && !inarena) { 
     delete [] data;
   }
   data=0;
-  info.nodetype=BTREE_UNALLOCATED_BLOCK;
+  inarena=false;
 }
 
 
-BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size)
+BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size,
+		     SIZE_T header_bytes)
 {
   info.nodetype=node_type;
   info.keysize=key_size;
@@ -65,10 +104,16 @@ BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T b
   info.rootnode=0;
   info.freelist=0;
   info.numkeys=0;				       
+  info.headerbytes=header_bytes;
+  if (node_type==BTREE_SUPERBLOCK || node_type==BTREE_UNALLOCATED_BLOCK) { 
+    info.headerbytes=BTREE_FULL_HEADER_BYTES;
+  }
   data=0;
-  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
-    data = new char [info.GetNumDataBytes()];
-    memset(data,0,info.GetNumDataBytes());
+  inarena=false;
+  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK) {
+    // room for the data under either header
+    AllocateData();
+    memset(data,0,info.blocksize);
   }
 }
 
@@ -81,17 +126,49 @@ BTreeNode::BTreeNode(const BTreeNode &rhs)
   info.rootnode=rhs.info.rootnode;
   info.freelist=rhs.info.freelist;
   info.numkeys=rhs.info.numkeys;				       
+  info.headerbytes=rhs.info.headerbytes;
   data=0;
+  inarena=false;
   if (rhs.data) { 
-   data=new char [info.GetNumDataBytes()];
-    memcpy(data,rhs.data,info.GetNumDataBytes());
+    AllocateData();
+    memcpy(data,rhs.data,info.blocksize);
   }
 }
 
 
 BTreeNode & BTreeNode::operator=(const BTreeNode &rhs) 
 {
-  return *(new (this) BTreeNode(rhs));
+  if (this==&rhs) { 
+    return *this;
+  }
+  // keep the buffer if it is the right size
+  if (!rhs.data || info.blocksize!=rhs.info.blocksize) { 
+    FreeData();
+  }
+  info=rhs.info;
+  if (rhs.data) { 
+    if (!data) { 
+      AllocateData();
+    }
+    memcpy(data,rhs.data,info.blocksize);
+  }
+  return *this;
+}
+
+
+// How the cache is to weigh a node of this type against others
+static CacheHint NodeHint(const int nodetype)
+{
+  switch (nodetype) { 
+  case BTREE_SUPERBLOCK:
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    return CACHE_HINT_INTERIOR;
+  case BTREE_UNALLOCATED_BLOCK:
+    return CACHE_HINT_FREED;
+  default:
+    return CACHE_HINT_LEAF;
+  }
 }
 
 
@@ -99,20 +176,29 @@ ERROR_T BTreeNode::Serialize(BufferCache *b, const SIZE_T blocknum) const
 {
   assert((unsigned)info.blocksize==b->GetBlockSize());
 
-  Block block(sizeof(info)+info.GetNumDataBytes());
+  Block block(info.blocksize,Arena::Current());
+  SIZE_T header=BTREE_FULL_HEADER_BYTES;
 
-  memcpy(block.data,&info,sizeof(info));
-  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) { 
-    memcpy(block.data+sizeof(info),data,info.GetNumDataBytes());
+  if (info.headerbytes==BTREE_COMPACT_HEADER_BYTES &&
+      info.nodetype!=BTREE_SUPERBLOCK && info.nodetype!=BTREE_UNALLOCATED_BLOCK) { 
+    SIZE_T word=BTREE_NODE_COMPACT | info.nodetype<<BTREE_COMPACT_TYPE_SHIFT | info.numkeys;
+    assert(info.numkeys<=BTREE_COMPACT_NUMKEYS);
+    header=BTREE_COMPACT_HEADER_BYTES;
+    memcpy(block.data,&word,sizeof(word));
+  } else {
+    memcpy(block.data,&info,BTREE_FULL_HEADER_BYTES);
+  }
+  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK) { 
+    memcpy(block.data+header,data,info.blocksize-header);
   }
 
-  return b->WriteBlock(blocknum,block);
+  return b->WriteBlock(blocknum,block,NodeHint(info.nodetype));
 }
 
 
 ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
 {
-  Block block;
+  Block block(b->GetBlockSize(),Arena::Current());
 
   ERROR_T rc;
 
@@ -122,34 +208,139 @@ ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
     return rc;
   }
 
-  memcpy(&info,block.data,sizeof(info));
+  rc=Unpack(block,0);
+  if (rc==ERROR_NOERROR) { 
+    // the type is known only now
+    b->HintBlock(blocknum,NodeHint(info.nodetype));
+  }
+  return rc;
+}
+
+
+ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum, const NodeMetadata &layout)
+{
+  Block block(b->GetBlockSize(),Arena::Current());
+
+  ERROR_T rc;
+
+  rc=b->ReadBlock(blocknum,block);
+
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+
+  rc=Unpack(block,&layout);
+  if (rc==ERROR_NOERROR) { 
+    b->HintBlock(blocknum,NodeHint(info.nodetype));
+  }
+  return rc;
+}
+
+
+ERROR_T BTreeNode::Unpack(const Block &block, const NodeMetadata *layout)
+{
+  SIZE_T oldsize=info.blocksize;
+  SIZE_T word;
+
+  memcpy(&word,block.data,sizeof(word));
+  if (word & BTREE_NODE_COMPACT) { 
+    if (!layout) { 
+      return ERROR_INSANE;
+    }
+    info=*layout;
+    info.nodetype=(word & ~BTREE_NODE_COMPACT)>>BTREE_COMPACT_TYPE_SHIFT;
+    info.numkeys=word & BTREE_COMPACT_NUMKEYS;
+    info.rootnode=0;
+    info.freelist=0;
+    info.headerbytes=BTREE_COMPACT_HEADER_BYTES;
+  } else {
+    memcpy(&info,block.data,BTREE_FULL_HEADER_BYTES);
+    info.headerbytes=BTREE_FULL_HEADER_BYTES;
+  }
   
-  if (data) { 
-    delete [] data;
-    data=0;
+  if (info.nodetype==BTREE_UNALLOCATED_BLOCK || oldsize!=info.blocksize) { 
+    FreeData();
   }
 
-  assert(b->GetBlockSize()==(unsigned)info.blocksize);
+  assert(block.length==info.blocksize);
 
-  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
-    data = new char [info.GetNumDataBytes()];
-    memcpy(data,block.data+sizeof(info),info.GetNumDataBytes());
+  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK) {
+    if (!data) { 
+      AllocateData();
+    }
+    memcpy(data,block.data+info.headerbytes,info.GetNumDataBytes());
+    memset(data+info.GetNumDataBytes(),0,info.headerbytes);
   }
   
   return ERROR_NOERROR;
 }
 
 
+char * BTreeNode::ResolveSuperField(const SIZE_T field) const
+{
+  switch (info.nodetype) { 
+  case BTREE_SUPERBLOCK:
+    assert(field<BTREE_SUPER_NUMFIELDS);
+    return data+field*sizeof(SIZE_T);
+    break;
+  default:
+    return 0;
+  }
+}
+
+
+// A slotted interior node's PTRs (with their COUNTs, if counted) and
+// KEYREFs alternate after FORMAT, in entries of entry bytes
+#define SLOTTED_PTR(offset,entry)    (sizeof(SIZE_T)+(offset)*(entry))
+#define SLOTTED_COUNT(offset,entry)  (2*sizeof(SIZE_T)+(offset)*(entry))
+#define SLOTTED_KEYREF(offset,entry) ((entry)+(offset)*(entry))
+#define SLOTTED_ENTRY(counted) ((counted) ? 3*sizeof(SIZE_T) : 2*sizeof(SIZE_T))
+// As do a variable-length leaf's KEYREFs and VALREFs
+#define VARLEAF_KEYREF(offset) (sizeof(SIZE_T)+(offset)*2*sizeof(SIZE_T))
+#define VARLEAF_VALREF(offset) (2*sizeof(SIZE_T)+(offset)*2*sizeof(SIZE_T))
+// The heap offset in FORMAT, and the offset and length in a REF
+#define HEAP_MASK 0xffff
+
+
+static SIZE_T GetWord(const char *p)
+{
+  SIZE_T w;
+
+  memcpy(&w,p,sizeof(SIZE_T));
+  return w;
+}
+
+static void SetWord(char *p, const SIZE_T w)
+{
+  memcpy(p,&w,sizeof(SIZE_T));
+}
+
+
 char * BTreeNode::ResolveKey(const SIZE_T offset) const
 {
+  SIZE_T ref;
+
   switch (info.nodetype) { 
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
     assert(offset<info.numkeys);
+    if (IsSlotted()) { 
+      ref=GetWord(data+SLOTTED_KEYREF(offset,GetSlottedEntry()));
+      return data+(ref>>16);
+    }
     return data+sizeof(SIZE_T)+offset*(sizeof(SIZE_T)+info.keysize);
     break;
   case BTREE_LEAF_NODE:
     assert(offset<info.numkeys);
+    if (IsVariableLength()) { 
+      ref=GetWord(data+VARLEAF_KEYREF(offset));
+      return data+(ref>>16);
+    }
+    if (IsPrefixed()) { 
+      // the suffix
+      SIZE_T plen=GetLeafPrefixLength();
+      return data+sizeof(SIZE_T)+plen+offset*(info.keysize-plen+info.valuesize);
+    }
     return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize);
     break;
   default:
@@ -164,6 +355,9 @@ char * BTreeNode::ResolvePtr(const SIZE_T offset) const
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
     assert(offset<=info.numkeys);
+    if (IsSlotted()) { 
+      return data+SLOTTED_PTR(offset,GetSlottedEntry());
+    }
     return data+offset*(sizeof(SIZE_T)+info.keysize);
     break;
   case BTREE_LEAF_NODE:
@@ -182,6 +376,13 @@ char * BTreeNode::ResolveVal(const SIZE_T offset) const
   switch (info.nodetype) { 
   case BTREE_LEAF_NODE:
     assert(offset<info.numkeys);
+    if (IsVariableLength()) { 
+      return data+(GetWord(data+VARLEAF_VALREF(offset))>>16);
+    }
+    if (IsPrefixed()) { 
+      SIZE_T plen=GetLeafPrefixLength();
+      return data+sizeof(SIZE_T)+plen+offset*(info.keysize-plen+info.valuesize)+info.keysize-plen;
+    }
     return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize)+info.keysize;
     break;
   default:
@@ -196,6 +397,27 @@ char * BTreeNode::ResolveKeyVal(const SIZE_T offset) const
   return ResolveKey(offset);
 }
 
+ERROR_T BTreeNode::GetSuperField(const SIZE_T field, SIZE_T &v) const
+{
+  char *p=ResolveSuperField(field);
+  SIZE_T magic;
+
+  if (p==0) { 
+    return ERROR_NOMEM;
+  }
+
+  // Superblocks written before the fields existed hold junk here
+  memcpy(&magic,ResolveSuperField(BTREE_SUPER_MAGIC),sizeof(SIZE_T));
+  if (magic!=BTREE_SUPER_MAGIC_VALUE) { 
+    v=0;
+    return ERROR_NOERROR;
+  }
+
+  memcpy(&v,p,sizeof(SIZE_T));
+  return ERROR_NOERROR;
+}
+
+
 ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
 {
   char *p=ResolveKey(offset);
@@ -204,7 +426,24 @@ ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
     return ERROR_NOMEM;
   }
   
+  if (IsVariableLength()) { 
+    k.Resize(GetKeyLength(offset),false);
+    memcpy(k.data,p,k.length);
+    return ERROR_NOERROR;
+  }
   k.Resize(info.keysize,false);
+  if (info.nodetype==BTREE_LEAF_NODE && IsPrefixed()) { 
+    SIZE_T plen=GetLeafPrefixLength();
+    memcpy(k.data,data+sizeof(SIZE_T),plen);
+    memcpy(k.data+plen,p,info.keysize-plen);
+    return ERROR_NOERROR;
+  }
+  if (IsSlotted()) { 
+    SIZE_T len=GetKeyLength(offset);
+    memcpy(k.data,p,len);
+    memset(k.data+len,0xff,info.keysize-len);
+    return ERROR_NOERROR;
+  }
   memcpy(k.data,p,info.keysize);
   return ERROR_NOERROR;
 }
@@ -229,6 +468,11 @@ ERROR_T BTreeNode::GetVal(const SIZE_T offset, VALUE_T &v) const
     return ERROR_NOMEM;
   }
   
+  if (IsVariableLength()) { 
+    v.Resize(GetWord(data+VARLEAF_VALREF(offset)) & HEAP_MASK,false);
+    memcpy(v.data,p,v.length);
+    return ERROR_NOERROR;
+  }
   v.Resize(info.valuesize,false);
   memcpy(v.data,p,info.valuesize);
   return ERROR_NOERROR;
@@ -247,6 +491,21 @@ ERROR_T BTreeNode::GetKeyVal(const SIZE_T offset, KeyValuePair &p) const
 }
 
 
+ERROR_T BTreeNode::SetSuperField(const SIZE_T field, const SIZE_T &v)
+{
+  char *p=ResolveSuperField(field);
+  SIZE_T magic=BTREE_SUPER_MAGIC_VALUE;
+
+  if (p==0) { 
+    return ERROR_NOMEM;
+  }
+
+  memcpy(ResolveSuperField(BTREE_SUPER_MAGIC),&magic,sizeof(SIZE_T));
+  memcpy(p,&v,sizeof(SIZE_T));
+  return ERROR_NOERROR;
+}
+
+
 ERROR_T BTreeNode::SetKey(const SIZE_T offset, const KEY_T &k)
 {
   char *p=ResolveKey(offset);
@@ -255,6 +514,25 @@ ERROR_T BTreeNode::SetKey(const SIZE_T offset, const KEY_T &k)
     return ERROR_NOMEM;
   }
 
+  if (info.nodetype==BTREE_LEAF_NODE && IsPrefixed()) { 
+    SIZE_T plen=GetLeafPrefixLength();
+    if (memcmp(k.data,data+sizeof(SIZE_T),plen)) { 
+      return ERROR_SIZE;
+    }
+    memcpy(p,k.data+plen,info.keysize-plen);
+    return ERROR_NOERROR;
+  }
+
+  if (IsVariableLength() && k.length>info.keysize) { 
+    return ERROR_SIZE;
+  }
+  if (IsSlotted()) { 
+    return PutHeapBytes(SLOTTED_KEYREF(offset,GetSlottedEntry()),k.data,StoredKeyLength(k));
+  }
+  if (IsVariableLength()) { 
+    return PutHeapBytes(VARLEAF_KEYREF(offset),k.data,k.length);
+  }
+
   memcpy(p,k.data,info.keysize);
 
   return ERROR_NOERROR;
@@ -283,6 +561,13 @@ ERROR_T BTreeNode::SetVal(const SIZE_T offset, const VALUE_T &v)
   if (p==0) { 
     return ERROR_NOMEM;
   }
+
+  if (IsVariableLength()) { 
+    if (v.length>info.valuesize) { 
+      return ERROR_SIZE;
+    }
+    return PutHeapBytes(VARLEAF_VALREF(offset),v.data,v.length);
+  }
   
   memcpy(p,v.data,info.valuesize);
   
@@ -304,6 +589,671 @@ ERROR_T BTreeNode::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
 
 
 
+bool BTreeNode::IsPrefixed() const
+{
+  SIZE_T format;
+
+  if (info.nodetype!=BTREE_LEAF_NODE) { 
+    return false;
+  }
+  memcpy(&format,data,sizeof(SIZE_T));
+  return (format & BTREE_LEAF_PREFIXED)!=0;
+}
+
+
+SIZE_T BTreeNode::GetLeafPrefixLength() const
+{
+  SIZE_T format;
+
+  if (!IsPrefixed()) { 
+    return 0;
+  }
+  memcpy(&format,data,sizeof(SIZE_T));
+  return format & ~BTREE_LEAF_PREFIXED;
+}
+
+
+ERROR_T BTreeNode::SetLeafPrefix(const KEY_T &k, const SIZE_T len)
+{
+  SIZE_T format=BTREE_LEAF_PREFIXED | len;
+
+  if (info.nodetype!=BTREE_LEAF_NODE || info.numkeys!=0 || len>info.keysize) { 
+    return ERROR_INSANE;
+  }
+  memcpy(data,&format,sizeof(SIZE_T));
+  memcpy(data+sizeof(SIZE_T),k.data,len);
+  return ERROR_NOERROR;
+}
+
+
+SIZE_T BTreeNode::GetNumSlotsAsLeaf() const
+{
+  if (IsVariableLength()) { 
+    // every key has at least a byte
+    return (info.GetNumDataBytes()-VARLEAF_KEYREF(0))/(2*sizeof(SIZE_T)+1);
+  }
+  if (IsPrefixed()) { 
+    return info.GetNumSlotsAsLeaf(GetLeafPrefixLength());
+  }
+  return info.GetNumSlotsAsLeaf();
+}
+
+
+// Keys are stored as their bytes, which is already an order-preserving
+// form (see NormalizeUnsigned), so they compare a word at a time
+int BTreeNode::CompareKey(const KEY_T &k, const SIZE_T offset) const
+{
+  const char *p=ResolveKey(offset);
+  SIZE_T len, i;
+  int cmp;
+
+  if (IsVariableLength()) { 
+    // Shorter keys sort first among those they begin
+    len=GetKeyLength(offset);
+    cmp=CompareBytes(k.data,(const BYTE_T *)p,k.length<len ? k.length : len);
+    if (cmp==0) { 
+      cmp= k.length<len ? -1 : k.length>len ? 1 : 0;
+    }
+    return cmp;
+  }
+  if (info.nodetype==BTREE_LEAF_NODE) { 
+    // the caller has matched the prefix
+    len=GetLeafPrefixLength();
+    return CompareBytes(k.data+len,(const BYTE_T *)p,info.keysize-len);
+  }
+  if (IsSlotted()) { 
+    // the rest of a truncated key reads as 0xff, as GetKey has it
+    len=GetKeyLength(offset);
+    cmp=CompareBytes(k.data,(const BYTE_T *)p,len);
+    for (i=len;cmp==0 && i<info.keysize;i++) { 
+      cmp= (BYTE_T)k.data[i]<0xff ? -1 : 0;
+    }
+    return cmp;
+  }
+  return CompareBytes(k.data,(const BYTE_T *)p,info.keysize);
+}
+
+
+// Up to eight bytes of a key from where the keys differ, read as a
+// number.  Digits are read as decimal if the node's keys are, so
+// numeric strings interpolate evenly.
+static double KeyNumber(const BYTE_T *p, const SIZE_T len, const SIZE_T from,
+			const SIZE_T n, const BYTE_T pad, const bool decimal)
+{
+  double v=0;
+  SIZE_T i;
+  BYTE_T b;
+
+  for (i=from;i<from+n;i++) { 
+    b= i<len ? p[i] : pad;
+    if (decimal) { 
+      b= b<'0' ? '0' : b>'9' ? '9' : b;
+      v=v*10+(b-'0');
+    } else {
+      v=v*256+b;
+    }
+  }
+  return v;
+}
+
+
+SIZE_T BTreeNode::PredictKey(const KEY_T &k, const SIZE_T lo, const SIZE_T hi) const
+{
+  const BYTE_T *a=(const BYTE_T *)ResolveKey(lo);
+  const BYTE_T *b=(const BYTE_T *)ResolveKey(hi);
+  const BYTE_T *x=(const BYTE_T *)k.data;
+  SIZE_T alen, blen, xlen, c, n, i;
+  BYTE_T pad=0;
+  bool decimal=true;
+  double av, bv, xv;
+  int cmp;
+
+  // the stored bytes of each key, as CompareKey sees them
+  if (IsVariableLength()) { 
+    alen=GetKeyLength(lo);
+    blen=GetKeyLength(hi);
+    xlen=k.length;
+  } else if (info.nodetype==BTREE_LEAF_NODE) { 
+    x+=GetLeafPrefixLength();
+    alen=blen=xlen=info.keysize-GetLeafPrefixLength();
+  } else if (IsSlotted()) { 
+    alen=GetKeyLength(lo);
+    blen=GetKeyLength(hi);
+    xlen=info.keysize;
+    pad=0xff;
+  } else {
+    alen=blen=xlen=info.keysize;
+  }
+
+  for (c=0;c<alen && c<blen && a[c]==b[c];c++) { }
+  cmp=memcmp(x,a,c<xlen ? c : xlen);
+  if (cmp<0 || (cmp==0 && xlen<c)) { 
+    return lo;
+  }
+  if (cmp>0) { 
+    return hi;
+  }
+
+  n=(alen>blen ? alen : blen)-c;
+  n= n>8 ? 8 : n<1 ? 1 : n;
+  for (i=c;i<c+n;i++) { 
+    if ((i<alen && (a[i]<'0' || a[i]>'9')) || (i<blen && (b[i]<'0' || b[i]>'9'))) { 
+      decimal=false;
+    }
+  }
+  av=KeyNumber(a,alen,c,n,pad,decimal);
+  bv=KeyNumber(b,blen,c,n,pad,decimal);
+  xv=KeyNumber(x,xlen,c,n,pad,decimal);
+  if (bv<=av || xv<=av) { 
+    return lo;
+  }
+  if (xv>=bv) { 
+    return hi;
+  }
+  return lo+(SIZE_T)((xv-av)/(bv-av)*(hi-lo));
+}
+
+
+ERROR_T BTreeNode::FindKey(const KEY_T &k, SIZE_T &offset, bool &found,
+			   const BTreeSearchType how, SIZE_T *probes) const
+{
+  SIZE_T n=info.numkeys;
+  SIZE_T lo, hi, i, step, count;
+  int cmp, hicmp;
+
+  found=false;
+
+  if (info.nodetype!=BTREE_LEAF_NODE && info.nodetype!=BTREE_INTERIOR_NODE &&
+      info.nodetype!=BTREE_ROOT_NODE) { 
+    return ERROR_INSANE;
+  }
+
+  if (info.nodetype==BTREE_LEAF_NODE && !IsVariableLength()) { 
+    // Keys outside the prefix sort before or after the whole leaf
+    cmp=CompareBytes(k.data,(const BYTE_T *)data+sizeof(SIZE_T),GetLeafPrefixLength());
+    if (cmp!=0) { 
+      offset= cmp<0 ? 0 : n;
+      return ERROR_NOERROR;
+    }
+  }
+
+  // The first key >= k is in [lo,hi], and hicmp is k against key hi
+  lo=0;
+  hi=n;
+  hicmp=-1;
+  count=0;
+
+  if (how==BTREE_SEARCH_LINEAR) { 
+    for (hi=0;hi<n;hi++) { 
+      count++;
+      hicmp=CompareKey(k,hi);
+      if (hicmp<=0) { 
+	break;
+      }
+    }
+    lo=hi;
+  }
+
+  if (how==BTREE_SEARCH_INTERPOLATION && n>2) { 
+    i=PredictKey(k,0,n-1);
+    count++;
+    cmp=CompareKey(k,i);
+    if (cmp<=0) { 
+      hi=i;
+      hicmp=cmp;
+      // gallop down from the guess
+      for (step=1;step<=BTREE_SEARCH_MAXSTEP && lo<hi;step*=2) { 
+	i= hi-lo>step ? hi-step : lo;
+	count++;
+	cmp=CompareKey(k,i);
+	if (cmp>0) { 
+	  lo=i+1;
+	  break;
+	}
+	hi=i;
+	hicmp=cmp;
+      }
+    } else {
+      lo=i+1;
+      // and up
+      for (step=1;step<=BTREE_SEARCH_MAXSTEP && lo<hi;step*=2) { 
+	i= hi-lo>step ? lo+step-1 : hi-1;
+	count++;
+	cmp=CompareKey(k,i);
+	if (cmp<=0) { 
+	  hi=i;
+	  hicmp=cmp;
+	  break;
+	}
+	lo=i+1;
+      }
+    }
+  }
+
+  // binary search of whatever is left
+  while (lo<hi) { 
+    i=lo+(hi-lo)/2;
+    count++;
+    cmp=CompareKey(k,i);
+    if (cmp<=0) { 
+      hi=i;
+      hicmp=cmp;
+    } else {
+      lo=i+1;
+    }
+  }
+
+  offset=hi;
+  found= hi<n && hicmp==0;
+  if (probes) { 
+    *probes+=count;
+  }
+  return ERROR_NOERROR;
+}
+
+
+bool BTreeNode::IsSlotted() const
+{
+  SIZE_T format;
+
+  if (info.nodetype!=BTREE_INTERIOR_NODE && info.nodetype!=BTREE_ROOT_NODE) { 
+    return false;
+  }
+  memcpy(&format,data,sizeof(SIZE_T));
+  return (format & BTREE_INTERIOR_SLOTTED)!=0;
+}
+
+
+ERROR_T BTreeNode::SetSlotted()
+{
+  SIZE_T format=BTREE_INTERIOR_SLOTTED | info.GetNumDataBytes();
+
+  if (info.nodetype!=BTREE_INTERIOR_NODE && info.nodetype!=BTREE_ROOT_NODE) { 
+    return ERROR_INSANE;
+  }
+  // KEYREF offsets and lengths are 16 bits
+  if (info.GetNumDataBytes()>0xffff) { 
+    return ERROR_SIZE;
+  }
+  memset(data,0,info.GetNumDataBytes());
+  memcpy(data,&format,sizeof(SIZE_T));
+  return ERROR_NOERROR;
+}
+
+
+bool BTreeNode::IsCounted() const
+{
+  return IsSlotted() && (GetWord(data) & BTREE_INTERIOR_COUNTED)!=0;
+}
+
+
+ERROR_T BTreeNode::SetCounted()
+{
+  if (!IsSlotted()) { 
+    return ERROR_INSANE;
+  }
+  SetWord(data,GetWord(data) | BTREE_INTERIOR_COUNTED);
+  return ERROR_NOERROR;
+}
+
+
+SIZE_T BTreeNode::GetSlottedEntry() const
+{
+  return SLOTTED_ENTRY(IsCounted());
+}
+
+
+ERROR_T BTreeNode::GetCount(const SIZE_T offset, SIZE_T &c) const
+{
+  if (!IsCounted() || offset>info.numkeys) { 
+    return ERROR_INSANE;
+  }
+  c=GetWord(data+SLOTTED_COUNT(offset,GetSlottedEntry()));
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::SetCount(const SIZE_T offset, const SIZE_T c)
+{
+  if (!IsCounted() || offset>info.numkeys) { 
+    return ERROR_INSANE;
+  }
+  SetWord(data+SLOTTED_COUNT(offset,GetSlottedEntry()),c);
+  return ERROR_NOERROR;
+}
+
+
+SIZE_T BTreeNode::GetSubtreeCount() const
+{
+  SIZE_T count=0;
+  SIZE_T i;
+
+  if (info.nodetype==BTREE_LEAF_NODE) { 
+    return info.numkeys;
+  }
+  if (!IsCounted() || (info.numkeys==0 && info.nodetype==BTREE_ROOT_NODE)) { 
+    // an empty tree's root has no pointers at all
+    return 0;
+  }
+  for (i=0;i<=info.numkeys;i++) { 
+    count+=GetWord(data+SLOTTED_COUNT(i,GetSlottedEntry()));
+  }
+  return count;
+}
+
+
+bool BTreeNode::IsVariableLength() const
+{
+  if (info.nodetype!=BTREE_LEAF_NODE && info.nodetype!=BTREE_INTERIOR_NODE && 
+      info.nodetype!=BTREE_ROOT_NODE) { 
+    return false;
+  }
+  return (GetWord(data) & BTREE_NODE_VARLEN)!=0;
+}
+
+
+ERROR_T BTreeNode::SetVariableLength()
+{
+  ERROR_T rc;
+
+  switch (info.nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+    rc=SetSlotted();
+    if (rc) { return rc; }
+    SetWord(data,GetWord(data) | BTREE_NODE_VARLEN);
+    return ERROR_NOERROR;
+    break;
+  case BTREE_LEAF_NODE:
+    if (info.GetNumDataBytes()>HEAP_MASK) { 
+      return ERROR_SIZE;
+    }
+    memset(data,0,info.GetNumDataBytes());
+    SetWord(data,BTREE_NODE_VARLEN | info.GetNumDataBytes());
+    return ERROR_NOERROR;
+    break;
+  default:
+    return ERROR_INSANE;
+  }
+}
+
+
+SIZE_T BTreeNode::GetKeyLength(const SIZE_T offset) const
+{
+  if (IsSlotted()) { 
+    return GetWord(data+SLOTTED_KEYREF(offset,GetSlottedEntry())) & HEAP_MASK;
+  }
+  if (IsVariableLength()) { 
+    return GetWord(data+VARLEAF_KEYREF(offset)) & HEAP_MASK;
+  }
+  return info.keysize;
+}
+
+
+SIZE_T BTreeNode::GetNumSlotsAsInterior() const
+{
+  if (IsSlotted()) { 
+    return (info.GetNumDataBytes()-SLOTTED_KEYREF(0,GetSlottedEntry()))/GetSlottedEntry();
+  }
+  return info.GetNumSlotsAsInterior();
+}
+
+
+bool BTreeNode::HasRoomForKey(const KEY_T &k) const
+{
+  if (!IsSlotted()) { 
+    return info.numkeys<info.GetNumSlotsAsInterior();
+  }
+  return GetDirectoryEnd()+GetSlottedEntry()+GetNumHeapBytes()+StoredKeyLength(k)
+    <= info.GetNumDataBytes();
+}
+
+
+bool BTreeNode::HasRoomForKeyVal(const KEY_T &k, const VALUE_T &v) const
+{
+  if (!IsVariableLength()) { 
+    return info.numkeys<GetNumSlotsAsLeaf();
+  }
+  return GetDirectoryEnd()+2*sizeof(SIZE_T)+GetNumHeapBytes()+k.length+v.length
+    <= info.GetNumDataBytes();
+}
+
+
+ERROR_T BTreeNode::InsertKeyPtr(const SIZE_T offset, const KEY_T &k, const SIZE_T ptr)
+{
+  SIZE_T entry;
+  ERROR_T rc;
+
+  if ((info.nodetype!=BTREE_INTERIOR_NODE && info.nodetype!=BTREE_ROOT_NODE) || 
+      offset>info.numkeys) { 
+    return ERROR_INSANE;
+  }
+  if (!HasRoomForKey(k)) { 
+    return ERROR_NOSPACE;
+  }
+
+  // Key offset and the pointer after it are next to each other in 
+  // both layouts
+  if (IsSlotted()) { 
+    entry=GetSlottedEntry();
+    if ((GetWord(data) & HEAP_MASK)<GetDirectoryEnd()+entry) { 
+      // the directory grows into the space of replaced keys
+      CompactHeap();
+    }
+    memmove(data+SLOTTED_KEYREF(offset+1,entry),data+SLOTTED_KEYREF(offset,entry),
+	    (info.numkeys-offset)*entry);
+    SetWord(data+SLOTTED_KEYREF(offset,entry),0);
+    if (IsCounted()) { 
+      SetWord(data+SLOTTED_COUNT(offset+1,entry),0);
+    }
+  } else {
+    entry=sizeof(SIZE_T)+info.keysize;
+    memmove(data+sizeof(SIZE_T)+(offset+1)*entry,data+sizeof(SIZE_T)+offset*entry,
+	    (info.numkeys-offset)*entry);
+  }
+  info.numkeys++;
+
+  rc=SetKey(offset,k);
+  if (rc) { return rc; }
+  return SetPtr(offset+1,ptr);
+}
+
+
+ERROR_T BTreeNode::InsertKeyVal(const SIZE_T offset, const KEY_T &k, const VALUE_T &v)
+{
+  SIZE_T plen=GetLeafPrefixLength();
+  SIZE_T entry;
+  ERROR_T rc;
+
+  if (info.nodetype!=BTREE_LEAF_NODE || offset>info.numkeys) { 
+    return ERROR_INSANE;
+  }
+  if (!HasRoomForKeyVal(k,v)) { 
+    return ERROR_NOSPACE;
+  }
+
+  if (IsVariableLength()) { 
+    entry=2*sizeof(SIZE_T);
+    if ((GetWord(data) & HEAP_MASK)<GetDirectoryEnd()+entry) { 
+      CompactHeap();
+    }
+    memmove(data+VARLEAF_KEYREF(offset+1),data+VARLEAF_KEYREF(offset),
+	    (info.numkeys-offset)*entry);
+    SetWord(data+VARLEAF_KEYREF(offset),0);
+    SetWord(data+VARLEAF_VALREF(offset),0);
+  } else {
+    entry=info.keysize-plen+info.valuesize;
+    memmove(data+sizeof(SIZE_T)+plen+(offset+1)*entry,data+sizeof(SIZE_T)+plen+offset*entry,
+	    (info.numkeys-offset)*entry);
+  }
+  info.numkeys++;
+
+  rc=SetKey(offset,k);
+  if (rc) { return rc; }
+  return SetVal(offset,v);
+}
+
+
+ERROR_T BTreeNode::DeleteKeyVal(const SIZE_T offset)
+{
+  SIZE_T plen=GetLeafPrefixLength();
+  SIZE_T entry;
+
+  if (info.nodetype!=BTREE_LEAF_NODE || offset>=info.numkeys) { 
+    return ERROR_INSANE;
+  }
+
+  // The heap bytes of a variable-length pair are left for CompactHeap
+  if (IsVariableLength()) { 
+    entry=2*sizeof(SIZE_T);
+    memmove(data+VARLEAF_KEYREF(offset),data+VARLEAF_KEYREF(offset+1),
+	    (info.numkeys-offset-1)*entry);
+  } else {
+    entry=info.keysize-plen+info.valuesize;
+    memmove(data+sizeof(SIZE_T)+plen+offset*entry,data+sizeof(SIZE_T)+plen+(offset+1)*entry,
+	    (info.numkeys-offset-1)*entry);
+  }
+  info.numkeys--;
+
+  return ERROR_NOERROR;
+}
+
+
+SIZE_T BTreeNode::GetStoredKeyLength(const KEY_T &k, const SIZE_T keysize, const bool exact)
+{
+  SIZE_T len=keysize;
+
+  if (exact) { 
+    return k.length;
+  }
+  while (len>0 && (BYTE_T)k.data[len-1]==0xff) { 
+    len--;
+  }
+  return len;
+}
+
+
+SIZE_T BTreeNode::StoredKeyLength(const KEY_T &k) const
+{
+  return GetStoredKeyLength(k,info.keysize,IsVariableLength());
+}
+
+
+SIZE_T BTreeNode::GetSlottedBytes(const vector<KEY_T> &keys, const SIZE_T from, 
+				  const SIZE_T to, const SIZE_T keysize, const bool exact,
+				  const bool counted)
+{
+  SIZE_T bytes=SLOTTED_KEYREF(to-from,SLOTTED_ENTRY(counted));
+  SIZE_T i;
+
+  for (i=from;i<to;i++) { 
+    bytes+=GetStoredKeyLength(keys[i],keysize,exact);
+  }
+  return bytes;
+}
+
+
+SIZE_T BTreeNode::GetVariableLeafBytes(const vector<KeyValuePair> &kvs, const SIZE_T from, 
+				       const SIZE_T to)
+{
+  SIZE_T bytes=VARLEAF_KEYREF(to-from);
+  SIZE_T i;
+
+  for (i=from;i<to;i++) { 
+    bytes+=kvs[i].key.length+kvs[i].value.length;
+  }
+  return bytes;
+}
+
+
+SIZE_T BTreeNode::GetDirectoryEnd() const
+{
+  return IsSlotted() ? SLOTTED_KEYREF(info.numkeys,GetSlottedEntry()) : VARLEAF_KEYREF(info.numkeys);
+}
+
+
+void BTreeNode::GetHeapRefs(vector<SIZE_T> &refs) const
+{
+  SIZE_T i;
+
+  refs.clear();
+  for (i=0;i<info.numkeys;i++) { 
+    if (IsSlotted()) { 
+      refs.push_back(SLOTTED_KEYREF(i,GetSlottedEntry()));
+    } else {
+      refs.push_back(VARLEAF_KEYREF(i));
+      refs.push_back(VARLEAF_VALREF(i));
+    }
+  }
+}
+
+
+SIZE_T BTreeNode::GetNumHeapBytes() const
+{
+  vector<SIZE_T> refs;
+  SIZE_T bytes=0;
+  SIZE_T i;
+
+  GetHeapRefs(refs);
+  for (i=0;i<refs.size();i++) { 
+    bytes+=GetWord(data+refs[i]) & HEAP_MASK;
+  }
+  return bytes;
+}
+
+
+// Store len bytes for the REF at refpos: in place if they fit where
+// it points, else at the bottom of the heap, squeezing out the space
+// of replaced keys and values first if need be
+ERROR_T BTreeNode::PutHeapBytes(const SIZE_T refpos, const void *bytes, const SIZE_T len)
+{
+  SIZE_T ref=GetWord(data+refpos);
+  SIZE_T heap;
+
+  if (len>(ref & HEAP_MASK)) { 
+    SetWord(data+refpos,0);
+    heap=GetWord(data) & HEAP_MASK;
+    if (heap<GetDirectoryEnd()+len) { 
+      CompactHeap();
+      heap=GetWord(data) & HEAP_MASK;
+      if (heap<GetDirectoryEnd()+len) { 
+	return ERROR_NOSPACE;
+      }
+    }
+    heap-=len;
+    SetWord(data,(GetWord(data) & ~HEAP_MASK) | heap);
+    ref=heap<<16;
+  }
+  ref=(ref & ~HEAP_MASK) | len;
+  memcpy(data+(ref>>16),bytes,len);
+  SetWord(data+refpos,ref);
+  return ERROR_NOERROR;
+}
+
+
+void BTreeNode::CompactHeap()
+{
+  vector<SIZE_T> refs;
+  vector<char> heap;
+  SIZE_T ref, len, top, i;
+
+  GetHeapRefs(refs);
+  for (i=0;i<refs.size();i++) { 
+    ref=GetWord(data+refs[i]);
+    heap.insert(heap.end(),data+(ref>>16),data+(ref>>16)+(ref & HEAP_MASK));
+  }
+  top=info.GetNumDataBytes();
+  for (i=refs.size();i>0;i--) { 
+    len=GetWord(data+refs[i-1]) & HEAP_MASK;
+    top-=len;
+    memcpy(data+top,&heap[heap.size()-len],len);
+    heap.resize(heap.size()-len);
+    SetWord(data+refs[i-1],(top<<16) | len);
+  }
+  SetWord(data,(GetWord(data) & ~HEAP_MASK) | top);
+}
+
+
 ostream & BTreeNode::Print(ostream &os) const 
 {
   os << "BTreeNode(info="<<info;
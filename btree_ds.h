@@ -2,6 +2,8 @@
 #define _btree_ds
 
 #include <iostream>
+#include <vector>
+#include <stddef.h>
 #include "global.h"
 #include "block.h"
 
@@ -13,6 +15,62 @@ using namespace std;
 #define BTREE_ROOT_NODE 2
 #define BTREE_INTERIOR_NODE 3
 #define BTREE_LEAF_NODE 4
+#define BTREE_FILTER_NODE 5
+#define BTREE_OVERFLOW_NODE 6
+
+// Superblock fields
+#define BTREE_SUPER_MAGIC 0
+#define BTREE_SUPER_FEATURES 1
+#define BTREE_SUPER_TIMESTAMP 2
+#define BTREE_SUPER_PIVOTS 3
+#define BTREE_SUPER_FILTERS 4
+#define BTREE_SUPER_VERSION 5
+#define BTREE_SUPER_OVERFLOW 6
+#define BTREE_SUPER_FRESH 7
+#define BTREE_SUPER_NUMFIELDS 8
+
+#define BTREE_SUPER_MAGIC_VALUE 0xb7ee0001
+
+// Optional on-disk formats, as bits of BTREE_SUPER_FEATURES
+#define BTREE_FEATURE_MVCC 0x1
+#define BTREE_FEATURE_BUFFERED 0x2
+#define BTREE_FEATURE_PREFIX 0x4
+#define BTREE_FEATURE_TRUNCATED 0x8
+#define BTREE_FEATURE_VARLEN 0x10
+#define BTREE_FEATURE_OVERFLOW 0x20
+#define BTREE_FEATURE_COMPACT 0x40
+#define BTREE_FEATURE_COUNTED 0x80
+
+// Layout generation, in BTREE_SUPER_VERSION.  Version 2 added the
+// slotted and variable-length nodes, version 3 overflow chains,
+// version 4 compact node headers, version 5 counted interior nodes
+// and version 6 the never-used end of the disk kept as a mark
+// (BTREE_SUPER_FRESH) rather than chained onto the free list; trees
+// from before read as 1.
+#define BTREE_FORMAT_VERSION 6
+
+// Set in the first word of a leaf that stores a common key prefix
+#define BTREE_LEAF_PREFIXED 0x80000000
+// Set in the first word of an interior node with a key heap
+#define BTREE_INTERIOR_SLOTTED 0x80000000
+// And also if it keeps the number of keys under each pointer
+#define BTREE_INTERIOR_COUNTED 0x20000000
+// Set in the first word of a node whose keys have their own lengths
+#define BTREE_NODE_VARLEN 0x40000000
+// Set in the length of an overflow value whose blocks are consecutive
+#define BTREE_OVERFLOW_EXTENT 0x80000000
+// Set in the first word of a node with a compact header
+#define BTREE_NODE_COMPACT 0x80000000
+
+// How a node is searched for a key.  Interpolation guesses the
+// position from the node's first and last keys, read as numbers,
+// then gallops from the guess; a guess that is still off after
+// BTREE_SEARCH_MAXSTEP positions (a skewed node) falls back to
+// binary search of what is left.
+enum BTreeSearchType {BTREE_SEARCH_LINEAR, BTREE_SEARCH_BINARY, BTREE_SEARCH_INTERPOLATION};
+#define BTREE_SEARCH_MAXSTEP 16
+#define BTREE_COMPACT_TYPE_SHIFT 24
+#define BTREE_COMPACT_NUMKEYS 0x00ffffff
 
 
 typedef Block Buffer;
@@ -32,10 +90,13 @@ struct NodeMetadata {
   SIZE_T rootnode; //meaningful only for superblock
   SIZE_T freelist; //meaningful only for superblock or a free block
   SIZE_T numkeys;
+  SIZE_T headerbytes; // not stored: how many bytes the header takes
 
   SIZE_T GetNumDataBytes() const;
   SIZE_T GetNumSlotsAsInterior() const;
   SIZE_T GetNumSlotsAsLeaf() const;
+  // For a leaf that stores a prefixlen byte prefix once
+  SIZE_T GetNumSlotsAsLeaf(const SIZE_T prefixlen) const;
 
   ostream &Print(ostream &rhs) const;
 			  
@@ -44,18 +105,110 @@ struct NodeMetadata {
 
 inline ostream & operator<< (ostream &os, const NodeMetadata &node) { return node.Print(os); }
 
+// A full header is every field before headerbytes; a compact one
+// is a single word
+#define BTREE_FULL_HEADER_BYTES offsetof(NodeMetadata,headerbytes)
+#define BTREE_COMPACT_HEADER_BYTES sizeof(SIZE_T)
 
 
+
+//
+// Every block begins with a header, either the fields of
+// NodeMetadata up to headerbytes, or in a tree with
+// BTREE_FEATURE_COMPACT, for nodes other than the superblock and
+// free blocks,
+//
+// BTREE_NODE_COMPACT | NODETYPE << BTREE_COMPACT_TYPE_SHIFT | NUMKEYS
+//
+// with keysize, valuesize and blocksize taken from the superblock.
+// Each header tells its kind by its first word, so the nodes below
+// begin right after either one.
 //
 // Interior node:
 //
 // PTR KEY PTR KEY PTR KEY PTR
 //
+// Slotted interior node (BTREE_FEATURE_TRUNCATED):
+//
+// FORMAT PTR KEYREF PTR KEYREF PTR ... free ... KEY KEY KEY
+//
+// FORMAT is BTREE_INTERIOR_SLOTTED | the offset where the key heap
+// begins; the heap grows down from the end of the node.  KEYREF is
+// the offset of a key in the heap << 16 | its length.  A key is
+// stored without its trailing 0xff bytes, and read back padded
+// with them to keysize.
+//
+// Variable-length interior node (BTREE_FEATURE_VARLEN) is a slotted
+// one with BTREE_NODE_VARLEN also set in FORMAT.  Keys are stored
+// exactly as they are.
+//
+// Counted interior node (BTREE_FEATURE_COUNTED) is a slotted one with
+// BTREE_INTERIOR_COUNTED also set in FORMAT:
+//
+// FORMAT PTR COUNT KEYREF PTR COUNT KEYREF ... PTR COUNT ... free ... KEY KEY
+//
+// COUNT is the number of keys in the subtree PTR points to.
+//
 // Leaf:
 //
 // PTR* KEY VALUE KEY VALUE KEY VALUE
 //
 // *Here this pointer is not used
+//
+// Multi-version leaf (BTREE_FEATURE_MVCC):
+//
+// PTR* KEY VALUE STAMP KEY VALUE STAMP ...
+//
+// STAMP is a SIZE_T stored as the tail of the value.  Several slots
+// may share a key; they hold versions of it, newest first.
+//
+// Prefix-compressed leaf (BTREE_FEATURE_PREFIX):
+//
+// FORMAT PREFIX SUFFIX VALUE SUFFIX VALUE ...
+//
+// FORMAT is BTREE_LEAF_PREFIXED | the prefix length, in place of the
+// unused pointer.  Every key is PREFIX followed by its SUFFIX.
+//
+// Variable-length leaf (BTREE_FEATURE_VARLEN):
+//
+// FORMAT KEYREF VALREF KEYREF VALREF ... free ... KEY VALUE KEY VALUE
+//
+// FORMAT is BTREE_NODE_VARLEN | where the heap begins, as in a
+// slotted interior node, and VALREF locates a value as KEYREF does a
+// key.  Space of replaced keys and values is reclaimed by compacting
+// the heap when it runs into the directory.
+//
+// Leaf of a tree with values out of line (BTREE_FEATURE_OVERFLOW):
+//
+// PTR* KEY FIRST LENGTH KEY FIRST LENGTH ...
+//
+// Each value is kept in a chain of overflow nodes from FIRST, and
+// LENGTH is its size, or'd with BTREE_OVERFLOW_EXTENT if the chain
+// is FIRST, FIRST+1, ... in order.  BTREE_SUPER_OVERFLOW holds the
+// size of the values themselves.
+//
+// Overflow node:
+//
+// NEXT BYTES...
+//
+// Superblock:
+//
+// FIELD FIELD FIELD ...
+//
+// Each field is a SIZE_T, see BTREE_SUPER_*.  A field reads as zero
+// unless BTREE_SUPER_MAGIC holds BTREE_SUPER_MAGIC_VALUE.
+//
+// Filter node (BTREE_SUPER_FILTERS is the first of a chain):
+//
+// NEXT BYTES...
+//
+// The bytes of all the nodes of the chain, in order, are
+//
+// BITSPERKEY GLOBALROOM GLOBALKEYS FILTER NUMLEAVES LEAF FILTER LEAF FILTER ...
+//
+// GLOBALROOM is zero if there is no global filter.  Each FILTER is the
+// raw bit array of a BloomFilter, sized from BITSPERKEY and GLOBALROOM
+// or the leaf slot count.
 
 
 struct BTreeNode {
@@ -65,6 +218,11 @@ struct BTreeNode {
   // unallocated or superblock => blank
   // interior => array of keys
   // leaf => array of key/value pairs
+  bool          inarena;   // data is from the current Arena, not new[]
+
+  // data, of blocksize bytes, from the current Arena if there is one
+  void AllocateData();
+  void FreeData();
 
 
   BTreeNode();
@@ -74,29 +232,103 @@ struct BTreeNode {
   //         because we will serialize it directly to disk
   //
   ~BTreeNode();
-  BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size);
+  // header_bytes picks the header; superblocks and free blocks
+  // always have a full one
+  BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size,
+	    SIZE_T header_bytes=BTREE_FULL_HEADER_BYTES);
   BTreeNode(const BTreeNode &rhs);
   BTreeNode & operator=(const BTreeNode &rhs);
   
   ERROR_T Serialize(BufferCache *b, const SIZE_T block) const;
   ERROR_T Unserialize(BufferCache *b, const SIZE_T block);
+  // A node of a tree whose sizes are those of layout, needed to read
+  // a compact header
+  ERROR_T Unserialize(BufferCache *b, const SIZE_T block, const NodeMetadata &layout);
+  ERROR_T Unpack(const Block &block, const NodeMetadata *layout);
 
+  char *ResolveSuperField(const SIZE_T field) const; // Gives a pointer to a superblock field
   char *ResolveKey(const SIZE_T offset) const; // Gives a pointer to the ith key  (interior or leaf)
   char *ResolvePtr(const SIZE_T offset) const; // Gives a pointer to the ith pointer (interior)
   char *ResolveVal(const SIZE_T offset) const; // Gives a pointer to the ith value (leaf)
   char *ResolveKeyVal(const SIZE_T offset) const ; // Gives a pointer to the ith keyvalue pair (leaf)
 
+  ERROR_T GetSuperField(const SIZE_T field, SIZE_T &v) const; // Gives a superblock field
   ERROR_T GetKey(const SIZE_T offset, KEY_T &k) const ; // Gives the ith key  (interior or leaf)
   ERROR_T GetPtr(const SIZE_T offset, SIZE_T &p) const ;   // Gives the ith pointer (interior)
   ERROR_T GetVal(const SIZE_T offset, VALUE_T &v) const ; // Gives  the ith value (leaf)
   ERROR_T GetKeyVal(const SIZE_T offset, KeyValuePair &p) const; // Gives  the ith key value pair (leaf)
 
 
+  ERROR_T SetSuperField(const SIZE_T field, const SIZE_T &v); // Writes a superblock field
   ERROR_T SetKey(const SIZE_T offset, const KEY_T &k); // Writesthe ith key  (interior or leaf)
   ERROR_T SetPtr(const SIZE_T offset, const SIZE_T &p);   // Writes the ith pointer (interior)
   ERROR_T SetVal(const SIZE_T offset, const VALUE_T &v); // Writes the ith value (leaf)
   ERROR_T SetKeyVal(const SIZE_T offset, const KeyValuePair &p); // Writes the ith key value pair (leaf)
 
+  // Prefix-compressed leaves.  SetLeafPrefix lays out an empty leaf
+  // to store the first len bytes of k once; keys set later must start
+  // with them (else ERROR_SIZE).
+  bool    IsPrefixed() const;
+  SIZE_T  GetLeafPrefixLength() const;
+  ERROR_T SetLeafPrefix(const KEY_T &k, const SIZE_T len);
+  SIZE_T  GetNumSlotsAsLeaf() const;  // for this leaf's layout
+  // Offset of the first key >= k (leaf or interior), found is set
+  // if it is k.  Compares keys in place, and only suffixes once a
+  // leaf's prefix matches.  probes, if given, counts the compares.
+  ERROR_T FindKey(const KEY_T &k, SIZE_T &offset, bool &found,
+		  const BTreeSearchType how=BTREE_SEARCH_LINEAR, SIZE_T *probes=0) const;
+  int     CompareKey(const KEY_T &k, const SIZE_T offset) const;  // k against the ith key
+  // Where interpolation puts k among the keys from lo to hi
+  SIZE_T  PredictKey(const KEY_T &k, const SIZE_T lo, const SIZE_T hi) const;
+
+  // Slotted interior nodes.  SetSlotted lays out an interior node,
+  // dropping its keys, to store each key in only the bytes it needs;
+  // SetKey then returns ERROR_NOSPACE once they no longer fit.
+  bool    IsSlotted() const;
+  ERROR_T SetSlotted();
+  // Variable-length nodes.  SetVariableLength lays out a leaf or
+  // interior node, dropping its keys, to store keys (and values) of
+  // any length up to keysize (valuesize) as they are.
+  bool    IsVariableLength() const;
+  ERROR_T SetVariableLength();
+  // Counted interior nodes.  SetCounted makes a freshly laid out slotted node
+  // keep a count of the keys under each pointer, read and written
+  // with GetCount and SetCount.
+  bool    IsCounted() const;
+  ERROR_T SetCounted();
+  ERROR_T GetCount(const SIZE_T offset, SIZE_T &c) const;
+  ERROR_T SetCount(const SIZE_T offset, const SIZE_T c);
+  SIZE_T  GetSubtreeCount() const;  // keys of a leaf, or the sum of the counts
+  SIZE_T  GetSlottedEntry() const;  // bytes per pointer in the directory
+  SIZE_T  GetKeyLength(const SIZE_T offset) const;  // bytes stored for the ith key
+  SIZE_T  GetNumSlotsAsInterior() const;  // most keys this node's layout can hold
+  bool    HasRoomForKey(const KEY_T &k) const;  // one more key (interior)
+  bool    HasRoomForKeyVal(const KEY_T &k, const VALUE_T &v) const;  // one more pair (leaf)
+  // Shifts the keys from offset, and the pointers after them, up by
+  // one to make room for k at offset and ptr just after it (interior)
+  ERROR_T InsertKeyPtr(const SIZE_T offset, const KEY_T &k, const SIZE_T ptr);
+  // Shifts the pairs from offset up by one to make room for k,v (leaf)
+  ERROR_T InsertKeyVal(const SIZE_T offset, const KEY_T &k, const VALUE_T &v);
+  // Shifts the pairs after offset down by one over it (leaf)
+  ERROR_T DeleteKeyVal(const SIZE_T offset);
+  // Bytes of a key in a slotted node (exact for variable length)
+  static SIZE_T GetStoredKeyLength(const KEY_T &k, const SIZE_T keysize, const bool exact);
+  SIZE_T  StoredKeyLength(const KEY_T &k) const;
+  // Bytes of a slotted node holding keys[from,to) and one more pointer
+  static SIZE_T GetSlottedBytes(const vector<KEY_T> &keys, const SIZE_T from, 
+				const SIZE_T to, const SIZE_T keysize, const bool exact,
+				const bool counted);
+  // Bytes of a variable-length leaf holding kvs[from,to)
+  static SIZE_T GetVariableLeafBytes(const vector<KeyValuePair> &kvs, const SIZE_T from,
+				     const SIZE_T to);
+
+  // The heap of a slotted or variable-length node
+  SIZE_T  GetDirectoryEnd() const;  // where the free space begins
+  void    GetHeapRefs(vector<SIZE_T> &refs) const;  // where its REFs are
+  SIZE_T  GetNumHeapBytes() const;  // bytes of live keys and values
+  ERROR_T PutHeapBytes(const SIZE_T refpos, const void *bytes, const SIZE_T len);
+  void    CompactHeap();  // squeeze out the space of replaced ones
+
   ostream &Print(ostream &rhs) const;
 };
 
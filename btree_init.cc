@@ -4,29 +4,60 @@
 
 void usage() 
 {
-  cerr << "usage: btree_init filestem cachesize keysize valuesize\n";
+  cerr << "usage: btree_init filestem cachesize keysize valuesize [mvcc] [prefix] [truncate] [varlen] [overflow=bytes] [counted]\n";
 }
 
 
 int main(int argc, char **argv)
 {
   char *filestem;
-  SIZE_T cachesize, keysize, valuesize;
+  SIZE_T keysize, valuesize;
   SIZE_T superblocknum;
+  SIZE_T overflow=0;
+  bool mvcc=false, prefix=false, truncate=false, varlen=false, counted=false;
 
-  if (argc!=5) { 
+  if (argc<5) { 
     usage();
     return -1;
   }
+  for (int i=5;i<argc;i++) { 
+    if (string(argv[i])=="mvcc") { 
+      mvcc=true;
+    } else if (string(argv[i])=="prefix") { 
+      prefix=true;
+    } else if (string(argv[i])=="truncate") { 
+      truncate=true;
+    } else if (string(argv[i])=="varlen") { 
+      varlen=true;
+    } else if (string(argv[i]).compare(0,9,"overflow=")==0) { 
+      overflow=atoi(argv[i]+9);
+    } else if (string(argv[i])=="counted") { 
+      counted=true;
+    } else {
+      usage();
+      return -1;
+    }
+  }
 
   filestem=argv[1];
-  cachesize=atoi(argv[2]);
   keysize=atoi(argv[3]);
   valuesize=atoi(argv[4]);
 
   DiskSystem disk(filestem);
-  BufferCache cache(&disk,cachesize);
+  BufferCache cache(&disk,0);
+  if (cache.SetSize(argv[2])!=ERROR_NOERROR) { 
+    usage();
+    return -1;
+  }
+  cache.SetMissRatioCurve(MRC_DEFAULT_SAMPLES);
   BTreeIndex btree(keysize,valuesize,&cache);
+
+  btree.SetMultiVersion(mvcc);
+  btree.SetPrefixCompression(prefix);
+  btree.SetSuffixTruncation(truncate);
+  btree.SetVariableLength(varlen);
+  btree.SetOverflowThreshold(overflow);
+  btree.SetOrderStatistics(counted);
   
   ERROR_T rc;
 
@@ -59,6 +90,10 @@ int main(int argc, char **argv)
     cerr << endl;
     
     cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+    cerr << "residentbytes   = "<<cache.GetPeakResidentBytes()<<endl;
+    // what other cache sizes would have missed
+    cerr << endl;
+    cache.GetMissRatioCurve().PrintCurve(cerr);
 
     return 0;
   }
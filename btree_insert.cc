@@ -11,7 +11,6 @@ void usage()
 int main(int argc, char **argv)
 {
   char *filestem;
-  SIZE_T cachesize;
   SIZE_T superblocknum;
   char *key, *value;
   bool newTree;
@@ -22,7 +21,6 @@ int main(int argc, char **argv)
   }
 
   filestem=argv[1];
-  cachesize=atoi(argv[2]);
   key=argv[3];
   value=argv[4];
   if (strcmp(argv[5],"0")==0){
@@ -32,7 +30,12 @@ int main(int argc, char **argv)
   }
 
   DiskSystem disk(filestem);
-  BufferCache cache(&disk,cachesize);
+  BufferCache cache(&disk,0);
+  if (cache.SetSize(argv[2])!=ERROR_NOERROR) { 
+    usage();
+    return -1;
+  }
+  cache.SetMissRatioCurve(MRC_DEFAULT_SAMPLES);
   usage();
   BTreeIndex btree(0,0,&cache);
   
@@ -72,6 +75,10 @@ int main(int argc, char **argv)
     cerr << endl;
     
     cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+    cerr << "residentbytes   = "<<cache.GetPeakResidentBytes()<<endl;
+    // what other cache sizes would have missed
+    cerr << endl;
+    cache.GetMissRatioCurve().PrintCurve(cerr);
 
     return 0;
   }
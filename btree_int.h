@@ -0,0 +1,85 @@
+#ifndef _btree_int
+#define _btree_int
+
+#include <stdint.h>
+
+#include "btree.h"
+
+//
+// How an integer key type is laid out in a node: the encoding of
+// NormalizeUnsigned/NormalizeSigned at the type's width, so that the
+// bytes order as the numbers do and CompareBytes compares a key as
+// one word.  Only the types specialized below may be keys.
+//
+template <class INT_T> struct BTreeIntegerKey;
+
+template <> struct BTreeIntegerKey<uint64_t> {
+  static void Encode(const uint64_t v, BYTE_T *p) { EncodeUnsigned(v,sizeof(v),p); }
+  static uint64_t Decode(const BYTE_T *p) { return DecodeUnsigned(p,sizeof(uint64_t)); }
+};
+
+template <> struct BTreeIntegerKey<uint32_t> {
+  static void Encode(const uint32_t v, BYTE_T *p) { EncodeUnsigned(v,sizeof(v),p); }
+  static uint32_t Decode(const BYTE_T *p) { return (uint32_t)DecodeUnsigned(p,sizeof(uint32_t)); }
+};
+
+template <> struct BTreeIntegerKey<int64_t> {
+  static void Encode(const int64_t v, BYTE_T *p) { EncodeSigned(v,sizeof(v),p); }
+  static int64_t Decode(const BYTE_T *p) { return DecodeSigned(p,sizeof(int64_t)); }
+};
+
+template <> struct BTreeIntegerKey<int32_t> {
+  static void Encode(const int32_t v, BYTE_T *p) { EncodeSigned(v,sizeof(v),p); }
+  static int32_t Decode(const BYTE_T *p) { return (int32_t)DecodeSigned(p,sizeof(int32_t)); }
+};
+
+
+//
+// An index whose keys are integers of type INT_T, passed by value.
+// Each key is encoded into a buffer the index keeps for the purpose,
+// so a call allocates nothing for its key, and the tree underneath is
+// an ordinary one with keysize sizeof(INT_T): the other tools read it
+// as keys of big-endian bytes.  The KEY_T interface stays available.
+//
+template <class INT_T>
+class BTreeIntegerIndex : public BTreeIndex {
+ private:
+  KEY_T keybuf;
+  KEY_T hibuf;    // the second key of a Count
+
+  const KEY_T & Key(const INT_T k) {
+    BTreeIntegerKey<INT_T>::Encode(k,keybuf.data);
+    return keybuf;
+  }
+
+ public:
+  BTreeIntegerIndex(SIZE_T valuesize, BufferCache *cache) :
+    BTreeIndex(sizeof(INT_T),valuesize,cache), keybuf(sizeof(INT_T)), hibuf(sizeof(INT_T))
+  {}
+
+  using BTreeIndex::Insert;
+  using BTreeIndex::Update;
+  using BTreeIndex::Delete;
+  using BTreeIndex::Lookup;
+  using BTreeIndex::Rank;
+  using BTreeIndex::Select;
+  using BTreeIndex::Count;
+
+  ERROR_T Insert(const INT_T key, const VALUE_T &value) { return Insert(Key(key),value); }
+  ERROR_T Update(const INT_T key, const VALUE_T &value) { return Update(Key(key),value); }
+  ERROR_T Delete(const INT_T key) { return Delete(Key(key)); }
+  ERROR_T Lookup(const INT_T key, VALUE_T &value) { return Lookup(Key(key),value); }
+  ERROR_T Rank(const INT_T key, SIZE_T &rank) { return Rank(Key(key),rank); }
+  ERROR_T Select(const SIZE_T k, INT_T &key) {
+    ERROR_T rc=Select(k,keybuf);
+    if (rc) { return rc; }
+    key=BTreeIntegerKey<INT_T>::Decode(keybuf.data);
+    return ERROR_NOERROR;
+  }
+  ERROR_T Count(const INT_T lo, const INT_T hi, SIZE_T &count) {
+    BTreeIntegerKey<INT_T>::Encode(hi,hibuf.data);
+    return Count(Key(lo),hibuf,count);
+  }
+};
+
+#endif
@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <set>
+#include "btree.h"
+
+//
+// Builds an index of numeric string keys (or with binary, integers
+// in their order-preserving encoding) spread uniformly, in a zipfian
+// (power law) way, or in clusters, and looks up keys in it with each
+// node search, reporting the key compares and CPU time per lookup.
+// The disk (made by makedisk) is reformatted for each spread.
+//
+
+void usage()
+{
+  cerr << "usage: btree_searchbench filestem cachesize keysize numkeys numlookups [seed] [binary]\n";
+}
+
+
+static KEY_T MakeKey(const unsigned long long n, const SIZE_T keysize, const bool binary)
+{
+  char buf[64];
+  KEY_T k;
+
+  if (binary) { 
+    NormalizeUnsigned(n,keysize,k);
+    return k;
+  }
+  snprintf(buf,sizeof(buf),"%0*llu",(int)keysize,n);
+  buf[keysize]=0;
+  return KEY_T(buf);
+}
+
+
+// The key numbers in [0,range) for one spread
+static void MakeKeys(const string &spread, const SIZE_T numkeys,
+		     const unsigned long long range, vector<unsigned long long> &keys)
+{
+  set<unsigned long long> seen;
+  vector<unsigned long long> centers;
+  unsigned long long n;
+  SIZE_T i;
+
+  for (i=0;i<32;i++) {
+    centers.push_back((unsigned long long)(drand48()*range));
+  }
+  keys.clear();
+  while (keys.size()<numkeys) {
+    if (spread=="uniform") {
+      n=(unsigned long long)(drand48()*range);
+    } else if (spread=="zipfian") {
+      // dense at the low end, with a long tail
+      n=(unsigned long long)(pow(drand48(),4.0)*range);
+    } else {
+      // clustered: tight runs around a few points
+      n=centers[lrand48()%centers.size()]+(unsigned long long)(drand48()*(range/10000+numkeys));
+      if (n>=range) {
+	n%=range;
+      }
+    }
+    if (seen.insert(n).second) {
+      keys.push_back(n);
+    }
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+  const char *spreads[]={"uniform","zipfian","clustered"};
+  const BTreeSearchType hows[]={BTREE_SEARCH_LINEAR,BTREE_SEARCH_BINARY,BTREE_SEARCH_INTERPOLATION};
+  const char *hownames[]={"linear","binary","interpolation"};
+  char *filestem;
+  SIZE_T keysize, numkeys, numlookups;
+  SIZE_T superblocknum;
+  SIZE_T s, h, i, probes;
+  unsigned long long range;
+  vector<unsigned long long> keys;
+  bool binary;
+  ERROR_T rc;
+
+  if (argc<6) {
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  keysize=atoi(argv[3]);
+  numkeys=atoi(argv[4]);
+  numlookups=atoi(argv[5]);
+  srand48(argc>6 ? atoi(argv[6]) : 1);
+  binary= argc>7 && string(argv[7])=="binary";
+
+  range=1;
+  for (i=0;i<keysize && i<(binary ? 7 : 18);i++) {
+    range*= binary ? 256 : 10;
+  }
+  if (keysize>=40 || (binary && keysize>8) || range<4*numkeys) {
+    cerr << "keysize does not suit numkeys\n";
+    return -1;
+  }
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,0);
+  if (cache.SetSize(argv[2])!=ERROR_NOERROR) { 
+    usage();
+    return -1;
+  }
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  printf("%-10s %-14s %12s %12s\n","keys","search","probes/op","usec/op");
+
+  for (s=0;s<sizeof(spreads)/sizeof(spreads[0]);s++) {
+    BTreeIndex btree(keysize,keysize,&cache);
+
+    if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+      cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+      return -1;
+    }
+    MakeKeys(spreads[s],numkeys,range,keys);
+    btree.SetSearchType(BTREE_SEARCH_BINARY);
+    for (i=0;i<keys.size();i++) {
+      KEY_T k=MakeKey(keys[i],keysize,binary);
+      if ((rc=btree.Insert(k,k))!=ERROR_NOERROR) {
+	cerr << "Can't insert due to error "<<rc<<endl;
+	return -1;
+      }
+    }
+
+    for (h=0;h<sizeof(hows)/sizeof(hows[0]);h++) {
+      VALUE_T val;
+      clock_t start;
+      double cpu;
+
+      btree.SetSearchType(hows[h]);
+      probes=btree.GetNumKeyProbes();
+      start=clock();
+      for (i=0;i<numlookups;i++) {
+	KEY_T k=MakeKey(keys[lrand48()%keys.size()],keysize,binary);
+	if ((rc=btree.Lookup(k,val))!=ERROR_NOERROR) {
+	  cerr << "Can't find an inserted key due to error "<<rc<<endl;
+	  return -1;
+	}
+      }
+      cpu=(double)(clock()-start)/CLOCKS_PER_SEC;
+      printf("%-10s %-14s %12.2f %12.3f\n",spreads[s],hownames[h],
+	     (double)(btree.GetNumKeyProbes()-probes)/numlookups,
+	     1e6*cpu/numlookups);
+    }
+
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+  }
+
+  if ((rc=cache.Detach())!=ERROR_NOERROR) {
+    cerr <<"Can't detach from cache due to error "<<rc<<endl;
+    return -1;
+  }
+  return 0;
+}
@@ -1,52 +1,940 @@
+#include <time.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <algorithm>
+
 #include "buffercache.h"
+#include "lz.h"
+
+// Read ahead: the streams followed at once, the most blocks between
+// two reads of one, and its first window
+#define READAHEAD_STREAMS   8
+#define READAHEAD_MAXSTRIDE 4
+#define READAHEAD_FIRST     4
+
+// What the compressed tier takes for a block besides its bytes: its
+// entries in tiermap and tierage, each in a red-black tree node with
+// four words of links and color
+#define TIER_ENTRY_BYTES (sizeof(pair<const SIZE_T,CompressedFrame>)+sizeof(pair<const SIZE_T,SIZE_T>)+8*sizeof(void *))
+
 
-ERROR_T BufferCache::CheckDeleteOldest()
+ERROR_T ParseSize(const char *arg, SIZE_T &num, bool &bytes)
 {
-  // In a real buffer cache, we would use a priority queue to make this O(1)
+  unsigned long long n;
+  char *end;
+  int shift=0;
+
+  if (!isdigit((unsigned char)*arg)) { 
+    return ERROR_SIZE;
+  }
+  n=strtoull(arg,&end,10);
+  switch (*end) { 
+  case 'k': case 'K':
+    shift=10; end++;
+    break;
+  case 'm': case 'M':
+    shift=20; end++;
+    break;
+  case 'g': case 'G':
+    shift=30; end++;
+    break;
+  }
+  if (*end || n>(unsigned long long)((SIZE_T)-1)>>shift) { 
+    return ERROR_SIZE;
+  }
+  num=(SIZE_T)(n<<shift);
+  bytes= shift>0;
+  return ERROR_NOERROR;
+}
 
-  map<SIZE_T, Block, cache_compare_lessthan>::iterator oldestptr=blockmap.end();
-  double oldest = curtime+1;
 
-  // Only delete if the cache is full
-  if (blockmap.size() < cachesize) {
-    return ERROR_NOERROR;
+// The size of a shard's index for num frames: at most half full, so
+// probes stay short.  shift is 32 less its log2.
+static SIZE_T IndexSize(const SIZE_T num, SIZE_T &shift)
+{
+  SIZE_T i;
+
+  for (i=1, shift=32;i<2*num;i<<=1, shift--) { 
+  }
+  return i;
+}
+
+
+static void UnmapSlab(BYTE_T *slab, const SIZE_T bytes, const bool mapped)
+{
+  if (slab) { 
+    if (mapped) { 
+      munmap(slab,bytes);
+    } else {
+      free(slab);
+    }
   }
+}
 
-  // Find oldest
+// A hit copies a frame's bytes out without the latch while a writer
+// may be changing them.  The version catches a torn copy, but for the
+// copy not to be a data race both sides go a word at a time through
+// relaxed atomics (bytes at a time if the frame is not word aligned).
+static void LoadFrame(BYTE_T *to, const BYTE_T *frame, const SIZE_T bytes)
+{
+  SIZE_T i;
+  uint64_t w;
 
-  for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
-	 i!=blockmap.end();
-	 ++i) {
-       if ((*i).second.lastaccessed<oldest) { 
-	 oldestptr=i;
-	 oldest=(*i).second.lastaccessed;
-       }
+  if (((uintptr_t)frame|bytes)%sizeof(w)) { 
+    for (i=0;i<bytes;i++) { 
+      to[i]=__atomic_load_n(frame+i,__ATOMIC_RELAXED);
+    }
+    return;
   }
-  
-  // write and delete it if it exists
- 
-  if (oldestptr!=blockmap.end()) { 
-    if ((*oldestptr).second.dirty) {
-      double reqtime;
-      int rc=disk->Write((*oldestptr).first,
-			 (*oldestptr).second,
-			 reqtime);
-      curtime+=reqtime;
-      diskwrites++;
+  for (i=0;i<bytes;i+=sizeof(w)) { 
+    w=__atomic_load_n((const uint64_t *)(frame+i),__ATOMIC_RELAXED);
+    memcpy(to+i,&w,sizeof(w));
+  }
+}
+
+
+static void StoreFrame(BYTE_T *frame, const BYTE_T *from, const SIZE_T bytes)
+{
+  SIZE_T i;
+  uint64_t w;
+
+  if (((uintptr_t)frame|bytes)%sizeof(w)) { 
+    for (i=0;i<bytes;i++) { 
+      __atomic_store_n(frame+i,from[i],__ATOMIC_RELAXED);
+    }
+    return;
+  }
+  for (i=0;i<bytes;i+=sizeof(w)) { 
+    memcpy(&w,from+i,sizeof(w));
+    __atomic_store_n((uint64_t *)(frame+i),w,__ATOMIC_RELAXED);
+  }
+}
+
+
+// Fibonacci hashing of a block number into a shard's index: the top
+// bits of the product, as blocks of one shard share their low bits
+static SIZE_T IndexSlot(const SIZE_T blocknum, const SIZE_T shift)
+{
+  return (SIZE_T)(blocknum*2654435769U) >> shift;
+}
+
+
+SIZE_T BufferCache::FindFrame(const CacheShard &s, const SIZE_T blocknum) const
+{
+  SIZE_T mask=s.index.size()-1;
+  SIZE_T i, f;
+
+  for (i=IndexSlot(blocknum,s.shift); (f=s.index[i].load(memory_order_relaxed))!=0; i=(i+1)&mask) { 
+    if (frames[f-1].blocknum.load(memory_order_relaxed)==blocknum) { 
+      return f-1;
+    }
+  }
+  return frames.size();
+}
+
+
+void BufferCache::IndexInsert(CacheShard &s, const SIZE_T blocknum, const SIZE_T frame)
+{
+  SIZE_T mask=s.index.size()-1;
+  SIZE_T i;
+
+  for (i=IndexSlot(blocknum,s.shift); s.index[i].load(memory_order_relaxed)!=0; i=(i+1)&mask) { 
+  }
+  s.index[i].store(frame+1,memory_order_relaxed);
+}
+
+
+void BufferCache::IndexErase(CacheShard &s, const SIZE_T blocknum)
+{
+  SIZE_T mask=s.index.size()-1;
+  SIZE_T i, j, f, home;
+
+  for (i=IndexSlot(blocknum,s.shift); (f=s.index[i].load(memory_order_relaxed))!=0; i=(i+1)&mask) { 
+    if (frames[f-1].blocknum.load(memory_order_relaxed)==blocknum) { 
+      break;
+    }
+  }
+  if (f==0) { 
+    return;
+  }
+  // shift back the entries after it that would no longer be found
+  for (j=(i+1)&mask; (f=s.index[j].load(memory_order_relaxed))!=0; j=(j+1)&mask) { 
+    home=IndexSlot(frames[f-1].blocknum.load(memory_order_relaxed),s.shift);
+    if (((j-home)&mask) >= ((j-i)&mask)) { 
+      s.index[i].store(f,memory_order_relaxed);
+      i=j;
+    }
+  }
+  s.index[i].store(0,memory_order_relaxed);
+}
+
+
+bool BufferCache::ReadHit(CacheShard &s, const SIZE_T blocknum, Block &outblock,
+			  SIZE_T &stream)
+{
+  SIZE_T seq, version, f;
+  double now;
+
+  for (;;) { 
+    seq=s.seq.load(memory_order_acquire);
+    if (seq&1) { 
+      continue;
+    }
+    f=FindFrame(s,blocknum);
+    if (f==frames.size()) { 
+      // a miss counts only if the table was not changing under us
+      atomic_thread_fence(memory_order_acquire);
+      if (s.seq.load(memory_order_relaxed)==seq) { 
+	return false;
+      }
+      continue;
+    }
+    CacheFrame &frame=frames[f];
+    version=frame.version.load(memory_order_acquire);
+    if (version&1) { 
+      continue;
+    }
+    LoadFrame(outblock.data,FrameData(f),blocksize);
+    outblock.lastaccessed=frame.lastaccessed.load(memory_order_relaxed);
+    outblock.dirty=frame.dirty.load(memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    if (frame.version.load(memory_order_relaxed)!=version ||
+	frame.blocknum.load(memory_order_relaxed)!=blocknum) { 
+      continue;
+    }
+    // a store only when the clock has moved keeps hot frames' lines shared
+    now=curtime.load(memory_order_relaxed);
+    if (frame.lastaccessed.load(memory_order_relaxed)!=now) { 
+      frame.lastaccessed.store(now,memory_order_relaxed);
+    }
+    s.reads.fetch_add(1,memory_order_relaxed);
+    stream=0;
+    if (frame.prefetched.load(memory_order_relaxed)) { 
+      stream=frame.prefetched.exchange(0);
+    }
+    return true;
+  }
+}
+
+
+void BufferCache::BeginFrame(const SIZE_T frame)
+{
+  frames[frame].version.fetch_add(1,memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+
+void BufferCache::EndFrame(const SIZE_T frame)
+{
+  frames[frame].version.fetch_add(1,memory_order_release);
+}
+
+
+bool BufferCache::Older(const SIZE_T a, const SIZE_T b) const
+{
+  // The least recently used, the lowest block among equals
+  return b==frames.size() ||
+    frames[a].lastaccessed<frames[b].lastaccessed ||
+    (frames[a].lastaccessed==frames[b].lastaccessed &&
+     frames[a].blocknum<frames[b].blocknum);
+}
+
+
+SIZE_T BufferCache::ChooseVictim(const CacheShard &s) const
+{
+  SIZE_T oldest=frames.size(), freed=frames.size(), leaf=frames.size();
+  SIZE_T interior=0;
+  SIZE_T i;
+
+  // In a real buffer cache, we would use a priority queue to make this O(1)
+  for (i=s.first;i<s.first+s.num;i++) { 
+    if (!frames[i].valid) { 
+      continue;
+    }
+    if (Older(i,oldest)) { 
+      oldest=i;
+    }
+    if (interiorshare>0) { 
+      switch (frames[i].hint) { 
+      case CACHE_HINT_FREED:
+	if (Older(i,freed)) { 
+	  freed=i;
+	}
+	break;
+      case CACHE_HINT_INTERIOR:
+	interior++;
+	break;
+      default:
+	if (Older(i,leaf)) { 
+	  leaf=i;
+	}
+	break;
+      }
+    }
+  }
+  // freed blocks, then leaves while interior nodes are within their share
+  if (freed!=frames.size()) { 
+    return freed;
+  }
+  if (leaf!=frames.size() && interior<=interiorshare*s.num) { 
+    return leaf;
+  }
+  return oldest;
+}
+
+
+ERROR_T BufferCache::TakeFrame(CacheShard &s, const SIZE_T blocknum, SIZE_T &frame,
+			       const CacheHint hint)
+{
+  if (!s.freeframes.empty()) { 
+    frame=s.freeframes.back();
+    s.freeframes.pop_back();
+    BeginFrame(frame);
+  } else {
+    frame=ChooseVictim(s);
+    if (frames[frame].dirty) {
+      // what the flusher is there to spare the caller
+      ERROR_T rc=DiskWrite(frames[frame].blocknum,1,FrameData(frame));
       if (rc!=ERROR_NOERROR) { 
 	return rc;
       }
+      MarkClean(frame);
+      dirtyevictions++;
     }
-    blockmap.erase(oldestptr);
+    if (frames[frame].prefetched) { 
+      SIZE_T stream=frames[frame].prefetched.exchange(0);
+      if (stream) { 
+	ReadAheadWasted(stream);
+      }
+    }
+    TierInsert(frames[frame].blocknum,FrameData(frame));
+    BeginFrame(frame);
+    s.seq.fetch_add(1,memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    IndexErase(s,frames[frame].blocknum);
+    s.seq.fetch_add(1,memory_order_release);
   }
+  frames[frame].blocknum=blocknum;
+  frames[frame].lastaccessed=curtime.load();
+  frames[frame].valid=true;
+  frames[frame].dirty=false;
+  frames[frame].prefetched=0;
+  frames[frame].hint= hint==CACHE_HINT_NONE ? CACHE_HINT_LEAF : hint;
+  s.seq.fetch_add(1,memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  IndexInsert(s,blocknum,frame);
+  s.seq.fetch_add(1,memory_order_release);
   return ERROR_NOERROR;
 }
 
+
+void BufferCache::ReleaseFrame(CacheShard &s, const SIZE_T frame)
+{
+  BeginFrame(frame);
+  s.seq.fetch_add(1,memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  IndexErase(s,frames[frame].blocknum);
+  s.seq.fetch_add(1,memory_order_release);
+  frames[frame].valid=false;
+  frames[frame].prefetched=0;
+  MarkClean(frame);
+  EndFrame(frame);
+  s.freeframes.push_back(frame);
+}
+
+
+ERROR_T BufferCache::DiskRead(const SIZE_T blocknum, const SIZE_T num, BYTE_T *data)
+{
+  lock_guard<mutex> l(disklatch);
+  double reqtime;
+  ERROR_T rc;
+
+  rc=disk->Read(blocknum,num,data,reqtime);
+  AddTime(reqtime);
+  diskreads++;
+  return rc;
+}
+
+
+ERROR_T BufferCache::DiskWrite(const SIZE_T blocknum, const SIZE_T num, const BYTE_T *data,
+			       const bool background)
+{
+  lock_guard<mutex> l(disklatch);
+  double reqtime;
+  ERROR_T rc;
+
+  rc=disk->Write(blocknum,num,data,reqtime);
+  if (background) { 
+    flushtime+=reqtime;
+  } else {
+    AddTime(reqtime);
+  }
+  diskwrites++;
+  return rc;
+}
+
+
+void BufferCache::MarkDirty(const SIZE_T frame)
+{
+  if (!frames[frame].dirty) { 
+    frames[frame].dirty=true;
+    dirtyframes++;
+  }
+}
+
+
+void BufferCache::MarkClean(const SIZE_T frame)
+{
+  if (frames[frame].dirty) { 
+    frames[frame].dirty=false;
+    dirtyframes--;
+  }
+}
+
+
+void BufferCache::Flush()
+{
+  vector<pair<double,SIZE_T> > dirty;   // lastaccessed, block
+  vector<SIZE_T> blocks;
+  SIZE_T i, j, k, f;
+  ERROR_T rc;
+
+  // all of the shards, in order, so that no write of a block can
+  // come between our copy of it and our write of it
+  for (i=0;i<shards.size();i++) { 
+    shards[i].latch.lock();
+  }
+
+  for (i=0;i<frames.size();i++) { 
+    if (frames[i].valid && frames[i].dirty) { 
+      dirty.push_back(make_pair(frames[i].lastaccessed.load(),frames[i].blocknum.load()));
+    }
+  }
+  if (dirty.size()>flushlow) { 
+    // the least recently used, which eviction would come to first,
+    // written in block order
+    sort(dirty.begin(),dirty.end());
+    for (i=0;i<dirty.size()-flushlow;i++) { 
+      blocks.push_back(dirty[i].second);
+    }
+    sort(blocks.begin(),blocks.end());
+    for (i=0;i<blocks.size();i=j) { 
+      for (j=i+1;j<blocks.size() && blocks[j]==blocks[j-1]+1;j++) { 
+      }
+      // one request for each run of consecutive blocks
+      if (flushbuf.size()<(j-i)*blocksize) { 
+	flushbuf.resize((j-i)*blocksize);
+	NoteResident();
+      }
+      for (k=i;k<j;k++) { 
+	f=FindFrame(ShardOf(blocks[k]),blocks[k]);
+	memcpy(&flushbuf[(k-i)*blocksize],FrameData(f),blocksize);
+      }
+      rc=DiskWrite(blocks[i],j-i,&flushbuf[0],true);
+      if (rc!=ERROR_NOERROR) { 
+	// left dirty, for eviction to write and report
+	break;
+      }
+      for (k=i;k<j;k++) { 
+	MarkClean(FindFrame(ShardOf(blocks[k]),blocks[k]));
+      }
+      flushruns++;
+      flushwrites+=j-i;
+    }
+  }
+
+  for (i=shards.size();i>0;i--) { 
+    shards[i-1].latch.unlock();
+  }
+}
+
+
+void BufferCache::FlushThread()
+{
+  unique_lock<mutex> l(flushlatch);
+
+  for (;;) { 
+    while (!flushstop && dirtyframes<=flushhigh) { 
+      flushwake.wait(l);
+    }
+    if (flushstop) { 
+      return;
+    }
+    l.unlock();
+    Flush();
+    l.lock();
+  }
+}
+
+
+void BufferCache::WakeFlusher()
+{
+  if (flushthreaded) { 
+    // with the latch, so the thread is either waiting or yet to look
+    { 
+      lock_guard<mutex> l(flushlatch);
+    }
+    flushwake.notify_one();
+  } else {
+    Flush();
+  }
+}
+
+
+void BufferCache::PlanReadAhead(const SIZE_T blocknum, const SIZE_T stream,
+				SIZE_T &first, SIZE_T &count, SIZE_T &stride, SIZE_T &id)
+{
+  lock_guard<mutex> l(streamlatch);
+  SIZE_T i, j, window;
+
+  count=0;
+  // a quarter of the cache at most, so a window seldom evicts itself
+  window= readaheadmax<cachesize/4 ? readaheadmax : cachesize/4;
+
+  if (stream) { 
+    // read ahead, and now read: the next window once halfway through
+    ReadAheadStream &r=streams[stream-1];
+    readaheadused++;
+    r.last=blocknum;
+    r.stamp=streamstamp++;
+    if (!r.window || !window || blocknum+r.stride*(r.window/2)<r.ahead) { 
+      return;
+    }
+    r.window= 2*r.window<window ? 2*r.window : window;
+    first=r.ahead;
+    count=r.window;
+    stride=r.stride;
+    id=stream-1;
+    r.ahead+=count*stride;
+    return;
+  }
+
+  // a miss: the stream it continues, or else one yet to settle on a
+  // stride that it gives one
+  for (i=0;i<streams.size();i++) { 
+    if (streams[i].stride && blocknum==streams[i].last+streams[i].stride) { 
+      break;
+    }
+  }
+  if (i==streams.size()) { 
+    for (i=0;i<streams.size();i++) { 
+      if (streams[i].run<2 && blocknum>streams[i].last &&
+	  blocknum-streams[i].last<=READAHEAD_MAXSTRIDE) { 
+	break;
+      }
+    }
+    if (i<streams.size()) { 
+      streams[i].stride=blocknum-streams[i].last;
+      streams[i].run=1;
+    } else {
+      // a new stream, in place of the least recently used
+      for (i=0, j=1;j<streams.size();j++) { 
+	if (streams[j].stamp<streams[i].stamp) { 
+	  i=j;
+	}
+      }
+      streams[i].stride=0;
+      streams[i].run=0;
+    }
+    streams[i].window=0;
+    streams[i].last=blocknum;
+    streams[i].stamp=streamstamp++;
+    return;
+  }
+
+  ReadAheadStream &r=streams[i];
+  r.last=blocknum;
+  r.stamp=streamstamp++;
+  r.run++;
+  if (r.run<3 || !window) { 
+    return;
+  }
+  r.window= r.window ? (2*r.window<window ? 2*r.window : window)
+    : (READAHEAD_FIRST<window ? READAHEAD_FIRST : window);
+  first=blocknum;
+  count=1+r.window;
+  stride=r.stride;
+  id=i;
+  r.ahead=first+count*stride;
+}
+
+
+void BufferCache::ReadAheadWasted(const SIZE_T stream)
+{
+  lock_guard<mutex> l(streamlatch);
+  ReadAheadStream &r=streams[stream-1];
+
+  readaheadwasted++;
+  // read too far ahead: a smaller window, and none at all at zero
+  r.window/=2;
+  if (!r.window) { 
+    r.stride=0;
+    r.run=0;
+  }
+}
+
+
+void BufferCache::ReadAhead(const SIZE_T blocknum, const SIZE_T stream)
+{
+  SIZE_T first, count, stride, id;
+  SIZE_T i, n, b, f;
+  ERROR_T rc;
+
+  PlanReadAhead(blocknum,stream,first,count,stride,id);
+  if (first>=GetNumBlocks()) { 
+    count=0;
+  } else if (count && first+(count-1)*stride>=GetNumBlocks()) { 
+    count=(GetNumBlocks()-1-first)/stride+1;
+  }
+  if (!count) { 
+    return;
+  }
+
+  // all of the shards, in order, as Flush takes them, so that no block
+  // can be written back between our read of it and our caching of it
+  for (i=0;i<shards.size();i++) { 
+    shards[i].latch.lock();
+  }
+
+  for (n=0;n<count;n++) { 
+    b=first+n*stride;
+    if (FindFrame(ShardOf(b),b)!=frames.size() || TierHas(b)) { 
+      break;
+    }
+  }
+  if (n>0) { 
+    // the span from the first to the last, in one request
+    if (aheadbuf.size()<((n-1)*stride+1)*blocksize) { 
+      aheadbuf.resize(((n-1)*stride+1)*blocksize);
+      NoteResident();
+    }
+    rc=DiskRead(first,(n-1)*stride+1,&aheadbuf[0]);
+    for (i=0;i<n && rc==ERROR_NOERROR;i++) { 
+      b=first+i*stride;
+      rc=TakeFrame(ShardOf(b),b,f);
+      if (rc==ERROR_NOERROR) { 
+	StoreFrame(FrameData(f),&aheadbuf[i*stride*blocksize],blocksize);
+	// a miss's own block is read by the caller, not ahead
+	if (stream || i>0) { 
+	  frames[f].prefetched=id+1;
+	  readaheadblocks++;
+	}
+	EndFrame(f);
+      }
+    }
+    if (stream || n>1) { 
+      readaheads++;
+    }
+  }
+
+  for (i=shards.size();i>0;i--) { 
+    shards[i-1].latch.unlock();
+  }
+}
+
+
+void BufferCache::AddTime(const double t)
+{
+  double now=curtime.load(memory_order_relaxed);
+
+  while (!curtime.compare_exchange_weak(now,now+t,memory_order_relaxed)) { 
+  }
+}
+
+
+ERROR_T BufferCache::AllocateSlab()
+{
+  SIZE_T n= cachesize>numshards ? cachesize : numshards;
+  SIZE_T bytes=n*blocksize;
+  void *p;
+
+  slabmapped=false;
+  slabhuge=false;
+  if (hugepages) { 
+    // huge pages come in 2 MB
+    slabbytes=(bytes+(1<<21)-1) & ~((1<<21)-1);
+    p=MAP_FAILED;
+#ifdef MAP_HUGETLB
+    p=mmap(0,slabbytes,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+    slabhuge= p!=MAP_FAILED;
+#endif
+    if (p==MAP_FAILED) { 
+      p=mmap(0,slabbytes,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+#ifdef MADV_HUGEPAGE
+      slabhuge= p!=MAP_FAILED && madvise(p,slabbytes,MADV_HUGEPAGE)==0;
+#endif
+    }
+    if (p!=MAP_FAILED) { 
+      slab=(BYTE_T *)p;
+      slabmapped=true;
+    }
+  }
+  if (!slabmapped) { 
+    slabbytes=bytes;
+    if (posix_memalign(&p,4096,slabbytes)) { 
+      slab=0;
+      return ERROR_NOMEM;
+    }
+    slab=(BYTE_T *)p;
+  }
+  return ERROR_NOERROR;
+}
+
+
+void BufferCache::FreeSlab()
+{
+  UnmapSlab(slab,slabbytes,slabmapped);
+  slab=0;
+  slabbytes=0;
+}
+
+
+ERROR_T BufferCache::Resize(const SIZE_T newsize)
+{
+  vector<CacheFrame> old;
+  BYTE_T *oldslab=slab;
+  SIZE_T oldbytes=slabbytes, oldsize=cachesize;
+  bool   oldmapped=slabmapped, oldhuge=slabhuge;
+  SIZE_T i, j, k, f, n, first, oldfirst, oldnum;
+  ERROR_T rc=ERROR_NOERROR;
+
+  n= newsize>numshards ? newsize : numshards;
+
+  // all of the shards, in order, as Flush takes them, which keeps the
+  // flusher out too
+  for (i=0;i<shards.size();i++) { 
+    shards[i].latch.lock();
+  }
+
+  // a shrink first evicts each shard down to its new share, as misses
+  // would
+  for (j=0;j<shards.size() && rc==ERROR_NOERROR;j++) { 
+    CacheShard &s=shards[j];
+    while (s.num-s.freeframes.size() > n/numshards + (j<n%numshards)) { 
+      f=ChooseVictim(s);
+      if (frames[f].dirty) { 
+	rc=DiskWrite(frames[f].blocknum,1,FrameData(f));
+	if (rc!=ERROR_NOERROR) { 
+	  break;
+	}
+      }
+      TierInsert(frames[f].blocknum,FrameData(f));
+      ReleaseFrame(s,f);
+    }
+  }
+
+  if (rc==ERROR_NOERROR) { 
+    slab=0;
+    cachesize=newsize;
+    rc=AllocateSlab();
+    if (rc!=ERROR_NOERROR) { 
+      slab=oldslab; slabbytes=oldbytes; slabmapped=oldmapped; slabhuge=oldhuge;
+      cachesize=oldsize;
+    }
+  }
+
+  if (rc==ERROR_NOERROR) { 
+    // each shard's blocks to the front of its new range
+    frames.swap(old);
+    vector<CacheFrame>(n).swap(frames);
+    first=0;
+    for (j=0;j<shards.size();j++) { 
+      CacheShard &s=shards[j];
+      oldfirst=s.first;
+      oldnum=s.num;
+      s.first=first;
+      s.num=n/numshards + (j<n%numshards);
+      first+=s.num;
+      vector<atomic<SIZE_T> >(IndexSize(s.num,s.shift)).swap(s.index);
+      for (i=oldfirst, k=s.first;i<oldfirst+oldnum;i++) { 
+	if (old[i].valid) { 
+	  frames[k].blocknum=old[i].blocknum.load();
+	  frames[k].lastaccessed=old[i].lastaccessed.load();
+	  frames[k].dirty=old[i].dirty.load();
+	  frames[k].hint=old[i].hint.load();
+	  frames[k].prefetched=old[i].prefetched.load();
+	  frames[k].valid=true;
+	  memcpy(FrameData(k),oldslab+(size_t)i*blocksize,blocksize);
+	  IndexInsert(s,frames[k].blocknum,k);
+	  k++;
+	}
+      }
+      vector<SIZE_T>().swap(s.freeframes);
+      s.freeframes.reserve(s.num);
+      for (i=s.first+s.num;i>k;i--) { 
+	s.freeframes.push_back(i-1);
+      }
+    }
+    UnmapSlab(oldslab,oldbytes,oldmapped);
+  }
+
+  for (i=shards.size();i>0;i--) { 
+    shards[i-1].latch.unlock();
+  }
+  NoteResident();
+  return rc;
+}
+
+
+size_t BufferCache::FrameBytes(const SIZE_T n) const
+{
+  SIZE_T m= n>numshards ? n : numshards;
+  size_t bytes=(size_t)m*disk->GetBlockSize();
+  SIZE_T j, shift;
+
+  if (hugepages) { 
+    bytes=(bytes+(1<<21)-1) & ~(size_t)((1<<21)-1);
+  }
+  // the frames' descriptions and places in the free lists
+  bytes+=(size_t)m*(sizeof(CacheFrame)+sizeof(SIZE_T));
+  bytes+=numshards*sizeof(CacheShard);
+  for (j=0;j<numshards;j++) { 
+    bytes+=IndexSize(m/numshards + (j<m%numshards),shift)*sizeof(atomic<SIZE_T>);
+  }
+  return bytes;
+}
+
+
+SIZE_T BufferCache::BudgetFrames() const
+{
+  SIZE_T lo=0, hi=membudget/disk->GetBlockSize(), mid;
+
+  // FrameBytes grows with the frames, so the most that fit is found
+  // by bisection
+  while (lo<hi) { 
+    mid=lo+(hi-lo+1)/2;
+    if (FrameBytes(mid)<=membudget) { 
+      lo=mid;
+    } else {
+      hi=mid-1;
+    }
+  }
+  return lo;
+}
+
+
+void BufferCache::NoteResident()
+{
+  SIZE_T now=GetResidentBytes();
+  SIZE_T peak=residentpeak.load();
+
+  while (now>peak && !residentpeak.compare_exchange_weak(peak,now)) { 
+  }
+}
+
+
+void BufferCache::TierInsert(const SIZE_T blocknum, const BYTE_T *data)
+{
+  CompressedFrame frame;
+  string out;
+  SIZE_T len;
+  clock_t start;
+
+  if (!tierbytes) { 
+    return;
+  }
+
+  // a frame that does not save anything is not worth its room
+  out.resize(blocksize);
+  start=clock();
+  len=LZCompress(data,blocksize,(BYTE_T *)&out[0],blocksize-1);
+  lock_guard<mutex> l(tierlatch);
+  compresstime+=(double)(clock()-start)/CLOCKS_PER_SEC;
+  if (len==0 || len>tierbytes) { 
+    return;
+  }
+  tierrawbytes+=blocksize;
+  tiercompressedbytes+=len;
+
+  TierErase(blocknum);
+  while (tierused+len>tierbytes) { 
+    TierErase((*tierage.begin()).second);
+  }
+  frame.bytes.assign(out,0,len);
+  frame.stamp=tierstamp++;
+  tiermap[blocknum]=frame;
+  tierage[frame.stamp]=blocknum;
+  tierused+=len;
+  NoteResident();
+}
+
+
+bool BufferCache::TierTake(const SIZE_T blocknum, BYTE_T *data)
+{
+  map<SIZE_T, CompressedFrame, cache_compare_lessthan>::iterator f;
+  clock_t start;
+  ERROR_T rc;
+
+  if (!tierbytes) { 
+    return false;
+  }
+  lock_guard<mutex> l(tierlatch);
+  f=tiermap.find(blocknum);
+  if (f==tiermap.end()) { 
+    return false;
+  }
+  start=clock();
+  rc=LZDecompress((const BYTE_T *)(*f).second.bytes.data(),(*f).second.bytes.size(),
+		  data,blocksize);
+  compresstime+=(double)(clock()-start)/CLOCKS_PER_SEC;
+  TierErase(blocknum);
+  if (rc) { 
+    return false;
+  }
+  tierhits++;
+  return true;
+}
+
+
+void BufferCache::TierDrop(const SIZE_T blocknum)
+{
+  if (tierbytes) { 
+    lock_guard<mutex> l(tierlatch);
+    TierErase(blocknum);
+  }
+}
+
+
+bool BufferCache::TierHas(const SIZE_T blocknum)
+{
+  if (!tierbytes) { 
+    return false;
+  }
+  lock_guard<mutex> l(tierlatch);
+  return tiermap.find(blocknum)!=tiermap.end();
+}
+
+
+void BufferCache::TierErase(const SIZE_T blocknum)
+{
+  map<SIZE_T, CompressedFrame, cache_compare_lessthan>::iterator f;
+
+  f=tiermap.find(blocknum);
+  if (f!=tiermap.end()) { 
+    tierused-=(*f).second.bytes.size();
+    tierage.erase((*f).second.stamp);
+    tiermap.erase(f);
+  }
+}
+
+
 BufferCache::BufferCache(DiskSystem *d,
 			 SIZE_T cs) : 
-   disk(d), cachesize(cs), curtime(0),
+   disk(d), cachesize(cs), membudget(0), numshards(1), interiorshare(0), blocksize(0),
+   slab(0), slabbytes(0), hugepages(false), slabmapped(false), slabhuge(false),
+   curtime(0),
    allocs(0), deallocs(0), reads(0), writes(0),
-   diskreads(0), diskwrites(0)
+   diskreads(0), diskwrites(0),
+   tierbytes(0), tierused(0), tierstamp(0),
+   tierhits(0), tierrawbytes(0), tiercompressedbytes(0),
+   compresstime(0),
+   flushlow(0), flushhigh(0), flushthreaded(false), dirtyframes(0), flushstop(false),
+   flushtime(0), flushruns(0), flushwrites(0), dirtyevictions(0), discards(0),
+   readaheadmax(0), streamstamp(0),
+   readaheads(0), readaheadblocks(0), readaheadused(0), readaheadwasted(0),
+   residentpeak(0)
 {}
 
 
@@ -60,40 +948,157 @@ BufferCache::~BufferCache()
 
 ERROR_T BufferCache::Attach()
 {
-  blockmap.clear();
+  SIZE_T i, j, n, first;
+
+  FreeSlab();
+  blocksize=disk->GetBlockSize();
+  if (membudget) { 
+    cachesize=BudgetFrames();
+  }
+  if (AllocateSlab()!=ERROR_NOERROR) { 
+    return ERROR_NOMEM;
+  }
+  n= cachesize>numshards ? cachesize : numshards;
+  reads=GetNumReads();
+  writes=GetNumWrites();
+  vector<CacheFrame>(n).swap(frames);
+  vector<CacheShard>(numshards).swap(shards);
+  first=0;
+  for (j=0;j<numshards;j++) { 
+    CacheShard &s=shards[j];
+    s.first=first;
+    s.num=n/numshards + (j<n%numshards);
+    first+=s.num;
+    s.freeframes.reserve(s.num);
+    for (i=s.first+s.num;i>s.first;i--) { 
+      s.freeframes.push_back(i-1);
+    }
+    vector<atomic<SIZE_T> >(IndexSize(s.num,s.shift)).swap(s.index);
+  }
+  tiermap.clear();
+  tierage.clear();
+  tierused=0;
+  dirtyframes=0;
+  vector<ReadAheadStream>(READAHEAD_STREAMS).swap(streams);
+  streamstamp=0;
+  if (flushhigh && flushthreaded) { 
+    flushstop=false;
+    flusher=thread(&BufferCache::FlushThread,this);
+  }
+  NoteResident();
   return ERROR_NOERROR;
 }
 
 ERROR_T BufferCache::Detach()
 {
+  map<SIZE_T,SIZE_T> dirty;   // block => frame, to write in block order
+  SIZE_T i;
+
+  if (flusher.joinable()) { 
+    { 
+      lock_guard<mutex> l(flushlatch);
+      flushstop=true;
+    }
+    flushwake.notify_one();
+    flusher.join();
+  }
+
+  NoteResident();
+
   // write out all of our data and then throw it away
 
-  for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
-	 i!=blockmap.end();
-	 ++i) {
-    if ((*i).second.dirty) { 
-      double reqtime;
-      int rc=disk->Write((*i).first,
-			 (*i).second,
-			 reqtime);
-      curtime+=reqtime;
-      diskwrites++;
-      if (rc!=ERROR_NOERROR) { 
-	return rc;
-      }
+  for (i=0;i<frames.size();i++) { 
+    if (frames[i].valid && frames[i].dirty) { 
+      dirty[frames[i].blocknum]=i;
+    }
+  }
+  for (map<SIZE_T,SIZE_T>::iterator d=dirty.begin(); d!=dirty.end(); ++d) { 
+    ERROR_T rc=DiskWrite((*d).first,1,FrameData((*d).second));
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
     }
+    MarkClean((*d).second);
   }
-  blockmap.clear();
+  reads=GetNumReads();
+  writes=GetNumWrites();
+  vector<CacheFrame>().swap(frames);
+  vector<CacheShard>().swap(shards);
+  FreeSlab();
+  tiermap.clear();
+  tierage.clear();
+  tierused=0;
   return ERROR_NOERROR;
 }
 
 
+ERROR_T BufferCache::SetCacheSize(const SIZE_T blocks)
+{
+  membudget=0;
+  if (frames.empty()) { 
+    cachesize=blocks;
+    return ERROR_NOERROR;
+  }
+  return Resize(blocks);
+}
+
+
 SIZE_T BufferCache::GetCacheSize() const
 {
   return cachesize;
 }
 
 
+ERROR_T BufferCache::SetMemoryBudget(const SIZE_T bytes)
+{
+  membudget=bytes;
+  if (!membudget) { 
+    return ERROR_NOERROR;
+  }
+  if (frames.empty()) { 
+    cachesize=BudgetFrames();
+    return ERROR_NOERROR;
+  }
+  return Resize(BudgetFrames());
+}
+
+
+SIZE_T BufferCache::GetMemoryBudget() const
+{
+  return membudget;
+}
+
+
+ERROR_T BufferCache::SetSize(const char *size)
+{
+  SIZE_T num;
+  bool bytes;
+  ERROR_T rc;
+
+  if ((rc=ParseSize(size,num,bytes))!=ERROR_NOERROR) { 
+    return rc;
+  }
+  return bytes ? SetMemoryBudget(num) : SetCacheSize(num);
+}
+
+
+SIZE_T BufferCache::GetResidentBytes() const
+{
+  size_t bytes=slabbytes;
+  SIZE_T j;
+
+  bytes+=frames.capacity()*sizeof(CacheFrame);
+  bytes+=shards.size()*sizeof(CacheShard);
+  for (j=0;j<shards.size();j++) { 
+    bytes+=shards[j].index.size()*sizeof(atomic<SIZE_T>);
+    bytes+=shards[j].freeframes.capacity()*sizeof(SIZE_T);
+  }
+  bytes+=tierused+tiermap.size()*TIER_ENTRY_BYTES;
+  bytes+=flushbuf.capacity()+aheadbuf.capacity();
+  bytes+=mrc.GetNumBytes();
+  return bytes<(SIZE_T)-1 ? (SIZE_T)bytes : (SIZE_T)-1;
+}
+
+
 SIZE_T BufferCache::GetBlockSize() const
 {
   return disk->GetBlockSize();
@@ -109,14 +1114,157 @@ double BufferCache::GetCurrentTime() const
   return curtime;
 }
 
+
+void BufferCache::SetCompressedTier(const SIZE_T bytes)
+{
+  tierbytes=bytes;
+  while (tierused>tierbytes) { 
+    TierErase((*tierage.begin()).second);
+  }
+}
+
+
+SIZE_T BufferCache::GetCompressedTier() const
+{
+  return tierbytes;
+}
+
+
+void BufferCache::SetHugePages(const bool huge)
+{
+  hugepages=huge;
+}
+
+
+bool BufferCache::GetHugePages() const
+{
+  return hugepages;
+}
+
+
+bool BufferCache::IsSlabHuge() const
+{
+  return slabhuge;
+}
+
+
+void BufferCache::SetFlusher(const SIZE_T low, const SIZE_T high, const bool threaded)
+{
+  flushlow= low<high ? low : (high ? high-1 : 0);
+  flushhigh=high;
+  flushthreaded=threaded;
+}
+
+
+void BufferCache::SetReadAhead(const SIZE_T max)
+{
+  readaheadmax=max;
+}
+
+
+SIZE_T BufferCache::GetReadAhead() const
+{
+  return readaheadmax;
+}
+
+
+void BufferCache::SetMissRatioCurve(const SIZE_T samples)
+{
+  mrc.Reset(samples);
+}
+
+
+void BufferCache::SetShards(const SIZE_T num)
+{
+  numshards= num ? num : 1;
+}
+
+
+SIZE_T BufferCache::GetShards() const
+{
+  return numshards;
+}
+
+
+void BufferCache::SetInteriorShare(const double share)
+{
+  interiorshare=share;
+}
+
+
+double BufferCache::GetInteriorShare() const
+{
+  return interiorshare;
+}
+
+
+void BufferCache::HintBlock(const SIZE_T blocknum, const CacheHint hint)
+{
+  CacheShard &s=ShardOf(blocknum);
+  SIZE_T f;
+
+  if (interiorshare<=0 || hint==CACHE_HINT_NONE) { 
+    return;
+  }
+  // mostly it was told already, which a look without the latch shows
+  f=FindFrame(s,blocknum);
+  if (f!=frames.size() && frames[f].blocknum==blocknum && frames[f].hint==hint) { 
+    return;
+  }
+  lock_guard<mutex> l(s.latch);
+  f=FindFrame(s,blocknum);
+  if (f!=frames.size()) { 
+    frames[f].hint=hint;
+  }
+}
+
+
+SIZE_T BufferCache::GetNumReads() const
+{
+  SIZE_T i, n=reads;
+
+  for (i=0;i<shards.size();i++) { 
+    n+=shards[i].reads;
+  }
+  return n;
+}
+
+
+SIZE_T BufferCache::GetNumWrites() const
+{
+  SIZE_T i, n=writes;
+
+  for (i=0;i<shards.size();i++) { 
+    n+=shards[i].writes;
+  }
+  return n;
+}
+
 ERROR_T BufferCache::NotifyAllocateBlock(const SIZE_T outblocknum)
 {
+  lock_guard<mutex> l(disklatch);
   allocs++;
   return disk->NotifyAllocateBlocks(outblocknum,1);
 }
 
 ERROR_T BufferCache::NotifyDeallocateBlock(const SIZE_T inblocknum)
 {
+  CacheShard &s=ShardOf(inblocknum);
+  SIZE_T f;
+
+  { 
+    lock_guard<mutex> l(s.latch);
+    // nobody will read what it holds, so it is not written back
+    f=FindFrame(s,inblocknum);
+    if (f!=frames.size()) { 
+      if (frames[f].dirty) { 
+	discards++;
+      }
+      ReleaseFrame(s,f);
+    }
+  }
+  TierDrop(inblocknum);
+  lock_guard<mutex> l(disklatch);
   deallocs++;
   return disk->NotifyDeallocateBlocks(inblocknum,1);
 }
@@ -124,135 +1272,276 @@ ERROR_T BufferCache::NotifyDeallocateBlock(const SIZE_T inblocknum)
 
 bool  BufferCache::IsBlockAllocated(const SIZE_T inblocknum)
 {
+  lock_guard<mutex> l(disklatch);
   return disk->IsBlockAllocated(inblocknum);
 }
 
 
-ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock) 
+ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock,
+			       const CacheHint hint)
 {
-  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+  CacheShard &s=ShardOf(inblocknum);
+  SIZE_T f, stream;
+  ERROR_T rc;
+
+  mrc.Access(inblocknum);
+  outblock.Resize(blocksize,false);
+  if (ReadHit(s,inblocknum,outblock,stream)) { 
+    HintBlock(inblocknum,hint);
+    if (stream) { 
+      ReadAhead(inblocknum,stream);
+    }
+    return ERROR_NOERROR;
+  }
 
-  b = blockmap.find(inblocknum);
+  if (readaheadmax) { 
+    // which may bring in this block with those after it
+    ReadAhead(inblocknum,0);
+  }
+
+  unique_lock<mutex> l(s.latch);
 
-  if (b!=blockmap.end()) {
-    // It's in  cache, just update its lastaccessed and return it
-    outblock=(*b).second;
-    (*b).second.lastaccessed=curtime;
-    reads++;
+  f=FindFrame(s,inblocknum);
+
+  if (f!=frames.size()) {
+    // It came in while we waited, just update its lastaccessed and return it
+    memcpy(outblock.data,FrameData(f),blocksize);
+    outblock.lastaccessed=frames[f].lastaccessed;
+    outblock.dirty=frames[f].dirty;
+    frames[f].lastaccessed=curtime.load();
+    if (hint!=CACHE_HINT_NONE) { 
+      frames[f].hint=hint;
+    }
+    s.reads++;
+    stream=frames[f].prefetched.exchange(0);
+    if (stream) { 
+      l.unlock();
+      ReadAhead(inblocknum,stream);
+    }
     return ERROR_NOERROR;
   } else {
     // It's not in cache, so time to allocate it
-    CheckDeleteOldest();
-    // read it from disk
-    if (!(disk->IsBlockAllocated(inblocknum))) { 
-      if (PRINT_BUFFERCACHE_ALLOCATION_ERRORS) {
-	cerr << "BufferCache::ReadBlock: Attempt to read unallocated block " << inblocknum<<endl;
+    if (TierTake(inblocknum,outblock.data)) { 
+      rc=TakeFrame(s,inblocknum,f,hint);
+      if (rc!=ERROR_NOERROR) { 
+	return rc;
       }
+      StoreFrame(FrameData(f),outblock.data,blocksize);
+    } else {
+      rc=TakeFrame(s,inblocknum,f,hint);
+      if (rc!=ERROR_NOERROR) { 
+	return rc;
+      }
+      // read it from disk
+      if (!IsBlockAllocated(inblocknum)) { 
+	if (PRINT_BUFFERCACHE_ALLOCATION_ERRORS) {
+	  cerr << "BufferCache::ReadBlock: Attempt to read unallocated block " << inblocknum<<endl;
+	}
+      }
+      // into the block handed back, and from it into the frame
+      rc=DiskRead(inblocknum,1,outblock.data);
+      if (rc!=ERROR_NOERROR) { 
+	EndFrame(f);
+	ReleaseFrame(s,f);
+	return rc;
+      }
+      StoreFrame(FrameData(f),outblock.data,blocksize);
     }
-    double reqtime;
-    int rc = disk->Read(inblocknum,
-			outblock,
-			reqtime);
-    curtime+=reqtime;
-    diskreads++;
-    if (rc!=ERROR_NOERROR) { 
-      return rc;
+    frames[f].lastaccessed=curtime.load();
+    EndFrame(f);
+    outblock.lastaccessed=frames[f].lastaccessed;
+    outblock.dirty=false;
+    s.reads++;
+    return ERROR_NOERROR;
+  }
+}
+
+
+ERROR_T BufferCache::ReadBlocks(const SIZE_T inblocknum, const SIZE_T num, vector<Block> &outblocks)
+{
+  static thread_local vector<BYTE_T> scratch;   // the run, when read
+  static thread_local vector<bool> cached;      // which were, when it was
+  SIZE_T i, f;
+  bool allcached=true;
+  ERROR_T rc=ERROR_NOERROR;
+
+  outblocks.clear();
+  for (i=0;i<num;i++) { 
+    mrc.Access(inblocknum+i);
+  }
+
+  // all of the shards, in order, as ReadAhead takes them, so that no
+  // block can be written, or written back, between our read of the
+  // run and our caching of it
+  for (i=0;i<shards.size();i++) { 
+    shards[i].latch.lock();
+  }
+
+  cached.assign(num,false);
+  for (i=0;i<num;i++) { 
+    cached[i] = FindFrame(ShardOf(inblocknum+i),inblocknum+i)!=frames.size() || TierHas(inblocknum+i);
+    allcached = allcached && cached[i];
+  }
+
+  if (!allcached) { 
+    // the whole run in one request, through the scratch buffer
+    if (scratch.size()<num*blocksize) { 
+      scratch.resize(num*blocksize);
+    }
+    rc=DiskRead(inblocknum,num,&scratch[0]);
+  }
+
+  outblocks.resize(num);
+  for (i=0;i<num && rc==ERROR_NOERROR;i++) { 
+    CacheShard &s=ShardOf(inblocknum+i);
+    f=FindFrame(s,inblocknum+i);
+    outblocks[i].Resize(blocksize,false);
+    outblocks[i].lastaccessed=curtime;
+    outblocks[i].dirty=false;
+    if (f!=frames.size()) {
+      // the cached copy may be newer than the disk's
+      frames[f].lastaccessed=curtime.load();
+      memcpy(outblocks[i].data,FrameData(f),blocksize);
     } else {
-      outblock.lastaccessed=curtime;
-      outblock.dirty=false;
-      blockmap[inblocknum]=outblock;
-      reads++;
-      return ERROR_NOERROR;
+      // into the block handed back, and from it into a frame
+      BYTE_T *data=outblocks[i].data;
+      if (TierTake(inblocknum+i,data)) { 
+      } else if (!cached[i]) { 
+	memcpy(data,&scratch[i*blocksize],blocksize);
+      } else {
+	// evicted, and written back, by an earlier block of the run
+	rc=DiskRead(inblocknum+i,1,data);
+      }
+      if (rc==ERROR_NOERROR) { 
+	rc=TakeFrame(s,inblocknum+i,f);
+      }
+      if (rc==ERROR_NOERROR) { 
+	StoreFrame(FrameData(f),data,blocksize);
+	EndFrame(f);
+      }
     }
+    s.reads++;
+  }
+
+  for (i=shards.size();i>0;i--) { 
+    shards[i-1].latch.unlock();
   }
-} 
- 
-ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
+  return rc;
+}
+
+
+ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock,
+				const CacheHint hint)
 {
-  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
-  
-  b = blockmap.find(inblocknum);
+  CacheShard &s=ShardOf(inblocknum);
+  SIZE_T f;
+
+  if (inblock.length!=blocksize) { 
+    return ERROR_WRONGSIZEBLOCK;
+  }
+  mrc.Access(inblocknum);
+
+  unique_lock<mutex> l(s.latch);
 
-  if (b!=blockmap.end()) {
+  f = FindFrame(s,inblocknum);
+
+  if (f!=frames.size()) {
     // It's in  cache, so just replace the block
-    (*b).second=inblock;
-    (*b).second.lastaccessed=curtime;
-    (*b).second.dirty=true;
-    writes++;
-    return ERROR_NOERROR;
+    BeginFrame(f);
+    if (hint!=CACHE_HINT_NONE) { 
+      frames[f].hint=hint;
+    }
   } else {
     // It's not in cache, so time to allocate it
-    CheckDeleteOldest();
-    if (!(disk->IsBlockAllocated(inblocknum))) { 
+    TierDrop(inblocknum);
+    ERROR_T rc=TakeFrame(s,inblocknum,f,hint);
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+    if (!IsBlockAllocated(inblocknum)) { 
       if (PRINT_BUFFERCACHE_ALLOCATION_ERRORS) {
 	cerr << "BufferCache::WriteBlock: Attempt to write unallocated block " << inblocknum << endl;
       }
     }
-    Block myblock=inblock;
-    myblock.lastaccessed=curtime;
-    myblock.dirty=true;
-    blockmap[inblocknum]=myblock;
-    writes++;
-    return ERROR_NOERROR;
   }
+  StoreFrame(FrameData(f),inblock.data,blocksize);
+  frames[f].lastaccessed=curtime.load();
+  MarkDirty(f);
+  EndFrame(f);
+  s.writes++;
+  l.unlock();
+  if (flushhigh && dirtyframes>flushhigh) { 
+    WakeFlusher();
+  }
+  return ERROR_NOERROR;
 }
-  
+
 ERROR_T BufferCache::PrefetchBlock (const SIZE_T blocknum)
 {
   // Not implemented yet
   return ERROR_IMPLBUG;
 }
-  
+
 ERROR_T BufferCache::FlushBlock(const SIZE_T blocknum)
 {
-  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
-  
-  b = blockmap.find(blocknum);
+  CacheShard &s=ShardOf(blocknum);
+  SIZE_T f;
 
-  if (b==blockmap.end()) { 
+  lock_guard<mutex> l(s.latch);
+
+  f = FindFrame(s,blocknum);
+
+  if (f==frames.size()) { 
     return ERROR_NOERROR;
   } else {
-    if ((*b).second.dirty) { 
-      double reqtime;
-      int rc;
-      rc=disk->Write((*b).first,
-		     (*b).second,
-		     reqtime);
-      diskwrites++;
-      curtime+=reqtime;
+    if (frames[f].dirty) { 
+      ERROR_T rc=DiskWrite(blocknum,1,FrameData(f));
       if (rc!=ERROR_NOERROR) { 
 	return rc;
       }
     }
-    blockmap.erase(b);
+    ReleaseFrame(s,f);
     return ERROR_NOERROR;
   }
 }
-  
+
 ostream & BufferCache::Print(ostream &os) const
 {
+  map<SIZE_T,bool> cached;   // block => dirty, in block order
+
+  for (SIZE_T i=0;i<frames.size();i++) { 
+    if (frames[i].valid) { 
+      cached[frames[i].blocknum]=frames[i].dirty;
+    }
+  }
+
   os << "BufferCache(cachesize="<<cachesize
+     << ", membudget="<<membudget
      << ", blocksize="<<GetBlockSize()
      << ", curtime="<<curtime
      << ", allocs="<<allocs
      << ", deallocs="<<deallocs
-     << ", reads="<<reads
-     << ", writes="<<writes
+     << ", reads="<<GetNumReads()
+     << ", writes="<<GetNumWrites()
      << ", diskreads="<<diskreads
      << ", diskwrites="<<diskwrites
+     << ", tierbytes="<<tierbytes
+     << ", tierused="<<tierused
+     << ", hugepages="<<hugepages
+     << ", shards="<<numshards
+     << ", readahead="<<readaheadmax
      << ", blocks = {";
 
   
-  for (map<SIZE_T, Block, cache_compare_lessthan>::const_iterator b=blockmap.begin(); 
-       b!=blockmap.end(); 
+  for (map<SIZE_T,bool>::const_iterator b=cached.begin(); 
+       b!=cached.end(); 
        ++b) {
-    if (b!=blockmap.begin()) { 
+    if (b!=cached.begin()) { 
       os << ", ";
     }
-    os << (*b).first << ((*b).second.dirty ? "(dirty)" : "");
+    os << (*b).first << ((*b).second ? "(dirty)" : "");
   }
   os << "}, disk="<<*disk<<")";
-  
+
   return os;
 }
-  
@@ -1,12 +1,19 @@
 #ifndef _buffercache
 #define _buffercache
 
+#include <atomic>
+#include <condition_variable>
 #include <iostream>
 #include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "global.h"
 #include "block.h"
 #include "disksystem.h"
+#include "mrc.h"
 
 using namespace std;
 
@@ -17,20 +24,240 @@ struct cache_compare_lessthan {
 };
 
 
+// What a block holds, as far as replacement cares: interior nodes are
+// on the way to many others and kept in preference, freed blocks (as
+// written to a free list) are evicted first.  NONE is no news: a cached block keeps what it was
+// last told, a new one is a LEAF.
+enum CacheHint {CACHE_HINT_NONE, CACHE_HINT_LEAF, CACHE_HINT_INTERIOR, CACHE_HINT_FREED};
+
+
+// One slot of the cache's slab: which block it holds, if any.  A hit
+// reads it without its shard's latch, so what such a reader looks at
+// is atomic, and version is odd while the frame's block or bytes are
+// being changed (a seqlock).  The bytes themselves are copied in and
+// out a word at a time with relaxed atomics.
+struct CacheFrame {
+  atomic<SIZE_T> blocknum;
+  atomic<SIZE_T> version;
+  atomic<double> lastaccessed;
+  atomic<bool>   dirty;
+  atomic<CacheHint> hint;
+  atomic<SIZE_T> prefetched;       // 1+the stream that read it ahead, 0 once read
+  bool           valid;
+
+  CacheFrame() : blocknum(0), version(0), lastaccessed(0), dirty(false),
+		 hint(CACHE_HINT_LEAF), prefetched(0), valid(false) {}
+};
+
+
+// The part of the cache that the blocks hashing to it go through: its
+// frames, their replacement state and the table finding them.  Its
+// latch is held by whatever changes them; a hit takes no latch, but
+// checks seq, which is odd while the table is being changed.
+struct alignas(64) CacheShard {
+  mutex          latch;
+  atomic<SIZE_T> seq;
+  SIZE_T         first, num;       // its frames
+  vector<SIZE_T> freeframes;
+  vector<atomic<SIZE_T> > index;   // block hash => frame+1, zero if empty
+  SIZE_T         shift;            // 32 less log2 of the index's size
+  atomic<SIZE_T> reads, writes;
+
+  CacheShard() : seq(0), first(0), num(0), shift(0), reads(0), writes(0) {}
+};
+
+
+// Reads the cache has seen go stride blocks at a time, and how far
+// ahead of them it is reading
+struct ReadAheadStream {
+  SIZE_T last;     // the latest block
+  SIZE_T stride;   // zero until a second block shows it
+  SIZE_T run;      // misses in a row that kept to the stride
+  SIZE_T window;   // blocks read ahead at a time, zero for none
+  SIZE_T ahead;    // the first block not yet read ahead
+  SIZE_T stamp;    // of its last use, the oldest is reused
+
+  ReadAheadStream() : last(0), stride(0), run(0), window(0), ahead(0), stamp(0) {}
+};
+
+
+// A size as the tools take one: a number, or with a K, M or G suffix
+// a number of bytes (powers of 1024), bytes saying which.  ERROR_SIZE
+// if it is neither, or does not fit.
+ERROR_T ParseSize(const char *arg, SIZE_T &num, bool &bytes);
+
+
+// A clean block evicted from the cache, LZ compressed
+struct CompressedFrame {
+  string bytes;
+  SIZE_T stamp;  // when it was evicted, for LRU within the tier
+};
+
+
 //
 // LRU block cache with single step prefetch
 //
 // Write Back
 // Write Allocate
+//
+// Blocks live in one page-aligned slab of cachesize frames, allocated
+// at Attach, described by an array of CacheFrames and found through an
+// open-addressed table of block numbers, so a miss allocates nothing.
+// Optionally the slab is backed by huge pages.  The size may be given
+// as a memory budget instead, and changed while attached but quiesced
+// (see below): the frames then move to a new slab, a shrink evicting
+// as misses would.
+//
+// The frames are split among shards, each block going through the
+// shard its number hashes to, with its own LRU and latch, so that
+// threads using different shards do not wait on each other.  Reads,
+// writes and the rest may be called from any number of threads at
+// once.  Attach, Detach and the Set calls may not: nothing else may be
+// under way while they run, since a hit holds no latch that a resize
+// could wait on before freeing the frames and slab the hit is reading.  A read that hits
+// takes no latch at all: it looks the block up and copies it out
+// optimistically, and only tries again if a writer changed that
+// frame or that shard's table meanwhile.  So hits are lock-free, not
+// wait-free: a reader retries for as long as writers keep changing
+// its frame.  ReadBlocks and read ahead hold every shard's latch
+// from their disk read until the blocks are cached.  The compressed
+// tier and the disk each have a latch of their own, taken after a
+// shard's.
+//
+// Given a share for interior nodes, replacement is told by the hints
+// the index gives with its reads and writes: freed blocks go first,
+// then leaves, and interior nodes only once they hold more than their
+// share of the shard, so that a descent mostly misses only at its
+// leaf.  Without (the default), replacement is plain LRU.
+//
+// Optionally a flusher writes dirty blocks back ahead of eviction,
+// between two watermarks, so that a miss seldom has to write its
+// victim before reading.
+//
+// Optionally misses that step through the disk a few blocks at a
+// time, as a scan of the leaves does, are read ahead: once four in a
+// row keep to one stride, the blocks that follow come in with the
+// miss, in one request, and the window doubles each time the reader
+// gets halfway through it.  A block read ahead and evicted unread
+// halves it, and at zero the stream is dropped.
+//
+// Optionally it follows, from a sample of the blocks read and written,
+// the miss ratio that LRU caches of every other size would have had
+// (see MissRatioCurve).
+//
+// Optionally backed by a second tier of compressed frames: blocks
+// evicted from the cache (after any write back) are kept there,
+// compressed, within a byte budget, so reading one again costs a
+// decompression instead of a disk read.  A block is in at most one
+// of the two tiers.
 class BufferCache {
  private:
   DiskSystem *disk;
   SIZE_T cachesize;
-  map<SIZE_T, Block, cache_compare_lessthan> blockmap;
-  double curtime;
-  SIZE_T allocs, deallocs, reads, writes, diskreads, diskwrites;
+  SIZE_T membudget;                // bytes, zero for cachesize as given
+  SIZE_T numshards;
+  double interiorshare;
+  SIZE_T blocksize;                // of the disk, as of Attach
+  BYTE_T *slab;                    // the frames' bytes, frame i at i*blocksize
+  SIZE_T slabbytes;
+  bool   hugepages;                // asked for
+  bool   slabmapped;               // slab is from mmap, not posix_memalign
+  bool   slabhuge;                 // and the kernel gave huge pages
+  vector<CacheFrame> frames;
+  vector<CacheShard> shards;
+  mutex  disklatch;                // the disk, and the counts below
+  mutex  tierlatch;                // the compressed tier
+  atomic<double> curtime;
+  SIZE_T allocs, deallocs;
+  SIZE_T reads, writes;            // by the shards of earlier Attaches
+  SIZE_T diskreads, diskwrites;
+  SIZE_T tierbytes, tierused, tierstamp;
+  map<SIZE_T, CompressedFrame, cache_compare_lessthan> tiermap;
+  map<SIZE_T, SIZE_T> tierage;  // stamp to block, oldest first
+  SIZE_T tierhits, tierrawbytes, tiercompressedbytes;
+  double compresstime;
+  SIZE_T flushlow, flushhigh;      // dirty frames, no flusher if high is zero
+  bool   flushthreaded;
+  atomic<SIZE_T> dirtyframes;
+  thread flusher;
+  mutex  flushlatch;               // flushstop, and the flusher's waking
+  condition_variable flushwake;
+  bool   flushstop;
+  vector<BYTE_T> flushbuf;         // a run on its way to the disk
+  double flushtime;                // under the disk's latch
+  SIZE_T flushruns, flushwrites;
+  atomic<SIZE_T> dirtyevictions;
+  atomic<SIZE_T> discards;
+  SIZE_T readaheadmax;             // blocks at a time, zero for no read ahead
+  mutex  streamlatch;              // the streams, taken after a shard's
+  vector<ReadAheadStream> streams;
+  SIZE_T streamstamp;
+  vector<BYTE_T> aheadbuf;         // a window on its way from the disk
+  atomic<SIZE_T> readaheads, readaheadblocks, readaheadused, readaheadwasted;
+  atomic<SIZE_T> residentpeak;
+  MissRatioCurve mrc;
  protected:
-  ERROR_T CheckDeleteOldest();
+  BYTE_T *FrameData(const SIZE_T frame) const { return slab+(size_t)frame*blocksize; }
+  CacheShard & ShardOf(const SIZE_T blocknum) { return shards[blocknum%shards.size()]; }
+  // The frame holding blocknum, or frames.size() if none does
+  SIZE_T  FindFrame(const CacheShard &s, const SIZE_T blocknum) const;
+  void    IndexInsert(CacheShard &s, const SIZE_T blocknum, const SIZE_T frame);
+  void    IndexErase(CacheShard &s, const SIZE_T blocknum);
+  // Copies blocknum out without the shard's latch, if it is cached;
+  // stream is the frame's prefetched, cleared
+  bool    ReadHit(CacheShard &s, const SIZE_T blocknum, Block &outblock, SIZE_T &stream);
+  // A frame's version is odd from BeginFrame to EndFrame
+  void    BeginFrame(const SIZE_T frame);
+  void    EndFrame(const SIZE_T frame);
+  // Whether frame a is to be evicted before frame b, by LRU alone;
+  // every frame is before frames.size()
+  bool    Older(const SIZE_T a, const SIZE_T b) const;
+  SIZE_T  ChooseVictim(const CacheShard &s) const;
+  // A free frame of the shard for blocknum, after evicting a block
+  // (see ChooseVictim) if there is none, begun (see BeginFrame)
+  ERROR_T TakeFrame(CacheShard &s, const SIZE_T blocknum, SIZE_T &frame,
+		    const CacheHint hint=CACHE_HINT_NONE);
+  void    ReleaseFrame(CacheShard &s, const SIZE_T frame);
+  ERROR_T DiskRead(const SIZE_T blocknum, const SIZE_T num, BYTE_T *data);
+  // A background write's time goes to flushtime, not the clock
+  ERROR_T DiskWrite(const SIZE_T blocknum, const SIZE_T num, const BYTE_T *data,
+		    const bool background=false);
+  void    AddTime(const double t);
+  // These keep the count of dirty frames
+  void    MarkDirty(const SIZE_T frame);
+  void    MarkClean(const SIZE_T frame);
+  // Writes back the least recently used dirty frames but flushlow
+  void    Flush();
+  void    FlushThread();
+  void    WakeFlusher();
+  // What to read ahead, as count blocks stride apart from first, on a
+  // miss of blocknum (stream zero) or a first read of it after stream
+  // (1+ as in prefetched) read it ahead; count is zero for nothing.
+  // These two take the streams' latch.
+  void    PlanReadAhead(const SIZE_T blocknum, const SIZE_T stream,
+			SIZE_T &first, SIZE_T &count, SIZE_T &stride, SIZE_T &id);
+  void    ReadAheadWasted(const SIZE_T stream);
+  // Reads in what PlanReadAhead says, the blocks not cached up to the
+  // first that is, in one request; a miss is left to be read from its
+  // frame.  Failure only means less was read ahead.
+  void    ReadAhead(const SIZE_T blocknum, const SIZE_T stream);
+  ERROR_T AllocateSlab();
+  void    FreeSlab();
+  // Moves the frames to a slab of n, evicting down to it first.  The
+  // latches keep out other writers and the flusher, but not hits, so
+  // no other call may be under way.
+  ERROR_T Resize(const SIZE_T n);
+  // What the slab, frames and shards take with n frames
+  size_t  FrameBytes(const SIZE_T n) const;
+  // The most frames whose FrameBytes are within membudget
+  SIZE_T  BudgetFrames() const;
+  void    NoteResident();
+  // These three take the tier's latch
+  void    TierInsert(const SIZE_T blocknum, const BYTE_T *data);
+  bool    TierTake(const SIZE_T blocknum, BYTE_T *data);  // and drop it from the tier
+  void    TierDrop(const SIZE_T blocknum);
+  bool    TierHas(const SIZE_T blocknum);
+  void    TierErase(const SIZE_T blocknum);  // with the latch held
  public:
   // Cache size is in number of blocks
   BufferCache(DiskSystem *disk,
@@ -45,8 +272,27 @@ class BufferCache {
   ERROR_T Attach();
   ERROR_T Detach();
 
-  // Number of blocks in the cache
+  // Number of blocks in the cache.  Attached, the cache is resized at
+  // once, dirty blocks that no longer fit written back; the caller
+  // must see that no other call is under way.
+  ERROR_T SetCacheSize(const SIZE_T blocks);
   SIZE_T GetCacheSize() const;
+  // As many blocks as fit in bytes, with what each takes besides its
+  // own (see GetResidentBytes), and at least one per shard; kept to
+  // as the block size or the shards change.  The compressed tier and
+  // the buffers have budgets of their own.  Zero (the default) for the
+  // cache size as given.
+  ERROR_T SetMemoryBudget(const SIZE_T bytes);
+  SIZE_T GetMemoryBudget() const;
+  // A tool's cachesize argument: blocks, or with a suffix (see
+  // ParseSize) a memory budget
+  ERROR_T SetSize(const char *size);
+  // Bytes held now: the slab, the frames' descriptions, the shards and
+  // their tables, the compressed tier's frames and entries, the
+  // flusher's and read ahead's buffers, and the miss ratio curve.
+  // Peak is the most held since construction, and survives Detach.
+  SIZE_T GetResidentBytes() const;
+  SIZE_T GetPeakResidentBytes() const { return residentpeak;}
   // Number of bytes per block
   SIZE_T GetBlockSize() const;
   // Number of blocks in the underlying device
@@ -54,22 +300,77 @@ class BufferCache {
   // Current time in the simulation (starts at zero)
   double GetCurrentTime() const;
 
+  // Bytes of compressed frames to keep behind the cache, zero (the
+  // default) for none
+  void   SetCompressedTier(const SIZE_T bytes);
+  SIZE_T GetCompressedTier() const;
+
+  // Back the slab with huge pages (MAP_HUGETLB, or failing that
+  // transparent huge pages by madvise) from the next Attach on, which
+  // cuts TLB misses in a large cache
+  void   SetHugePages(const bool huge);
+  bool   GetHugePages() const;
+  // Whether the kernel actually gave the slab huge pages
+  bool   IsSlabHuge() const;
+
+  // Number of shards from the next Attach on, one by default.  Each
+  // has at least one frame.
+  void   SetShards(const SIZE_T num);
+  SIZE_T GetShards() const;
+
+  // The most of each shard's frames, as a fraction, that interior
+  // nodes may hold before they are evicted like leaves.  Zero (the
+  // default) for plain LRU, hints ignored.
+  void   SetInteriorShare(const double share);
+  double GetInteriorShare() const;
+
+  // Tells the cache what a cached block holds, when the caller learns
+  // it only from the bytes read
+  void   HintBlock(const SIZE_T blocknum, const CacheHint hint);
+
+  // Whenever more than high frames are dirty, write the least recently
+  // used of them back, in runs of consecutive blocks, until low are.
+  // With threaded, a thread started by the next Attach does it;
+  // otherwise the write that passes high does, and its disk time is
+  // counted in GetFlushTime instead of the clock, as though it had
+  // overlapped the operations that follow.  high of zero (the
+  // default) for no flusher.
+  void   SetFlusher(const SIZE_T low, const SIZE_T high, const bool threaded=false);
+
+  // Read ahead of sequential and strided misses, up to max blocks at a
+  // time (and a quarter of the cache); zero (the default) for none
+  void   SetReadAhead(const SIZE_T max);
+  SIZE_T GetReadAhead() const;
+
+  // Follow the miss ratio curve of the reads and writes from now on,
+  // sampling at most samples blocks; zero (the default) for none.  It
+  // outlasts Detach.
+  void   SetMissRatioCurve(const SIZE_T samples);
+  const MissRatioCurve & GetMissRatioCurve() const { return mrc; }
+
   // outblocknum is the number of the block that we just allocated
   // if the error return is nonzero
   ERROR_T NotifyAllocateBlock(const SIZE_T outblocknum);
-  // inblocknum is the block that we just deallocated
+  // inblocknum is the block that we just deallocated; its cached
+  // copy, if any, is dropped unwritten
   ERROR_T NotifyDeallocateBlock(const SIZE_T inblocknum);
   // check to see if we think the block was allocated
   bool  IsBlockAllocated(const SIZE_T inblocknum);
   
   // returns one of ERROR_NOERROR  (zero)
   // ERROR_NOSUCHBLOCK or other nonzero error codes
-  ERROR_T ReadBlock(const SIZE_T inblocknum, Block &outblock);
+  ERROR_T ReadBlock(const SIZE_T inblocknum, Block &outblock,
+		    const CacheHint hint=CACHE_HINT_NONE);
+
+  // Reads num consecutive blocks from inblocknum.  Those not in the
+  // cache come from the disk in one request for the whole run.
+  ERROR_T ReadBlocks(const SIZE_T inblocknum, const SIZE_T num, vector<Block> &outblocks);
   
   // returns one of ERROR_NOERROR  (zero)
   // ERROR_NOSUCHBLOCK
-  // ERROR_WRONGSIZEBLOCK or other nonzero error codes
-  ERROR_T WriteBlock(const SIZE_T inblocknum, const Block &inblock);
+  // ERROR_WRONGSIZEBLOCK (inblock is not blocksize bytes) or other nonzero error codes
+  ERROR_T WriteBlock(const SIZE_T inblocknum, const Block &inblock,
+		     const CacheHint hint=CACHE_HINT_NONE);
   
   // Request that a block be read into the cache
   // This returns immediately.
@@ -84,10 +385,32 @@ class BufferCache {
  
   SIZE_T GetNumAllocs() const { return allocs; }
   SIZE_T GetNumDeallocs() const { return deallocs; }
-  SIZE_T GetNumReads() const { return reads;}
-  SIZE_T GetNumWrites() const { return writes;}
+  SIZE_T GetNumReads() const;
+  SIZE_T GetNumWrites() const;
   SIZE_T GetNumDiskReads() const { return diskreads;}
   SIZE_T GetNumDiskWrites() const { return diskwrites;}
+  // Reads the compressed tier answered, each a disk read saved
+  SIZE_T GetNumTierHits() const { return tierhits;}
+  // Bytes of blocks put in the compressed tier, and what they took
+  SIZE_T GetNumTierRawBytes() const { return tierrawbytes;}
+  SIZE_T GetNumTierCompressedBytes() const { return tiercompressedbytes;}
+  // CPU seconds spent compressing and decompressing
+  double GetCompressionTime() const { return compresstime;}
+  // Blocks the flusher wrote back, in how many requests, and the disk
+  // time they took
+  SIZE_T GetNumFlushWrites() const { return flushwrites;}
+  SIZE_T GetNumFlushRuns() const { return flushruns;}
+  double GetFlushTime() const { return flushtime;}
+  // Misses that had to write their victim back first
+  SIZE_T GetNumDirtyEvictions() const { return dirtyevictions;}
+  // Dirty blocks dropped unwritten because they were deallocated
+  SIZE_T GetNumDiscards() const { return discards;}
+  // Requests that read ahead, the blocks they brought in besides the
+  // one missed, and how many of those were read, or evicted unread
+  SIZE_T GetNumReadAheads() const { return readaheads;}
+  SIZE_T GetNumReadAheadBlocks() const { return readaheadblocks;}
+  SIZE_T GetNumReadAheadUsed() const { return readaheadused;}
+  SIZE_T GetNumReadAheadWasted() const { return readaheadwasted;}
 
   ostream & Print(ostream &os) const;
   
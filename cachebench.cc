@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include "buffercache.h"
+
+//
+// Measures the buffer cache's hit path from 1 thread up to maxthreads,
+// doubling, each thread reading (or with writefraction, sometimes
+// writing) blocks chosen at random among numblocks that all fit in the
+// cache.  Every block holds one stamp in each of its words, so a read
+// that saw half of a write is caught.  The first numblocks blocks of
+// the disk (made by makedisk) are overwritten.
+//
+
+void usage()
+{
+  cerr << "usage: cachebench filestem cachesize numblocks opsperthread [maxthreads] [shards] [writefraction]\n";
+}
+
+
+static void Stamp(Block &block, const uint64_t stamp)
+{
+  SIZE_T i;
+
+  for (i=0;i+sizeof(stamp)<=block.length;i+=sizeof(stamp)) {
+    memcpy(block.data+i,&stamp,sizeof(stamp));
+  }
+}
+
+
+// Whether the block is whole and is blocknum's
+static bool Check(const Block &block, const SIZE_T blocknum)
+{
+  uint64_t first, w;
+  SIZE_T i;
+
+  memcpy(&first,block.data,sizeof(first));
+  if ((first>>32)!=blocknum) {
+    return false;
+  }
+  for (i=sizeof(w);i+sizeof(w)<=block.length;i+=sizeof(w)) {
+    memcpy(&w,block.data+i,sizeof(w));
+    if (w!=first) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+static void Run(BufferCache *cache, const SIZE_T numblocks, const SIZE_T ops,
+		const double writefraction, const unsigned seed,
+		atomic<SIZE_T> *bad, atomic<SIZE_T> *errors)
+{
+  Block block(cache->GetBlockSize());
+  uint64_t x=seed*2654435761U+1;
+  uint32_t writes=(uint32_t)(writefraction*4294967295.0);
+  SIZE_T i, b, nbad=0, nerrors=0;
+
+  for (i=0;i<ops;i++) {
+    // xorshift, so the threads share nothing but the cache
+    x^=x<<13; x^=x>>7; x^=x<<17;
+    b=(SIZE_T)((x>>32)%numblocks);
+    if ((uint32_t)x<writes) {
+      Stamp(block,((uint64_t)b<<32)|(uint32_t)i);
+      if (cache->WriteBlock(b,block)!=ERROR_NOERROR) {
+	nerrors++;
+      }
+    } else if (cache->ReadBlock(b,block)!=ERROR_NOERROR) {
+      nerrors++;
+    } else if (!Check(block,b)) {
+      nbad++;
+    }
+  }
+  *bad+=nbad;
+  *errors+=nerrors;
+}
+
+
+int main(int argc, char **argv)
+{
+  SIZE_T numblocks, ops, maxthreads, shards;
+  SIZE_T t, i, diskreads;
+  double writefraction, base=0;
+  atomic<SIZE_T> bad(0), errors(0);
+  ERROR_T rc;
+
+  if (argc<5) {
+    usage();
+    return -1;
+  }
+
+  numblocks=atoi(argv[3]);
+  ops=atoi(argv[4]);
+  maxthreads= argc>5 ? atoi(argv[5]) : 32;
+  shards= argc>6 ? atoi(argv[6]) : 64;
+  writefraction= argc>7 ? atof(argv[7]) : 0;
+
+  DiskSystem disk(argv[1]);
+  BufferCache cache(&disk,0);
+  if (cache.SetSize(argv[2])!=ERROR_NOERROR) { 
+    usage();
+    return -1;
+  }
+
+  cache.SetShards(shards);
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  // as sized by the Attach, a memory budget being in bytes
+  if (numblocks==0 || numblocks>cache.GetCacheSize() || numblocks>disk.GetNumBlocks()) {
+    cerr << "numblocks must be at least one and fit in both the cache and the disk\n";
+    return -1;
+  }
+
+  Block block(cache.GetBlockSize());
+  for (i=0;i<numblocks;i++) {
+    Stamp(block,(uint64_t)i<<32);
+    if ((rc=cache.WriteBlock(i,block))!=ERROR_NOERROR) {
+      cerr << "Can't write block "<<i<<" due to error "<<rc<<endl;
+      return -1;
+    }
+  }
+  diskreads=cache.GetNumDiskReads();
+
+  printf("%-8s %12s %10s\n","threads","Mops/s","speedup");
+
+  for (t=1;t<=maxthreads;t*=2) {
+    vector<thread> threads;
+    chrono::steady_clock::time_point start=chrono::steady_clock::now();
+    double secs, mops;
+
+    for (i=0;i<t;i++) {
+      threads.push_back(thread(Run,&cache,numblocks,ops,writefraction,(unsigned)(i+1),&bad,&errors));
+    }
+    for (i=0;i<t;i++) {
+      threads[i].join();
+    }
+    secs=chrono::duration<double>(chrono::steady_clock::now()-start).count();
+    mops=t*ops/secs/1e6;
+    if (t==1) {
+      base=mops;
+    }
+    printf("%-8u %12.3f %10.2f\n",(unsigned)t,mops,mops/base);
+  }
+
+  printf("shards=%u torn=%u errors=%u diskreads=%u\n",(unsigned)cache.GetShards(),
+	 (unsigned)bad,(unsigned)errors,(unsigned)(cache.GetNumDiskReads()-diskreads));
+
+  if ((rc=cache.Detach())!=ERROR_NOERROR) {
+    cerr <<"Can't detach from cache due to error "<<rc<<endl;
+    return -1;
+  }
+  return bad || errors ? -1 : 0;
+}
@@ -427,6 +427,7 @@ ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
 
   reqtime=ModelAccess(inoffblock,numblock);
 
+  blocks.reserve(blocks.size()+numblock);
   for (SIZE_T i=0;i<numblock;i++) { 
     Block b(blocksize);
     if (!IsBlockAllocated(inoffblock+i)) { 
@@ -438,7 +439,7 @@ ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
       cerr << "DiskSystem::Read: myread has failed"<<endl;
       return ERROR_IMPLBUG;
     }
-    blocks.push_back(b);
+    blocks.push_back(move(b));
   }
 
   return ERROR_NOERROR;
@@ -474,6 +475,65 @@ ERROR_T DiskSystem::Write(const SIZE_T   inoffblock,
 }
 
 
+ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
+			 const SIZE_T   numblock,
+			 BYTE_T        *data,
+			 double        &reqtime)
+{
+  reqtime=0;
+
+  if (inoffblock+numblock > numblocks) { 
+    cerr << "DiskSystem::Read: Attempt to read blocks "<<inoffblock<<" to "<<(inoffblock+numblock-1)<<", but maxmimum block is only "<<(numblocks-1)<<endl;
+    return ERROR_NOSPACE;
+  }
+
+  reqtime=ModelAccess(inoffblock,numblock);
+
+  for (SIZE_T i=0;i<numblock;i++) { 
+    if (!IsBlockAllocated(inoffblock+i)) { 
+      if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
+	cerr <<"DiskSystem::Read: reading unallocated block "<<(i+inoffblock)<<endl;
+      }
+    }
+    if (myread(datafilefd,offset+(inoffblock+i)*blocksize,data+i*blocksize,blocksize,true)!=blocksize) { 
+      cerr << "DiskSystem::Read: myread has failed"<<endl;
+      return ERROR_IMPLBUG;
+    }
+  }
+
+  return ERROR_NOERROR;
+}
+
+ERROR_T DiskSystem::Write(const SIZE_T   inoffblock,
+			  const SIZE_T   numblock,
+			  const BYTE_T  *data,
+			  double        &reqtime)
+{
+  reqtime=0;
+
+  if (inoffblock+numblock > numblocks) { 
+    cerr << "DiskSystem::Write: Attempt to write blocks "<<inoffblock<<" to "<<(inoffblock+numblock-1)<<", but maxmimum block is only "<<(numblocks-1)<<endl;
+    return ERROR_NOSPACE;
+  }
+
+  reqtime=ModelAccess(inoffblock,numblock);
+
+  for (SIZE_T i=0;i<numblock;i++) { 
+    if (!IsBlockAllocated(inoffblock+i)) { 
+      if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
+	cerr <<"DiskSystem::Write: writing unallocated block "<<(i+inoffblock)<<endl;
+      }
+    }
+    if (mywrite(datafilefd,offset+(inoffblock+i)*blocksize,data+i*blocksize,blocksize)!=blocksize) {  
+      cerr << "DiskSystem::Write: mywrite has failed"<<endl;
+      return ERROR_IMPLBUG;
+    }
+  }
+
+  return ERROR_NOERROR;
+}
+
+
 ERROR_T DiskSystem::Read(const SIZE_T inoffblock, Block &blocks, double &reqtime)
 {
   vector<Block> bl;
@@ -484,7 +544,7 @@ ERROR_T DiskSystem::Read(const SIZE_T inoffblock, Block &blocks, double &reqtime
     return rc;
   }
 
-  blocks = bl[0];
+  blocks = move(bl[0]);
 
   return ERROR_NOERROR;
 }
@@ -94,6 +94,18 @@ class DiskSystem {
 		const Block &blocks,
 		double &reqtime);
 
+  // The same into and out of numblock*blocksize bytes of memory the
+  // caller keeps, such as a buffer cache's frames
+  ERROR_T Read(const SIZE_T inoffblock,
+	       const SIZE_T numblock,
+	       BYTE_T *data,
+	       double &reqtime);
+
+  ERROR_T Write(const SIZE_T inoffblock,
+		const SIZE_T numblock,
+		const BYTE_T *data,
+		double &reqtime);
+
   SIZE_T GetBlockSize() const;
   SIZE_T GetNumBlocks() const;
 
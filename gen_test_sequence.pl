@@ -1,8 +1,16 @@
 #!/usr/bin/perl -w
 
-$#ARGV==3 or die "usage: gen_test_sequence.pl keysize valsize seed num\n";
+$usage="usage: gen_test_sequence.pl keysize valsize seed num [deletes] [upserts] [ranks] [nolookups] [nodisplay]\n";
 
-($keysize,$valuesize,$seed,$num)=@ARGV;
+$#ARGV>=3 or die $usage;
+
+($keysize,$valuesize,$seed,$num,@options)=@ARGV;
+
+%options=();
+foreach $option (@options) { 
+  $option =~ /^(deletes|upserts|ranks|nolookups|nodisplay)$/ or die $usage;
+  $options{$option}=1;
+}
 
 srand $seed;
 
@@ -13,15 +21,36 @@ $valuebytes="abcdefghijklmnopqrstuvwxyz0123456789";
 	 INSERT_EXISTS => \&gen_insert_exists,
 	 UPDATE_NEW => \&gen_update_new,
 	 UPDATE_EXISTS => \&gen_update_exists,
+       );
+
 #
-# No deletes required this quarter
+# No deletes required this quarter, unless asked for
 # 
-#	 DELETE_NEW => \&gen_delete_new,
-#	 DELETE_EXISTS => \&gen_delete_new,
-	 LOOKUP_NEW => \&gen_lookup_new,
-	 LOOKUP_EXISTS => \&gen_lookup_exists,
-	 DISPLAY => \&gen_display
-       );
+if ($options{deletes}) { 
+  $ops{DELETE_NEW}=\&gen_delete_new;
+  $ops{DELETE_EXISTS}=\&gen_delete_exists;
+}
+# Blind writes, which always succeed
+if ($options{upserts}) { 
+  $ops{UPSERT_NEW}=\&gen_upsert_new;
+  $ops{UPSERT_EXISTS}=\&gen_upsert_exists;
+  $ops{ERASE_NEW}=\&gen_erase_new;
+  $ops{ERASE_EXISTS}=\&gen_erase_exists;
+}
+# Order statistics, which sim answers only with counted
+if ($options{ranks}) { 
+  $ops{RANK_NEW}=\&gen_rank_new;
+  $ops{RANK_EXISTS}=\&gen_rank_exists;
+  $ops{SELECT}=\&gen_select;
+  $ops{COUNT}=\&gen_count;
+}
+if (!$options{nolookups}) { 
+  $ops{LOOKUP_NEW}=\&gen_lookup_new;
+  $ops{LOOKUP_EXISTS}=\&gen_lookup_exists;
+}
+if (!$options{nodisplay}) { 
+  $ops{DISPLAY}=\&gen_display;
+}
 
 @opnames=keys %ops;
 
@@ -94,6 +123,28 @@ sub gen_delete_exists {
   return "DELETE $key  # should succeed";
 }
 
+sub gen_upsert_new {
+  my ($key, $value) = (MakeNonExistentKey(), MakeValue());
+  $content{$key}=$value;
+  return "UPSERT $key $value  # should succeed";
+}
+
+sub gen_upsert_exists {
+  my ($key, $value) = (MakeExistentKey(), MakeValue());
+  $content{$key}=$value;
+  return "UPSERT $key $value  # should succeed";
+}
+
+sub gen_erase_new {
+  return "ERASE ".MakeNonExistentKey()."  # should succeed";
+}
+
+sub gen_erase_exists {
+  my $key=MakeExistentKey();
+  delete $content{$key};
+  return "ERASE $key  # should succeed";
+}
+
 sub gen_lookup_new {
   return "LOOKUP ".MakeNonExistentKey()."  # should fail";
 }
@@ -103,6 +154,27 @@ sub gen_lookup_exists {
   return "LOOKUP $key  # should succeed and return $content{$key}";
 }
 
+sub gen_rank_new {
+  return "RANK ".MakeNonExistentKey()."  # should succeed";
+}
+
+sub gen_rank_exists {
+  return "RANK ".MakeExistentKey()."  # should succeed";
+}
+
+sub gen_select {
+  # one past the last key fails
+  my $numkeys=keys %content;
+  my $rank=int(rand($numkeys+1));
+  return "SELECT $rank  # should ".($rank<$numkeys ? "succeed" : "fail");
+}
+
+sub gen_count {
+  my $numkeys=keys %content;
+  my ($lo, $hi) = sort ($numkeys>0 && rand(2)<1 ? MakeExistentKey() : MakeKey(), MakeKey());
+  return "COUNT $lo $hi  # should succeed";
+}
+
 sub gen_display {
   return "DISPLAY  # should always succeed";
 }
@@ -0,0 +1,161 @@
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_HASHBITS 12
+#define LZ_MAXOFFSET 0xffff
+
+
+// Fibonacci hash of the next LZ_MINMATCH bytes
+static SIZE_T Hash(const BYTE_T *p)
+{
+  SIZE_T v;
+
+  memcpy(&v,p,sizeof(v));
+  return (v*2654435761u)>>(32-LZ_HASHBITS);
+}
+
+
+// The rest of a field that did not fit in its 4 bits
+static bool PutLength(BYTE_T *out, SIZE_T &pos, const SIZE_T room, SIZE_T n)
+{
+  while (n>=255) {
+    if (pos>=room) {
+      return false;
+    }
+    out[pos++]=255;
+    n-=255;
+  }
+  if (pos>=room) {
+    return false;
+  }
+  out[pos++]=n;
+  return true;
+}
+
+
+static bool GetLength(const BYTE_T *in, SIZE_T &pos, const SIZE_T len, SIZE_T &n)
+{
+  BYTE_T b;
+
+  do {
+    if (pos>=len) {
+      return false;
+    }
+    b=in[pos++];
+    n+=b;
+  } while (b==255);
+  return true;
+}
+
+
+// matchlen is zero for the last sequence
+static bool PutSequence(BYTE_T *out, SIZE_T &pos, const SIZE_T room,
+			const BYTE_T *literals, const SIZE_T numliterals,
+			const SIZE_T offset, const SIZE_T matchlen)
+{
+  SIZE_T extra= matchlen ? matchlen-LZ_MINMATCH : 0;
+
+  if (pos>=room) {
+    return false;
+  }
+  out[pos++]=(numliterals<15 ? numliterals : 15)<<4 | (extra<15 ? extra : 15);
+  if (numliterals>=15 && !PutLength(out,pos,room,numliterals-15)) {
+    return false;
+  }
+  if (pos+numliterals>room) {
+    return false;
+  }
+  memcpy(out+pos,literals,numliterals);
+  pos+=numliterals;
+  if (!matchlen) {
+    return true;
+  }
+  if (pos+2>room) {
+    return false;
+  }
+  out[pos++]=offset & 0xff;
+  out[pos++]=offset>>8;
+  if (extra>=15 && !PutLength(out,pos,room,extra-15)) {
+    return false;
+  }
+  return true;
+}
+
+
+SIZE_T LZCompress(const BYTE_T *in, const SIZE_T len, BYTE_T *out, const SIZE_T room)
+{
+  // last position+1 of each hash, zero if none yet
+  SIZE_T table[1<<LZ_HASHBITS];
+  SIZE_T i, anchor, pos, h, cand, n;
+
+  memset(table,0,sizeof(table));
+  i=0;
+  anchor=0;
+  pos=0;
+  while (i+LZ_MINMATCH<=len) {
+    h=Hash(in+i);
+    cand=table[h];
+    table[h]=i+1;
+    if (cand && i-(cand-1)<=LZ_MAXOFFSET && memcmp(in+cand-1,in+i,LZ_MINMATCH)==0) {
+      cand--;
+      for (n=LZ_MINMATCH; i+n<len && in[cand+n]==in[i+n]; n++) {
+      }
+      if (!PutSequence(out,pos,room,in+anchor,i-anchor,i-cand,n)) {
+	return 0;
+      }
+      i+=n;
+      anchor=i;
+    } else {
+      i++;
+    }
+  }
+  if (!PutSequence(out,pos,room,in+anchor,len-anchor,0,0)) {
+    return 0;
+  }
+  return pos;
+}
+
+
+ERROR_T LZDecompress(const BYTE_T *in, const SIZE_T len, BYTE_T *out, const SIZE_T outlen)
+{
+  SIZE_T ip, op, numliterals, offset, matchlen;
+  BYTE_T token;
+
+  ip=0;
+  op=0;
+  while (ip<len) {
+    token=in[ip++];
+    numliterals=token>>4;
+    if (numliterals==15 && !GetLength(in,ip,len,numliterals)) {
+      return ERROR_INSANE;
+    }
+    if (numliterals>len-ip || numliterals>outlen-op) {
+      return ERROR_INSANE;
+    }
+    memcpy(out+op,in+ip,numliterals);
+    ip+=numliterals;
+    op+=numliterals;
+    if (ip==len) {
+      break;
+    }
+    if (ip+2>len) {
+      return ERROR_INSANE;
+    }
+    offset=in[ip] | in[ip+1]<<8;
+    ip+=2;
+    matchlen=token & 15;
+    if (matchlen==15 && !GetLength(in,ip,len,matchlen)) {
+      return ERROR_INSANE;
+    }
+    matchlen+=LZ_MINMATCH;
+    if (offset==0 || offset>op || matchlen>outlen-op) {
+      return ERROR_INSANE;
+    }
+    // byte by byte, as the match may overlap its own output
+    for (;matchlen>0;matchlen--,op++) {
+      out[op]=out[op-offset];
+    }
+  }
+  return op==outlen ? ERROR_NOERROR : ERROR_INSANE;
+}
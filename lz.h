@@ -0,0 +1,28 @@
+#ifndef _lz
+#define _lz
+
+#include "global.h"
+
+//
+// Byte-oriented LZ77 compression, in the manner of LZ4.  The output
+// is a run of sequences
+//
+// TOKEN LITERALS OFFSET MATCHLEN
+//
+// TOKEN is the literal count << 4 | the match length - LZ_MINMATCH;
+// a field of 15 goes on in the bytes after it (literal count) or
+// after OFFSET (match length), each added in until one is not 255.
+// OFFSET is two bytes, little endian, back from the end of the
+// output so far, and the match may overlap what it copies.  The last
+// sequence stops after its literals.
+//
+#define LZ_MINMATCH 4
+
+// Compresses len bytes of in into out, and returns how many bytes
+// that took, or 0 if it would take more than room
+SIZE_T  LZCompress(const BYTE_T *in, const SIZE_T len, BYTE_T *out, const SIZE_T room);
+// Expands len bytes of in into exactly outlen bytes of out, else
+// ERROR_INSANE
+ERROR_T LZDecompress(const BYTE_T *in, const SIZE_T len, BYTE_T *out, const SIZE_T outlen);
+
+#endif
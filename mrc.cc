@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "mrc.h"
+
+
+// The finalizer of MurmurHash3, so that consecutive blocks are spread
+// over all of the hashes
+static SIZE_T Hash(SIZE_T x)
+{
+  x^=x>>16;
+  x*=0x85ebca6bU;
+  x^=x>>13;
+  x*=0xc2b2ae35U;
+  x^=x>>16;
+  return x;
+}
+
+
+// To four significant bits
+static SIZE_T Quantize(const double d)
+{
+  SIZE_T x= d<(double)(SIZE_T)-1 ? (SIZE_T)d : (SIZE_T)-1;
+  SIZE_T shift;
+
+  for (shift=0;(x>>shift)>=16;shift++) { 
+  }
+  return (x>>shift)<<shift;
+}
+
+
+// This thread's counter, taken in turn on its first reference
+static SIZE_T Counter()
+{
+  static atomic<SIZE_T> next(0);
+  static thread_local SIZE_T mine=next.fetch_add(1,memory_order_relaxed)%MRC_COUNTERS;
+
+  return mine;
+}
+
+
+MissRatioCurve::MissRatioCurve(const SIZE_T max) : maxsamples(0), threshold(0)
+{
+  Reset(max);
+}
+
+
+void MissRatioCurve::Reset(const SIZE_T max)
+{
+  lock_guard<mutex> l(latch);
+  SIZE_T i;
+
+  maxsamples=max;
+  threshold=1ULL<<32;
+  for (i=0;i<MRC_COUNTERS;i++) { 
+    total[i].n=0;
+  }
+  last.clear();
+  byhash.clear();
+  // room for four references per block followed between compactions
+  vector<SIZE_T>(maxsamples ? 4*maxsamples+1 : 0,0).swap(tree);
+  clock=0;
+  distances.clear();
+  refs=0;
+  cold=0;
+}
+
+
+void MissRatioCurve::TreeAdd(SIZE_T when, const int delta)
+{
+  for (when++;when<tree.size();when+=when&-when) { 
+    tree[when]+=delta;
+  }
+}
+
+
+SIZE_T MissRatioCurve::TreeSum(SIZE_T when) const
+{
+  SIZE_T sum=0;
+
+  for (;when>0;when-=when&-when) { 
+    sum+=tree[when];
+  }
+  return sum;
+}
+
+
+void MissRatioCurve::Compact()
+{
+  map<SIZE_T,SIZE_T> bytime;   // when => block
+  map<SIZE_T,SIZE_T>::iterator i;
+
+  for (i=last.begin();i!=last.end();++i) { 
+    bytime[(*i).second]=(*i).first;
+  }
+  fill(tree.begin(),tree.end(),0);
+  clock=0;
+  for (i=bytime.begin();i!=bytime.end();++i) { 
+    last[(*i).second]=clock;
+    TreeAdd(clock,1);
+    clock++;
+  }
+}
+
+
+void MissRatioCurve::Drop(const SIZE_T blocknum)
+{
+  map<SIZE_T,SIZE_T>::iterator b=last.find(blocknum);
+
+  TreeAdd((*b).second,-1);
+  last.erase(b);
+  byhash.erase(make_pair(Hash(blocknum),blocknum));
+}
+
+
+void MissRatioCurve::Access(const SIZE_T blocknum)
+{
+  map<SIZE_T,SIZE_T>::iterator b;
+  SIZE_T h, d;
+  double w;
+
+  if (!maxsamples) { 
+    return;
+  }
+  total[Counter()].n.fetch_add(1,memory_order_relaxed);
+  h=Hash(blocknum);
+  if (h>=threshold.load(memory_order_relaxed)) { 
+    return;
+  }
+
+  lock_guard<mutex> l(latch);
+
+  if (h>=threshold) { 
+    // came down while we waited
+    return;
+  }
+  if (clock==tree.size()-1) { 
+    Compact();
+  }
+  // each stands for the references to the blocks not sampled like it
+  w=1/GetRate();
+  refs+=w;
+  b=last.find(blocknum);
+  if (b==last.end()) { 
+    cold+=w;
+    last[blocknum]=clock;
+    byhash.insert(make_pair(h,blocknum));
+  } else {
+    // the distinct blocks followed that were referenced since, scaled
+    // to the whole stream
+    d=TreeSum(clock)-TreeSum((*b).second+1);
+    TreeAdd((*b).second,-1);
+    (*b).second=clock;
+    distances[Quantize(d*w)]+=w;
+  }
+  TreeAdd(clock,1);
+  clock++;
+
+  while (last.size()>maxsamples) { 
+    // the threshold down to the largest hash followed, dropping its blocks
+    threshold=(*byhash.rbegin()).first;
+    while (!byhash.empty() && (*byhash.rbegin()).first>=threshold) { 
+      Drop((*byhash.rbegin()).second);
+    }
+  }
+}
+
+
+double MissRatioCurve::MissRatio(const SIZE_T size) const
+{
+  lock_guard<mutex> l(latch);
+  map<SIZE_T,double>::const_iterator i;
+  double misses=cold;
+  double all=0;
+  SIZE_T j;
+
+  for (j=0;j<MRC_COUNTERS;j++) { 
+    all+=(double)total[j].n.load(memory_order_relaxed);
+  }
+  if (all==0) { 
+    return 0;
+  }
+  for (i=distances.lower_bound(size);i!=distances.end();++i) { 
+    misses+=(*i).second;
+  }
+  // Over all the references rather than those sampled: hot blocks
+  // sampled more or less than their share then skew only the hits
+  // (SHARDS_adj)
+  return min(misses/all,1.0);
+}
+
+
+void MissRatioCurve::Curve(vector<pair<SIZE_T,double> > &curve) const
+{
+  SIZE_T size, first, largest;
+
+  {
+    lock_guard<mutex> l(latch);
+    largest= distances.empty() ? 0 : (*distances.rbegin()).first;
+  }
+  for (first=1;first<1/GetRate() && first<1U<<31;first*=2) { 
+  }
+  curve.clear();
+  for (size=first;;size*=2) { 
+    curve.push_back(make_pair(size,MissRatio(size)));
+    if (size>largest || size>=1U<<31) { 
+      break;
+    }
+  }
+}
+
+
+double MissRatioCurve::GetNumSampled() const
+{
+  lock_guard<mutex> l(latch);
+  return refs;
+}
+
+
+double MissRatioCurve::GetRate() const
+{
+  return (double)threshold.load()/(double)(1ULL<<32);
+}
+
+
+SIZE_T MissRatioCurve::GetNumBytes() const
+{
+  lock_guard<mutex> l(latch);
+
+  return tree.capacity()*sizeof(SIZE_T)
+    + last.size()*(sizeof(pair<const SIZE_T,SIZE_T>)+4*sizeof(void *))
+    + byhash.size()*(sizeof(pair<SIZE_T,SIZE_T>)+4*sizeof(void *))
+    + distances.size()*(sizeof(pair<const SIZE_T,double>)+4*sizeof(void *));
+}
+
+
+ostream & MissRatioCurve::PrintCurve(ostream &os) const
+{
+  vector<pair<SIZE_T,double> > curve;
+  char name[32];
+  SIZE_T i, len;
+
+  Curve(curve);
+  for (i=0;i<curve.size();i++) { 
+    len=snprintf(name,sizeof(name),"missratio(%u)",(unsigned)curve[i].first);
+    os << name << string(len<16 ? 16-len : 1,' ') << "= " << curve[i].second << endl;
+  }
+  return os;
+}
+
+
+ostream & MissRatioCurve::Print(ostream &os) const
+{
+  vector<pair<SIZE_T,double> > curve;
+  SIZE_T i;
+
+  Curve(curve);
+  os << "MissRatioCurve(maxsamples="<<maxsamples
+     << ", rate="<<GetRate()
+     << ", sampled="<<GetNumSampled()
+     << ", curve={";
+  for (i=0;i<curve.size();i++) { 
+    if (i>0) { 
+      os << ", ";
+    }
+    os << curve[i].first << ":" << curve[i].second;
+  }
+  os << "})";
+  return os;
+}
@@ -0,0 +1,99 @@
+#ifndef _mrc
+#define _mrc
+
+#include <atomic>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "global.h"
+
+using namespace std;
+
+// Blocks a curve follows unless told otherwise
+#define MRC_DEFAULT_SAMPLES 8192
+// Counters the references are spread over, one line each, so threads
+// counting at once seldom share one
+#define MRC_COUNTERS 64
+
+struct alignas(64) MissRatioCounter {
+  atomic<unsigned long long> n;
+
+  MissRatioCounter() : n(0) {}
+};
+
+//
+// Miss ratio curve of LRU caches of every size at once, over a stream
+// of block references, after SHARDS (Waldspurger et al., FAST '15).
+// Only blocks whose hash is under a threshold are followed, which
+// samples the blocks at the threshold's rate; the reuse distance of a
+// followed block (the distinct followed blocks referenced since it
+// last was) divided by the rate is its distance in the whole stream,
+// and a cache of that many blocks or fewer misses it.  At most
+// maxsamples blocks are followed: past that, the threshold comes down
+// to the largest hash followed, and those at it are dropped.  A
+// sampled reference counts for 1/rate of them at the rate it was
+// taken at, and the misses are taken over every reference.  The
+// distances are kept to four significant bits.
+//
+// Access may be called from any number of threads; one not sampled
+// takes no latch, and counts itself in its thread's counter.
+//
+class MissRatioCurve {
+ private:
+  SIZE_T                 maxsamples;      // zero for none
+  atomic<unsigned long long> threshold;   // hashes below are sampled, of 2^32
+  mutable mutex          latch;
+  map<SIZE_T,SIZE_T>     last;            // block => when last referenced
+  set<pair<SIZE_T,SIZE_T> > byhash;       // hash, block, of those in last
+  vector<SIZE_T>         tree;            // a Fenwick tree over the times
+  SIZE_T                 clock;
+  map<SIZE_T,double>     distances;       // scaled distance => references
+  double                 refs, cold;         // each weighed by 1/rate
+  MissRatioCounter       total[MRC_COUNTERS];  // references, sampled or not
+
+  void   TreeAdd(SIZE_T when, const int delta);
+  SIZE_T TreeSum(SIZE_T when) const;      // of those before when
+  // Renumbers the times from zero, when the tree is used up
+  void   Compact();
+  void   Drop(const SIZE_T blocknum);
+
+ public:
+  MissRatioCurve(const SIZE_T maxsamples=0);
+
+  // Forgets all references, and from now follows at most maxsamples
+  // blocks, zero for none
+  void   Reset(const SIZE_T maxsamples);
+  SIZE_T GetMaxSamples() const { return maxsamples; }
+
+  void   Access(const SIZE_T blocknum);
+
+  // The share of references an LRU cache of size blocks would miss,
+  // first references (which any size misses) included
+  double MissRatio(const SIZE_T size) const;
+  // The miss ratio at each power of two, from the first of at least
+  // 1/rate blocks (a followed block stands for that many, so shorter
+  // distances are not told apart) to the first beyond every distance
+  // seen
+  void   Curve(vector<pair<SIZE_T,double> > &curve) const;
+  // References sampled, weighed up to the whole stream, and the rate
+  // they are now sampled at
+  double GetNumSampled() const;
+  double GetRate() const;
+
+  // Bytes it holds, counting four words of links and color for each
+  // node of its maps
+  SIZE_T GetNumBytes() const;
+
+  // One line for each point of Curve, as the tools print statistics
+  ostream & PrintCurve(ostream &os) const;
+  ostream & Print(ostream &os) const;
+};
+
+inline ostream & operator<<(ostream &os, const MissRatioCurve &m) { return m.Print(os); }
+
+#endif
@@ -6,7 +6,7 @@
 
 void usage() 
 {
-  cerr << "usage: readbuffer cachesize filestem blocknum numblocks > data\n";
+  cerr << "usage: readbuffer cachesize filestem blocknum numblocks [readahead] > data\n";
 }
 
 int main(int argc, char *argv[])
@@ -15,15 +15,21 @@ int main(int argc, char *argv[])
     usage();
     exit(-1);
   }
-  SIZE_T cachesize=atoi(argv[1]);
   SIZE_T blocknum=atoi(argv[3]);
   SIZE_T numblocks=atoi(argv[4]);
 
   DiskSystem disk(argv[2]);
-  BufferCache cache(&disk,cachesize);
+  BufferCache cache(&disk,0);
+  if (cache.SetSize(argv[1])!=ERROR_NOERROR) { 
+    usage();
+    return -1;
+  }
 
   SIZE_T blocksize = disk.GetBlockSize();
 
+  if (argc>5) { 
+    cache.SetReadAhead(atoi(argv[5]));
+  }
   cache.Attach();
 
   for (unsigned i=blocknum;i<(blocknum+numblocks);i++) { 
@@ -52,6 +58,7 @@ int main(int argc, char *argv[])
   cerr << endl;
 
   cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+  cerr << "residentbytes   = "<<cache.GetPeakResidentBytes()<<endl;
 
   return 0;
 }
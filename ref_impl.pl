@@ -53,6 +53,26 @@ while ($line=<STDIN>) {
       print STDERR "Deleted ($key)\n" if $debug;
       print "OK\n";
     }
+  } elsif ($op eq "UPSERT") { 
+    ($key, $value) = split(/\s+/,$rest);
+    if (Bug()) { 
+      print STDERR "Upserting ($key, $value) failed\n" if $debug;
+      print "FAIL\n";
+    } else {
+      $content{$key}=$value;
+      print STDERR "Upserted ($key, $value)\n" if $debug;
+      print "OK\n";
+    }
+  } elsif ($op eq "ERASE") { 
+    ($key)=split(/\s+/,$rest);
+    if (Bug()) { 
+      print STDERR "Erasing ($key) failed\n" if $debug;
+      print "FAIL\n";
+    } else {
+      delete $content{$key};
+      print STDERR "Erased ($key)\n" if $debug;
+      print "OK\n";
+    }
   } elsif ($op eq "LOOKUP") { 
     ($key)=split(/\s+/,$rest);
     if (!(defined $content{$key}) || Bug() ) { 
@@ -63,6 +83,36 @@ while ($line=<STDIN>) {
       print STDERR "Lookup ($key) found $value\n" if $debug;
       print "OK $value\n";
     }
+  } elsif ($op eq "RANK") { 
+    ($key)=split(/\s+/,$rest);
+    if (Bug()) { 
+      print STDERR "Ranking ($key) failed\n" if $debug;
+      print "FAIL\n";
+    } else {
+      $rank=grep { $_ lt $key } keys %content;
+      print STDERR "Rank ($key) is $rank\n" if $debug;
+      print "OK $rank\n";
+    }
+  } elsif ($op eq "SELECT") { 
+    ($rank)=split(/\s+/,$rest);
+    @sorted=sort keys %content;
+    if ($rank>=@sorted || Bug()) { 
+      print STDERR "Selecting ($rank) failed because there are only ".@sorted." keys\n" if $debug;
+      print "FAIL\n";
+    } else {
+      print STDERR "Select ($rank) found $sorted[$rank]\n" if $debug;
+      print "OK $sorted[$rank]\n";
+    }
+  } elsif ($op eq "COUNT") { 
+    ($lo, $hi)=split(/\s+/,$rest);
+    if (Bug()) { 
+      print STDERR "Counting ($lo, $hi) failed\n" if $debug;
+      print "FAIL\n";
+    } else {
+      $count=grep { $_ ge $lo && $_ lt $hi } keys %content;
+      print STDERR "Count ($lo, $hi) is $count\n" if $debug;
+      print "OK $count\n";
+    }
   } elsif ($op eq "DISPLAY") { 
     print STDERR "Displaying content in sorted order\n" if $debug;
     print "OK BEGIN DISPLAY\n";
@@ -5,13 +5,35 @@
 #include <strstream>
 #include <fstream>
 #include "btree.h"
+#include "betree.h"
 
 
 using namespace std;
 
 void usage()
 {
-  cerr << "usage: sim filestem cachesize < specfile \n";
+  cerr << "usage: sim filestem cachesize [cow] [mvcc] [betree] [prefix] [truncate] [varlen] [overflow=bytes] [counted] [search=how] [memtable=bytes] [bloom=bits] [globalbloom] [compressedcache=bytes] [hugepages] [shards=n] [interiorshare=percent] [flusher=low,high] [flusherthread] [readahead=blocks] [stats] < specfile \n";
+  cerr << "  cachesize       in blocks, or with a K, M or G suffix in bytes of memory\n";
+  cerr << "  cow     run the index in copy-on-write mode\n";
+  cerr << "  mvcc    create a multi-version index\n";
+  cerr << "  betree  create a write-optimized (buffered) index (bloom= only with globalbloom)\n";
+  cerr << "  prefix  store each leaf's common key prefix once\n";
+  cerr << "  truncate        keep short separators in slotted interior nodes\n";
+  cerr << "  varlen          take keys and values of any length up to the sizes given\n";
+  cerr << "  overflow=bytes  keep values over bytes in chains of their own blocks\n";
+  cerr << "  counted         keep subtree key counts for RANK, SELECT and COUNT\n";
+  cerr << "  search=how      search nodes by linear scan, binary or interpolation\n";
+  cerr << "  memtable=bytes  hold up to bytes of writes in memory\n";
+  cerr << "  bloom=bits      keep Bloom filters of bits per key for each leaf\n";
+  cerr << "  globalbloom     and one for the whole tree\n";
+  cerr << "  compressedcache=bytes  keep up to bytes of evicted blocks compressed in memory\n";
+  cerr << "  hugepages       back the buffer cache with huge pages\n";
+  cerr << "  shards=n        split the buffer cache into n shards\n";
+  cerr << "  interiorshare=percent  keep interior nodes cached ahead of leaves, up to percent of it\n";
+  cerr << "  flusher=low,high  write dirty blocks back ahead of eviction, between these\n";
+  cerr << "  flusherthread   and do so on a thread of its own\n";
+  cerr << "  readahead=blocks  read sequential misses ahead, up to blocks at a time\n";
+  cerr << "  stats   print performance statistics on DEINIT\n";
 }
 
 
@@ -20,13 +42,93 @@ int main(int argc, char *argv[])
 
   // CONFORMS to the interface of ref_impl.pl
 
-  if (argc != 3){
+  if (argc < 3){
     usage();
     return 1;
   }
 
   char *filestem=argv[1];
-  SIZE_T cachesize=atoi(argv[2]);
+  bool cow=false;
+  bool mvcc=false;
+  bool betree=false;
+  bool prefix=false;
+  bool truncate=false;
+  bool varlen=false;
+  bool counted=false;
+  BTreeSearchType search=BTREE_SEARCH_LINEAR;
+  bool stats=false;
+  SIZE_T overflow=0;
+  SIZE_T memtable=0;
+  SIZE_T bloom=0;
+  bool globalbloom=false;
+  SIZE_T compressedcache=0;
+  bool hugepages=false;
+  SIZE_T shards=1;
+  SIZE_T interiorshare=0;
+  SIZE_T flushlow=0, flushhigh=0;
+  bool flusherthread=false;
+  SIZE_T readahead=0;
+  bool suffixed;                  // bytes either way
+
+  for (int i=3;i<argc;i++) { 
+    if (string(argv[i])=="cow") { 
+      cow=true;
+    } else if (string(argv[i])=="mvcc") { 
+      mvcc=true;
+    } else if (string(argv[i])=="betree") { 
+      betree=true;
+    } else if (string(argv[i])=="prefix") { 
+      prefix=true;
+    } else if (string(argv[i])=="truncate") { 
+      truncate=true;
+    } else if (string(argv[i])=="varlen") { 
+      varlen=true;
+    } else if (string(argv[i]).compare(0,9,"overflow=")==0) { 
+      overflow=atoi(argv[i]+9);
+    } else if (string(argv[i])=="counted") { 
+      counted=true;
+    } else if (string(argv[i])=="search=linear") { 
+      search=BTREE_SEARCH_LINEAR;
+    } else if (string(argv[i])=="search=binary") { 
+      search=BTREE_SEARCH_BINARY;
+    } else if (string(argv[i])=="search=interpolation") { 
+      search=BTREE_SEARCH_INTERPOLATION;
+    } else if (string(argv[i]).compare(0,9,"memtable=")==0) { 
+      if (ParseSize(argv[i]+9,memtable,suffixed)!=ERROR_NOERROR) { 
+	usage();
+	return 1;
+      }
+    } else if (string(argv[i]).compare(0,6,"bloom=")==0) { 
+      bloom=atoi(argv[i]+6);
+    } else if (string(argv[i])=="globalbloom") { 
+      globalbloom=true;
+    } else if (string(argv[i]).compare(0,16,"compressedcache=")==0) { 
+      if (ParseSize(argv[i]+16,compressedcache,suffixed)!=ERROR_NOERROR) { 
+	usage();
+	return 1;
+      }
+    } else if (string(argv[i])=="hugepages") { 
+      hugepages=true;
+    } else if (string(argv[i]).compare(0,7,"shards=")==0) { 
+      shards=atoi(argv[i]+7);
+    } else if (string(argv[i]).compare(0,14,"interiorshare=")==0) { 
+      interiorshare=atoi(argv[i]+14);
+    } else if (string(argv[i]).compare(0,8,"flusher=")==0) { 
+      if (sscanf(argv[i]+8,"%u,%u",&flushlow,&flushhigh)!=2) { 
+	usage();
+	return 1;
+      }
+    } else if (string(argv[i])=="flusherthread") { 
+      flusherthread=true;
+    } else if (string(argv[i]).compare(0,10,"readahead=")==0) { 
+      readahead=atoi(argv[i]+10);
+    } else if (string(argv[i])=="stats") { 
+      stats=true;
+    } else {
+      usage();
+      return 1;
+    }
+  }
   SIZE_T superblocknum;
 
   FILE *file; 
@@ -38,9 +140,25 @@ int main(int argc, char *argv[])
   // run lots of operations
   // so we need to do this outside the loop
   DiskSystem disk(filestem);
-  BufferCache cache(&disk,cachesize);
+  BufferCache cache(&disk,0);
+  if (cache.SetSize(argv[2])!=ERROR_NOERROR) { 
+    usage();
+    return -1;
+  }
+  cache.SetCompressedTier(compressedcache);
+  cache.SetHugePages(hugepages);
+  cache.SetShards(shards);
+  cache.SetInteriorShare(interiorshare/100.0);
+  cache.SetFlusher(flushlow,flushhigh,flusherthread);
+  cache.SetReadAhead(readahead);
+  if (stats) { 
+    cache.SetMissRatioCurve(MRC_DEFAULT_SAMPLES);
+  }
   // will be set on init
-  BTreeIndex *btree;
+  BTreeIndex *btree=0;
+  // whether init succeeded; until it has, there is no tree to run
+  // anything against
+  bool attached=false;
 
 
   if ((rc=cache.Attach())!=ERROR_NOERROR) {
@@ -58,12 +176,35 @@ int main(int argc, char *argv[])
     istrstream is(line2.c_str(),line2.size());
     is >> action >> key >> value;
 
+    if (action != "INIT" && !action.empty() && !attached) { 
+      cout << "FAIL\n";
+      cerr << "Can't " << action << " without an attached btree\n";
+      continue;
+    }
+
     if (action == "INIT") {
-      btree = new BTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache);
+      if (betree) { 
+	btree = new BeTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache);
+      } else {
+	btree = new BTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache);
+      }
+      btree->SetCopyOnWrite(cow);
+      btree->SetMultiVersion(mvcc);
+      btree->SetPrefixCompression(prefix);
+      btree->SetSuffixTruncation(truncate);
+      btree->SetVariableLength(varlen);
+      btree->SetOverflowThreshold(overflow);
+      btree->SetOrderStatistics(counted);
+      btree->SetSearchType(search);
+      btree->SetMemTableLimit(memtable);
+      btree->SetBloomFilter(bloom,globalbloom);
       if ((rc=btree->Attach(0, true))!=ERROR_NOERROR) {
 	cerr << "Can't attach btree with initialization due to error "<<rc<<"\n";
 	cout << "FAIL\n";
+	delete btree;
+	btree=0;
       } else {
+	attached=true;
 	cout << "OK\n";
       }
     } else if (action == "INSERT"){
@@ -87,6 +228,21 @@ int main(int argc, char *argv[])
       } else {
         cout <<"OK\n";
       }
+    } else if (action == "UPSERT"){
+      // blind, so there is nothing to fail on but the index itself
+      if ((rc=btree->Upsert(KEY_T(key.c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) { 
+        cout <<"FAIL"<<endl;
+	cerr <<"Can't upsert due to error "<<rc<<endl;
+      } else {
+        cout <<"OK\n";
+      }
+    } else if (action == "ERASE"){
+      if ((rc=btree->Erase(KEY_T(key.c_str())))!=ERROR_NOERROR) { 
+        cout <<"FAIL"<<endl;
+	cerr <<"Can't erase due to error "<<rc<<endl;
+      } else {
+        cout <<"OK\n";
+      }
     } else if (action == "LOOKUP"){
       VALUE_T lookup_value;
       if ((rc=btree->Lookup(KEY_T(key.c_str()),lookup_value))!=ERROR_NOERROR) { 
@@ -99,6 +255,34 @@ int main(int argc, char *argv[])
 	}
  	cout << endl;
       }
+    } else if (action == "RANK"){
+      SIZE_T rank;
+      if ((rc=btree->Rank(KEY_T(key.c_str()),rank))!=ERROR_NOERROR) { 
+        cout <<"FAIL"<< endl;
+	cerr <<"Can't rank due to error "<<rc<<endl;
+      } else {
+        cout <<"OK "<<rank<<endl;
+      }
+    } else if (action == "SELECT"){
+      KEY_T select_key;
+      if ((rc=btree->Select(atoi(key.c_str()),select_key))!=ERROR_NOERROR) { 
+        cout <<"FAIL"<< endl;
+	cerr <<"Can't select due to error "<<rc<<endl;
+      } else {
+        cout <<"OK ";
+ 	for (unsigned int k=0; k<select_key.length; k++) {
+ 	    cout << select_key.data[k];
+	}
+ 	cout << endl;
+      }
+    } else if (action == "COUNT"){
+      SIZE_T count;
+      if ((rc=btree->Count(KEY_T(key.c_str()),KEY_T(value.c_str()),count))!=ERROR_NOERROR) { 
+        cout <<"FAIL"<< endl;
+	cerr <<"Can't count due to error "<<rc<<endl;
+      } else {
+        cout <<"OK "<<count<<endl;
+      }
     } else if (action == "DISPLAY") {
       // This should always be OK
       cout <<"OK BEGIN DISPLAY\n";
@@ -113,8 +297,80 @@ int main(int argc, char *argv[])
 	  cout <<"FAIL"<<endl;
 	  cerr <<"Can't detach cache due to error "<<rc<<endl;
 	} else {
+	  SIZE_T leafskips, leaffalsepos, globalskips, globalfalsepos;
+	  SIZE_T keyprobes=btree->GetNumKeyProbes();
+	  SIZE_T arenachunks=btree->GetArena().GetNumChunkAllocs();
+	  SIZE_T arenabytes=btree->GetArena().GetHighWater();
+	  btree->GetBloomFilterStats(leafskips,leaffalsepos,globalskips,globalfalsepos);
 	  delete btree;
+	  btree=0;
+	  attached=false;
 	  cout << "OK\n";
+	  if (stats) { 
+	    cerr << "Performance statistics:\n";
+	    
+	    cerr << "numallocs       = "<<cache.GetNumAllocs()<<endl;
+	    cerr << "numdeallocs     = "<<cache.GetNumDeallocs()<<endl;
+	    cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+	    cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+	    cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
+	    cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+	    cerr << endl;
+	    
+	    cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+	    // the most memory the cache held, tier and buffers included
+	    cerr << "residentbytes   = "<<cache.GetPeakResidentBytes()<<endl;
+	    cerr << "keyprobes       = "<<keyprobes<<endl;
+	    // heap allocations all the operations' node buffers took
+	    cerr << "arenachunks     = "<<arenachunks<<endl;
+	    cerr << "arenabytes      = "<<arenabytes<<endl;
+	    // misses that wrote their victim back before reading
+	    cerr << "dirtyevictions  = "<<cache.GetNumDirtyEvictions()<<endl;
+	    // freed blocks that never reached the disk
+	    cerr << "discards        = "<<cache.GetNumDiscards()<<endl;
+	    // what other cache sizes would have missed
+	    cerr << endl;
+	    cache.GetMissRatioCurve().PrintCurve(cerr);
+	    if (compressedcache) { 
+	      // each tier hit is a disk read the cache alone would have made
+	      cerr << endl;
+	      cerr << "tierhits        = "<<cache.GetNumTierHits()<<endl;
+	      cerr << "tierratio       = "<<(cache.GetNumTierCompressedBytes() ? 
+					      (double)cache.GetNumTierRawBytes()/cache.GetNumTierCompressedBytes() : 0)<<endl;
+	      cerr << "compresstime    = "<<cache.GetCompressionTime()<<endl;
+	    }
+	    if (hugepages) { 
+	      cerr << endl;
+	      cerr << "hugeslab        = "<<cache.IsSlabHuge()<<endl;
+	    }
+	    if (flushhigh) { 
+	      // flushtime is disk time kept off the operations' clock
+	      cerr << endl;
+	      cerr << "flushwrites     = "<<cache.GetNumFlushWrites()<<endl;
+	      cerr << "flushruns       = "<<cache.GetNumFlushRuns()<<endl;
+	      cerr << "flushtime       = "<<cache.GetFlushTime()<<endl;
+	    }
+	    if (readahead) { 
+	      // blocks read ahead go either used or wasted, or are still cached
+	      cerr << endl;
+	      cerr << "readaheads      = "<<cache.GetNumReadAheads()<<endl;
+	      cerr << "readaheadblocks = "<<cache.GetNumReadAheadBlocks()<<endl;
+	      cerr << "readaheadused   = "<<cache.GetNumReadAheadUsed()<<endl;
+	      cerr << "readaheadwasted = "<<cache.GetNumReadAheadWasted()<<endl;
+	    }
+	    if (bloom) { 
+	      // a miss the filter let through cost the reads it could have saved
+	      cerr << endl;
+	      cerr << "leafskips       = "<<leafskips<<endl;
+	      cerr << "leaffalsepos    = "<<leaffalsepos<<endl;
+	      cerr << "leaffprate      = "<<(leafskips+leaffalsepos ? (double)leaffalsepos/(leafskips+leaffalsepos) : 0)<<endl;
+	      if (globalbloom) { 
+		cerr << "globalskips     = "<<globalskips<<endl;
+		cerr << "globalfalsepos  = "<<globalfalsepos<<endl;
+		cerr << "globalfprate    = "<<(globalskips+globalfalsepos ? (double)globalfalsepos/(globalskips+globalfalsepos) : 0)<<endl;
+	      }
+	    }
+	  }
 	}
       }
     }
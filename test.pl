@@ -1,13 +1,14 @@
 #!/usr/bin/perl -w
 
-$#ARGV==6 or die "usage: test.pl \"reference implementation command line\" \"your implementation command line\" keysize valsize seed num maxerrs\n";
+($#ARGV==6 || $#ARGV==7) or die "usage: test.pl \"reference implementation command line\" \"your implementation command line\" keysize valsize seed num maxerrs [\"gen_test_sequence options\"]\n";
 
-($refcmd,$testcmd,$keysize,$valsize,$seed,$num,$maxerrs)=@ARGV;
+($refcmd,$testcmd,$keysize,$valsize,$seed,$num,$maxerrs,$genopts)=@ARGV;
+$genopts="" if !defined $genopts;
 
 $t=time();
 $pid=$$;
 
-system "gen_test_sequence.pl $keysize $valsize $seed $num > TEST.$t.$pid.input";
+system "gen_test_sequence.pl $keysize $valsize $seed $num $genopts > TEST.$t.$pid.input";
 
 system "$refcmd < TEST.$t.$pid.input > TEST.$t.$pid.refout";
 
@@ -16,9 +16,13 @@ $cachesize=64;
 
 $maxerr=10;
 
-$#ARGV==3 or die "usage: test_me.pl keysize valuesize seed numops\n";
+# genopts go to gen_test_sequence.pl and simopts to sim, as in
+#   test_me.pl 8 8 1 2000 "deletes ranks" counted
+($#ARGV>=3 && $#ARGV<=5) or die "usage: test_me.pl keysize valuesize seed numops [\"genopts\" [\"simopts\"]]\n";
 
-($keysize,$valuesize,$seed,$numops)=@ARGV;
+($keysize,$valuesize,$seed,$numops,$genopts,$simopts)=@ARGV;
+$genopts="" if !defined $genopts;
+$simopts="" if !defined $simopts;
 
 $ENV{PATH}.=":.";
 
@@ -26,7 +30,7 @@ system "deletedisk $diskstem";
 system "makedisk $diskstem $numblocks $blocksize $heads $blockspertrack $tracks $avgseek $trackseek $rotlat";
 
 
-$cmd="test.pl \"ref_impl.pl nodebug 0\" \"sim $diskstem $cachesize\" $keysize $valuesize $seed $numops $maxerr";
+$cmd="test.pl \"ref_impl.pl nodebug 0\" \"sim $diskstem $cachesize $simopts\" $keysize $valuesize $seed $numops $maxerr \"$genopts\"";
 
 system $cmd;
 
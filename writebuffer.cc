@@ -15,12 +15,15 @@ int main(int argc, char *argv[])
     usage();
     exit(-1);
   }
-  SIZE_T cachesize=atoi(argv[2]);
   SIZE_T blocknum=atoi(argv[3]);
   SIZE_T numblocks=atoi(argv[4]);
 
   DiskSystem disk(argv[1]);
-  BufferCache cache(&disk,cachesize);
+  BufferCache cache(&disk,0);
+  if (cache.SetSize(argv[2])!=ERROR_NOERROR) { 
+    usage();
+    return -1;
+  }
 
   SIZE_T blocksize = disk.GetBlockSize();
 
@@ -57,6 +60,7 @@ int main(int argc, char *argv[])
   cerr << endl;
 
   cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+  cerr << "residentbytes   = "<<cache.GetPeakResidentBytes()<<endl;
 
   return 0;
 }